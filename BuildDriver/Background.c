@@ -18,16 +18,10 @@
 
 //////////////////////////////////////////////////////////////////////
 
-volatile B1 BackgroundThread_STOP    = FALSE;  //  TODO need one thread per volume
-volatile B1 BackgroundThread_STOPPED = FALSE;  //  TODO need one thread per volume
-volatile B1 BackgroundThread_Busy    = TRUE;   //  TODO need one thread per volume
-
-//////////////////////////////////////////////////////////////////////
-
-B1 RedispatchACompletablePendingReadIrp()
+B1 RedispatchACompletablePendingReadIrp( VCB_ Vcb )
 
 {
-    LINK_ Link = Volume_PendingReadsChain.First;
+    LINK_ Link = Vcb->PendingReadsChain.First;
     while ( Link )
     {
         ICB_         Icb        = OWNER( ICB, PendingReadsLink, Link );
@@ -36,21 +30,21 @@ B1 RedispatchACompletablePendingReadIrp()
         PFILE_OBJECT FileObject = IrpSp->FileObject;
         FCB_         Fcb        = FileObject->FsContext;
         ID           Id         = Fcb->Id;
-        ENTRY_       Entry      = Entries[ Id ];
-        U8           A          = 0;
-        U4           N          = 0;
+        ENTRY_       Entry      = EntryForId( Vcb, Id );
+        BLOCK_IO_SEGMENT Uncached;
 
-        FindFirstUncachedRange( Entry, &A, &N );  //  TODO don't need to cache the whole file.
-        if ( ! A )
+        U4 NumUncached = FindUncachedRanges( Vcb, Entry, &Uncached, 1 );  //  TODO don't need to cache the whole file.
+        if ( ! NumUncached )
         {
             //  We can complete it; it is a read with all data in cache.
 AlwaysLogString( "!!!!!!!!!!!!!!WE CAN COMPLETE A PENDING IRP_MJ_READ\n" );
 
-            DetachLink( &Volume_PendingReadsChain, Link );
-
-            B1 Acquired = AcquireSpinlockOrFail( &Volume_MetadataLock );
+            //  Only take it off the chain once we can complete it; otherwise it waits for next time.
+            B1 Acquired = AcquireSpinlockOrFail( &Vcb->MetadataLock );
             if ( ! Acquired ) return FALSE;
 
+            DetachLink( &Vcb->PendingReadsChain, Link );
+
 AlwaysLogString( "+( redispatch )\n" );
 
             FsRtlEnterFileSystem();
@@ -67,7 +61,7 @@ ASSERT( Status != STATUS_PENDING );
 
 AlwaysLogString( "2( redispatch )\n" );
 
-            ReleaseSpinlock( &Volume_MetadataLock );
+            ReleaseSpinlock( &Vcb->MetadataLock );
 
             //IoSetTopLevelIrp( 0 );  //  TODO need? nBecause recursive?
             FsRtlExitFileSystem();
@@ -79,17 +73,15 @@ AlwaysLogString( "- ( redispatch )\n" );
         Link = Link->Next;
     }
 
-    ReleaseSpinlock( &Volume_MetadataLock );
-
     return FALSE;
 }
 
 //////////////////////////////////////////////////////////////////////
 
-B1 MakeSomeNeededCacheForAPendingReadIrp()
+B1 MakeSomeNeededCacheForAPendingReadIrp( VCB_ Vcb )
 
 {
-    LINK_ Link = Volume_PendingReadsChain.First;
+    LINK_ Link = Vcb->PendingReadsChain.First;
     while ( Link )
     {
         ICB_         Icb        = OWNER( ICB, PendingReadsLink, Link );
@@ -98,38 +90,295 @@ B1 MakeSomeNeededCacheForAPendingReadIrp()
         PFILE_OBJECT FileObject = IrpSp->FileObject;
         FCB_         Fcb        = FileObject->FsContext;
         ID           Id         = Fcb->Id;
-        ENTRY_       Entry      = Entries[ Id ];
-        U8           A          = 0;
-        U4           N          = 0;
+        ENTRY_       Entry      = EntryForId( Vcb, Id );
+        BLOCK_IO_SEGMENT Segments[BLOCK_IO_MAX_SEGMENTS];
 
-        FindFirstUncachedRange( Entry, &A, &N );  //  TODO don't need to cache the whole file.
-        if ( A )
+        U4 NumSegments = FindUncachedRanges( Vcb, Entry, Segments, BLOCK_IO_MAX_SEGMENTS );  //  TODO don't need to cache the whole file.
+        if ( NumSegments )
         {
 
-AlwaysLogFormatted( "!!!!!!!!!!!!!!BACKGROUND READ INTO CACHE INITIATED %p %X\n", ( V_ ) A, N );
+AlwaysLogFormatted( "!!!!!!!!!!!!!!BACKGROUND READ INTO CACHE INITIATED %p %X and %u more\n",
+( V_ ) Segments[0].VolumeAddress, Segments[0].NumBytes, NumSegments - 1 );
 
-            //  Allocate a buffer.
-            U1_ B = AllocateMemory( N );  //  TODO speedup
-            if ( ! B ) return FALSE;
+            //  Get cache memory for the ranges. Taken one after another, they tend to be adjacent in
+            //  the arena, so ranges adjacent on the volume too go as one request.
+            U4 DirectWriteSequence;
+            U4 NumGot = 0;
+            for ( ; NumGot < NumSegments; NumGot++ )
+            {
+                Segments[NumGot].Buffer = CacheMemoryAllocateWithLock( Vcb, Segments[NumGot].NumBytes, &DirectWriteSequence );
+                if ( ! Segments[NumGot].Buffer ) break;
+            }
+            if ( ! NumGot ) return FALSE;
 
-            //  Read in the buffer from the volume.
-            NTSTATUS Status2 = ReadBlockDevice( Volume_PhysicalDeviceObject, A, N, B, NO_VERIFY );
+            //  Read from the volume straight into it, all at once.
+            NTSTATUS Status2 = ReadBlockDeviceVector( Vcb->PhysicalDeviceObject, Segments, NumGot, NO_VERIFY, IO_DEMAND );
 
 AlwaysLogFormatted( "!!!!!!!!!!!!!!BACKGROUND READ INTO CACHE got status %X\n", Status2 );
 ASSERT( Status2 == 0 );
 
-            //  Create the cache range.
-            NTSTATUS Status = CacheRangeMakeWithLock( A, B, N, CLEAN, 0, N );
+            //  Make them cache ranges.
+            for ( U4 i = 0; i < NumGot; i++ )
+            {
+                BLOCK_IO_SEGMENT_ S = Segments + i;
+                if ( Status2 )
+                {
+                    CacheMemoryFreeWithLock( Vcb, S->Buffer, S->NumBytes );
+                }
+                else
+                {
+                    NTSTATUS Status = CacheRangeAdoptWithLock( Vcb, Id, S->VolumeAddress, S->Buffer, S->NumBytes, CLEAN, DirectWriteSequence );
 ASSERT( ! Status );
+                }
+            }
 
-            FreeMemory( B );
-            return TRUE;
+            return ! Status2;
         }
         Link = Link->Next;
     }
     return FALSE;
 }
 
+//////////////////////////////////////////////////////////////////////
+//
+//  Metadata Writes
+//
+//  The metadata is copied with the metadata lock held, and written after it is released.
+//
+
+typedef struct _METADATA_COPY
+{
+    U1_ OverviewBuffer;
+    U1_ EntriesBuffer;
+    U4  EntriesNumBytes;
+    U8  UpdateCount;  //  The IRPs the copy reflects.
+    U1_ ManifestBuffer;
+    U4  ManifestNumBytes;
+    U1_ LaunchTracesBuffer;
+    U4  LaunchTracesNumBytes;
+} METADATA_COPY, *METADATA_COPY_;
+
+//--------------------------------------------------------------------
+
+static NTSTATUS metadataCopy( VCB_ Vcb, METADATA_COPY_ Copy )
+
+{
+    Copy->UpdateCount = Vcb->ConservativeMetadataUpdateCount;
+
+    //  Copy the current Overview.
+    Copy->OverviewBuffer = AllocateMemory( 4096 );
+ASSERT( Copy->OverviewBuffer );
+    NTSTATUS Status = OverviewFreeze1( Vcb, Copy->OverviewBuffer );
+ASSERT( ! Status );
+
+    //  Copy the entries.
+    Copy->EntriesNumBytes = ROUND_UP( Vcb->EntriesFirstFreeByte, 4096 );
+    Copy->EntriesBuffer   = AllocateMemory( Copy->EntriesNumBytes );
+ASSERT( Copy->EntriesBuffer );
+    memcpy( Copy->EntriesBuffer, Vcb->EntriesBytes, Copy->EntriesNumBytes );
+
+    //  Copy the warm-cache manifest; it is only a hint, so do without it if need be.
+    Copy->ManifestBuffer = 0;
+#if WARM_CACHE_MANIFEST == YES
+    if ( CacheManifestFreeze1( Vcb, &Copy->ManifestBuffer, &Copy->ManifestNumBytes ) ) Copy->ManifestBuffer = 0;
+#endif
+
+    //  And the launch traces, likewise.
+    Copy->LaunchTracesBuffer = 0;
+#if LAUNCH_TRACES == YES
+    if ( LaunchTracesFreeze1( Vcb, &Copy->LaunchTracesBuffer, &Copy->LaunchTracesNumBytes ) ) Copy->LaunchTracesBuffer = 0;
+#endif
+
+    return Status;
+}
+
+//--------------------------------------------------------------------
+
+static void metadataServePendingReads( VCB_ Vcb )
+
+{
+    //  Between slices of a metadata write, since reads pending on us would otherwise wait out the lot.
+    for ( int i = 0; i < 8; i++ )
+    {
+        if ( RedispatchACompletablePendingReadIrp( Vcb ) ) continue;
+        if ( MakeSomeNeededCacheForAPendingReadIrp( Vcb ) ) continue;
+        break;
+    }
+}
+
+//--------------------------------------------------------------------
+
+static NTSTATUS metadataWrite( VCB_ Vcb, METADATA_COPY_ Copy )
+
+{
+    NTSTATUS Status;
+    NTSTATUS FirstStatus;
+
+    Vcb->DeviceActivity.CheckpointUnderway = TRUE;
+
+    //  Write the copied Overview, then free the copy.
+    FirstStatus = OverviewFreeze2( Vcb, Copy->OverviewBuffer );
+ASSERT( ! FirstStatus );
+    FreeMemory( Copy->OverviewBuffer );
+
+    //  Write the copied entries a slice at a time, then free the copy.
+    Status = 0;
+    for ( U4 FromByte = 0; FromByte < Copy->EntriesNumBytes && ! Status; FromByte += CHECKPOINT_SLICE_NUM_BYTES )
+    {
+        Status = EntriesFreeze( Vcb, Copy->EntriesBuffer, FromByte, min( CHECKPOINT_SLICE_NUM_BYTES, Copy->EntriesNumBytes - FromByte ) );
+        metadataServePendingReads( Vcb );
+    }
+ASSERT( ! Status );
+    FreeMemory( Copy->EntriesBuffer );
+    if ( ! FirstStatus ) FirstStatus = Status;
+
+    //  Write the copied manifest, then free the copy.
+    if ( Copy->ManifestBuffer ) CacheManifestFreeze2( Vcb, Copy->ManifestBuffer, Copy->ManifestNumBytes );
+
+    //  Write the copied launch traces, then free the copy.
+    if ( Copy->LaunchTracesBuffer ) LaunchTracesFreeze2( Vcb, Copy->LaunchTracesBuffer, Copy->LaunchTracesNumBytes );
+
+    //  Mark the location so we notice this info.
+    *( ( U8_ ) ( Vcb->FirstBlock + 0x440 ) ) = 2 * 1024 * 1024;  //  $20'0000 Vcb->OverviewStart TODO
+    Status = WriteBlockDevice( Vcb->PhysicalDeviceObject, 0, Volume_BlockSize, Vcb->FirstBlock, MAY_VERIFY, IO_CHECKPOINT );
+ASSERT ( ! Status );
+    if ( ! FirstStatus ) FirstStatus = Status;
+
+    if ( ! FirstStatus ) Vcb->LastMetadataOkCount = Copy->UpdateCount;
+
+    Vcb->DeviceActivity.CheckpointUnderway = FALSE;
+
+    return FirstStatus;
+}
+
+//////////////////////////////////////////////////////////////////////
+
+B1 CompletePendingFlushes( VCB_ Vcb )
+
+{
+    //  Group commit: every flush that has arrived shares one pass over the dirty data, one
+    //  metadata write and one write barrier. Waiting a little for the first lets others join.
+    if ( ! Vcb->PendingFlushesChain.First ) return FALSE;
+    if ( CurrentMicrosecond() - Vcb->PendingFlushesSinceMicrosecond < FLUSH_GROUP_WINDOW_MICROSECONDS ) return FALSE;
+
+    B1 Acquired = AcquireSpinlockOrFail( &Vcb->MetadataLock );
+    if ( ! Acquired ) return FALSE;
+
+    //  Take the group; flushes that arrive from now on make the next one.
+    CHAIN Group = Vcb->PendingFlushesChain;
+    Vcb->PendingFlushesChain.First = 0;
+    Vcb->PendingFlushesChain.Last  = 0;
+
+    //  A flush of the volume or of its root directory flushes everything. A file deleted since
+    //  its flush arrived has nothing left to flush.
+    B1 FlushAll = FALSE;
+    for ( LINK_ Link = Group.First; Link; Link = Link->Next )
+    {
+        ICB_   Icb   = OWNER( ICB, PendingFlushesLink, Link );
+        FCB_   Fcb   = IoGetCurrentIrpStackLocation( Icb->Irp )->FileObject->FsContext;
+        ENTRY_ Entry = Fcb->IsAVolume ? 0 : EntryForId( Vcb, Fcb->Id );
+        if ( Fcb->IsAVolume || ( Entry && Entry->ParentId == 0 ) ) FlushAll = TRUE;
+    }
+
+    //  The metadata as of now covers every IRP before the flushes.
+    METADATA_COPY Copy;
+    B1 MetadataChanged = Vcb->ConservativeMetadataUpdateCount > Vcb->LastMetadataOkCount;
+    if ( MetadataChanged ) metadataCopy( Vcb, &Copy );
+
+    ReleaseSpinlock( &Vcb->MetadataLock );
+
+    //  The data first, then the metadata that points at it, then the barrier behind them both.
+    NTSTATUS Status = 0;
+    if ( FlushAll )
+    {
+        Status = CacheFlushAll( Vcb );
+    }
+    else
+    {
+        for ( LINK_ Link = Group.First; Link; Link = Link->Next )
+        {
+            ICB_ Icb = OWNER( ICB, PendingFlushesLink, Link );
+            FCB_ Fcb = IoGetCurrentIrpStackLocation( Icb->Irp )->FileObject->FsContext;
+            NTSTATUS FileStatus = CacheFlushFile( Vcb, Fcb->Id );
+            if ( ! Status ) Status = FileStatus;
+        }
+    }
+
+    if ( MetadataChanged )
+    {
+        NTSTATUS MetadataStatus = metadataWrite( Vcb, &Copy );
+        if ( ! Status ) Status = MetadataStatus;
+    }
+
+    NTSTATUS BarrierStatus = FlushBlockDevice( Vcb->PhysicalDeviceObject );
+    if ( ! Status ) Status = BarrierStatus;
+
+    //  Complete them all.
+    U8 Now = CurrentMicrosecond();
+    U4 NumInGroup = 0;
+    while ( Group.First )
+    {
+        LINK_ Link = Group.First;
+        DetachLink( &Group, Link );
+        ICB_ Icb = OWNER( ICB, PendingFlushesLink, Link );
+
+        U8 Latency = Now - Icb->PendingSinceMicrosecond;
+        Vcb->FlushTotalMicroseconds += Latency;
+        Vcb->FlushMaxMicroseconds    = max( Vcb->FlushMaxMicroseconds, Latency );
+        Vcb->FlushNumCompleted++;
+        NumInGroup++;
+
+        Icb->Irp->IoStatus.Status      = Status;
+        Icb->Irp->IoStatus.Information = 0;
+        IoCompleteRequest( Icb->Irp, IO_NO_INCREMENT );
+        UnmakeIcb( Icb );
+    }
+    Vcb->FlushNumGroups++;
+
+LogFormatted( "Completed %u flushes with one barrier, status %X\n", NumInGroup, Status );
+
+    return TRUE;
+}
+
+//////////////////////////////////////////////////////////////////////
+
+void FailPendingFlushes( VCB_ Vcb, PFILE_OBJECT FileObjectOrZero, NTSTATUS Status )
+
+{
+    //  Complete queued flushes unflushed: those of a file object being cleaned up, or all of them
+    //  when the background thread stops, so that no caller waits for ever. Call with the metadata
+    //  lock held, or with the background thread stopped.
+    LINK_ Next;
+    for ( LINK_ Link = Vcb->PendingFlushesChain.First; Link; Link = Next )
+    {
+        Next = Link->Next;
+        ICB_ Icb = OWNER( ICB, PendingFlushesLink, Link );
+        if ( FileObjectOrZero && IoGetCurrentIrpStackLocation( Icb->Irp )->FileObject != FileObjectOrZero ) continue;
+
+        DetachLink( &Vcb->PendingFlushesChain, Link );
+        Icb->Irp->IoStatus.Status      = Status;
+        Icb->Irp->IoStatus.Information = 0;
+        IoCompleteRequest( Icb->Irp, IO_NO_INCREMENT );
+        UnmakeIcb( Icb );
+    }
+}
+
+//////////////////////////////////////////////////////////////////////
+
+NTSTATUS FlushReport( VCB_ Vcb, S1_ Buffer, int MaxNumBytes )
+
+{
+    U8 NumCompleted = Vcb->FlushNumCompleted;
+
+    return RtlStringCchPrintfA( Buffer, MaxNumBytes,
+            "FlushReport %llu flushes completed in %llu groups, each behind one write barrier   "
+            "%llu us on average and %llu us at most from arrival to completion",
+            NumCompleted,
+            Vcb->FlushNumGroups,
+            NumCompleted ? Vcb->FlushTotalMicroseconds / NumCompleted : 0,
+            Vcb->FlushMaxMicroseconds );
+}
+
 //////////////////////////////////////////////////////////////////////
 
 void BackgroundThread( PVOID context )
@@ -140,13 +389,14 @@ void BackgroundThread( PVOID context )
     B1       Did;
     NTSTATUS Status;
 
-    BackgroundThread_Busy = TRUE;
+    Vcb->BackgroundThreadBusy = TRUE;
 
     U8 LastMetaWriteMillisecond = CurrentMillisecond();
+    U8 MicrosecondOfLastDirtyWrite = 0;
 
     for ( int BackgroundPass = 1 ; ; BackgroundPass++ )
     {
-        if ( BackgroundThread_STOP ) break;
+        if ( Vcb->BackgroundThreadStop ) break;
         U8 CurrentMicrosecond2 = CurrentMicrosecond();
 
 
@@ -162,10 +412,10 @@ void BackgroundThread( PVOID context )
         //
         //  Priority 0: re-dispatch a pending read that has all data in cache.
         //
-        Did = RedispatchACompletablePendingReadIrp();
+        Did = RedispatchACompletablePendingReadIrp( Vcb );
         if ( Did )
         {
-            BackgroundThread_Busy = TRUE;
+            Vcb->BackgroundThreadBusy = TRUE;
             continue;
         }
 
@@ -174,10 +424,10 @@ void BackgroundThread( PVOID context )
         //
         //  Priority 1: Cache some of the volume towards completing a read irp.
         //
-        Did = MakeSomeNeededCacheForAPendingReadIrp();
+        Did = MakeSomeNeededCacheForAPendingReadIrp( Vcb );
         if ( Did )
         {
-            BackgroundThread_Busy = TRUE;
+            Vcb->BackgroundThreadBusy = TRUE;
             continue;
         }
 
@@ -186,7 +436,7 @@ void BackgroundThread( PVOID context )
         //
         //  Priority ?: help a pending lock.
         //
-ASSERT( Volume_PendingLocksChain.First == 0 );
+ASSERT( Vcb->PendingLocksChain.First == 0 );
 
 
 
@@ -196,16 +446,16 @@ ASSERT( Volume_PendingLocksChain.First == 0 );
         U8 NumCleanBytes = 100'000'000;  //  TODO compute
         if ( NumCleanBytes > 200'000'000 )
         {
-            Acquired = AcquireSpinlockOrFail( &Volume_MetadataLock );
+            Acquired = AcquireSpinlockOrFail( &Vcb->MetadataLock );
             if ( Acquired )
             {
 AlwaysBreakToDebugger();
 AlwaysLogString( "Free some cache?\n" );
-                U4 NumBytesFreed = CacheFreeSomeCache();
-                ReleaseSpinlock( &Volume_MetadataLock );
+                U4 NumBytesFreed = CacheFreeSomeCache( Vcb );
+                ReleaseSpinlock( &Vcb->MetadataLock );
                 if ( NumBytesFreed )
                 {
-                    BackgroundThread_Busy = TRUE;
+                    Vcb->BackgroundThreadBusy = TRUE;
                     continue;
                 }
             }
@@ -214,16 +464,58 @@ AlwaysLogString( "Free some cache?\n" );
 
 
         //
-        //  Priority 2: write some dirty bytes to the volume.
+        //  Priority 2: complete a group of pending flushes.
+        //
+        Did = CompletePendingFlushes( Vcb );
+        if ( Did )
+        {
+            Vcb->BackgroundThreadBusy = TRUE;
+            continue;
+        }
+
+
+
+        //
+        //  Priority 3: prefetch for a program that is starting.
+        //
+#if LAUNCH_TRACES == YES
+        Did = CachePrefetchFromManifest( Vcb, TRUE );
+        if ( Did )
+        {
+            Vcb->BackgroundThreadBusy = TRUE;
+            continue;
+        }
+#endif
+
+
+
+        //
+        //  Priority 4: write back dirty ranges, as the write-back policy allows; see Cache.c.
         //
-        static U8 MicrosecondOfLastDirtyWrite = 0;
         if ( CurrentMicrosecond2 - MicrosecondOfLastDirtyWrite > 1'000 )
         {
             MicrosecondOfLastDirtyWrite = CurrentMicrosecond2;
-            U4 NumBytesWritten = CacheBackgroundWriteDirtiestToVolume();
+            U4 NumBytesWritten = CacheBackgroundWriteDirtiestToVolume( Vcb );
             if ( NumBytesWritten )
             {
-                BackgroundThread_Busy = TRUE;
+                Vcb->BackgroundThreadBusy = TRUE;
+                continue;
+            }
+        }
+
+
+
+        //
+        //  Priority 5: compact a slice of the entries if they have too many holes.
+        //
+        Acquired = AcquireSpinlockOrFail( &Vcb->MetadataLock );
+        if ( Acquired )
+        {
+            Did = EntriesCompactSlice( Vcb );
+            ReleaseSpinlock( &Vcb->MetadataLock );
+            if ( Did )
+            {
+                Vcb->BackgroundThreadBusy = TRUE;
                 continue;
             }
         }
@@ -234,55 +526,34 @@ AlwaysLogString( "Free some cache?\n" );
         //  Or possibly write all the metadata?
         //
         U8 Now = CurrentMillisecond();
-        if ( ! Volume_LastMetadataOkCount ) Volume_LastMetadataOkCount = Volume_ConservativeMetadataUpdateCount;
-        if (    ( Volume_ConservativeMetadataUpdateCount > Volume_LastMetadataOkCount )
+        if ( ! Vcb->LastMetadataOkCount ) Vcb->LastMetadataOkCount = Vcb->ConservativeMetadataUpdateCount;
+        if (    ( Vcb->ConservativeMetadataUpdateCount > Vcb->LastMetadataOkCount )
              && ( Now - LastMetaWriteMillisecond > 5'000 ) )  //  TODO
         {
-            Acquired = AcquireSpinlockOrFail( &Volume_MetadataLock );
+            Acquired = AcquireSpinlockOrFail( &Vcb->MetadataLock );
             if ( Acquired )
             {
-AlwaysLogFormatted( "W R I T I N G   A L L   M E T A D A T A   after irp %d\n", ( int ) Volume_ConservativeMetadataUpdateCount );
+AlwaysLogFormatted( "W R I T I N G   A L L   M E T A D A T A   after irp %d\n", ( int ) Vcb->ConservativeMetadataUpdateCount );
 
                 LastMetaWriteMillisecond = Now;
 
-                //  Copy the current Overview.
-                U1_ OverviewBuffer = AllocateMemory( 4096 );
-ASSERT( OverviewBuffer );
-                Status = OverviewFreeze1( OverviewBuffer );
+                METADATA_COPY Copy;
+                Status = metadataCopy( Vcb, &Copy );
 ASSERT( ! Status );
 
-                //  Copy the entries.
-                U4 EntriesNumBytes = ROUND_UP( EntriesFirstFreeByte, 4096 );
-                U1_ EntriesBuffer = AllocateMemory( EntriesNumBytes );
-ASSERT( EntriesBuffer );
-                memcpy( EntriesBuffer, EntriesBytes, EntriesNumBytes );
-
                 //  We can free up the metadata now.
-                ReleaseSpinlock( &Volume_MetadataLock );
+                ReleaseSpinlock( &Vcb->MetadataLock );
 
-                //  Write the copied Overview, then free the copy.
-                Status = OverviewFreeze2( OverviewBuffer );
+                Status = metadataWrite( Vcb, &Copy );
 ASSERT( ! Status );
-                FreeMemory( OverviewBuffer );
-
-                //  Write the copied entries, the free the copy.
-                Status = EntriesFreeze( EntriesBytes, EntriesNumBytes );
-ASSERT( ! Status );
-                FreeMemory( EntriesBuffer );
-
-                //  Mark the location so we notice this info.
-                *( ( U8_ ) ( Vcb->FirstBlock + 0x440 ) ) = 2 * 1024 * 1024;  //  $20'0000 Volume_OverviewStart TODO
-                Status = WriteBlockDevice( Vcb->PhysicalDeviceObject, 0, Volume_BlockSize, Vcb->FirstBlock, MAY_VERIFY );
-ASSERT ( ! Status );
 
 
 U8 Finished = CurrentMillisecond();
 AlwaysLogFormatted( "W R I T I N G   A L L   M E T A D A T A   TOOK %d MILLISECONDS \n",
 ( int ) ( Finished - Now ) );
 
-                Volume_LastMetadataOkCount = Volume_ConservativeMetadataUpdateCount;
-////////////////ReleaseSpinlock( &Volume_MetadataLock );
-                BackgroundThread_Busy = TRUE;
+////////////////ReleaseSpinlock( &Vcb->MetadataLock );
+                Vcb->BackgroundThreadBusy = TRUE;
                 continue;
             }
 
@@ -290,14 +561,28 @@ AlwaysLogFormatted( "W R I T I N G   A L L   M E T A D A T A   TOOK %d MILLISECO
 
 
 
+        //
+        //  Priority 6: prefetch some of the warm-cache manifest.
+        //
+#if WARM_CACHE_MANIFEST == YES
+        Did = CachePrefetchFromManifest( Vcb, FALSE );
+        if ( Did )
+        {
+            Vcb->BackgroundThreadBusy = TRUE;
+            continue;
+        }
+#endif
+
+
+
         //  We did not have anything to do.
-        BackgroundThread_Busy = FALSE;
+        Vcb->BackgroundThreadBusy = FALSE;
         SleepForMilliseconds( 1 );  //  TODO Sleep?
 
 
     }
 
-    BackgroundThread_STOPPED = TRUE;
+    Vcb->BackgroundThreadStopped = TRUE;
 
     //PsTerminateSystemThread( STATUS_SUCCESS );  //  Terminate ourself.
 
@@ -316,6 +601,11 @@ LogString( "Entering BackgroundThreadStartup.\n" );
 
     HANDLE ThreadHandle = 0;  //  A "kernel handle".
 
+    //  One thread per volume; it reports itself busy until it first finds nothing to do.
+    Vcb->BackgroundThreadStop    = FALSE;
+    Vcb->BackgroundThreadStopped = FALSE;
+    Vcb->BackgroundThreadBusy    = TRUE;
+
     Status = PsCreateSystemThread( &ThreadHandle, 0L,                0, 0, 0, BackgroundThread, Vcb );
 ////Status = PsCreateSystemThread( &ThreadHandle, THREAD_ALL_ACCESS, 0, 0, 0, BackgroundThread, Vcb );
 
@@ -327,16 +617,18 @@ LogString( "Leaving  BackgroundThreadStartup.\n" );
 
 //////////////////////////////////////////////////////////////////////
 
-NTSTATUS BackgroundThreadShutdown()
+NTSTATUS BackgroundThreadShutdown( VCB_ Vcb )
 
 {
 LogString( "Entering BackgroundThreadShutdown\n" );
 
-    BackgroundThread_STOP = TRUE;
+    Vcb->BackgroundThreadStop = TRUE;
     for ( int x = 0; x < 100; x++ )
     {
-        if ( BackgroundThread_STOPPED )
+        if ( Vcb->BackgroundThreadStopped )
         {
+            //  No one is left to complete flushes that arrived too late for it.
+            FailPendingFlushes( Vcb, 0, STATUS_VOLUME_DISMOUNTED );
 LogString( "Leaving  BackgroundThreadShutdown\n" );
             return 0;
         }
@@ -17,8 +17,119 @@
 #include "Common.h"
 
 //////////////////////////////////////////////////////////////////////
+//
+//  Device Activity
+//
+//  A mounted volume has us count the requests we send its device, so the write-back policy
+//  can tell an idle device from a busy one. A synchronous request, or a vectored one, counts
+//  as outstanding from when it is sent until we are done waiting for it.
+//
+//  A request finds its device's activity, and holds it, under the lock; so once untracking
+//  has cleared its slot under the lock, it need only wait for the holds already taken.
+
+static BLOCK_IO_ACTIVITY_ blockIoActivities[BLOCK_IO_MAX_DEVICES];
+static SPINLOCK           blockIoActivitiesLock;  //  Zeroed is unlocked.
+
+//////////////////////////////////////////////////////////////////////
+
+void BlockIoTrackDevice( BLOCK_IO_ACTIVITY_ Activity )
+
+{
+    AcquireSpinlock( &blockIoActivitiesLock );
+
+    for ( int i = 0; i < BLOCK_IO_MAX_DEVICES; i++ )
+    {
+        if ( blockIoActivities[i] ) continue;
+        blockIoActivities[i] = Activity;
+        break;
+    }
+
+    ReleaseSpinlock( &blockIoActivitiesLock );
+}
+
+//////////////////////////////////////////////////////////////////////
+
+void BlockIoUntrackDevice( BLOCK_IO_ACTIVITY_ Activity )
+
+{
+    AcquireSpinlock( &blockIoActivitiesLock );
+
+    for ( int i = 0; i < BLOCK_IO_MAX_DEVICES; i++ )
+    {
+        if ( blockIoActivities[i] == Activity ) blockIoActivities[i] = 0;
+    }
+
+    ReleaseSpinlock( &blockIoActivitiesLock );
+
+    //  Requests that found it before then are still using it.
+    while ( Activity->NumHolds ) SleepForMilliseconds( 1 );
+}
+
+//--------------------------------------------------------------------
+
+static BLOCK_IO_ACTIVITY_ blockIoActivityFor( PDEVICE_OBJECT DeviceObject )
+
+{
+    //  Find, and hold, the device's activity, if it is tracked; see blockIoActivityRelease.
+    BLOCK_IO_ACTIVITY_ Activity = 0;
+
+    AcquireSpinlock( &blockIoActivitiesLock );
+
+    for ( int i = 0; i < BLOCK_IO_MAX_DEVICES && ! Activity; i++ )
+    {
+        if ( blockIoActivities[i] && blockIoActivities[i]->DeviceObject == DeviceObject ) Activity = blockIoActivities[i];
+    }
+
+    if ( Activity ) InterlockedIncrement( &Activity->NumHolds );
+
+    ReleaseSpinlock( &blockIoActivitiesLock );
+
+    return Activity;
+}
+
+//--------------------------------------------------------------------
+
+static void blockIoActivityRelease( BLOCK_IO_ACTIVITY_ Activity )
 
-NTSTATUS ReadBlockDevice( PDEVICE_OBJECT DeviceObject, U8 Offset, U4 Length, V_ Buffer, VERIFY Verify )
+{
+    if ( Activity ) InterlockedDecrement( &Activity->NumHolds );
+}
+
+//--------------------------------------------------------------------
+
+static U8 blockIoStarted( BLOCK_IO_ACTIVITY_ Activity )
+
+{
+    U8 Now = CurrentMicrosecond();
+
+    if ( Activity && InterlockedIncrement( &Activity->NumOutstanding ) == 1 ) Activity->BusySinceMicrosecond = Now;
+
+    return Now;
+}
+
+//--------------------------------------------------------------------
+
+static void blockIoFinished( BLOCK_IO_ACTIVITY_ Activity, U8 StartedMicrosecond, UCHAR MajorFunction )
+
+{
+    if ( ! Activity ) return;
+
+    U8 Now       = CurrentMicrosecond();
+    U8 BusySince = Activity->BusySinceMicrosecond;  //  Before we drop our count, so it is still ours.
+
+    if ( ! InterlockedDecrement( &Activity->NumOutstanding ) ) InterlockedAdd64( &Activity->BusyMicroseconds, ( LONG64 ) ( Now - BusySince ) );
+
+    if ( MajorFunction != IRP_MJ_WRITE ) return;
+
+    LONG64 Microseconds = ( LONG64 ) ( Now - StartedMicrosecond );
+    InterlockedIncrement64( &Activity->NumWrites );
+    InterlockedAdd64( &Activity->WriteMicroseconds, Microseconds );
+    if ( Microseconds > Activity->MaxWriteMicroseconds ) Activity->MaxWriteMicroseconds = Microseconds;  //  Near enough.
+}
+
+//--------------------------------------------------------------------
+
+static NTSTATUS blockIoRead( PDEVICE_OBJECT DeviceObject, U8 Offset, U4 Length, V_ Buffer, VERIFY Verify )
 
 {
     KEVENT          Event;
@@ -52,6 +163,9 @@ LogFormatted( "(%p,%X,%X,%p)\n", ( V_ ) DeviceObject, ( U4 ) Offset, Length, Buf
     }
 
 
+    BLOCK_IO_ACTIVITY_ Activity = blockIoActivityFor( DeviceObject );
+    U8                 Started  = blockIoStarted( Activity );
+
     NTSTATUS Status = IoCallDriver( DeviceObject, Irp );
     if ( Status == STATUS_PENDING )
     {
@@ -60,6 +174,9 @@ LogString( "Waiting.\n" );
         Status = IoStatusBlock.Status;
     }
 
+    blockIoFinished( Activity, Started, IRP_MJ_READ );
+    blockIoActivityRelease( Activity );
+
 
 //  NTSTATUS Status = IoCallDriver( DeviceObject, Irp );
 //  LARGE_INTEGER NegativeOne;
@@ -86,9 +203,9 @@ AlwaysLogFormatted( "(%p,%X,%X,%p) %X\n", ( V_ ) DeviceObject, ( U4 ) Offset, Le
     return Status;
 }
 
-//////////////////////////////////////////////////////////////////////
+//--------------------------------------------------------------------
 
-NTSTATUS WriteBlockDevice( PDEVICE_OBJECT DeviceObject, U8 Offset, U4 Length, V_ Buffer, VERIFY Verify )
+static NTSTATUS blockIoWrite( PDEVICE_OBJECT DeviceObject, U8 Offset, U4 Length, V_ Buffer, VERIFY Verify )
 
 {
     KEVENT          Event;
@@ -119,6 +236,9 @@ AlwaysBreakToDebugger();
     }
 
 
+    BLOCK_IO_ACTIVITY_ Activity = blockIoActivityFor( DeviceObject );
+    U8                 Started  = blockIoStarted( Activity );
+
     NTSTATUS Status = IoCallDriver( DeviceObject, Irp );
     if ( Status == STATUS_PENDING )
     {
@@ -126,6 +246,9 @@ AlwaysBreakToDebugger();
         Status = IoStatusBlock.Status;
     }
 
+    blockIoFinished( Activity, Started, IRP_MJ_WRITE );
+    blockIoActivityRelease( Activity );
+
 if ( Status )
 {
 AlwaysLogFormatted( "(%p,%X,%X,%p) %X\n", ( V_ ) DeviceObject, ( U4 ) Offset, Length, Buffer, Status );
@@ -136,6 +259,411 @@ AlwaysLogFormatted( "(%p,%X,%X,%p) %X\n", ( V_ ) DeviceObject, ( U4 ) Offset, Le
 
 //////////////////////////////////////////////////////////////////////
 
+NTSTATUS FlushBlockDevice( PDEVICE_OBJECT DeviceObject )
+
+{
+    //  A write barrier: wait until everything written so far is on the media, not just in the
+    //  device's cache.
+    KEVENT          Event;
+    IO_STATUS_BLOCK IoStatusBlock;
+
+    KeInitializeEvent( &Event, NotificationEvent, FALSE );
+
+    PIRP Irp = IoBuildSynchronousFsdRequest( IRP_MJ_FLUSH_BUFFERS, DeviceObject, 0, 0, 0, &Event, &IoStatusBlock );
+    if ( ! Irp ) return STATUS_INSUFFICIENT_RESOURCES;
+
+    SetBit( IoGetNextIrpStackLocation( Irp )->Flags, SL_OVERRIDE_VERIFY_VOLUME );
+
+    BLOCK_IO_ACTIVITY_ Activity = blockIoActivityFor( DeviceObject );
+    U8                 Started  = blockIoStarted( Activity );
+
+    NTSTATUS Status = IoCallDriver( DeviceObject, Irp );
+    if ( Status == STATUS_PENDING )
+    {
+        KeWaitForSingleObject( &Event, Executive, KernelMode, FALSE, 0 );
+        Status = IoStatusBlock.Status;
+    }
+
+    blockIoFinished( Activity, Started, IRP_MJ_FLUSH_BUFFERS );
+    blockIoActivityRelease( Activity );
+
+if ( Status )
+{
+AlwaysLogFormatted( "(%p) flush %X\n", ( V_ ) DeviceObject, Status );
+}
+
+    return Status;
+}
+
+//////////////////////////////////////////////////////////////////////
+//
+//  Vectored Requests
+//
+//  Move a list of volume extents to or from a list of buffers. Extents that follow one another on the
+//  volume, with buffers that follow one another in memory, merge into one request. The requests all
+//  go out before we wait, just once, for the lot.
+
+typedef struct _BLOCK_IO_VECTOR { KEVENT Done; volatile LONG NumOutstanding; volatile LONG Status; } BLOCK_IO_VECTOR, *BLOCK_IO_VECTOR_;
+
+//--------------------------------------------------------------------
+
+static NTSTATUS blockIoVectorComplete( PDEVICE_OBJECT DeviceObject, PIRP Irp, PVOID Context )
+
+{
+    UNREFERENCED_PARAMETER( DeviceObject );
+
+    BLOCK_IO_VECTOR_ Vector = Context;
+
+    if ( ! NT_SUCCESS( Irp->IoStatus.Status ) ) InterlockedCompareExchange( &Vector->Status, Irp->IoStatus.Status, 0 );
+
+    //  We built the IRP, so we take it apart.
+    PMDL Mdl, NextMdl;
+    for ( Mdl = Irp->MdlAddress; Mdl; Mdl = NextMdl )
+    {
+        NextMdl = Mdl->Next;
+        MmUnlockPages( Mdl );
+        IoFreeMdl( Mdl );
+    }
+    Irp->MdlAddress = 0;
+    IoFreeIrp( Irp );
+
+    if ( ! InterlockedDecrement( &Vector->NumOutstanding ) ) KeSetEvent( &Vector->Done, IO_NO_INCREMENT, FALSE );
+
+    return STATUS_MORE_PROCESSING_REQUIRED;
+}
+
+//--------------------------------------------------------------------
+
+static NTSTATUS blockIoVectorSend( UCHAR MajorFunction, PDEVICE_OBJECT DeviceObject, BLOCK_IO_SEGMENT_ Segments, U4 NumSegments, VERIFY Verify )
+
+{
+    BLOCK_IO_VECTOR Vector;
+    KeInitializeEvent( &Vector.Done, NotificationEvent, FALSE );
+    Vector.NumOutstanding = 1;  //  Ours, until every request is sent.
+    Vector.Status         = 0;
+
+    BLOCK_IO_ACTIVITY_ Activity = blockIoActivityFor( DeviceObject );
+    U8                 Started  = blockIoStarted( Activity );
+
+    for ( U4 i = 0; i < NumSegments; )
+    {
+        //  Take this extent, and those after it that continue it both on the volume and in memory.
+        U8  Offset = Segments[i].VolumeAddress;
+        U1_ Buffer = Segments[i].Buffer;
+        U4  Length = Segments[i].NumBytes;
+        for ( i++; i < NumSegments; i++ )
+        {
+            if ( Segments[i].VolumeAddress != Offset + Length ) break;
+            if ( ( U1_ ) Segments[i].Buffer != Buffer + Length ) break;
+            if ( Length + Segments[i].NumBytes > BLOCK_IO_MAX_MERGED_NUM_BYTES ) break;
+            Length += Segments[i].NumBytes;
+        }
+
+ASSERT( ALIGNED_256( Offset ) );
+ASSERT( ALIGNED_256( Length ) );
+
+        LARGE_INTEGER OffsetAsLargeInteger;
+        OffsetAsLargeInteger.QuadPart = Offset;
+
+        PIRP Irp = IoBuildAsynchronousFsdRequest( MajorFunction, DeviceObject, Buffer, Length, &OffsetAsLargeInteger, 0 );
+        if ( ! Irp )
+        {
+            InterlockedCompareExchange( &Vector.Status, STATUS_INSUFFICIENT_RESOURCES, 0 );
+            break;
+        }
+
+        //  Override verification?
+        if ( Verify == NO_VERIFY )
+        {
+            SetBit( IoGetNextIrpStackLocation( Irp )->Flags, SL_OVERRIDE_VERIFY_VOLUME );
+        }
+
+        IoSetCompletionRoutine( Irp, blockIoVectorComplete, &Vector, TRUE, TRUE, TRUE );
+
+        InterlockedIncrement( &Vector.NumOutstanding );
+        IoCallDriver( DeviceObject, Irp );
+    }
+
+    if ( InterlockedDecrement( &Vector.NumOutstanding ) )
+    {
+        KeWaitForSingleObject( &Vector.Done, Executive, KernelMode, FALSE, 0 );
+    }
+
+    blockIoFinished( Activity, Started, MajorFunction );
+    blockIoActivityRelease( Activity );
+
+if ( Vector.Status )
+{
+AlwaysLogFormatted( "(%p,%X,%u) %X\n", ( V_ ) DeviceObject, ( U4 ) MajorFunction, NumSegments, Vector.Status );
+}
+
+    return Vector.Status;
+}
+
+//////////////////////////////////////////////////////////////////////
+//
+//  Scheduling
+//
+//  Each request has a class. Demand requests, those someone is waiting on, go straight to the
+//  device. Writeback, prefetch and checkpoint requests wait while demand requests are in flight,
+//  though never more than IO_MAX_DEFER_MICROSECONDS, so they are not starved; and they go in
+//  pieces no bigger than their class's budget, so a demand request that arrives meanwhile waits
+//  behind one piece, not the lot. Their vectored requests go in volume address order, as an
+//  elevator would take them.
+
+//--------------------------------------------------------------------
+
+static U4 blockIoBudget( IO_CLASS Class )
+
+{
+    switch ( Class )
+    {
+        case IO_WRITEBACK:   return IO_WRITEBACK_BUDGET_NUM_BYTES;
+        case IO_PREFETCH:    return IO_PREFETCH_BUDGET_NUM_BYTES;
+        case IO_CHECKPOINT:  return IO_CHECKPOINT_BUDGET_NUM_BYTES;
+        default:             return 0xFFFF'FFFF;
+    }
+}
+
+//--------------------------------------------------------------------
+
+static U4 blockIoLatencyBucket( U8 Microseconds )
+
+{
+    U4 Bucket = 0;
+    while ( Bucket < BLOCK_IO_NUM_LATENCY_BUCKETS - 1 && ( Microseconds >> Bucket ) ) Bucket++;
+    return Bucket;
+}
+
+//--------------------------------------------------------------------
+
+static U8 blockIoPercentile( volatile LONG* Latencies, U4 Percent )
+
+{
+    //  The bucket's bound, so "under" this many microseconds.
+    U8 Total = 0;
+    for ( U4 i = 0; i < BLOCK_IO_NUM_LATENCY_BUCKETS; i++ ) Total += ( U8 ) Latencies[i];
+    if ( ! Total ) return 0;
+
+    U8 Sum = 0;
+    for ( U4 i = 0; i < BLOCK_IO_NUM_LATENCY_BUCKETS; i++ )
+    {
+        Sum += ( U8 ) Latencies[i];
+        if ( Sum * 100 >= Total * Percent ) return ( U8 ) 1 << i;
+    }
+
+    return ( U8 ) 1 << ( BLOCK_IO_NUM_LATENCY_BUCKETS - 1 );
+}
+
+//--------------------------------------------------------------------
+
+static U8 blockIoAdmit( BLOCK_IO_ACTIVITY_ Activity, IO_CLASS Class )
+
+{
+    U8 Asked = CurrentMicrosecond();
+    if ( ! Activity ) return Asked;
+
+    BLOCK_IO_CLASS_ C = Activity->Classes + Class;
+
+    LONG NumQueued = InterlockedIncrement( &C->NumQueued );
+    if ( NumQueued > C->MaxNumQueued ) C->MaxNumQueued = NumQueued;  //  Near enough.
+
+    if ( Class != IO_DEMAND )
+    {
+        B1 Deferred = FALSE;
+        while (    Activity->Classes[IO_DEMAND].NumQueued + Activity->Classes[IO_DEMAND].NumInFlight
+                && CurrentMicrosecond() - Asked < IO_MAX_DEFER_MICROSECONDS )
+        {
+            Deferred = TRUE;
+            SleepForMilliseconds( 1 );
+        }
+        if ( Deferred ) InterlockedIncrement64( &C->NumDeferred );
+    }
+
+    InterlockedDecrement( &C->NumQueued );
+    InterlockedIncrement( &C->NumInFlight );
+
+    return Asked;
+}
+
+//--------------------------------------------------------------------
+
+static void blockIoDone( BLOCK_IO_ACTIVITY_ Activity, IO_CLASS Class, U8 Asked, U4 NumBytes )
+
+{
+    if ( ! Activity ) return;
+
+    BLOCK_IO_CLASS_ C = Activity->Classes + Class;
+
+    LONG64 Microseconds = ( LONG64 ) ( CurrentMicrosecond() - Asked );
+    U4     Bucket       = blockIoLatencyBucket( ( U8 ) Microseconds );
+
+    InterlockedDecrement( &C->NumInFlight );
+    InterlockedIncrement64( &C->NumRequests );
+    InterlockedAdd64( &C->NumBytes, NumBytes );
+    InterlockedAdd64( &C->Microseconds, Microseconds );
+    if ( Microseconds > C->MaxMicroseconds ) C->MaxMicroseconds = Microseconds;  //  Near enough.
+    InterlockedIncrement( &C->Latencies[Bucket] );
+
+    if ( Class != IO_DEMAND ) return;
+
+    if ( Microseconds > IO_DEMAND_DEADLINE_MICROSECONDS ) InterlockedIncrement64( &C->NumLate );
+    if ( Activity->CheckpointUnderway ) InterlockedIncrement( &Activity->DemandLatenciesDuringCheckpoint[Bucket] );
+}
+
+//--------------------------------------------------------------------
+
+static NTSTATUS blockIo( UCHAR MajorFunction, PDEVICE_OBJECT DeviceObject, U8 Offset, U4 Length, V_ Buffer, VERIFY Verify, IO_CLASS Class )
+
+{
+    BLOCK_IO_ACTIVITY_ Activity = blockIoActivityFor( DeviceObject );
+    U4                 Budget   = blockIoBudget( Class );
+
+    NTSTATUS Status = 0;
+    for ( U4 Done = 0; Done < Length && ! Status; )
+    {
+        U4  NumBytes = min( Budget, Length - Done );
+        U1_ At       = ( U1_ ) Buffer + Done;
+
+        U8 Asked = blockIoAdmit( Activity, Class );
+        Status = ( MajorFunction == IRP_MJ_READ )
+               ? blockIoRead(  DeviceObject, Offset + Done, NumBytes, At, Verify )
+               : blockIoWrite( DeviceObject, Offset + Done, NumBytes, At, Verify );
+        blockIoDone( Activity, Class, Asked, NumBytes );
+
+        Done += NumBytes;
+    }
+
+    blockIoActivityRelease( Activity );
+
+    return Status;
+}
+
+//--------------------------------------------------------------------
+
+static NTSTATUS blockIoVector( UCHAR MajorFunction, PDEVICE_OBJECT DeviceObject, BLOCK_IO_SEGMENT_ Segments, U4 NumSegments, VERIFY Verify, IO_CLASS Class )
+
+{
+    //  Background requests go by volume address. We sort a copy; callers pair their segments with other things.
+    BLOCK_IO_SEGMENT Sorted[BLOCK_IO_MAX_SEGMENTS];
+    if ( Class != IO_DEMAND && NumSegments <= BLOCK_IO_MAX_SEGMENTS )
+    {
+        for ( U4 i = 0; i < NumSegments; i++ )
+        {
+            U4 j = i;
+            for ( ; j && Sorted[j - 1].VolumeAddress > Segments[i].VolumeAddress; j-- ) Sorted[j] = Sorted[j - 1];
+            Sorted[j] = Segments[i];
+        }
+        Segments = Sorted;
+    }
+
+    //  Our completion routine only knows how to undo direct I/O, so other devices get one request at a time.
+    if ( BitIsClear( DeviceObject->Flags, DO_DIRECT_IO ) )
+    {
+        for ( U4 i = 0; i < NumSegments; i++ )
+        {
+            BLOCK_IO_SEGMENT_ S = Segments + i;
+            NTSTATUS Status = blockIo( MajorFunction, DeviceObject, S->VolumeAddress, S->NumBytes, S->Buffer, Verify, Class );
+            if ( Status ) return Status;
+        }
+        return 0;
+    }
+
+    BLOCK_IO_ACTIVITY_ Activity = blockIoActivityFor( DeviceObject );
+    U4                 Budget   = blockIoBudget( Class );
+
+    NTSTATUS Status = 0;
+    for ( U4 First = 0; First < NumSegments && ! Status; )
+    {
+        //  As many segments as the budget allows, and at least one.
+        U4 NumBytes = Segments[First].NumBytes;
+        U4 Last     = First + 1;
+        while ( Last < NumSegments && ( U8 ) NumBytes + Segments[Last].NumBytes <= Budget ) NumBytes += Segments[Last++].NumBytes;
+
+        U8 Asked = blockIoAdmit( Activity, Class );
+        Status = blockIoVectorSend( MajorFunction, DeviceObject, Segments + First, Last - First, Verify );
+        blockIoDone( Activity, Class, Asked, NumBytes );
+
+        First = Last;
+    }
+
+    blockIoActivityRelease( Activity );
+
+    return Status;
+}
+
+//////////////////////////////////////////////////////////////////////
+
+NTSTATUS ReadBlockDevice( PDEVICE_OBJECT DeviceObject, U8 Offset, U4 Length, V_ Buffer, VERIFY Verify, IO_CLASS Class )
+
+{
+    return blockIo( IRP_MJ_READ, DeviceObject, Offset, Length, Buffer, Verify, Class );
+}
+
+//////////////////////////////////////////////////////////////////////
+
+NTSTATUS WriteBlockDevice( PDEVICE_OBJECT DeviceObject, U8 Offset, U4 Length, V_ Buffer, VERIFY Verify, IO_CLASS Class )
+
+{
+    return blockIo( IRP_MJ_WRITE, DeviceObject, Offset, Length, Buffer, Verify, Class );
+}
+
+//--------------------------------------------------------------------
+
+NTSTATUS ReadBlockDeviceVector( PDEVICE_OBJECT DeviceObject, BLOCK_IO_SEGMENT_ Segments, U4 NumSegments, VERIFY Verify, IO_CLASS Class )
+
+{
+    return blockIoVector( IRP_MJ_READ, DeviceObject, Segments, NumSegments, Verify, Class );
+}
+
+//--------------------------------------------------------------------
+
+NTSTATUS WriteBlockDeviceVector( PDEVICE_OBJECT DeviceObject, BLOCK_IO_SEGMENT_ Segments, U4 NumSegments, VERIFY Verify, IO_CLASS Class )
+
+{
+    return blockIoVector( IRP_MJ_WRITE, DeviceObject, Segments, NumSegments, Verify, Class );
+}
+
+//////////////////////////////////////////////////////////////////////
+
+NTSTATUS BlockIoReport( S1_ Buffer, int MaxNumBytes, BLOCK_IO_ACTIVITY_ Activity )
+
+{
+    static const char* ClassNames[IO_NUM_CLASSES] = { "demand", "writeback", "prefetch", "checkpoint" };
+
+    NTSTATUS Status = RtlStringCchPrintfA( Buffer, MaxNumBytes,
+            "BlockIoReport %d requests outstanding   demand p99 under %llu us during checkpoints   %lld demand late  ",
+            Activity->NumOutstanding,
+            blockIoPercentile( Activity->DemandLatenciesDuringCheckpoint, 99 ),
+            Activity->Classes[IO_DEMAND].NumLate );
+
+    for ( int i = 0; i < IO_NUM_CLASSES && ! Status; i++ )
+    {
+        BLOCK_IO_CLASS_ C = Activity->Classes + i;
+        LONG64 NumRequests = C->NumRequests;
+
+        S1 scratch[256];
+        Status = RtlStringCchPrintfA( scratch, sizeof( scratch ),
+                "  %s: %lld requests %lld KB, %d queued (%d at most), %d in flight, %lld deferred, "
+                "%lld us on average, p99 under %llu us, %lld us at most ",
+                ClassNames[i],
+                NumRequests,
+                C->NumBytes / 1024,
+                C->NumQueued,
+                C->MaxNumQueued,
+                C->NumInFlight,
+                C->NumDeferred,
+                NumRequests ? C->Microseconds / NumRequests : 0,
+                blockIoPercentile( C->Latencies, 99 ),
+                C->MaxMicroseconds );
+        if ( ! Status ) Status = RtlStringCchCatA( Buffer, MaxNumBytes, scratch );
+    }
+
+    return Status;
+}
+
+//////////////////////////////////////////////////////////////////////
+
 NTSTATUS DeviceIoControlRequest( ULONG IoControlCode,  PDEVICE_OBJECT DeviceObject, V_ InputBuffer, ULONG InputBufferLength, V_ OutputBuffer, ULONG OutputBufferLength )
 
 {
@@ -18,294 +18,201 @@
 
 //////////////////////////////////////////////////////////////////////
 
-struct _CACHE_RANGE
-{
-    CACHE_RANGE_ P, L, R;   //  Parent, Left, Right
-    LINK        Link;
-    U8   VolumeAddress;
-    U1_  MemoryAddress;
-    U4   NumBytes;
-    B1   IsDirty;
-};
-
-//--------------------------------------------------------------------
-
-struct _CACHE
-{
-    CHAIN        Age;
-    CACHE_RANGE_ SetRoot;
-    U8           TotalNumDirtyBytes;
-    U4           TotalNumDirtyRanges;
-    U8           TotalNumCleanBytes;
-    U4           TotalNumCleanRanges;
-};
-
-//////////////////////////////////////////////////////////////////////
-
 #pragma warning( disable : 4706 )  //  assignment within conditional ( ex ) if ( a = b )
 
-
-CACHE    Cache;
-
-SPINLOCK CacheLock;
-
 //////////////////////////////////////////////////////////////////////
 //
 //  CacheRangesSet
 
-//--------------------------------------------------------------------
+#define cacheRangesKey( x ) ( x )->VolumeAddress
 
-inline void cacheRangesSetRotateL( CACHE_RANGE_ *rootHandle, CACHE_RANGE_ x )
+#if CACHE_INDEX == AVL
+ORDERED_SET_AVL(   cacheRanges, cacheRangesSet, CACHE_RANGE_, cacheRangesKey )
+#else
+ORDERED_SET_SPLAY( cacheRanges, cacheRangesSet, CACHE_RANGE_, cacheRangesKey )
+#endif
 
-{
-    CACHE_RANGE_ y = x->R, p = x->P;
-    if ( x->R = y->L ) y->L->P = x;
-    if ( ! ( y->P = p ) )
-        *rootHandle = y;
-    else
-    {
-        if ( x == p->L ) p->L = y;
-        else             p->R = y;
-    }
-    ( y->L = x )->P = y;
-}
+//////////////////////////////////////////////////////////////////////
+//
+//  CacheFilesSet
+//
+//  Each file with cache ranges has a node here, chaining them, so per-file work
+//  costs only as much as the file has cached.
 
-//--------------------------------------------------------------------
+#define cacheFilesKey( x ) ( U8 ) ( x )->Id
 
-inline void cacheRangesSetRotateR( CACHE_RANGE_ *rootHandle, CACHE_RANGE_ y )
+#if CACHE_INDEX == AVL
+ORDERED_SET_AVL(   cacheFiles, cacheFilesSet, CACHE_FILE_, cacheFilesKey )
+#else
+ORDERED_SET_SPLAY( cacheFiles, cacheFilesSet, CACHE_FILE_, cacheFilesKey )
+#endif
 
-{
-    CACHE_RANGE_ x = y->L, p = y->P;
-    if ( y->L = x->R ) x->R->P = y;
-    if ( ! ( x->P = p ) )
-        *rootHandle = x;
-    else
-    {
-        if ( y == p->L ) p->L = x;
-        else             p->R = x;
-    }
-    ( x->R = y )->P = x;
-}
+//////////////////////////////////////////////////////////////////////
+//
+//  Cache Arena
+//
+//  Cached ranges take runs of pages from one buffer reserved at mount, so caching a
+//  range neither fragments the pool nor pays to zero memory it is about to fill.
+//  A range that does not fit in the arena comes from the pool instead.
+//  Call these with the cache lock held.
 
 //--------------------------------------------------------------------
 
-static void cacheRangesSetSplay( CACHE_RANGE_ *rootHandle, CACHE_RANGE_ x )
+static U1_ cacheMemoryAllocate( VCB_ Vcb, U4 NumBytes )
 
 {
-    CACHE_RANGE_ p;
-    while ( p = x->P )
+    U4 NumPages = ( NumBytes + CACHE_PAGE_NUM_BYTES - 1 ) / CACHE_PAGE_NUM_BYTES;
+
+    if ( Vcb->Cache.ArenaNumPages )
     {
-        if ( ! p->P )
-        {
-            if ( p->L == x ) cacheRangesSetRotateR( rootHandle, p );
-            else             cacheRangesSetRotateL( rootHandle, p );
-        }
-        else
+        if ( Vcb->Cache.ArenaHint >= Vcb->Cache.ArenaNumPages ) Vcb->Cache.ArenaHint = 0;
+
+        ULONG Page = RtlFindClearBitsAndSet( &Vcb->Cache.ArenaMap, NumPages, Vcb->Cache.ArenaHint );
+        if ( Page != 0xFFFFFFFF )
         {
-            if ( p == p->P->R )
-            {
-                if ( p->R == x ) cacheRangesSetRotateL( rootHandle, p->P );
-                else             cacheRangesSetRotateR( rootHandle, p );
-                cacheRangesSetRotateL( rootHandle, x->P );
-            }
-            else
-            {
-                if ( p->L == x ) cacheRangesSetRotateR( rootHandle, p->P );
-                else             cacheRangesSetRotateL( rootHandle, p );
-                cacheRangesSetRotateR( rootHandle, x->P );
-            }
+            Vcb->Cache.ArenaHint          = Page + NumPages;
+            Vcb->Cache.ArenaNumPagesUsed += NumPages;
+            return Vcb->Cache.Arena + ( U8 ) Page * CACHE_PAGE_NUM_BYTES;
         }
     }
+
+    Vcb->Cache.NumPoolFallbacks++;
+    return AllocateMemory( NumBytes );
 }
 
 //--------------------------------------------------------------------
 
-inline int cacheRangesSetSeek( CACHE_RANGE_ from, CACHE_RANGE_ *resultHandle, U8 VolumeAddress )
+static void cacheMemoryFree( VCB_ Vcb, U1_ MemoryAddress, U4 NumBytes )
 
 {
-    CACHE_RANGE_ x = from;
-    for ( ;; )
+    U1_ Arena = Vcb->Cache.Arena;
+
+    if ( Arena && MemoryAddress >= Arena && MemoryAddress < Arena + ( U8 ) Vcb->Cache.ArenaNumPages * CACHE_PAGE_NUM_BYTES )
     {
-        S8 diff = VolumeAddress - x->VolumeAddress;
-        if ( diff < 0 )
-        {
-            if ( ! x->L ) { *resultHandle = x; return -1; }
-            x = x->L;
-        }
-        else
-        if ( diff > 0 )
-        {
-            if ( ! x->R ) { *resultHandle = x; return  1; }
-            x = x->R;
-        }
-        else              { *resultHandle = x; return  0; }
+        U4 Page     = ( U4 ) ( ( MemoryAddress - Arena ) / CACHE_PAGE_NUM_BYTES );
+        U4 NumPages = ( NumBytes + CACHE_PAGE_NUM_BYTES - 1 ) / CACHE_PAGE_NUM_BYTES;
+ASSERT( RtlAreBitsSet( &Vcb->Cache.ArenaMap, Page, NumPages ) );
+        RtlClearBits( &Vcb->Cache.ArenaMap, Page, NumPages );
+        Vcb->Cache.ArenaNumPagesUsed -= NumPages;
     }
+    else FreeMemory( MemoryAddress );
 }
 
 //--------------------------------------------------------------------
 
-CACHE_RANGE_ cacheRangesSetNext( CACHE_RANGE_ x )
+U1_ CacheMemoryAllocateWithLock( VCB_ Vcb, U4 NumBytes, U4_ DirectWriteSequence )
 
 {
-    if ( x->R ) { x = x->R; while ( x->L ) x = x->L; return x; }
-    CACHE_RANGE_ p = x->P;
-    while ( p && x == p->R ) { x = p; p = p->P; }
-    return p;
-}
+    AcquireSpinlock( &Vcb->CacheLock );
 
-//--------------------------------------------------------------------
+    U1_ MemoryAddress = cacheMemoryAllocate( Vcb, NumBytes );
+    *DirectWriteSequence = Vcb->Cache.DirectWriteSequence;  //  To hand back to CacheRangeAdoptWithLock.
 
-CACHE_RANGE_ cacheRangesSetPrev( CACHE_RANGE_ x )
+    ReleaseSpinlock( &Vcb->CacheLock );
 
-{
-    if ( x->L ) { x = x->L; while ( x->R ) x = x->R; return x; }
-    CACHE_RANGE_ p = x->P;
-    while ( p && x == p->L ) { x = p; p = p->P; }
-    return p;
+    return MemoryAddress;
 }
 
 //--------------------------------------------------------------------
 
-CACHE_RANGE_ cacheRangesSetFirst( CACHE_RANGE_ x )  //  NOTE does not bother to go up P to P!!
+void CacheMemoryFreeWithLock( VCB_ Vcb, U1_ MemoryAddress, U4 NumBytes )
 
 {
-    if ( x ) while ( x->L ) x = x->L;
-    return x;
-}
-
-//--------------------------------------------------------------------
+    AcquireSpinlock( &Vcb->CacheLock );
 
-CACHE_RANGE_ cacheRangesSetLast( CACHE_RANGE_ x )  //  NOTE does not bother to go up P to P!!
+    cacheMemoryFree( Vcb, MemoryAddress, NumBytes );
 
-{
-    if ( x ) while ( x->R ) x = x->R;
-    return x;
+    ReleaseSpinlock( &Vcb->CacheLock );
 }
 
-//--------------------------------------------------------------------
+//////////////////////////////////////////////////////////////////////
 
-CACHE_RANGE_ cacheRangesFind( CACHE_RANGE_ *rootHandle, U8 VolumeAddress )
+NTSTATUS CacheStartup( VCB_ Vcb )
 
 {
-    if ( ! *rootHandle ) return 0;
-    CACHE_RANGE_ x;
-    int direction = cacheRangesSetSeek( *rootHandle, &x, VolumeAddress );
-    cacheRangesSetSplay( rootHandle, x );
-    return direction?0:x;
-}
-
-//--------------------------------------------------------------------
 
-CACHE_RANGE_ cacheRangesNear( CACHE_RANGE_ *rootHandle, U8 VolumeAddress, NEIGHBOR want )
+ASSERT( ! Vcb->Cache.Age.First );
+ASSERT( ! Vcb->Cache.Age.Last  );
+ASSERT( ! Vcb->Cache.Dirty.First );
+ASSERT( ! Vcb->Cache.SetRoot   );
+ASSERT( ! Vcb->Cache.FileRoot  );
+ASSERT( ! Vcb->Cache.TotalNumDirtyRanges );
+ASSERT( ! Vcb->Cache.TotalNumDirtyBytes  );
 
-{
-    //  Return a node relative to ( <, <=, ==, >=, or > ) a key.
-    if ( ! *rootHandle ) return 0;
-    CACHE_RANGE_ x;
-    int dir = cacheRangesSetSeek( *rootHandle, &x, VolumeAddress );
-    if ( ( dir == 0 && want == GT ) || ( dir > 0 && want >= GE ) ) x = cacheRangesSetNext( x );
-    else
-    if ( ( dir == 0 && want == LT ) || ( dir < 0 && want <= LE ) ) x = cacheRangesSetPrev( x );
-    else
-    if ( dir != 0 && want == EQ ) x = 0;
-    if ( x ) cacheRangesSetSplay( rootHandle, x );
-    return x;
-}
+    Zero( &Vcb->Cache, sizeof( CACHE ) );
 
-//--------------------------------------------------------------------
+    InitializeSpinlock( &Vcb->CacheLock );
 
-int cacheRangesAttach( CACHE_RANGE_ *rootHandle, CACHE_RANGE_ x )
+#if CACHE_ARENA_NUM_BYTES > 0
+    //  One big nonpaged allocation, which the memory manager maps with large pages when it can.
+    U4 NumPages = CACHE_ARENA_NUM_BYTES / CACHE_PAGE_NUM_BYTES;
 
-{
-    if ( ! *rootHandle )
+    Vcb->Cache.Arena     = AllocateMemory( CACHE_ARENA_NUM_BYTES );
+    Vcb->Cache.ArenaBits = AllocateAndZeroMemory( ROUND_UP( NumPages, 32 ) / 8 );
+    if ( Vcb->Cache.Arena && Vcb->Cache.ArenaBits )
     {
-        *rootHandle = x;
-        x->P = x->L = x->R = 0;
+        RtlInitializeBitMap( &Vcb->Cache.ArenaMap, Vcb->Cache.ArenaBits, NumPages );
+        Vcb->Cache.ArenaNumPages = NumPages;
     }
     else
     {
-        CACHE_RANGE_ f;
-        int diff = cacheRangesSetSeek( *rootHandle, &f, x->VolumeAddress );
-        if ( ! diff ) return 0;
-        if ( diff < 0 ) f->L = x; else f->R = x;
-        x->P = f;
-        x->L = x->R = 0;
-        cacheRangesSetSplay( rootHandle, x );
+        AlwaysLogString( "CacheStartup could not reserve the cache arena, so will cache from the pool.\n" );
+        FreeMemory( Vcb->Cache.Arena     );
+        FreeMemory( Vcb->Cache.ArenaBits );
+        Vcb->Cache.Arena     = 0;
+        Vcb->Cache.ArenaBits = 0;
     }
-    return 1;
+#endif
+
+    return 0;
 }
 
-//--------------------------------------------------------------------
+//////////////////////////////////////////////////////////////////////
 
-void cacheRangesDetach( CACHE_RANGE_ *rootHandle, CACHE_RANGE_ x )
+NTSTATUS CacheShutdown( VCB_ Vcb )
 
 {
-    CACHE_RANGE_ p = x->P;
-    if ( ! x->L )
-    {
-        if ( p ) { if ( p->L == x ) p->L = x->R; else p->R = x->R; }
-        else *rootHandle = x->R;
-        if ( x->R ) x->R->P = p;
-    }
-    else if ( ! x->R )
-    {
-        if ( p ) { if ( p->L == x ) p->L = x->L; else p->R = x->L; }
-        else *rootHandle = x->L;
-        if ( x->L ) x->L->P = p;
-    }
-    else
+    if ( Vcb->Cache.TotalNumDirtyRanges )
     {
-        CACHE_RANGE_ e = x->L;
-        if ( e->R )
-        {
-            do { e = e->R; } while ( e->R );
-            if ( e->P->R = e->L ) e->L->P = e->P;
-            ( e->L = x->L )->P = e;
-        }
-        ( e->R = x->R )->P = e;
-        if ( e->P = x->P ) { if ( e->P->L == x ) e->P->L = e; else e->P->R = e; }
-        else *rootHandle = e;
+        for ( int i = 0; i < 5; i++ ) AlwaysLogString( "Need to have no dirty file here!!!\n" );
+ASSERT( 0 );
     }
-}
-
-//////////////////////////////////////////////////////////////////////
-
-NTSTATUS CacheStartup()
 
-{
+    CacheBlindlyThrowAwayAll( Vcb );
 
-ASSERT( ! Cache.Age.First );
-ASSERT( ! Cache.Age.Last  );
-ASSERT( ! Cache.SetRoot   );
-ASSERT( ! Cache.TotalNumDirtyRanges );
-ASSERT( ! Cache.TotalNumDirtyBytes  );
+    FreeMemory( Vcb->Cache.Manifest );
+    Vcb->Cache.Manifest = 0;
 
-    Zero( &Cache, sizeof( CACHE ) );
+ASSERT( ! Vcb->Cache.ArenaNumPagesUsed );
+    FreeMemory( Vcb->Cache.Arena     );
+    FreeMemory( Vcb->Cache.ArenaBits );
+    Vcb->Cache.Arena         = 0;
+    Vcb->Cache.ArenaBits     = 0;
+    Vcb->Cache.ArenaNumPages = 0;
 
-    InitializeSpinlock( &CacheLock );
+    UninitializeSpinlock( &Vcb->CacheLock );
 
     return 0;
 }
 
 //////////////////////////////////////////////////////////////////////
 
-NTSTATUS CacheShutdown()
+static void cacheRangeDirtied( VCB_ Vcb, CACHE_RANGE_ CacheRange )
 
 {
-    if ( Cache.TotalNumDirtyRanges )
-    {
-        for ( int i = 0; i < 5; i++ ) AlwaysLogString( "Need to have no dirty file here!!!\n" );
-ASSERT( 0 );
-    }
-
-    UninitializeSpinlock( &CacheLock );
-
-    return 0;
+    //  Count a new or clean range as dirty from now.
+    CacheRange->IsDirty               = TRUE;
+    CacheRange->DirtySinceMicrosecond = CurrentMicrosecond();
+    AttachLinkLast( &Vcb->Cache.Dirty, &CacheRange->DirtyLink );
+
+    Vcb->Cache.TotalNumDirtyBytes  += CacheRange->NumBytes;
+    Vcb->Cache.TotalNumDirtyRanges += 1;
+    if ( Vcb->Cache.TotalNumDirtyBytes > Vcb->Cache.MaxNumDirtyBytes ) Vcb->Cache.MaxNumDirtyBytes = Vcb->Cache.TotalNumDirtyBytes;
 }
 
-//////////////////////////////////////////////////////////////////////
+//--------------------------------------------------------------------
 
-NTSTATUS cacheRangeMake( U8 VolumeAddress, U1_ B, U4 NumBytes, CLEAN_OR_DIRTY CleanOrDirty, U4 WithinRangeOffset, U4 WithinRangeNumBytes )
+static NTSTATUS cacheRangeAttach( VCB_ Vcb, ID Id, U8 VolumeAddress, U1_ MemoryAddress, U4 NumBytes, CLEAN_OR_DIRTY CleanOrDirty )
 
 {
 
@@ -314,9 +221,9 @@ NTSTATUS cacheRangeMake( U8 VolumeAddress, U1_ B, U4 NumBytes, CLEAN_OR_DIRTY Cl
 
 
 //  For now, just cry out if not simple.
-CACHE_RANGE_ lt = cacheRangesNear( &Cache.SetRoot, VolumeAddress, LT );
-CACHE_RANGE_ eq = cacheRangesFind( &Cache.SetRoot, VolumeAddress     );
-CACHE_RANGE_ gt = cacheRangesNear( &Cache.SetRoot, VolumeAddress, GT );
+CACHE_RANGE_ lt = cacheRangesNear( &Vcb->Cache.SetRoot, VolumeAddress, LT );
+CACHE_RANGE_ eq = cacheRangesFind( &Vcb->Cache.SetRoot, VolumeAddress     );
+CACHE_RANGE_ gt = cacheRangesNear( &Vcb->Cache.SetRoot, VolumeAddress, GT );
 ASSERT( ! lt || lt->VolumeAddress + lt->NumBytes <= VolumeAddress );  //  No overlap with previous.
 ASSERT( ! eq );                                                       //  Doesn't already exist.
 ASSERT( ! gt || VolumeAddress + NumBytes <= gt->VolumeAddress );      //  No overlap with next.
@@ -328,38 +235,40 @@ ASSERT( VolumeAddress );
 ASSERT( CacheRange );
     if ( ! CacheRange ) return STATUS_INSUFFICIENT_RESOURCES;
 
-    U1_ MemoryAddress = AllocateAndZeroMemory( NumBytes );
-ASSERT( MemoryAddress );
-    if ( ! MemoryAddress )
+    CACHE_FILE_ CacheFile = cacheFilesFind( &Vcb->Cache.FileRoot, ( U8 ) Id );
+    if ( ! CacheFile )
     {
-        FreeMemory( CacheRange );
-        return STATUS_INSUFFICIENT_RESOURCES;
+        CacheFile = AllocateAndZeroMemory( sizeof( CACHE_FILE ) );
+ASSERT( CacheFile );
+        if ( ! CacheFile )
+        {
+            FreeMemory( CacheRange );
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+        CacheFile->Id = Id;
+        int OK = cacheFilesAttach( &Vcb->Cache.FileRoot, CacheFile, ( U8 ) Id );
+ASSERT( OK );
     }
 
     CacheRange->VolumeAddress = VolumeAddress;
     CacheRange->MemoryAddress = MemoryAddress;
     CacheRange->NumBytes      = NumBytes;
+    CacheRange->File          = CacheFile;
 
-    int OK = cacheRangesAttach( &Cache.SetRoot, CacheRange );
+    int OK = cacheRangesAttach( &Vcb->Cache.SetRoot, CacheRange, VolumeAddress );
 ASSERT( OK );
-    AttachLinkLast( &Cache.Age, &CacheRange->Link );
-
-
-    if ( B ) memcpy( MemoryAddress + WithinRangeOffset, B, WithinRangeNumBytes );
-    else     Zero(   MemoryAddress + WithinRangeOffset,    WithinRangeNumBytes );
-
+    AttachLinkLast( &Vcb->Cache.Age, &CacheRange->Link );
+    AttachLinkLast( &CacheFile->Ranges, &CacheRange->FileLink );
 
     if ( CleanOrDirty == CLEAN )
     {
         CacheRange->IsDirty = FALSE;
-        Cache.TotalNumCleanBytes  += NumBytes;
-        Cache.TotalNumCleanRanges += 1;
+        Vcb->Cache.TotalNumCleanBytes  += NumBytes;
+        Vcb->Cache.TotalNumCleanRanges += 1;
     }
     else
     {
-        CacheRange->IsDirty = TRUE;
-        Cache.TotalNumDirtyBytes  += NumBytes;
-        Cache.TotalNumDirtyRanges += 1;
+        cacheRangeDirtied( Vcb, CacheRange );
     }
 
     return 0;
@@ -367,356 +276,1340 @@ ASSERT( OK );
 
 //////////////////////////////////////////////////////////////////////
 
-//  TODO should we be looking for and removing cache when we remove a file range?
-
-void cacheRangeUnmake( U8 VolumeAddress )
+NTSTATUS cacheRangeMake( VCB_ Vcb, ID Id, U8 VolumeAddress, U1_ B, U4 NumBytes, CLEAN_OR_DIRTY CleanOrDirty, U4 WithinRangeOffset, U4 WithinRangeNumBytes )
 
 {
-    CACHE_RANGE_ CacheRange = cacheRangesFind( &Cache.SetRoot, VolumeAddress );
-ASSERT( CacheRange );
+    U1_ MemoryAddress = cacheMemoryAllocate( Vcb, NumBytes );
+ASSERT( MemoryAddress );
+    if ( ! MemoryAddress ) return STATUS_INSUFFICIENT_RESOURCES;
+
+    //  Fill the part we were given, and zero only the rest.
+    U4 WithinRangeOffsetTo = WithinRangeOffset + WithinRangeNumBytes;
+    Zero( MemoryAddress, WithinRangeOffset );
+    if ( B ) memcpy( MemoryAddress + WithinRangeOffset, B, WithinRangeNumBytes );
+    else     Zero(   MemoryAddress + WithinRangeOffset,    WithinRangeNumBytes );
+    Zero( MemoryAddress + WithinRangeOffsetTo, NumBytes - WithinRangeOffsetTo );
+
+    NTSTATUS Status = cacheRangeAttach( Vcb, Id, VolumeAddress, MemoryAddress, NumBytes, CleanOrDirty );
+    if ( Status ) cacheMemoryFree( Vcb, MemoryAddress, NumBytes );
+
+    return Status;
+}
+
+//////////////////////////////////////////////////////////////////////
 
+static void cacheRangeUnmake( VCB_ Vcb, CACHE_RANGE_ CacheRange )
 
+{
+    //  Forget the range, dirty or not. If the background thread is writing from it,
+    //  leave its memory for cacheRangeUnpin to free when the write is done.
     if ( CacheRange->IsDirty )
     {
-        Cache.TotalNumDirtyBytes  -= CacheRange->NumBytes;
-        Cache.TotalNumDirtyRanges -= 1;
+        DetachLink( &Vcb->Cache.Dirty, &CacheRange->DirtyLink );
+        Vcb->Cache.TotalNumDirtyBytes  -= CacheRange->NumBytes;
+        Vcb->Cache.TotalNumDirtyRanges -= 1;
     }
     else
     {
-        Cache.TotalNumCleanBytes  -= CacheRange->NumBytes;
-        Cache.TotalNumCleanRanges -= 1;
+        Vcb->Cache.TotalNumCleanBytes  -= CacheRange->NumBytes;
+        Vcb->Cache.TotalNumCleanRanges -= 1;
     }
 
 
-    DetachLink(  &Cache.Age, &CacheRange->Link );
-    cacheRangesDetach( &Cache.SetRoot, CacheRange );
-    FreeMemory( CacheRange->MemoryAddress );
-    FreeMemory( CacheRange );
-}
-
-//////////////////////////////////////////////////////////////////////
-
-NTSTATUS CacheRangeMakeWithLock( U8 VolumeAddress, U1_ B, U4 NumBytes, CLEAN_OR_DIRTY CleanOrDirty, U4 WithinRangeOffset, U4 WithinRangeNumBytes )
-
-{
-    AcquireSpinlock( &CacheLock );
+    CACHE_FILE_ CacheFile = CacheRange->File;
 
-    NTSTATUS Status = cacheRangeMake( VolumeAddress, B, NumBytes, CleanOrDirty, WithinRangeOffset, WithinRangeNumBytes );
+    DetachLink(  &Vcb->Cache.Age, &CacheRange->Link );
+    DetachLink(  &CacheFile->Ranges, &CacheRange->FileLink );
+    cacheRangesDetach( &Vcb->Cache.SetRoot, CacheRange );
+    CacheRange->File = 0;
 
-    ReleaseSpinlock( &CacheLock );
+    if ( ! CacheFile->Ranges.First )
+    {
+        cacheFilesDetach( &Vcb->Cache.FileRoot, CacheFile );
+        FreeMemory( CacheFile );
+    }
 
-    return Status;
+    if ( CacheRange->IsWriting )
+    {
+        CacheRange->IsPurged = TRUE;
+        return;
+    }
 
+    cacheMemoryFree( Vcb, CacheRange->MemoryAddress, CacheRange->NumBytes );
+    FreeMemory( CacheRange );
 }
-//////////////////////////////////////////////////////////////////////
 
-NTSTATUS CacheBlindlyThrowAwayAll()
+//--------------------------------------------------------------------
+
+static void cacheRangeUnpin( VCB_ Vcb, CACHE_RANGE_ CacheRange )
 
 {
-    AcquireSpinlock( &CacheLock );
+ASSERT( CacheRange->IsWriting );
+    CacheRange->IsWriting = FALSE;
 
-    while ( Cache.Age.First )
+    if ( CacheRange->IsPurged )
     {
-        LINK_ Link = Cache.Age.First;
-        CACHE_RANGE_ CacheRange = OWNER( CACHE_RANGE, Link, Link );
-
-        cacheRangeUnmake( CacheRange->VolumeAddress );
+        cacheMemoryFree( Vcb, CacheRange->MemoryAddress, CacheRange->NumBytes );
+        FreeMemory( CacheRange );
     }
+}
 
-    ReleaseSpinlock( &CacheLock );
+//--------------------------------------------------------------------
 
-    return 0;
+static void cacheRangeMarkDirty( VCB_ Vcb, CACHE_RANGE_ CacheRange )
+
+{
+    if ( CacheRange->IsDirty ) return;
+
+    Vcb->Cache.TotalNumCleanBytes  -= CacheRange->NumBytes;
+    Vcb->Cache.TotalNumCleanRanges -= 1;
+    cacheRangeDirtied( Vcb, CacheRange );
 }
 
-//////////////////////////////////////////////////////////////////////
+//--------------------------------------------------------------------
 
-void FindFirstUncachedRange( ENTRY_ Entry, U8_ A_, U4_ N_ )
+static void cacheRangeMarkClean( VCB_ Vcb, CACHE_RANGE_ CacheRange )
 
 {
-    AcquireSpinlock( &CacheLock );
+    if ( ! CacheRange->IsDirty ) return;
+
+    CacheRange->IsDirty = FALSE;
+    DetachLink( &Vcb->Cache.Dirty, &CacheRange->DirtyLink );
+    Vcb->Cache.TotalNumCleanBytes  += CacheRange->NumBytes;
+    Vcb->Cache.TotalNumCleanRanges += 1;
+    Vcb->Cache.TotalNumDirtyBytes  -= CacheRange->NumBytes;
+    Vcb->Cache.TotalNumDirtyRanges -= 1;
+}
 
-    FILE_DATA_ FileData  = Data( Entry );
-ASSERT( FileData );
+//--------------------------------------------------------------------
 
-    for ( U4 i = 0; i < FileData->NumRanges; i++ )
-    {
-        DATA_RANGE_ DataRange = &FileData->DataRange[i];
+static void cacheRangeUsed( VCB_ Vcb, CACHE_RANGE_ CacheRange )
 
-        CACHE_RANGE_ CacheRange = cacheRangesFind( &Cache.SetRoot, DataRange->VolumeAddress );
-        if ( ! CacheRange )
-        {
-            *A_ = DataRange->VolumeAddress;
-            *N_ = DataRange->NumBytes;
-            ReleaseSpinlock( &CacheLock );
-            return;
-        }
-    }
+{
+    //  A range prefetched from the warm-cache manifest is first used now, so it ages, and is recorded, from now.
+    if ( ! CacheRange->IsPrefetched ) return;
 
-    *A_ = 0;
-    ReleaseSpinlock( &CacheLock );
-    return;
+    CacheRange->IsPrefetched = FALSE;
+    DetachLink(     &Vcb->Cache.Age, &CacheRange->Link );
+    AttachLinkLast( &Vcb->Cache.Age, &CacheRange->Link );
 }
 
-//////////////////////////////////////////////////////////////////////
+//--------------------------------------------------------------------
 
-NTSTATUS AccessCacheForFile( ENTRY_ Entry, DIRECTION Direction, U1_ CallerBuffer, U8 CallerFileOffset, U4 CallerNumBytes )
+static void cacheRangeMarkUnwritten( VCB_ Vcb, U8 VolumeAddress, U8 FileOffset )
 
 {
-    NTSTATUS Status;
-
-    AcquireSpinlock( &CacheLock );
+    //  The dirty range just made is over an unwritten one, which stays unwritten until this is written back.
+    CACHE_RANGE_ CacheRange = cacheRangesFind( &Vcb->Cache.SetRoot, VolumeAddress );
+    CacheRange->IsUnwritten = TRUE;
+    CacheRange->FileOffset  = FileOffset;
+}
 
-    FILE_DATA_ FileData = Data( Entry );
+//--------------------------------------------------------------------
 
-    if ( CallerFileOffset + CallerNumBytes > FileData->AllocationNumBytes )
-    {
-        ReleaseSpinlock( &CacheLock );
-        return STATUS_INVALID_USER_BUFFER;  //  TODO status or buffer overflow warning
-    }
-    U8 CurrentFileOffsetAt = CallerFileOffset;
-    U4 CurrentNumBytesLeft = CallerNumBytes;
-    U1_ B = CallerBuffer;
+static void cacheRangesWrittenBack( VCB_ Vcb, CACHE_RANGE_* Pinned, U4 NumPinned, NTSTATUS Status )
 
+{
+    //  Unpin the ranges written back, or dirty them again if the write failed. Those over unwritten
+    //  ranges make them written, only now that the volume has them, so that no metadata write ever
+    //  records a range as written that is not. That is a metadata change, so its lock comes first.
+    //  Only we clear IsUnwritten, and pinned ranges stay, so it can be read without the cache lock.
+    B1 MustMark = FALSE;
+    for ( U4 i = 0; i < NumPinned; i++ ) if ( Pinned[i]->IsUnwritten ) MustMark = ! Status;
 
-    //  Walk the ranges.
-    U8 DataRangeFileOffset = 0;
+    if ( MustMark ) AcquireSpinlock( &Vcb->MetadataLock );
+    AcquireSpinlock( &Vcb->CacheLock );
 
-    for ( U4 i = 0; i < FileData->NumRanges; i++ )  //  TODO Speedup? Maybe don't have to go over all ranges?
+    for ( U4 i = 0; i < NumPinned; i++ )
     {
-        if ( CurrentNumBytesLeft == 0 ) break;
-
-        DATA_RANGE_ DataRange = &FileData->DataRange[i];
-        U8 DataRangeFileOffsetTo = DataRangeFileOffset + DataRange->NumBytes;
-        if ( DataRangeFileOffsetTo > CurrentFileOffsetAt )
+        CACHE_RANGE_ CacheRange = Pinned[i];
+        if ( ! CacheRange->IsPurged )
         {
-            if ( DataRangeFileOffset > CurrentFileOffsetAt + CurrentNumBytesLeft )
+            if ( Status ) cacheRangeMarkDirty( Vcb, CacheRange );
+            else
+            if ( CacheRange->IsUnwritten )
             {
-AlwaysBreakToDebugger();  //  We won't get here right!?
-                break;
+                DataMarkRangeWritten( Vcb, CacheRange->File->Id, CacheRange->FileOffset, CacheRange->VolumeAddress );
+                CacheRange->IsUnwritten = FALSE;
             }
+        }
+        cacheRangeUnpin( Vcb, CacheRange );
+    }
 
-            U8 WithinRangeOffset   = max( DataRangeFileOffset   , CurrentFileOffsetAt                       ) - DataRangeFileOffset;
-            U8 WithinRangeOffsetTo = min( DataRangeFileOffsetTo , CurrentFileOffsetAt + CurrentNumBytesLeft ) - DataRangeFileOffset;
-            U4 WithinRangeNumBytes = ( U4 ) ( WithinRangeOffsetTo - WithinRangeOffset );
+    ReleaseSpinlock( &Vcb->CacheLock );
 
+    if ( MustMark )
+    {
+        Vcb->ConservativeMetadataUpdateCount++;
+        ReleaseSpinlock( &Vcb->MetadataLock );
+    }
+}
 
-            if ( WithinRangeOffset < WithinRangeOffsetTo )
-            {
+//////////////////////////////////////////////////////////////////////
 
-                //  Find the corresponding cache, if any, and deal with it..
-                U8 VolumeAddress = DataRange->VolumeAddress;
+NTSTATUS CacheRangeMakeWithLock( VCB_ Vcb, ID Id, U8 VolumeAddress, U1_ B, U4 NumBytes, CLEAN_OR_DIRTY CleanOrDirty, U4 WithinRangeOffset, U4 WithinRangeNumBytes )
 
-                CACHE_RANGE_ CacheRange = cacheRangesFind( &Cache.SetRoot, VolumeAddress );
-                if ( CacheRange )
-                {
-ASSERT( CacheRange->NumBytes == DataRange->NumBytes );
-                    switch( Direction )
-                    {
+{
+    AcquireSpinlock( &Vcb->CacheLock );
 
-                      case OUT_OF_CACHE:
-                        if ( B ) memcpy( B, CacheRange->MemoryAddress + WithinRangeOffset, WithinRangeNumBytes );
-                        break;
+    NTSTATUS Status = cacheRangeMake( Vcb, Id, VolumeAddress, B, NumBytes, CleanOrDirty, WithinRangeOffset, WithinRangeNumBytes );
 
-                      case INTO_CACHE:
-                        if ( B ) memcpy( CacheRange->MemoryAddress + WithinRangeOffset, B, WithinRangeNumBytes );
-                        else     Zero(   CacheRange->MemoryAddress + WithinRangeOffset,    WithinRangeNumBytes );
-                        if ( ! CacheRange->IsDirty )
-                        {
-                            CacheRange->IsDirty = TRUE;
-                            Cache.TotalNumCleanBytes  -= CacheRange->NumBytes;
-                            Cache.TotalNumCleanRanges -= 1;
-                            Cache.TotalNumDirtyBytes  += CacheRange->NumBytes;
-                            Cache.TotalNumDirtyRanges += 1;
-                        }
-                        break;
-                    }
-                }
-                else
-                {
-                    //  The cache range does not exist.
+    ReleaseSpinlock( &Vcb->CacheLock );
 
-                    switch( Direction )
-                    {
+    return Status;
 
-                      case OUT_OF_CACHE:
-AlwaysLogFormatted( "!!!!!!!!!!!!!!STATUS_PENDING; NEED CACHE FILL on %p %8X\n", ( V_ ) VolumeAddress, DataRange->NumBytes );
-                        ReleaseSpinlock( &CacheLock );
+}
+//////////////////////////////////////////////////////////////////////
 
-                        return STATUS_PENDING;
+NTSTATUS CacheRangeAdoptWithLock( VCB_ Vcb, ID Id, U8 VolumeAddress, U1_ MemoryAddress, U4 NumBytes, CLEAN_OR_DIRTY CleanOrDirty, U4 DirectWriteSequence )
 
-                      case INTO_CACHE:
+{
+    //  Make a cache range of memory from CacheMemoryAllocateWithLock that the caller filled without
+    //  the lock, as when reading from the volume. If a writer cached the range meanwhile, keep theirs.
+    //  If a direct write to the volume was in flight or has happened since, or a purge, what we read
+    //  may be stale or no longer the file's, so drop it; whoever needs the range will read it again.
+    NTSTATUS Status = 0;
 
-                        Status = cacheRangeMake( VolumeAddress, B, DataRange->NumBytes, DIRTY, ( U4 ) WithinRangeOffset, WithinRangeNumBytes );
-ASSERT( ! Status );
-                        break;
+    AcquireSpinlock( &Vcb->CacheLock );
 
-                    }
-                }
+    if (    ( DirectWriteSequence & 1 )
+         || ( DirectWriteSequence != Vcb->Cache.DirectWriteSequence )
+         || cacheRangesFind( &Vcb->Cache.SetRoot, VolumeAddress ) )
+    {
+        cacheMemoryFree( Vcb, MemoryAddress, NumBytes );
+    }
+    else
+    {
+        Status = cacheRangeAttach( Vcb, Id, VolumeAddress, MemoryAddress, NumBytes, CleanOrDirty );
+        if ( Status ) cacheMemoryFree( Vcb, MemoryAddress, NumBytes );
+    }
 
+    ReleaseSpinlock( &Vcb->CacheLock );
 
+    return Status;
+}
 
-                CurrentFileOffsetAt += WithinRangeNumBytes;
-                CurrentNumBytesLeft -= WithinRangeNumBytes;
-                if ( B ) B += WithinRangeNumBytes;
+//////////////////////////////////////////////////////////////////////
 
-            }
-            else
-            {
-AlwaysBreakToDebugger();  //  We won't get here right!?
-            }
+NTSTATUS CacheBlindlyThrowAwayAll( VCB_ Vcb )
 
-        }
-        DataRangeFileOffset = DataRangeFileOffsetTo;
+{
+    AcquireSpinlock( &Vcb->CacheLock );
+
+    while ( Vcb->Cache.Age.First )
+    {
+        LINK_ Link = Vcb->Cache.Age.First;
+        CACHE_RANGE_ CacheRange = OWNER( CACHE_RANGE, Link, Link );
+
+        cacheRangeUnmake( Vcb, CacheRange );
     }
 
-    ReleaseSpinlock( &CacheLock );
+    ReleaseSpinlock( &Vcb->CacheLock );
 
     return 0;
 }
 
 //////////////////////////////////////////////////////////////////////
 
-NTSTATUS CacheReport( S1_ Buffer, int MaxNumBytes )
+NTSTATUS CacheFlushFile( VCB_ Vcb, ID Id )
 
 {
+    //  Write the file's dirty ranges to the volume, as vectored requests, and wait for them.
+    //  A range the background thread is writing is not on the volume yet either, so wait for
+    //  that write to finish, and write the range again if it was dirtied meanwhile.
+    for ( ;; )
+    {
+        BLOCK_IO_SEGMENT Segments[BLOCK_IO_MAX_SEGMENTS];
+        CACHE_RANGE_     Pinned[BLOCK_IO_MAX_SEGMENTS];
+        U4               NumSegments = 0;
+        B1               MustWait    = FALSE;
 
-    AcquireSpinlock( &CacheLock );
+        AcquireSpinlock( &Vcb->CacheLock );
 
-    S1_ P = Buffer;
-    P[0] = 0;
-    S1 scratch[256] = {0};  //  TODO should not be necessary to init
+        CACHE_FILE_ CacheFile = cacheFilesFind( &Vcb->Cache.FileRoot, ( U8 ) Id );
+        LINK_       Link      = CacheFile ? CacheFile->Ranges.First : 0;
+
+        for ( ; Link && NumSegments < BLOCK_IO_MAX_SEGMENTS; Link = Link->Next )
+        {
+            CACHE_RANGE_ CacheRange = OWNER( CACHE_RANGE, FileLink, Link );
+            if ( CacheRange->IsWriting )
+            {
+                MustWait = TRUE;
+                continue;
+            }
+            if ( ! CacheRange->IsDirty ) continue;
+
+            cacheRangeMarkClean( Vcb, CacheRange );
+            CacheRange->IsWriting = TRUE;
+
+            Pinned[NumSegments] = CacheRange;
+            Segments[NumSegments].VolumeAddress = CacheRange->VolumeAddress;
+            Segments[NumSegments].NumBytes      = CacheRange->NumBytes;
+            Segments[NumSegments].Buffer        = CacheRange->MemoryAddress;
+            NumSegments++;
+        }
 
+        ReleaseSpinlock( &Vcb->CacheLock );
 
-    NTSTATUS Status = RtlStringCchPrintfA( scratch, MaxNumBytes,
-            "CacheReport %d dirty ranges for %d dirty bytes   %d clean ranges for %d clean bytes",
-                    Cache.TotalNumDirtyRanges,
-            ( int ) Cache.TotalNumDirtyBytes,
-                    Cache.TotalNumCleanRanges,
-            ( int ) Cache.TotalNumCleanBytes );
+        if ( ! NumSegments )
+        {
+            if ( ! MustWait ) return 0;
+            SleepForMilliseconds( 1 );
+            continue;
+        }
 
-    if ( ! Status ) strcat( P, scratch );
-    else            strcat( P, "(oops)" );
+        NTSTATUS Status = WriteBlockDeviceVector( Vcb->PhysicalDeviceObject, Segments, NumSegments, NO_VERIFY, IO_WRITEBACK );
 
-    ReleaseSpinlock( &CacheLock );
+        cacheRangesWrittenBack( Vcb, Pinned, NumSegments, Status );
 
-    return 0;
+        if ( Status ) return Status;
+    }
 }
 
 //////////////////////////////////////////////////////////////////////
 
-U4 CacheBackgroundWriteDirtiestToVolume()
+NTSTATUS CacheFlushAll( VCB_ Vcb )
 
 {
+    //  Flush every file with cache, one after another by Id, since files come and go meanwhile.
+    NTSTATUS Status = 0;
+    ID       Id     = 0;
 
-//AlwaysLogString( "@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@ CacheBackgroundWriteDirtiestToVolume got in.\n" );
+    for ( ;; )
+    {
+        AcquireSpinlock( &Vcb->CacheLock );
+        CACHE_FILE_ CacheFile = cacheFilesNear( &Vcb->Cache.FileRoot, ( U8 ) Id, GT );
+        if ( CacheFile ) Id = CacheFile->Id;
+        ReleaseSpinlock( &Vcb->CacheLock );
+
+        if ( ! CacheFile ) return Status;
+
+        NTSTATUS FileStatus = CacheFlushFile( Vcb, Id );
+        if ( ! Status ) Status = FileStatus;
+    }
+}
+
+//////////////////////////////////////////////////////////////////////
+
+void CachePurgeFile( VCB_ Vcb, ID Id )
+
+{
+    //  Forget all of a file's cache, dirty or not, as when it is deleted, so that none of it
+    //  is ever written over blocks the file no longer owns.
+    AcquireSpinlock( &Vcb->CacheLock );
+
+    //  Stepped by two, so it stays even, to make fills read before now be dropped when adopted.
+    Vcb->Cache.DirectWriteSequence += 2;
+
+    CACHE_FILE_ CacheFile = cacheFilesFind( &Vcb->Cache.FileRoot, ( U8 ) Id );
+    LINK_       Next;
+
+    //  The file's node goes away with its last range.
+    for ( LINK_ Link = CacheFile ? CacheFile->Ranges.First : 0; Link; Link = Next )
+    {
+        Next = Link->Next;
+        cacheRangeUnmake( Vcb, OWNER( CACHE_RANGE, FileLink, Link ) );
+    }
+
+    ReleaseSpinlock( &Vcb->CacheLock );
+}
+
+//////////////////////////////////////////////////////////////////////
+
+void CachePurgeRange( VCB_ Vcb, ID Id, U8 VolumeAddress )
+
+{
+    //  Forget the file's cache of one range, dirty or not, as when the range is cut from the file.
+    //  A range at that address cached for another file is that file's, and stays.
+    AcquireSpinlock( &Vcb->CacheLock );
+
+    Vcb->Cache.DirectWriteSequence += 2;
+
+    CACHE_RANGE_ CacheRange = cacheRangesFind( &Vcb->Cache.SetRoot, VolumeAddress );
+ASSERT( ! CacheRange || CacheRange->File->Id == Id );
+    if ( CacheRange && CacheRange->File->Id == Id ) cacheRangeUnmake( Vcb, CacheRange );
+
+    ReleaseSpinlock( &Vcb->CacheLock );
+}
+
+//////////////////////////////////////////////////////////////////////
 
+B1 CacheTrimRange( VCB_ Vcb, U8 VolumeAddress, U4 NumBytes )
+
+{
+    //  Cut the cache of a range down to its first NumBytes, or forget it for none, as when the end
+    //  of the range is cut from its file to give back. FALSE, and nothing cut, while the background
+    //  thread writes it, since blocks given back must not be written after.
+    AcquireSpinlock( &Vcb->CacheLock );
+
+    Vcb->Cache.DirectWriteSequence += 2;
+
+    CACHE_RANGE_ CacheRange = cacheRangesFind( &Vcb->Cache.SetRoot, VolumeAddress );
+    B1           OK         = ! CacheRange || ! CacheRange->IsWriting;
+
+    if ( CacheRange && OK )
+    {
+        if ( ! NumBytes )
+        {
+            cacheRangeUnmake( Vcb, CacheRange );
+        }
+        else if ( NumBytes < CacheRange->NumBytes )
+        {
+            U4 NumBytesCut = CacheRange->NumBytes - NumBytes;
+            if ( CacheRange->IsDirty ) Vcb->Cache.TotalNumDirtyBytes -= NumBytesCut;
+            else                       Vcb->Cache.TotalNumCleanBytes -= NumBytesCut;
+
+            //  Arena pages past the end go back; pool memory goes back whole when the range does.
+            U1_ Arena = Vcb->Cache.Arena;
+            if ( Arena && CacheRange->MemoryAddress >= Arena && CacheRange->MemoryAddress < Arena + ( U8 ) Vcb->Cache.ArenaNumPages * CACHE_PAGE_NUM_BYTES )
+            {
+                U4 KeptNumBytes = ROUND_UP( NumBytes, CACHE_PAGE_NUM_BYTES );
+                if ( KeptNumBytes < CacheRange->NumBytes ) cacheMemoryFree( Vcb, CacheRange->MemoryAddress + KeptNumBytes, CacheRange->NumBytes - KeptNumBytes );
+            }
+            CacheRange->NumBytes = NumBytes;
+        }
+    }
+
+    ReleaseSpinlock( &Vcb->CacheLock );
+
+    return OK;
+}
+
+//////////////////////////////////////////////////////////////////////
+
+U4 CacheEvictFile( VCB_ Vcb, ID Id )
+
+{
+    //  Free a file's clean cache, keeping what is dirty or being written.
+    U4 NumBytesUncached = 0;
+
+    AcquireSpinlock( &Vcb->CacheLock );
+
+    CACHE_FILE_ CacheFile = cacheFilesFind( &Vcb->Cache.FileRoot, ( U8 ) Id );
+    LINK_       Next;
+
+    for ( LINK_ Link = CacheFile ? CacheFile->Ranges.First : 0; Link; Link = Next )
+    {
+        Next = Link->Next;
+        CACHE_RANGE_ CacheRange = OWNER( CACHE_RANGE, FileLink, Link );
+        if ( CacheRange->IsDirty || CacheRange->IsWriting ) continue;
+
+        NumBytesUncached += CacheRange->NumBytes;
+        cacheRangeUnmake( Vcb, CacheRange );
+    }
+
+    ReleaseSpinlock( &Vcb->CacheLock );
+
+    return NumBytesUncached;
+}
+
+//////////////////////////////////////////////////////////////////////
+
+U4 FindUncachedRanges( VCB_ Vcb, ENTRY_ Entry, BLOCK_IO_SEGMENT_ Segments, U4 MaxNumSegments )
+
+{
+    //  Gather up to MaxNumSegments of the file's ranges that are not cached, for one vectored read.
+    U4 NumSegments = 0;
+
+    AcquireSpinlock( &Vcb->CacheLock );
+
+    RANGE_CURSOR Cursor;
+
+    for ( DATA_RANGE_ DataRange = DataFirstRange( Vcb, Entry, &Cursor ); DataRange; DataRange = DataNextRange( &Cursor ) )
+    {
+        if ( DataRange->State != RANGE_WRITTEN ) continue;  //  They read as zeros.
+
+        CACHE_RANGE_ CacheRange = cacheRangesFind( &Vcb->Cache.SetRoot, DataRange->VolumeAddress );
+        if ( ! CacheRange )
+        {
+            Segments[NumSegments].VolumeAddress = DataRange->VolumeAddress;
+            Segments[NumSegments].NumBytes      = DataRange->NumBytes;
+            Segments[NumSegments].Buffer        = 0;
+            if ( ++NumSegments == MaxNumSegments ) break;
+        }
+    }
+
+    ReleaseSpinlock( &Vcb->CacheLock );
+
+    return NumSegments;
+}
+
+//////////////////////////////////////////////////////////////////////
+
+NTSTATUS AccessCacheForFile( VCB_ Vcb, ENTRY_ Entry, DIRECTION Direction, U1_ CallerBuffer, U8 CallerFileOffset, U4 CallerNumBytes )
+
+{
     NTSTATUS Status;
 
-    if ( ! Cache.TotalNumDirtyRanges ) return 0;
+    AcquireSpinlock( &Vcb->CacheLock );
 
-    AcquireSpinlock( &CacheLock );
+    FILE_DATA_ FileData = Data( Entry );
 
-    U4 NumBytesWritten = 0;
+    if ( CallerFileOffset + CallerNumBytes > FileData->AllocationNumBytes )
+    {
+        ReleaseSpinlock( &Vcb->CacheLock );
+        return STATUS_INVALID_USER_BUFFER;  //  TODO status or buffer overflow warning
+    }
+    U8 CurrentFileOffsetAt = CallerFileOffset;
+    U4 CurrentNumBytesLeft = CallerNumBytes;
+    U1_ B = CallerBuffer;
 
-    //  Find the first dirty range.
-    LINK_ Link = Cache.Age.First;
-    while ( Link )
+
+    //  Walk the ranges, starting with the one holding the caller's offset.
+    RANGE_CURSOR Cursor;
+
+    for ( DATA_RANGE_ DataRange = DataRangeAt( Vcb, Entry, CallerFileOffset, &Cursor ); DataRange; DataRange = DataNextRange( &Cursor ) )
     {
+        if ( CurrentNumBytesLeft == 0 ) break;
 
-        CACHE_RANGE_ CacheRange = OWNER( CACHE_RANGE, Link, Link );
-        if ( CacheRange->IsDirty )
+        U8 DataRangeFileOffset   = Cursor.FileOffset;
+        U8 DataRangeFileOffsetTo = DataRangeFileOffset + DataRange->NumBytes;
+        if ( DataRangeFileOffsetTo > CurrentFileOffsetAt )
         {
+            if ( DataRangeFileOffset > CurrentFileOffsetAt + CurrentNumBytesLeft )
+            {
+AlwaysBreakToDebugger();  //  We won't get here right!?
+                break;
+            }
+
+            U8 WithinRangeOffset   = max( DataRangeFileOffset   , CurrentFileOffsetAt                       ) - DataRangeFileOffset;
+            U8 WithinRangeOffsetTo = min( DataRangeFileOffsetTo , CurrentFileOffsetAt + CurrentNumBytesLeft ) - DataRangeFileOffset;
+            U4 WithinRangeNumBytes = ( U4 ) ( WithinRangeOffsetTo - WithinRangeOffset );
+
 
-            //  If the range has not yet been assigned a volume address, get one now.
-            //  TODO what if the room isnt avail? or not contiguous?
-            //  TODO could be a place to combine ranges that are not assigned volume addresses yet. beware of changes to numdirty and numranges
-            if ( ! CacheRange->VolumeAddress )
+            if ( WithinRangeOffset < WithinRangeOffsetTo )
             {
-AlwaysBreakToDebugger();
 
-                U8 VolumeAddress;
-                U4 NumBytesGot;
-                U4 NumBytesRequested = CacheRange->NumBytes;
-                Status = SpaceRequestNumBytes( NumBytesRequested, &VolumeAddress, &NumBytesGot );
-ASSERT( ! Status );
-ASSERT( NumBytesRequested == NumBytesGot );
-                if ( Status )
+                //  Find the corresponding cache, if any, and deal with it..
+                U8 VolumeAddress = DataRange->VolumeAddress;
+
+                CACHE_RANGE_ CacheRange = ( DataRange->State != RANGE_HOLE ) ? cacheRangesFind( &Vcb->Cache.SetRoot, VolumeAddress ) : 0;
+                if ( CacheRange )
                 {
-                    ReleaseSpinlock( &CacheLock );
-                    return 0;
+ASSERT( CacheRange->NumBytes == DataRange->NumBytes );
+                    cacheRangeUsed( Vcb, CacheRange );
+                    switch( Direction )
+                    {
+
+                      case OUT_OF_CACHE:
+                        if ( B ) memcpy( B, CacheRange->MemoryAddress + WithinRangeOffset, WithinRangeNumBytes );
+                        break;
+
+                      case INTO_CACHE:
+                        if ( B ) memcpy( CacheRange->MemoryAddress + WithinRangeOffset, B, WithinRangeNumBytes );
+                        else     Zero(   CacheRange->MemoryAddress + WithinRangeOffset,    WithinRangeNumBytes );
+                        cacheRangeMarkDirty( Vcb, CacheRange );
+                        break;
+                    }
                 }
-                CacheRange->VolumeAddress = VolumeAddress;
+                else
+                {
+                    //  The cache range does not exist.
+
+                    switch( Direction )
+                    {
+
+                      case OUT_OF_CACHE:
+                        if ( DataRange->State != RANGE_WRITTEN )
+                        {
+                            if ( B ) Zero( B, WithinRangeNumBytes );
+                            break;
+                        }
+AlwaysLogFormatted( "!!!!!!!!!!!!!!STATUS_PENDING; NEED CACHE FILL on %p %8X\n", ( V_ ) VolumeAddress, DataRange->NumBytes );
+                        ReleaseSpinlock( &Vcb->CacheLock );
+
+                        return STATUS_PENDING;
+
+                      case INTO_CACHE:
+                        if ( DataRange->State != RANGE_WRITTEN && ! B ) break;  //  Zeros already.
+ASSERT( DataRange->State != RANGE_HOLE );  //  See DataFillHoles.
+
+                        //  The rest of the range is zeroed, which is right for an unwritten one;
+                        //  it is written once write-back has put it on the volume.
+                        Status = cacheRangeMake( Vcb, Entry->Id, VolumeAddress, B, DataRange->NumBytes, DIRTY, ( U4 ) WithinRangeOffset, WithinRangeNumBytes );
+                        if ( Status )
+                        {
+                            ReleaseSpinlock( &Vcb->CacheLock );
+                            return Status;
+                        }
+                        if ( DataRange->State == RANGE_UNWRITTEN ) cacheRangeMarkUnwritten( Vcb, VolumeAddress, Cursor.FileOffset );
+                        break;
+
+                    }
+                }
+
+
+
+                CurrentFileOffsetAt += WithinRangeNumBytes;
+                CurrentNumBytesLeft -= WithinRangeNumBytes;
+                if ( B ) B += WithinRangeNumBytes;
+
             }
+            else
+            {
+AlwaysBreakToDebugger();  //  We won't get here right!?
+            }
+
+        }
+    }
+
+    ReleaseSpinlock( &Vcb->CacheLock );
+
+    return 0;
+}
+
+//--------------------------------------------------------------------
+
+static NTSTATUS accessVolumeIssue( VCB_ Vcb, ENTRY_ Entry, DIRECTION Direction, BLOCK_IO_SEGMENT_ Segments, U4 NumSegments, U8_ Unwritten, U4 NumUnwritten )
 
+{
+    //  Send the gathered extents to or from the volume as one vectored request.
+    //  Unwritten holds the file offsets of the unwritten ranges being written whole;
+    //  they read as zeros until the write is done, and still do if it fails.
+    NTSTATUS Status;
+    U8       NumBytes = 0;
 
-            //  TODO TODO TODOTODO
-            //  Say that we have already written the range by marking it as not dirty, even though, at this point, we are
-            //  going to copy the buffer, and RELEASE the meta spinlock while we wait for the volume write.
-            //  Obviously (though extremely unlikely), the write could fail and this needs to be delt with.
+    for ( U4 i = 0; i < NumSegments; i++ ) NumBytes += Segments[i].NumBytes;
 
+    if ( Direction == OUT_OF_CACHE )
+    {
+        Status = ReadBlockDeviceVector( Vcb->PhysicalDeviceObject, Segments, NumSegments, NO_VERIFY, IO_DEMAND );
+        if ( ! Status ) Vcb->Cache.NumDirectBytesRead += NumBytes;
+    }
+    else
+    {
+        Status = WriteBlockDeviceVector( Vcb->PhysicalDeviceObject, Segments, NumSegments, NO_VERIFY, IO_DEMAND );
 
-            U8  Offset = CacheRange->VolumeAddress;
-            U4  Length = CacheRange->NumBytes;
-            U1_ Buffer = CacheRange->MemoryAddress;
+        AcquireSpinlock( &Vcb->CacheLock );
+ASSERT( Vcb->Cache.DirectWriteSequence & 1 );
+        Vcb->Cache.DirectWriteSequence++;  //  Even again; the write is done.
+        if ( ! Status ) Vcb->Cache.NumDirectBytesWritten += NumBytes;
+        ReleaseSpinlock( &Vcb->CacheLock );
 
+        for ( U4 i = 0; i < NumUnwritten && ! Status; i++ )
+        {
+            RANGE_CURSOR Cursor;
+            DATA_RANGE_  DataRange = DataRangeAt( Vcb, Entry, Unwritten[i], &Cursor );
+ASSERT( DataRange && Cursor.FileOffset == Unwritten[i] );
+            if ( DataRange->State == RANGE_UNWRITTEN ) DataSetRangeState( &Cursor, RANGE_WRITTEN );
+        }
+    }
 
-            CacheRange->IsDirty = FALSE;
-            Cache.TotalNumCleanBytes  += Length;
-            Cache.TotalNumCleanRanges += 1;
-            Cache.TotalNumDirtyBytes  -= Length;
-            Cache.TotalNumDirtyRanges -= 1;
+    return Status;
+}
 
+//////////////////////////////////////////////////////////////////////
 
-            PDEVICE_OBJECT DeviceObject = Volume_PhysicalDeviceObject;
+NTSTATUS AccessVolumeForFile( VCB_ Vcb, ENTRY_ Entry, DIRECTION Direction, U1_ CallerBuffer, U8 CallerFileOffset, U4 CallerNumBytes )
 
-            U1_ MetadatalessBuffer = AllocateMemory( Length );
-ASSERT( MetadatalessBuffer );
+{
+    //  Move whole blocks of a file straight between the volume and the caller's buffer, for uncached
+    //  and streaming transfers that would only churn the cache. Ranges already cached stay coherent:
+    //  reads of them come from the cache, and writes to them go into the cache as well, and on to the
+    //  volume only if the cached copy is clean and so will not be written out later anyway.
+    //  The rest of the file's ranges go to or from the volume in vectored requests.
+    FILE_DATA_ FileData = Data( Entry );
 
-            memcpy( MetadatalessBuffer, Buffer, Length );
+    if ( CallerFileOffset + CallerNumBytes > FileData->AllocationNumBytes ) return STATUS_INVALID_USER_BUFFER;
 
-            ReleaseSpinlock( &CacheLock );
+    NTSTATUS Status = 0;
+    U8  At   = CallerFileOffset;
+    U8  AtTo = CallerFileOffset + CallerNumBytes;
+    U1_ B    = CallerBuffer;
 
-            Status = WriteBlockDevice( DeviceObject, Offset, Length, MetadatalessBuffer, NO_VERIFY );
-ASSERT( ! Status ); //got $8000'0016 STATUS_VERIFY_REQUIRED when no verify override
-LogFormatted( "V o l u m e W r i t i n g   %p for %X \n", ( V_ ) Offset, Length );
+    BLOCK_IO_SEGMENT Segments[BLOCK_IO_MAX_SEGMENTS];
+    U4               NumSegments = 0;
+    U8               Unwritten[BLOCK_IO_MAX_SEGMENTS];
+    U4               NumUnwritten = 0;
+
+    RANGE_CURSOR Cursor;
+
+    for ( DATA_RANGE_ DataRange = DataRangeAt( Vcb, Entry, At, &Cursor ); DataRange && At < AtTo; DataRange = DataNextRange( &Cursor ) )
+    {
+        U4 WithinRangeOffset   = ( U4 ) ( At - Cursor.FileOffset );
+        U4 WithinRangeNumBytes = ( U4 ) ( min( Cursor.FileOffset + DataRange->NumBytes, AtTo ) - At );
+        B1 ToOrFromVolume      = TRUE;
+        B1 IsUnwritten         = FALSE;
+
+        AcquireSpinlock( &Vcb->CacheLock );
+
+        //  An unwritten range written before may still be in the cache, until written back.
+        CACHE_RANGE_ CacheRange = ( DataRange->State != RANGE_HOLE ) ? cacheRangesFind( &Vcb->Cache.SetRoot, DataRange->VolumeAddress ) : 0;
+        if ( DataRange->State != RANGE_WRITTEN && ! CacheRange )
+        {
+ASSERT( Direction == OUT_OF_CACHE || DataRange->State == RANGE_UNWRITTEN );  //  See DataFillHoles.
+
+            //  Unwritten ranges and holes read as zeros. An unwritten range written only in part
+            //  goes through the cache, which zeroes the rest of it. Either way, it is written
+            //  once the volume has it.
+            if ( Direction == OUT_OF_CACHE )
+            {
+                Zero( B, WithinRangeNumBytes );
+                ToOrFromVolume = FALSE;
+            }
+            else
+            if ( WithinRangeNumBytes < DataRange->NumBytes )
+            {
+                Status = cacheRangeMake( Vcb, Entry->Id, DataRange->VolumeAddress, B, DataRange->NumBytes, DIRTY, WithinRangeOffset, WithinRangeNumBytes );
+                ToOrFromVolume = FALSE;
+                if ( ! Status ) cacheRangeMarkUnwritten( Vcb, DataRange->VolumeAddress, Cursor.FileOffset );
+            }
+            else
+            {
+                IsUnwritten = TRUE;
+            }
+        }
+        else if ( CacheRange )
+        {
+ASSERT( CacheRange->NumBytes == DataRange->NumBytes );
+            cacheRangeUsed( Vcb, CacheRange );
+            U1_ Cached = CacheRange->MemoryAddress + WithinRangeOffset;
+            if ( Direction == OUT_OF_CACHE )
+            {
+                memcpy( B, Cached, WithinRangeNumBytes );
+                ToOrFromVolume = FALSE;
+            }
+            else
+            {
+                memcpy( Cached, B, WithinRangeNumBytes );
+                if ( CacheRange->IsDirty || CacheRange->IsWriting )
+                {
+                    cacheRangeMarkDirty( Vcb, CacheRange );
+                    ToOrFromVolume = FALSE;
+                }
+            }
+        }
+
+        //  The sequence goes odd when we gather the first extent of a write, so that no background
+        //  fill started before the write can finish.
+        if ( ToOrFromVolume && Direction == INTO_CACHE && ! NumSegments ) Vcb->Cache.DirectWriteSequence++;
+
+        ReleaseSpinlock( &Vcb->CacheLock );
+
+        if ( Status ) break;
+
+        if ( ToOrFromVolume )
+        {
+            Segments[NumSegments].VolumeAddress = DataRange->VolumeAddress + WithinRangeOffset;
+            Segments[NumSegments].NumBytes      = WithinRangeNumBytes;
+            Segments[NumSegments].Buffer        = B;
+            NumSegments++;
+            if ( IsUnwritten ) Unwritten[NumUnwritten++] = Cursor.FileOffset;
+        }
+
+        At += WithinRangeNumBytes;
+        B  += WithinRangeNumBytes;
+
+        if ( NumSegments == BLOCK_IO_MAX_SEGMENTS )
+        {
+            Status = accessVolumeIssue( Vcb, Entry, Direction, Segments, NumSegments, Unwritten, NumUnwritten );
+            NumSegments  = 0;
+            NumUnwritten = 0;
+            if ( Status ) break;
+        }
+    }
+
+    //  What was gathered goes even after a failure, since a write in progress holds the sequence odd.
+    //  The first failure is the one reported.
+    if ( NumSegments )
+    {
+        NTSTATUS IssueStatus = accessVolumeIssue( Vcb, Entry, Direction, Segments, NumSegments, Unwritten, NumUnwritten );
+        if ( ! Status ) Status = IssueStatus;
+    }
+
+ASSERT( Status || At == AtTo );
+
+    return Status;
+}
+
+//////////////////////////////////////////////////////////////////////
+//
+//  Warm-Cache Manifest
+//
+//  At each metadata write and at dismount, the cached ranges go to the volume, just past
+//  the Overview, in the order they were first used. After the next mount the earliest used
+//  of them, as many as fit in half the arena, are read back in volume order whenever the
+//  background thread has nothing better to do, so a launch after a reboot finds them cached.
+//  The metadata may be older or newer than the manifest, so each record is checked against
+//  its file before it is read. Launch traces ( see Launch.c ) jump the queue.
+
+//////////////////////////////////////////////////////////////////////
+
+NTSTATUS CacheManifestFreeze1( VCB_ Vcb, U1_ *BufferResult, U4_ NumBytesResult )
+
+{
+    //  Copy the manifest, to write after the locks are released. Ranges prefetched
+    //  and never used are left out, so they do not live on from one manifest to the next.
+    AcquireSpinlock( &Vcb->CacheLock );
+
+    U4 MaxNumRecords = min( Vcb->Cache.TotalNumCleanRanges + Vcb->Cache.TotalNumDirtyRanges, MANIFEST_MAX_NUM_RECORDS );
+    U4 NumBytes      = ROUND_UP( 8 + MaxNumRecords * MANIFEST_RECORD_NUM_BYTES, 4096 );
+
+    U1_ Buffer = AllocateAndZeroMemory( NumBytes );
+    if ( ! Buffer )
+    {
+        ReleaseSpinlock( &Vcb->CacheLock );
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    U1_ b = Buffer + 8;
+    U4  NumRecords = 0;
+
+    for ( LINK_ Link = Vcb->Cache.Age.First; Link && NumRecords < MaxNumRecords; Link = Link->Next )
+    {
+        CACHE_RANGE_ CacheRange = OWNER( CACHE_RANGE, Link, Link );
+        if ( CacheRange->IsPrefetched ) continue;
+
+        PUT8( b, CacheRange->VolumeAddress )
+        PUT4( b, CacheRange->NumBytes )
+        PUT4( b, CacheRange->File->Id )
+        NumRecords++;
+    }
+
+    ReleaseSpinlock( &Vcb->CacheLock );
+
+    b = Buffer;
+    PUT4( b, MANIFEST_MAGIC )
+    PUT4( b, NumRecords )
+
+    *BufferResult   = Buffer;
+    *NumBytesResult = ROUND_UP( 8 + NumRecords * MANIFEST_RECORD_NUM_BYTES, 4096 );
+
+    return 0;
+}
+
+//////////////////////////////////////////////////////////////////////
+
+NTSTATUS CacheManifestFreeze2( VCB_ Vcb, U1_ Buffer, U4 NumBytes )
+
+{
+    //  Write the copied manifest, then free the copy.
+    NTSTATUS Status = WriteBlockDevice( Vcb->PhysicalDeviceObject, Vcb->OverviewStart + MANIFEST_OFFSET, NumBytes, Buffer, MAY_VERIFY, IO_CHECKPOINT );
+    FreeMemory( Buffer );
+
+    return Status;
+}
+
+//--------------------------------------------------------------------
+
+static void cacheManifestSift( MANIFEST_RECORD_ Records, U4 Parent, U4 NumRecords )
+
+{
+    for ( U4 Child; ( Child = 2 * Parent + 1 ) < NumRecords; Parent = Child )
+    {
+        if ( Child + 1 < NumRecords && Records[Child].VolumeAddress < Records[Child + 1].VolumeAddress ) Child++;
+        if ( Records[Parent].VolumeAddress >= Records[Child].VolumeAddress ) return;
+        MANIFEST_RECORD t = Records[Parent]; Records[Parent] = Records[Child]; Records[Child] = t;
+    }
+}
+
+//--------------------------------------------------------------------
+
+static void cacheManifestSort( MANIFEST_RECORD_ Records, U4 NumRecords )
+
+{
+    //  Heapsort by volume address, so the prefetch reads sweep the volume once.
+    for ( U4 i = NumRecords / 2; i-- > 0; ) cacheManifestSift( Records, i, NumRecords );
+
+    for ( U4 Top = NumRecords; Top-- > 1; )
+    {
+        MANIFEST_RECORD t = Records[0]; Records[0] = Records[Top]; Records[Top] = t;
+        cacheManifestSift( Records, 0, Top );
+    }
+}
+
+//////////////////////////////////////////////////////////////////////
+
+NTSTATUS CacheManifestThaw( VCB_ Vcb )
+
+{
+    //  Read the manifest, if the volume has one, and keep what we will prefetch.
+    U8 Offset = Vcb->OverviewStart + MANIFEST_OFFSET;
 
-            FreeMemory( MetadatalessBuffer );
+    U1_ Buffer = AllocateMemory( 4096 );
+    if ( ! Buffer ) return STATUS_INSUFFICIENT_RESOURCES;
 
-            NumBytesWritten += CacheRange->NumBytes;
+    NTSTATUS Status = ReadBlockDevice( Vcb->PhysicalDeviceObject, Offset, 4096, Buffer, MAY_VERIFY, IO_DEMAND );
 
-            return NumBytesWritten;  //  Just do 1 for now?
+    U1_ b = Buffer;
+    U4  Magic;
+    U4  NumRecords;
+    GET4( b, Magic )
+    GET4( b, NumRecords )
+
+    if ( Status || Magic != MANIFEST_MAGIC || NumRecords > MANIFEST_MAX_NUM_RECORDS || ! NumRecords )
+    {
+        FreeMemory( Buffer );
+        return Status;
+    }
+
+    U4 NumBytes = ROUND_UP( 8 + NumRecords * MANIFEST_RECORD_NUM_BYTES, 4096 );
+    if ( NumBytes > 4096 )
+    {
+        FreeMemory( Buffer );
+        Buffer = AllocateMemory( NumBytes );
+        if ( ! Buffer ) return STATUS_INSUFFICIENT_RESOURCES;
+        Status = ReadBlockDevice( Vcb->PhysicalDeviceObject, Offset, NumBytes, Buffer, MAY_VERIFY, IO_DEMAND );
+        if ( Status )
+        {
+            FreeMemory( Buffer );
+            return Status;
         }
+    }
+
+    MANIFEST_RECORD_ Records = AllocateMemory( NumRecords * sizeof( MANIFEST_RECORD ) );
+    if ( ! Records )
+    {
+        FreeMemory( Buffer );
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    //  Take the earliest used, up to the prefetch budget.
+    U8 NumBytesTaken = 0;
+    U4 NumTaken      = 0;
+    b = Buffer + 8;
+    for ( U4 i = 0; i < NumRecords; i++ )
+    {
+        MANIFEST_RECORD_ R = Records + NumTaken;
+        GET8( b, R->VolumeAddress )
+        GET4( b, R->NumBytes )
+        GET4( b, R->Id )
+        if ( NumBytesTaken + R->NumBytes > MANIFEST_MAX_PREFETCH_NUM_BYTES ) break;
+        NumBytesTaken += R->NumBytes;
+        NumTaken++;
+    }
+
+    FreeMemory( Buffer );
+
+    cacheManifestSort( Records, NumTaken );
+
+    Vcb->Cache.Manifest           = Records;
+    Vcb->Cache.ManifestNumRecords = NumTaken;
+    Vcb->Cache.ManifestCursor     = 0;
+
+AlwaysLogFormatted( "CacheManifestThaw will prefetch %u of %u ranges, %u KB\n", NumTaken, NumRecords, ( U4 ) ( NumBytesTaken / 1024 ) );
+
+    return 0;
+}
+
+//////////////////////////////////////////////////////////////////////
+
+void CachePrefetchFirst( VCB_ Vcb, MANIFEST_RECORD_ Records, U4 NumRecords )
+
+{
+    //  Queue these ranges ahead of the rest of the manifest, merged with any still queued
+    //  from an earlier call, by volume address and each once. Call with the metadata lock held.
+    if ( ! NumRecords ) return;
+
+    MANIFEST_RECORD_ Old          = Vcb->Cache.Manifest;
+    U4               OldCursor    = Vcb->Cache.ManifestCursor;
+    U4               OldNumUrgent = Vcb->Cache.ManifestNumUrgent > OldCursor ? Vcb->Cache.ManifestNumUrgent - OldCursor : 0;
+    U4               OldNumLeft   = Vcb->Cache.ManifestNumRecords - OldCursor - OldNumUrgent;
+
+    MANIFEST_RECORD_ Queue = AllocateMemory( ( NumRecords + OldNumUrgent + OldNumLeft ) * sizeof( MANIFEST_RECORD ) );
+    if ( ! Queue ) return;
+
+    memcpy( Queue, Records, NumRecords * sizeof( MANIFEST_RECORD ) );
+    if ( OldNumUrgent ) memcpy( Queue + NumRecords, Old + OldCursor, OldNumUrgent * sizeof( MANIFEST_RECORD ) );
+    cacheManifestSort( Queue, NumRecords + OldNumUrgent );
 
+    U4 NumUrgent = 0;
+    for ( U4 i = 0; i < NumRecords + OldNumUrgent; i++ )
+    {
+        if ( ! NumUrgent || Queue[i].VolumeAddress != Queue[NumUrgent - 1].VolumeAddress ) Queue[NumUrgent++] = Queue[i];
+    }
+
+    if ( OldNumLeft ) memcpy( Queue + NumUrgent, Old + OldCursor + OldNumUrgent, OldNumLeft * sizeof( MANIFEST_RECORD ) );
+    FreeMemory( Old );
+
+    Vcb->Cache.Manifest           = Queue;
+    Vcb->Cache.ManifestNumRecords = NumUrgent + OldNumLeft;
+    Vcb->Cache.ManifestCursor     = 0;
+    Vcb->Cache.ManifestNumUrgent  = NumUrgent;
+}
+
+//--------------------------------------------------------------------
+
+static B1 cacheManifestRecordIsCurrent( VCB_ Vcb, MANIFEST_RECORD_ Record )
+
+{
+    //  Is the record still one of its file's ranges? Call with the metadata lock held.
+    ID Id = Record->Id;
+    if ( Id <= 0 || Id >= Vcb->WhereTableFirstUnusedBottomID ) return FALSE;
+
+    ENTRY_ Entry = EntryForId( Vcb, Id );
+    if ( ! EntryIsAFile( Entry ) || EntryIsAnExtentNode( Entry ) ) return FALSE;
+    if ( DataIsInline( Data( Entry ) ) ) return FALSE;
+
+    RANGE_CURSOR Cursor;
+
+    for ( DATA_RANGE_ DataRange = DataFirstRange( Vcb, Entry, &Cursor ); DataRange; DataRange = DataNextRange( &Cursor ) )
+    {
+        if ( DataRange->VolumeAddress == Record->VolumeAddress ) return DataRange->NumBytes == Record->NumBytes && DataRange->State == RANGE_WRITTEN;
+    }
+
+    return FALSE;
+}
+
+//--------------------------------------------------------------------
+
+static void cacheMakeRoom( VCB_ Vcb, U4 NumPages )
+
+{
+    //  Forget the least recently used clean ranges until the arena has NumPages free.
+    LINK_ Link = Vcb->Cache.Age.First;
+
+    while ( Link && Vcb->Cache.ArenaNumPagesUsed + NumPages > Vcb->Cache.ArenaNumPages )
+    {
+        CACHE_RANGE_ CacheRange = OWNER( CACHE_RANGE, Link, Link );
         Link = Link->Next;
+        if ( ! CacheRange->IsDirty && ! CacheRange->IsWriting ) cacheRangeUnmake( Vcb, CacheRange );
+    }
+}
 
+//////////////////////////////////////////////////////////////////////
+
+B1 CachePrefetchFromManifest( VCB_ Vcb, B1 UrgentOnly )
+
+{
+    //  Read the next of the manifest's ranges that are current and not yet cached, as one
+    //  vectored request, so neighbors on the volume go as single large reads. With UrgentOnly,
+    //  only those a starting program is waiting for, which may displace older clean cache.
+    if ( ! Vcb->Cache.Manifest ) return FALSE;
+    if ( UrgentOnly && Vcb->Cache.ManifestCursor >= Vcb->Cache.ManifestNumUrgent ) return FALSE;
+
+    B1 Acquired = AcquireSpinlockOrFail( &Vcb->MetadataLock );
+    if ( ! Acquired ) return FALSE;
+
+    U4 NumRecords = UrgentOnly ? Vcb->Cache.ManifestNumUrgent : Vcb->Cache.ManifestNumRecords;
+
+    BLOCK_IO_SEGMENT Segments[BLOCK_IO_MAX_SEGMENTS];
+    ID               Ids[BLOCK_IO_MAX_SEGMENTS];
+    U4               NumSegments = 0;
+    U4               DirectWriteSequence = 0;
+    B1               ArenaIsFull = FALSE;
+
+    while ( Vcb->Cache.ManifestCursor < NumRecords && NumSegments < BLOCK_IO_MAX_SEGMENTS )
+    {
+        MANIFEST_RECORD_ Record = Vcb->Cache.Manifest + Vcb->Cache.ManifestCursor;
+        if ( ! cacheManifestRecordIsCurrent( Vcb, Record ) )
+        {
+            Vcb->Cache.ManifestCursor++;
+            continue;
+        }
+
+        AcquireSpinlock( &Vcb->CacheLock );
+
+        //  Prefetch only into free arena pages; never push the pool. Only a launch displaces clean cache.
+        U1_ MemoryAddress = 0;
+        if ( ! cacheRangesFind( &Vcb->Cache.SetRoot, Record->VolumeAddress ) )
+        {
+            U4 NumPages = ROUND_UP( Record->NumBytes, CACHE_PAGE_NUM_BYTES ) / CACHE_PAGE_NUM_BYTES;
+            if ( UrgentOnly ) cacheMakeRoom( Vcb, NumPages );
+            ArenaIsFull = Vcb->Cache.ArenaNumPagesUsed + NumPages > Vcb->Cache.ArenaNumPages;
+
+            if ( ! ArenaIsFull )
+            {
+                MemoryAddress = cacheMemoryAllocate( Vcb, Record->NumBytes );
+                DirectWriteSequence = Vcb->Cache.DirectWriteSequence;
+            }
+        }
+
+        ReleaseSpinlock( &Vcb->CacheLock );
+
+        if ( ArenaIsFull ) break;
+        Vcb->Cache.ManifestCursor++;
+        if ( ! MemoryAddress ) continue;
+
+        Segments[NumSegments].VolumeAddress = Record->VolumeAddress;
+        Segments[NumSegments].NumBytes      = Record->NumBytes;
+        Segments[NumSegments].Buffer        = MemoryAddress;
+        Ids[NumSegments]                    = Record->Id;
+        NumSegments++;
+    }
+
+    //  A launch that does not fit even by displacing clean cache gives up the rest of its urgent
+    //  ranges, but not the others: they stay queued for the background pass, which ends the
+    //  manifest only if the arena is still full when it gets to them.
+    if ( ArenaIsFull && UrgentOnly )
+    {
+        Vcb->Cache.ManifestCursor = Vcb->Cache.ManifestNumUrgent;
+        ArenaIsFull = FALSE;
+    }
+
+    //  Done with the manifest? CachePrefetchFirst may replace it, so decide under the lock.
+    if ( ArenaIsFull || Vcb->Cache.ManifestCursor == Vcb->Cache.ManifestNumRecords )
+    {
+AlwaysLogFormatted( "CachePrefetchFromManifest done, %u KB prefetched\n", ( U4 ) ( Vcb->Cache.NumManifestBytesPrefetched / 1024 ) );
+        FreeMemory( Vcb->Cache.Manifest );
+        Vcb->Cache.Manifest           = 0;
+        Vcb->Cache.ManifestNumRecords = 0;
+        Vcb->Cache.ManifestCursor     = 0;
+        Vcb->Cache.ManifestNumUrgent  = 0;
+    }
+
+    ReleaseSpinlock( &Vcb->MetadataLock );
+
+    if ( ! NumSegments ) return FALSE;
+
+    NTSTATUS Status = ReadBlockDeviceVector( Vcb->PhysicalDeviceObject, Segments, NumSegments, NO_VERIFY, IO_PREFETCH );
+
+    //  Adopt them, unless a write or purge meanwhile made them stale; see CacheRangeAdoptWithLock.
+    AcquireSpinlock( &Vcb->CacheLock );
+
+    for ( U4 i = 0; i < NumSegments; i++ )
+    {
+        BLOCK_IO_SEGMENT_ S = Segments + i;
+        if (    Status
+             || DirectWriteSequence != Vcb->Cache.DirectWriteSequence
+             || ( DirectWriteSequence & 1 )
+             || cacheRangesFind( &Vcb->Cache.SetRoot, S->VolumeAddress )
+             || cacheRangeAttach( Vcb, Ids[i], S->VolumeAddress, S->Buffer, S->NumBytes, CLEAN ) )
+        {
+            cacheMemoryFree( Vcb, S->Buffer, S->NumBytes );
+            continue;
+        }
+
+        cacheRangesFind( &Vcb->Cache.SetRoot, S->VolumeAddress )->IsPrefetched = TRUE;
+        Vcb->Cache.NumManifestBytesPrefetched += S->NumBytes;
+    }
+
+    ReleaseSpinlock( &Vcb->CacheLock );
+
+    return TRUE;
+}
+
+//////////////////////////////////////////////////////////////////////
+
+NTSTATUS CacheReport( VCB_ Vcb, S1_ Buffer, int MaxNumBytes )
+
+{
+
+    AcquireSpinlock( &Vcb->CacheLock );
+
+    S1_ P = Buffer;
+    P[0] = 0;
+    S1 scratch[512] = {0};  //  TODO should not be necessary to init
+
+
+    NTSTATUS Status = RtlStringCchPrintfA( scratch, sizeof( scratch ),
+            "CacheReport %d dirty ranges for %d dirty bytes   %d clean ranges for %d clean bytes   %u of %u arena pages used   %u ranges from the pool   %u KB read and %u KB written directly   %u KB prefetched from the manifest and launch traces",
+                    Vcb->Cache.TotalNumDirtyRanges,
+            ( int ) Vcb->Cache.TotalNumDirtyBytes,
+                    Vcb->Cache.TotalNumCleanRanges,
+            ( int ) Vcb->Cache.TotalNumCleanBytes,
+                    Vcb->Cache.ArenaNumPagesUsed,
+                    Vcb->Cache.ArenaNumPages,
+                    Vcb->Cache.NumPoolFallbacks,
+            ( U4 ) ( Vcb->Cache.NumDirectBytesRead    / 1024 ),
+            ( U4 ) ( Vcb->Cache.NumDirectBytesWritten / 1024 ),
+            ( U4 ) ( Vcb->Cache.NumManifestBytesPrefetched / 1024 ) );
+
+    if ( ! Status ) RtlStringCchCatA( P, MaxNumBytes, scratch );
+    else            RtlStringCchCatA( P, MaxNumBytes, "(oops)" );
+
+    ReleaseSpinlock( &Vcb->CacheLock );
+
+    return 0;
+}
+
+//////////////////////////////////////////////////////////////////////
+//
+//  Write-Back Policy
+//
+//  Dirty ranges go to the volume oldest dirtied first, as vectored requests. While the device
+//  is idle they go at once, so little is ever at risk. While others keep it busy they wait,
+//  so as not to slow them, until WRITE_BACK_BATCH_NUM_BYTES have built up, and then go
+//  together; and a range dirty for WRITE_BACK_DEADLINE_MILLISECONDS goes regardless.
+//
+
+//--------------------------------------------------------------------
+
+static void cacheWindowUpdate( VCB_ Vcb, U8 Now )
+
+{
+    //  At the end of each window, work out how busy the device was over it, in all and less our own write-back.
+    U8 Elapsed = Now - Vcb->Cache.WindowStartMicrosecond;
+    if ( Elapsed < WRITE_BACK_WINDOW_MICROSECONDS ) return;
+
+    BLOCK_IO_ACTIVITY_ Activity = &Vcb->DeviceActivity;
+    U8 Busy = ( U8 ) Activity->BusyMicroseconds;
+    if ( Activity->NumOutstanding ) Busy += Now - Activity->BusySinceMicrosecond;
+
+    U8 BusyDelta   = Busy - Vcb->Cache.WindowStartBusyMicroseconds;
+    U8 OwnDelta    = Vcb->Cache.WriteBackMicroseconds - Vcb->Cache.WindowStartWriteBackMicroseconds;
+    U8 OthersDelta = BusyDelta > OwnDelta ? BusyDelta - OwnDelta : 0;
+
+    Vcb->Cache.UtilizationPercent       = ( U4 ) min( 100ULL, BusyDelta   * 100 / Elapsed );
+    Vcb->Cache.OthersUtilizationPercent = ( U4 ) min( 100ULL, OthersDelta * 100 / Elapsed );
+
+    Vcb->Cache.WindowStartMicrosecond          = Now;
+    Vcb->Cache.WindowStartBusyMicroseconds     = Busy;
+    Vcb->Cache.WindowStartWriteBackMicroseconds = Vcb->Cache.WriteBackMicroseconds;
+}
+
+//////////////////////////////////////////////////////////////////////
+
+U4 CacheBackgroundWriteDirtiestToVolume( VCB_ Vcb )
+
+{
+    //  Write back what the policy says to now, and return how many bytes that was.
+    NTSTATUS Status;
+
+    cacheWindowUpdate( Vcb, CurrentMicrosecond() );
+
+    if ( ! Vcb->Cache.TotalNumDirtyRanges )
+    {
+        Vcb->Cache.WriteBackIsDraining = FALSE;
+        return 0;
     }
 
-    ReleaseSpinlock( &CacheLock );
+    B1 IsIdle = ! Vcb->DeviceActivity.NumOutstanding && Vcb->Cache.OthersUtilizationPercent < WRITE_BACK_IDLE_PERCENT;
+
+    BLOCK_IO_SEGMENT Segments[BLOCK_IO_MAX_SEGMENTS];
+    CACHE_RANGE_     Pinned[BLOCK_IO_MAX_SEGMENTS];
+    U4               NumSegments = 0;
+    U4               NumBytes    = 0;
+    U4               NumDueBytes = 0;
+
+    AcquireSpinlock( &Vcb->CacheLock );
+
+    if ( Vcb->Cache.TotalNumDirtyBytes >= WRITE_BACK_BATCH_NUM_BYTES ) Vcb->Cache.WriteBackIsDraining = TRUE;
+    B1 IsDraining = Vcb->Cache.WriteBackIsDraining;
+
+    U8    Now = CurrentMicrosecond();
+    LINK_ Next;
+
+    for ( LINK_ Link = Vcb->Cache.Dirty.First; Link && NumSegments < BLOCK_IO_MAX_SEGMENTS; Link = Next )
+    {
+        Next = Link->Next;
+        CACHE_RANGE_ CacheRange = OWNER( CACHE_RANGE, DirtyLink, Link );
 
-//LogFormatted( "@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@ CacheBackgroundWriteDirtiestToVolume wrote %d bytes.\n", NumBytesWritten );
+        //  The rest were dirtied later still.
+        U8 DirtyMicroseconds = Now - CacheRange->DirtySinceMicrosecond;
+        B1 IsDue = DirtyMicroseconds >= WRITE_BACK_DEADLINE_MILLISECONDS * 1'000ULL;
+        if ( ! IsDue && ! IsIdle && ! IsDraining ) break;
 
-    return 0;//NumBytesWritten;
+        //  Dirtied again while being written; it goes again once that write is done.
+        if ( CacheRange->IsWriting ) continue;
+
+        if ( NumSegments && NumBytes + CacheRange->NumBytes > WRITE_BACK_BATCH_NUM_BYTES ) break;
+
+        //  If the range has not yet been assigned a volume address, get one now.
+        //  TODO what if the room isnt avail? or not contiguous?
+        if ( ! CacheRange->VolumeAddress )
+        {
+AlwaysBreakToDebugger();
+
+            U8 VolumeAddress;
+            U4 NumBytesGot;
+            U4 NumBytesRequested = CacheRange->NumBytes;
+            Status = SpaceRequestNumBytes( Vcb, NumBytesRequested, &VolumeAddress, &NumBytesGot );
+ASSERT( ! Status );
+ASSERT( NumBytesRequested == NumBytesGot );
+            if ( Status ) break;
+            CacheRange->VolumeAddress = VolumeAddress;
+        }
+
+        if ( DirtyMicroseconds > Vcb->Cache.MaxDirtyMicroseconds ) Vcb->Cache.MaxDirtyMicroseconds = DirtyMicroseconds;
+        if ( IsDue ) NumDueBytes += CacheRange->NumBytes;
+
+        //  Write straight from the cache pages. Pinned, the range cannot be freed under us, and
+        //  a write into it meanwhile just marks it dirty again, to be written again later.
+        //  A purge meanwhile leaves its freeing to cacheRangeUnpin.
+        cacheRangeMarkClean( Vcb, CacheRange );
+        CacheRange->IsWriting = TRUE;
+
+        Pinned[NumSegments] = CacheRange;
+        Segments[NumSegments].VolumeAddress = CacheRange->VolumeAddress;
+        Segments[NumSegments].NumBytes      = CacheRange->NumBytes;
+        Segments[NumSegments].Buffer        = CacheRange->MemoryAddress;
+        NumSegments++;
+        NumBytes += CacheRange->NumBytes;
+    }
+
+    ReleaseSpinlock( &Vcb->CacheLock );
+
+    if ( ! NumSegments ) return 0;
+
+    //  Writeback goes out by volume address, so neighbors merge into single requests; see BlockIo.c.
+    U8 Started = CurrentMicrosecond();
+    Status = WriteBlockDeviceVector( Vcb->PhysicalDeviceObject, Segments, NumSegments, NO_VERIFY, IO_WRITEBACK );
+ASSERT( ! Status ); //got $8000'0016 STATUS_VERIFY_REQUIRED when no verify override
+    Vcb->Cache.WriteBackMicroseconds += CurrentMicrosecond() - Started;
+
+    cacheRangesWrittenBack( Vcb, Pinned, NumSegments, Status );
+
+    if ( ! Status )
+    {
+        AcquireSpinlock( &Vcb->CacheLock );
+        Vcb->Cache.NumWriteBackBytesDue += NumDueBytes;
+        if ( IsIdle ) Vcb->Cache.NumWriteBackBytesIdle    += NumBytes - NumDueBytes;
+        else          Vcb->Cache.NumWriteBackBytesBatched += NumBytes - NumDueBytes;
+        ReleaseSpinlock( &Vcb->CacheLock );
+    }
+
+LogFormatted( "V o l u m e W r i t i n g   %u ranges for %X \n", NumSegments, NumBytes );
+
+    return Status ? 0 : NumBytes;
+}
+
+//////////////////////////////////////////////////////////////////////
+
+NTSTATUS WriteBackReport( VCB_ Vcb, S1_ Buffer, int MaxNumBytes )
+
+{
+    BLOCK_IO_ACTIVITY_ Activity  = &Vcb->DeviceActivity;
+    U8                 NumWrites = ( U8 ) Activity->NumWrites;
+
+    AcquireSpinlock( &Vcb->CacheLock );
+
+    U8 OldestDirtyMicroseconds = 0;
+    if ( Vcb->Cache.Dirty.First ) OldestDirtyMicroseconds = CurrentMicrosecond() - OWNER( CACHE_RANGE, DirtyLink, Vcb->Cache.Dirty.First )->DirtySinceMicrosecond;
+
+    NTSTATUS Status = RtlStringCchPrintfA( Buffer, MaxNumBytes,
+            "WriteBackReport device %u%% busy, %u%% by others   %d requests outstanding   "
+            "%llu device writes taking %llu us on average and %llu us at most   "
+            "%u KB at risk now, dirty for up to %llu ms   %u KB at most at risk, dirty for up to %llu ms   "
+            "%u KB written back while idle, %u KB in batches while busy and %u KB at the deadline",
+                    Vcb->Cache.UtilizationPercent,
+                    Vcb->Cache.OthersUtilizationPercent,
+            ( int ) Activity->NumOutstanding,
+                    NumWrites,
+                    NumWrites ? ( U8 ) Activity->WriteMicroseconds / NumWrites : 0,
+            ( U8 ) Activity->MaxWriteMicroseconds,
+            ( U4 ) ( Vcb->Cache.TotalNumDirtyBytes / 1024 ),
+                    OldestDirtyMicroseconds / 1000,
+            ( U4 ) ( Vcb->Cache.MaxNumDirtyBytes / 1024 ),
+                    Vcb->Cache.MaxDirtyMicroseconds / 1000,
+            ( U4 ) ( Vcb->Cache.NumWriteBackBytesIdle    / 1024 ),
+            ( U4 ) ( Vcb->Cache.NumWriteBackBytesBatched / 1024 ),
+            ( U4 ) ( Vcb->Cache.NumWriteBackBytesDue     / 1024 ) );
+
+    ReleaseSpinlock( &Vcb->CacheLock );
+
+    return Status;
 }
 
 //////////////////////////////////////////////////////////////////////
 
-U4 CacheFreeSomeCache()
+U4 CacheFreeSomeCache( VCB_ Vcb )
 
 {
 
 AlwaysLogString( "//////////////////////////////////////// CacheFreeSomeCache got in.\n" );
 
-    AcquireSpinlock( &CacheLock );
+    AcquireSpinlock( &Vcb->CacheLock );
 
     U4 NumBytesUncached = 0;
 
     //  Free the first clean range.
-    LINK_ Link = Cache.Age.First;
+    LINK_ Link = Vcb->Cache.Age.First;
     while ( Link )
     {
         CACHE_RANGE_      CacheRange = OWNER( CACHE_RANGE, Link, Link );
 
-        if ( ( ! CacheRange->IsDirty ) && CacheRange->MemoryAddress )
+        if ( ( ! CacheRange->IsDirty ) && ( ! CacheRange->IsWriting ) && CacheRange->MemoryAddress )
         {
 ASSERT ( CacheRange->VolumeAddress );
 ASSERT ( CacheRange->MemoryAddress );
@@ -725,9 +1618,9 @@ ASSERT ( CacheRange->MemoryAddress );
 AlwaysLogFormatted( "//////////////////////////////////////// CacheFreeSomeCache freed                    %d bytes.\n",
 CacheRange->NumBytes );
 
-            cacheRangeUnmake( CacheRange->VolumeAddress );
+            cacheRangeUnmake( Vcb, CacheRange );
 
-            ReleaseSpinlock( &CacheLock );
+            ReleaseSpinlock( &Vcb->CacheLock );
 
             return NumBytesUncached;
         }
@@ -735,7 +1628,7 @@ CacheRange->NumBytes );
         Link = Link->Next;
     }
 
-    ReleaseSpinlock( &CacheLock );
+    ReleaseSpinlock( &Vcb->CacheLock );
 
     return 0;
 }
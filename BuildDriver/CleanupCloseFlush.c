@@ -49,6 +49,10 @@ AlwaysLogString( "IrpMjCleanup called with a zero Fcb\n" );
     }
 
 
+    //  Flushes still queued for this file object are not waited for.
+    FailPendingFlushes( Vcb, FileObject, STATUS_CANCELLED );
+
+
     if ( Fcb->IsAVolume )
     {
 AlwaysLogString( "IrpMjCleanup called on volume!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!\n" );
@@ -61,7 +65,7 @@ AlwaysLogString( "IrpMjCleanup called on volume!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!
     else
     {
 
-        if ( IdIsAFile( Fcb->Id ) )
+        if ( IdIsAFile( Vcb, Fcb->Id ) )
         {
 
 BreakToDebugger();
@@ -126,22 +130,30 @@ AlwaysLogString( "Unmaking Vcb\n" );
         CCB_ Ccb = FileObject->FsContext2;
         UnmakeCcb( Ccb );
 
+        VCB_ Vcb = Fcb->Vcb;
+
         Fcb->NumReferences--;
 LogFormatted( "Decremented FcbReferences to %d\n", Fcb->NumReferences );
         if ( Fcb->NumReferences == 0 )
         {
+            //  Room allocated ahead of appends and not used goes back; see PreallocationTrim.
+            if ( ! Fcb->DeleteIsPending ) PreallocationTrim( Vcb, Fcb );
+
+            //  Its clean cache goes too, making room for files still open; dirty ranges stay to be
+            //  written back. A file being deleted forgets all its cache in UnmakeEntry.
+            if ( ! Fcb->DeleteIsPending && IdIsAFile( Vcb, Fcb->Id ) ) CacheEvictFile( Vcb, Fcb->Id );
 
             if ( Fcb->DeleteIsPending )
             {
 LogString( "Reference count is 0 and FCB_DELETE_PENDING.\n" );
-                if ( IdIsADirectory( Fcb->Id ) && ChildrenTree( Entries[Fcb->Id] ) )
+                if ( IdIsADirectory( Vcb, Fcb->Id ) && ChildrenTree( EntryForId( Vcb, Fcb->Id ) ) )
                 {
 LogString( "DELETE - It is a dir with children; we are supposed to silently ignore the unmake.\n" );
                 }
                 else
                 {
 LogString( "DELETE - unmake entry.\n" );
-                    UnmakeEntry( Fcb->Id );
+                    UnmakeEntry( Vcb, Fcb->Id );
                 }
             }
 
@@ -157,95 +169,35 @@ LogString( "DELETE - unmake entry.\n" );
 NTSTATUS IrpMjFlushBuffers( ICB_ Icb )
 
 {
-    UNREFERENCED_PARAMETER( Icb );
+    VCB_ Vcb = Icb->Vcb;
+    if ( ! Vcb ) return STATUS_SUCCESS;
 
-//  TODO need to do this. Derrrr.
-AlwaysLogString( "IrpMjFlushBuffers - hmmmm\n" );
-
-    return 0;
-
-#if 0
-
-////    UNREFERENCED_PARAMETER( Icb );
     PIRP         Irp        = Icb->Irp;
     IRPSP_       IrpSp      = IoGetCurrentIrpStackLocation( Irp );
     PFILE_OBJECT FileObject = IrpSp->FileObject;
     FCB_         Fcb        = FileObject->FsContext;
 
     if ( ! Fcb )
-//  I think this happened when I tried to shut down snick instead of .reboot
-//  I think it also happened when I jiggled the thumb drive to get it to connect.
-    {
-AlwaysLogString( "Called with a zero Fcb!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!\n" );
-AlwaysLogString( "Just going to pretend all is ok!!!!!!!!!!!!!!!!!!!!!!!\n" );
-AlwaysBreakToDebugger();  //  eb eip 0x90
-return STATUS_SUCCESS;  //  TODO
-    }
-
-//    ID Id = Fcb->Id;
-//    B1 IsAVolume    = Fcb->IsAVolume || IdIsAFile( Fcb->Id ) || )
-    B1 IsAFile      = ! Fcb->IsAVolume && IdIsAFile( Fcb->Id );
-    B1 IsADirectory = ! Fcb->IsAVolume && IdIsADirectory( Fcb->Id );
-
-
-    //  For any file, do its flush.
-    if ( IsAFile )
     {
-AlwaysLogString( "Need a flush for this file here.\n" );
-        return 0;
+AlwaysLogString( "IrpMjFlushBuffers called with a zero Fcb\n" );
+        return STATUS_SUCCESS;
     }
 
     //  For any directory other than the root, just say done.
-    if ( IsADirectory && Entries[ Fcb->Id ]->ParentId != 0 )
-    {
-        //  "File System Internals" says just say done.
-AlwaysLogString( "\"File System Internals\" says just say done.\n" );
-        return 0;
-    }
-
-
-    //  For a volume or the root directory, we need to flush all.
-    //  "File System Internals" says do this synchronously.
-    //  Wait for a signal from background task.
-AlwaysLogString( "IRP_MJ_FLUSH_BUFFERS for the volume\n" );
-AlwaysLogString( "IRP_MJ_FLUSH_BUFFERS for the volume\n" );
-AlwaysLogString( "IRP_MJ_FLUSH_BUFFERS for the volume\n" );
-AlwaysLogString( "Need a ligit flush of the volume here.\n" );
-    for (;;)
-    {
-        if ( ! BackgroundThread_Busy ) break;
-AlwaysLogString( "Sleeping because BackgroundThread_Busy.\n" );
-        SleepForMilliseconds( 100 );  //  TODO
-    }
-
-    //  "File System Internals" says pass this irp down, and ignore the result.
+    //  "File System Internals" says just say done.
+    if ( ! Fcb->IsAVolume && IdIsADirectory( Vcb, Fcb->Id ) && EntryForId( Vcb, Fcb->Id )->ParentId != 0 ) return STATUS_SUCCESS;
 
-/*	
+    //  For a file, its dirty data, and for the volume or the root directory, everything, goes
+    //  to the volume with the metadata, and then through one write barrier. The background
+    //  thread does that for all the flushes that arrive together, and then completes them.
+    Icb->PendingSinceMicrosecond = CurrentMicrosecond();
+    if ( ! Vcb->PendingFlushesChain.First ) Vcb->PendingFlushesSinceMicrosecond = Icb->PendingSinceMicrosecond;
 
-//  IoBuildAsynchronousFsdRequest ( IRP_MJ_FLUSH_BUFFERS
-PIRP zzz = IoBuildAsynchronousFsdRequest(
-IRP_MJ_FLUSH_BUFFERS,
-  DeviceObject,  //  next-lower driver's device object PDEVICE_OBJECT
-  0,  //  Buffer,
-  0,  //  Length,
-  0,  //  StartingOffset,
-  [in, optional] PIO_STATUS_BLOCK IoStatusBlock
-);
-ASSERT( zzz );
+    IoMarkIrpPending( Irp );
+    AttachLinkLast( &Vcb->PendingFlushesChain, &Icb->PendingFlushesLink );
 
-IoMakeAssociatedIrp
-
-IoBuildSynchronousFsdRequest
-
-*/
-
-    return 0;
-
-
-
-#endif
-
- }
+    return STATUS_PENDING;
+}
 
 //////////////////////////////////////////////////////////////////////
 
@@ -20,6 +20,7 @@
 #include <ntdddisk.h>
 #include <ntstrsafe.h>
 #include <stddef.h>
+#include "OrderedIndex.h"
 
 //////////////////////////////////////////////////////////////////////
 //
@@ -29,9 +30,23 @@
 #define YES 1
 #define NO  0
 
+#define SPLAY 1
+#define AVL   2
+
 #define DEBUG_PRINTING_ON  NO   //  YES or NO; Turn on or off all regular (not ALWAYS) logging.
 #define BREAKPOINTS_ON     NO   //  YES or NO; Stop at breakpoints.
 #define BACKGROUND_THREAD  YES  //  YES or NO; Optionally turn off the background thread for testing.
+#define SPINLOCK_STATS     YES  //  YES or NO; Keep per-lock acquisition, wait and hold statistics.
+#define SIMD_TRANSCODING   YES  //  YES or NO; On x64, convert runs of ASCII in names 16 characters at a time.
+#define CHILD_INDEXES      YES  //  YES or NO; Give big directories a B+tree over their children, so lookups need not splay.
+#define DIRECT_IO          YES  //  YES or NO; Uncached and big aligned file transfers go straight between the volume and the caller.
+#define WARM_CACHE_MANIFEST YES  //  YES or NO; Record the cached ranges at metadata writes and dismount, and prefetch them after mount.
+#define LAUNCH_TRACES      YES  //  YES or NO; Learn what each program reads as it starts, and prefetch that when it starts again.
+#define SPACE_INDEXES      SPLAY  //  SPLAY or AVL; The free space sets, by address and by size.
+#define CACHE_INDEX        SPLAY  //  SPLAY or AVL; The cached ranges, by volume address, and the files that have them, by Id.
+
+#define INLINE_DATA_MAX_NUM_BYTES  1024  //  Files no bigger than this keep their bytes in their entry; 0 for none.
+#define CACHE_ARENA_NUM_BYTES      ( 64 * 1024 * 1024 )  //  Reserved per volume to hold cached ranges; 0 to take each from the pool.
 
 //////////////////////////////////////////////////////////////////////
 //
@@ -52,6 +67,13 @@
 
 #define AlwaysBreakToDebugger DbgBreakPoint
 
+#if SIMD_TRANSCODING == YES && defined( _M_X64 )
+    #include <emmintrin.h>  //  SSE2 only; x64 kernel code may use XMM registers freely, but not YMM.
+    #define TRANSCODE_WITH_SSE2 YES
+#else
+    #define TRANSCODE_WITH_SSE2 NO
+#endif
+
 #if BREAKPOINTS_ON == YES
     #define BreakToDebugger AlwaysBreakToDebugger
 #else
@@ -153,7 +175,9 @@ typedef enum { LT=-2, LE=-1, EQ=0, GE=1, GT=2 } NEIGHBOR;  //  <  <=  =  >=  >
 typedef enum { SHARED, EXCLUSIVE }              LOCK_TYPE;
 typedef enum { DONT_FILL, ZERO_FILL }           FILL_TYPE;
 typedef enum { CLEAN, DIRTY }                   CLEAN_OR_DIRTY;
+typedef enum { RANGE_WRITTEN=0, RANGE_UNWRITTEN, RANGE_HOLE } RANGE_STATE;  //  See DATA_RANGE.
 typedef enum { NO_VERIFY=0, MAY_VERIFY }        VERIFY;
+typedef enum { IO_DEMAND=0, IO_WRITEBACK, IO_PREFETCH, IO_CHECKPOINT, IO_NUM_CLASSES } IO_CLASS;  //  Most urgent first; see BlockIo.c.
 
 //////////////////////////////////////////////////////////////////////
 //
@@ -189,6 +213,20 @@ typedef struct _FILE_DATA      FILE_DATA     , *FILE_DATA_     ;
 typedef struct _SPACE_RANGE    SPACE_RANGE   , *SPACE_RANGE_   ;
 typedef struct _CACHE          CACHE         , *CACHE_         ;
 typedef struct _CACHE_RANGE    CACHE_RANGE   , *CACHE_RANGE_   ;
+typedef struct _CACHE_FILE     CACHE_FILE    , *CACHE_FILE_    ;
+typedef struct _LAUNCH_TRACE   LAUNCH_TRACE  , *LAUNCH_TRACE_  ;
+typedef struct _LAUNCHES       LAUNCHES      , *LAUNCHES_      ;
+typedef struct _WHERE_CHUNK    WHERE_CHUNK   , *WHERE_CHUNK_   ;
+typedef struct _ENTRY_HOT      ENTRY_HOT     , *ENTRY_HOT_     ;
+typedef struct _CHILD_INDEX_NODE CHILD_INDEX_NODE, *CHILD_INDEX_NODE_;
+typedef struct _EXTENT_ITEM    EXTENT_ITEM   , *EXTENT_ITEM_   ;
+typedef struct _EXTENT_NODE    EXTENT_NODE   , *EXTENT_NODE_   ;
+typedef struct _RANGE_CURSOR   RANGE_CURSOR  , *RANGE_CURSOR_  ;
+typedef struct _BLOCK_IO_SEGMENT BLOCK_IO_SEGMENT, *BLOCK_IO_SEGMENT_;
+typedef struct _BLOCK_IO_CLASS BLOCK_IO_CLASS, *BLOCK_IO_CLASS_;
+typedef struct _BLOCK_IO_ACTIVITY BLOCK_IO_ACTIVITY, *BLOCK_IO_ACTIVITY_;
+typedef struct _MANIFEST_RECORD MANIFEST_RECORD, *MANIFEST_RECORD_;
+typedef struct _PATTERN        PATTERN       , *PATTERN_       ;  //  Compiled Wildcard Pattern
 
 typedef struct _CHAIN { struct _LINK *First ; struct _LINK *Last; } CHAIN , *CHAIN_ ;
 typedef struct _LINK  { struct _LINK *Next  ; struct _LINK *Prev; } LINK  , *LINK_  ;
@@ -200,6 +238,82 @@ typedef struct _LINK  { struct _LINK *Next  ; struct _LINK *Prev; } LINK  , *LIN
 
 static const U4 A_DIRECTORY = ( U4 ) -1;  //  Indicates NOT a file num ranges, but instead a directory.
 
+#define ENTRIES_NUM_FREE_LISTS   64          //  Size classes of holes in EntriesBytes, 16 bytes apart; the last takes all bigger.
+#define ENTRIES_NO_HOLE          0xFFFFFFFF  //  Ends a free list.
+
+#define ENTRIES_COMPACT_START_PERCENT  25          //  Start compacting when this much of the used entries store is holes,
+#define ENTRIES_COMPACT_STOP_PERCENT    5          //  and stop when it is down to this much.
+#define ENTRIES_COMPACT_MIN_NUM_BYTES  ( 64 * 1024 )  //  Never bother for fewer bytes in holes.
+#define ENTRIES_COMPACT_SLICE_NUM_BYTES ( 16 * 1024 )  //  Most bytes moved or stepped over while holding the metadata lock.
+
+#define INLINE_DATA_ROUNDING     64                 //  Inline data grows and shrinks in steps of this many bytes.
+
+#define RANGE_MAX_PACKED_NUM_BYTES  15              //  A packed data range is two varints: 5 bytes for a U4, 10 for a U8.
+
+#define EXTENTS_MAX_INLINE       16                 //  Past this many data ranges, a file's ranges move out to an extent tree.
+#define HOLE_MAX_NUM_BYTES       0x8000'0000        //  Sparse files grow by holes of up to this many bytes,
+#define HOLE_FILL_NUM_BYTES      ( 1024 * 1024 )    //  which are given volume space this much at a time, aligned, as they are written.
+
+#define PREALLOCATE_MIN_NUM_BYTES        ( 64 * 1024 )          //  A file appended past its allocation gets at least this much room ahead,
+#define PREALLOCATE_MAX_NUM_BYTES        ( 64 * 1024 * 1024 )   //  doubling each time it outgrows it, up to this,
+#define PREALLOCATE_HORIZON_MICROSECONDS 1'000'000              //  or what it appends in this long if more, but no more than its size
+#define PREALLOCATE_FREE_SPACE_SHARE     16                     //  nor this fraction of the free space.
+#define PREALLOCATE_PRESSURE_NUM_BYTES   ( 256 * 1024 * 1024 )  //  With less free than this, open files give their room ahead back.
+#define EXTENT_NODE_NUM_ITEMS    64
+#define EXTENT_LEAF_NUM_BYTES    1008               //  Room for packed ranges in a leaf; keeps EXTENT_NODE at 1 KB.
+#define EXTENT_TREE_MAX_HEIGHT   8
+#define EXTENT_NODE_PARENT_ID    ( ( ID ) -1 )      //  Marks an entry as an extent tree node, which is in no directory.
+
+#define CHILD_INDEX_NODE_NUM_ITEMS  30             //  Keeps a leaf's keys and Ids in six cache lines.
+#define CHILD_INDEX_MAX_HEIGHT      8
+#define CHILD_INDEX_MIN_SEEK_DEPTH  24             //  A sibling tree search this deep gets its directory a child index.
+
+#define CACHE_PAGE_NUM_BYTES     4096               //  Cached ranges take whole pages of the cache arena.
+#define DIRECT_IO_MIN_NUM_BYTES  ( 256 * 1024 )     //  Cacheable transfers at least this big, and block aligned, skip the cache too.
+
+#define BLOCK_IO_MAX_SEGMENTS          16                   //  Most extents we gather for one vectored request.
+#define BLOCK_IO_MAX_MERGED_NUM_BYTES  ( 16 * 1024 * 1024 )  //  Adjacent extents merge into requests up to this big.
+#define BLOCK_IO_MAX_DEVICES           8                    //  Most devices whose activity we count at once.
+#define BLOCK_IO_NUM_LATENCY_BUCKETS   24                   //  Latencies are counted by powers of two microseconds, for percentiles.
+
+#define IO_WRITEBACK_BUDGET_NUM_BYTES   ( 2 * 1024 * 1024 )  //  Most a background class has at the device at once, so a demand
+#define IO_PREFETCH_BUDGET_NUM_BYTES    ( 1 * 1024 * 1024 )  //  request waits behind no more than this of it.
+#define IO_CHECKPOINT_BUDGET_NUM_BYTES  ( 1 * 1024 * 1024 )
+#define IO_MAX_DEFER_MICROSECONDS       20'000               //  A background request waits this long at most for demand requests to clear.
+#define IO_DEMAND_DEADLINE_MICROSECONDS 10'000               //  A demand request slower than this counts as late.
+#define CHECKPOINT_SLICE_NUM_BYTES      ( 4 * 1024 * 1024 )  //  Pending reads are served between slices of the entries as they are written.
+
+#define WRITE_BACK_DEADLINE_MILLISECONDS  2'000          //  No dirty range waits longer than this to be written, busy or not.
+#define WRITE_BACK_BATCH_NUM_BYTES   ( 4 * 1024 * 1024 )  //  While the device is busy, dirty data waits until there is this much.
+#define WRITE_BACK_IDLE_PERCENT      10                   //  The device is idle when nothing is outstanding and others kept it busy less than this,
+#define WRITE_BACK_WINDOW_MICROSECONDS  100'000           //  over the last window this long.
+
+#define FLUSH_GROUP_WINDOW_MICROSECONDS  500        //  Flushes arriving this close together share one write barrier.
+
+#define OVERVIEW_FORMAT          0x32465754         //  "TWF2": files' ranges are packed, with a state in each.
+#define OVERVIEW_FORMAT_OFFSET   20                 //  Where the format sits in the Overview, after its length and three counts.
+
+#define MANIFEST_OFFSET          4096               //  The warm-cache manifest follows the Overview in its region.
+#define MANIFEST_MAGIC           0x4D575754         //  "TWWM"
+#define MANIFEST_RECORD_NUM_BYTES  16               //  On the volume, a U8 VolumeAddress, a U4 NumBytes and an ID.
+#define MANIFEST_MAX_NUM_RECORDS ( 32 * 1024 )      //  Most cache ranges a manifest records, earliest used first.
+#define MANIFEST_MAX_PREFETCH_NUM_BYTES  ( CACHE_ARENA_NUM_BYTES / 2 )  //  Leave the rest of the arena for what is used next.
+
+#define LAUNCH_OFFSET            ( 1024 * 1024 )    //  The launch traces follow the manifest in the Overview's region.
+#define LAUNCH_MAGIC             0x4C545754         //  "TWTL"
+#define LAUNCH_LEARN_SECONDS     10                 //  What a program reads this soon after it starts makes its trace.
+#define LAUNCH_MAX_TRACES        16                 //  Programs remembered; the least recently launched is forgotten first.
+#define LAUNCH_MAX_LEARNERS      4                  //  Programs learned at once.
+#define LAUNCH_MAX_RECENT        16                 //  Processes remembered as already considered.
+#define LAUNCH_TRACE_MAX_NUM_RECORDS  1024          //  Most extents one trace records, first read first.
+#define LAUNCH_NAME_NUM_BYTES    32                 //  Enough of a program's file name to report.
+#define LAUNCH_MAX_NUM_BYTES     ROUND_UP( 8 + LAUNCH_MAX_TRACES * ( 48 + LAUNCH_TRACE_MAX_NUM_RECORDS * MANIFEST_RECORD_NUM_BYTES ), 4096 )
+
+#define WHERE_CHUNK_SHIFT        14                               //  An Id's high bits pick a chunk of the where table,
+#define WHERE_CHUNK_NUM_IDS      ( 1 << WHERE_CHUNK_SHIFT )       //  and its low bits a slot in it.
+#define WHERE_CHUNK_MASK         ( WHERE_CHUNK_NUM_IDS - 1 )
+#define WHERE_MAX_NUM_CHUNKS     ( 0x80000000 >> WHERE_CHUNK_SHIFT )  //  IDs are positive S4s.
+
 //////////////////////////////////////////////////////////////////////
 //
 //  Structs
@@ -207,18 +321,23 @@ static const U4 A_DIRECTORY = ( U4 ) -1;  //  Indicates NOT a file num ranges, b
 
 //--------------------------------------------------------------------
 
-struct _SET_NODE { SET_NODE_ P, L, R; };  //  Parent, Left, Right
+struct _SET_NODE { SET_NODE_ P, L, R; U1 H; };  //  Parent, Left, Right, Height ( AVL only )
 
 //--------------------------------------------------------------------
 
-struct _MULTISET_NODE { MULTISET_NODE_ P, L, R, E; };  //  Parent, Left, Right, Equal
+struct _MULTISET_NODE { MULTISET_NODE_ P, L, R, E; U1 H; };  //  Parent, Left, Right, Equal, Height ( AVL only )
 
 //--------------------------------------------------------------------
 
+//  An unwritten range has volume space that was never written, so it reads as zeros, and
+//  becomes written once something written to it is on the volume; until then what was written
+//  is only in its dirty cache. A hole, only in sparse files, has no volume space at all until
+//  written; see DataFillHoles. A hole is never cached.
 struct _DATA_RANGE
 {
-    U8   VolumeAddress;
-    U4   NumBytes;
+    U8          VolumeAddress;  //  Zero for a hole.
+    U4          NumBytes;
+    RANGE_STATE State;
 };
 
 //--------------------------------------------------------------------
@@ -227,8 +346,113 @@ struct _FILE_DATA
 {
     U8         FileNumBytes;
     U8         AllocationNumBytes;
-    U4         NumRanges;
-    DATA_RANGE DataRange[100];  //  6   Better for testing than 0.
+    ID         ExtentTreeId;   //  If not zero, the ranges are in this extent tree, and NumRanges is zero.
+    U2         NumRanges;
+    U2         NumRangeBytes;
+    U1         RangeBytes[EXTENTS_MAX_INLINE * RANGE_MAX_PACKED_NUM_BYTES];  //  Only NumRangeBytes in memory.
+};
+//  Data ranges are packed to save metadata: each is a varint number of blocks, shifted up
+//  two bits to hold its RANGE_STATE, then a zigzagged varint number of blocks from the end
+//  of the range before it (or from zero) to its start, except that a hole has no start.
+//  Files are mostly contiguous, so most ranges take two or three bytes.
+//
+//  A file with neither ranges nor an extent tree keeps its AllocationNumBytes of data
+//  right here in place of RangeBytes, in its entry; see DataIsInline.
+
+
+//--------------------------------------------------------------------
+//
+//  Extent Tree
+//
+//  Once a file has more than EXTENTS_MAX_INLINE data ranges, they move out of its
+//  entry into a B+tree whose nodes are nameless entries of their own, so adding
+//  a range never resizes or moves the file's entry. Interior items count the bytes
+//  under each child so we can seek by file offset, and the leaves are chained.
+//
+
+struct _EXTENT_ITEM
+{
+    U8   NumBytes;  //  Under the child.
+    ID   ChildId;
+};
+
+struct _EXTENT_NODE
+{
+    U2   Height;      //  Zero for a leaf.
+    U2   NumItems;
+    ID   NextLeafId;  //  Zero for the last leaf, and for interior nodes.
+    union
+    {
+        struct                                      //  In a leaf, NumItems packed ranges,
+        {                                           //  the first packed from zero.
+            U8   LastEnd;                           //  In blocks, where the last range ends.
+            U2   NumRangeBytes;
+            U1   RangeBytes[EXTENT_LEAF_NUM_BYTES];
+        };
+        EXTENT_ITEM Child[EXTENT_NODE_NUM_ITEMS];  //  In an interior node.
+    };
+};
+
+//  One extent of a vectored request to the volume.
+struct _BLOCK_IO_SEGMENT
+{
+    U8  VolumeAddress;
+    U4  NumBytes;
+    V_  Buffer;
+};
+
+//  The requests of one class to a device; see IO_CLASS.
+struct _BLOCK_IO_CLASS
+{
+    volatile LONG   NumQueued;              //  Waiting their turn.
+    volatile LONG   MaxNumQueued;
+    volatile LONG   NumInFlight;            //  Sent, and not yet completed.
+    volatile LONG64 NumRequests;
+    volatile LONG64 NumBytes;
+    volatile LONG64 NumDeferred;            //  Made to wait for demand requests.
+    volatile LONG64 NumLate;                //  Slower than IO_DEMAND_DEADLINE_MICROSECONDS.
+    volatile LONG64 Microseconds;           //  In all, from asking to completion.
+    volatile LONG64 MaxMicroseconds;
+    volatile LONG   Latencies[BLOCK_IO_NUM_LATENCY_BUCKETS];  //  [i] counts those under 2^i microseconds, and not under half that.
+};
+
+//  How busy a device is, from the requests we send it; see BlockIoTrackDevice.
+struct _BLOCK_IO_ACTIVITY
+{
+    PDEVICE_OBJECT  DeviceObject;
+    volatile LONG   NumHolds;               //  Requests using it; it is untracked only once there are none.
+    volatile LONG   NumOutstanding;
+    volatile U8     BusySinceMicrosecond;   //  When NumOutstanding last rose from zero.
+    volatile LONG64 BusyMicroseconds;       //  In all, with at least one request outstanding.
+    volatile LONG64 NumWrites;
+    volatile LONG64 WriteMicroseconds;      //  In all, from sending each write to its completion.
+    volatile LONG64 MaxWriteMicroseconds;
+    volatile LONG   CheckpointUnderway;     //  While the metadata is being written.
+    BLOCK_IO_CLASS  Classes[IO_NUM_CLASSES];
+    volatile LONG   DemandLatenciesDuringCheckpoint[BLOCK_IO_NUM_LATENCY_BUCKETS];
+};
+
+//  A cache range recorded in the warm-cache manifest.
+struct _MANIFEST_RECORD
+{
+    U8  VolumeAddress;
+    U4  NumBytes;
+    ID  Id;
+};
+
+//--------------------------------------------------------------------
+
+//  Walks a file's data ranges in order, wherever they are.
+struct _RANGE_CURSOR
+{
+    VCB_        Vcb;
+    DATA_RANGE  Range;       //  The current one, unpacked.
+    U1_         At;          //  Where it is packed.
+    U1_         Next;        //  Where the one after it is packed,
+    U1_         End;         //  until here in the same entry or leaf.
+    U8          LastEnd;     //  In blocks, where the current one ends.
+    ID          NextLeafId;
+    U8          FileOffset;  //  Of the current one.
 };
 
 //--------------------------------------------------------------------
@@ -254,9 +478,11 @@ struct _ENTRY
     S1   Name[256];
 };
 //  In memory, the actual Name num bytes is not 256, but NameNumBytes + 1 for trailing zero.
+//  The sibling tree links here are the copy that is written to disk; see ENTRY_HOT.
 //  This is always followed by either...
 //      For a directory : an ID for the root node of its children
 //      For a file      : FILE_DATA
+//      For an extent node: EXTENT_NODE, with an empty Name and a ParentId of EXTENT_NODE_PARENT_ID
 
 //--------------------------------------------------------------------
 
@@ -272,8 +498,118 @@ struct _SPACE_RANGE
 
 struct _SPINLOCK
 {
-    LONG Locked;
-    LONG NumSpinning;
+    volatile LONG NextTicket;  //  Ticket handed to the next thread that wants the lock.
+    volatile LONG NowServing;  //  Ticket of the thread that holds (or may now take) the lock.
+    volatile LONG NumSpinning;
+
+    //  Statistics, only changed by the thread holding the lock.
+    U8   NumAcquisitions;
+    U8   NumContendedAcquisitions;
+    U8   TotalWaitTicks;
+    U8   MaxWaitTicks;
+    U8   TotalHoldTicks;
+    U8   MaxHoldTicks;
+    U8   AcquiredTick;
+};
+
+//--------------------------------------------------------------------
+
+struct _CACHE_RANGE
+{
+    CACHE_RANGE_ P, L, R;   //  Parent, Left, Right
+    U1          H;         //  Height ( AVL only )
+    LINK        Link;
+    LINK        FileLink;   //  In its file's chain of ranges.
+    CACHE_FILE_ File;
+    U8   VolumeAddress;
+    U1_  MemoryAddress;
+    U4   NumBytes;
+    B1   IsDirty;
+    B1   IsWriting;  //  Pinned while the background thread writes it to the volume.
+    B1   IsPurged;   //  Purged while pinned; whoever unpins it frees it.
+    B1   IsPrefetched;  //  Read from the manifest and not used since.
+    B1   IsUnwritten;   //  Its file's range is unwritten until write-back puts this on the volume.
+    U8   FileOffset;    //  Where that range is in the file, while IsUnwritten.
+    LINK DirtyLink;     //  In the cache's chain of dirty ranges, while dirty.
+    U8   DirtySinceMicrosecond;
+};
+
+//--------------------------------------------------------------------
+
+struct _CACHE_FILE
+{
+    CACHE_FILE_ P, L, R;    //  Parent, Left, Right
+    U1          H;         //  Height ( AVL only )
+    ID          Id;
+    CHAIN       Ranges;    //  Its cache ranges, by FileLink.
+};
+
+//--------------------------------------------------------------------
+
+struct _CACHE
+{
+    CHAIN        Age;
+    CHAIN        Dirty;              //  The dirty ranges, by DirtyLink, the longest dirty first.
+    CACHE_RANGE_ SetRoot;
+    CACHE_FILE_  FileRoot;           //  The files that have cache ranges, by Id.
+    U8           TotalNumDirtyBytes;
+    U4           TotalNumDirtyRanges;
+    U8           TotalNumCleanBytes;
+    U4           TotalNumCleanRanges;
+    U1_          Arena;              //  CACHE_ARENA_NUM_BYTES of pages, or 0 if we could not get it.
+    PULONG       ArenaBits;
+    RTL_BITMAP   ArenaMap;           //  A set bit is a page in use.
+    U4           ArenaNumPages;
+    U4           ArenaNumPagesUsed;
+    U4           ArenaHint;          //  Where to start looking for free pages.
+    U4           NumPoolFallbacks;   //  Ranges that did not fit in the arena.
+    U4           DirectWriteSequence;  //  Odd while a direct write is in flight, and stepped by purges; see CacheRangeAdoptWithLock.
+    U8           NumDirectBytesRead;
+    U8           NumDirectBytesWritten;
+    MANIFEST_RECORD_ Manifest;       //  Left to prefetch after mount, by volume address.
+    U4           ManifestNumRecords;
+    U4           ManifestCursor;
+    U4           ManifestNumUrgent;  //  Those first that a starting program is waiting for.
+    U8           NumManifestBytesPrefetched;
+    B1           WriteBackIsDraining;   //  A batch built up while the device was busy; write until none is dirty.
+    U8           WindowStartMicrosecond;
+    U8           WindowStartBusyMicroseconds;
+    U8           WindowStartWriteBackMicroseconds;
+    U4           UtilizationPercent;      //  Of the device, over the last whole window,
+    U4           OthersUtilizationPercent;  //  less the share of our own write-back.
+    U8           WriteBackMicroseconds;   //  In all, waiting on write-back requests.
+    U8           NumWriteBackBytesIdle;   //  Written back at once, the device being idle,
+    U8           NumWriteBackBytesBatched;  //  in a batch while it was busy,
+    U8           NumWriteBackBytesDue;    //  or at the deadline.
+    U8           MaxNumDirtyBytes;        //  The most at risk at once,
+    U8           MaxDirtyMicroseconds;    //  and for longest.
+};
+
+//--------------------------------------------------------------------
+
+//  What a program read as it started, keyed by a hash of its file name.
+struct _LAUNCH_TRACE
+{
+    U4               Key;
+    U4               NumRecords;
+    U8               LastLaunchTime;   //  System time, to forget the least recent first, and not prefetch twice for one launch.
+    S1               Name[LAUNCH_NAME_NUM_BYTES];
+    MANIFEST_RECORD_ Records;          //  Room for LAUNCH_TRACE_MAX_NUM_RECORDS, in the order first read; 0 if the slot is unused.
+};
+
+//--------------------------------------------------------------------
+
+struct _LAUNCHES
+{
+    LAUNCH_TRACE Traces[LAUNCH_MAX_TRACES];
+    LAUNCH_TRACE Learning[LAUNCH_MAX_LEARNERS];  //  Traces still being made, with LastLaunchTime when their process started,
+    PEPROCESS    LearningProcess[LAUNCH_MAX_LEARNERS];  //  by these processes; 0 if the slot is unused.
+    U4           NumLearning;
+    HANDLE       RecentId[LAUNCH_MAX_RECENT];          //  Processes already considered, so each is considered once; by ID,
+    U8           RecentCreateTime[LAUNCH_MAX_RECENT];  //  and when created, as IDs are reused. Not referenced, so may be gone.
+    U4           RecentCursor;
+    U4           NumLearned;
+    U4           NumPrefetched;
 };
 
 //--------------------------------------------------------------------
@@ -297,6 +633,60 @@ LOCK_TYPE Type;
 //  Volume Control Block
 //
 
+//--------------------------------------------------------------------
+//
+//  What a sibling tree search reads of each entry, kept densely by Id beside the
+//  where table. A search walks and compares in here, and only reads the ENTRY
+//  itself to break a tie between two long names. Links are read only from here,
+//  and written both here and in the ENTRY; see EntryHotRefresh.
+//
+
+struct _ENTRY_HOT
+{
+    ID   SiblingTreeParentId;
+    ID   SiblingTreeLeftId;
+    ID   SiblingTreeRightId;
+    U4   FileAttributes;
+    U8   NameKey;  //  The first eight bytes of the name, lowercased, big-endian, zero padded.
+    CHILD_INDEX_NODE_ ChildIndex;  //  For a directory, the root of its child index, if it has one.
+};
+
+//--------------------------------------------------------------------
+//
+//  A node of a directory's child index; see FindChild. Children are in name order.
+//  In an interior node, Key[i] and Id[i] are the smallest child under Child[i],
+//  and are not looked at for i of zero.
+//
+
+struct _CHILD_INDEX_NODE
+{
+    U2                Height;  //  Zero for a leaf.
+    U2                NumItems;
+    CHILD_INDEX_NODE_ Prev;    //  Leaves are chained in name order.
+    CHILD_INDEX_NODE_ Next;
+    U8                Key  [CHILD_INDEX_NODE_NUM_ITEMS];  //  Name keys, as in ENTRY_HOT.
+    ID                Id   [CHILD_INDEX_NODE_NUM_ITEMS];
+    CHILD_INDEX_NODE_ Child[CHILD_INDEX_NODE_NUM_ITEMS];  //  Not allocated in a leaf.
+};
+
+//--------------------------------------------------------------------
+//
+//  A chunk of the where table, which converts an Id to an Entry_.
+//
+//  Chunks are added as IDs run out and never move, so growing the table
+//  never copies or invalidates a slot. A set bit marks an unused Id.
+//
+
+struct _WHERE_CHUNK
+{
+    U4        NumFreeIds;
+    U4        FreeBits[WHERE_CHUNK_NUM_IDS / 32];
+    ENTRY_    Entries [WHERE_CHUNK_NUM_IDS];
+    ENTRY_HOT Hot     [WHERE_CHUNK_NUM_IDS];
+};
+
+//--------------------------------------------------------------------
+
 struct _VCB
 {  //  TODO AdvancedFcbHeader or SectionObjectPointers needed for volumes? yes if IsAVolume relied on.
     FSRTL_ADVANCED_FCB_HEADER AdvancedFcbHeader;  //  Need because it indicates if fast I/O is possible?
@@ -316,6 +706,84 @@ struct _VCB
     PARTITION_INFORMATION_EX  PartitionInformationEx;
     U1_                       FirstBlock;
     ID                        RootId;
+
+    //  Everything below belongs to this one volume, so that two mounted volumes
+    //  never share a lock, a cache, or a background thread.
+
+    SPINLOCK                  MetadataLock;  //  Held around every IRP to this volume.
+    U8                        ConservativeMetadataUpdateCount;
+    U8                        LastMetadataOkCount;
+    U8                        LastIrpMicrosecondStart;
+
+    U8                        OverviewStart;
+    U8                        OverviewNumBytes;
+    U8                        EntriesStart;
+    U8                        EntriesNumBytes;
+    U8                        DataStart;
+    U8                        DataNumBytes;
+    U8                        TotalNumBytes;
+
+    WHERE_CHUNK_*             WhereChunks;  //  Index to convert an Id to an Entry_; see EntryForId.
+    U4                        WhereNumChunks;
+    U4                        WhereMaxNumChunks;         //  Room in WhereChunks before it doubles.
+    U4                        WhereFirstChunkWithAFreeId;  //  No chunk before it has a free Id.
+    U1_                       EntriesBytes;
+    U4                        EntriesTotalAllocation;
+    U4                        EntriesNumBytesAvailable;
+    U4                        EntriesFirstFreeByte;
+    U4                        EntriesFreeLists[ENTRIES_NUM_FREE_LISTS];  //  Byte offset of the first hole in each size class.
+    U4                        EntriesNumBytesInHoles;
+    U4                        EntriesHighWaterMark;
+    U8                        EntriesNumAllocations;
+    U8                        EntriesNumAllocationsFromHoles;
+    U8                        EntriesNumCompactions;
+    B1                        EntriesCompacting;   //  Between the start and stop percents, compacting in slices.
+    U4                        EntriesCompactCursor;  //  Byte offset where the next slice looks for a hole.
+    U8                        EntriesCompactNumSlices;
+    U8                        EntriesCompactNumBytesMoved;
+    U8                        EntriesCompactNumBytesReclaimed;
+    U8                        EntriesCompactTotalPauseMicroseconds;
+    U8                        EntriesCompactMaxPauseMicroseconds;
+    U8                        ChildrenGeneration;  //  Bumped whenever any directory gains or loses a child.
+    U8                        ChildIndexNumBuilt;
+    U8                        ChildIndexNumLookups;
+    U4                        TotalNumberOfEntries;
+    ID                        WhereTableMaxId;                //  One past the last Id the chunks have room for.
+    U4                        WhereTableTotalAllocation;      //  Bytes in chunks and WhereChunks.
+    ID                        WhereTableFirstUnusedBottomID;  //  One past the highest Id ever used; Id zero is reserved for errors like not found.
+
+    MULTISET_NODE_            SpaceByNumBytes;
+    SET_NODE_                 SpaceByAddress;
+    U4                        SpaceNumNodes;
+    U8                        SpaceNumDifferencesFromVolume;
+    U8                        SpaceNumBytes;
+
+    U8                        PreallocateNumAppends;        //  Writes at or past the end of a file.
+    U8                        PreallocateNumAppendBytes;
+    U8                        PreallocateNumGrowths;        //  Appends that grew the allocation.
+    U8                        PreallocateNumBytes;          //  Allocated ahead of appends.
+    U8                        PreallocateNumTrims;
+    U8                        PreallocateNumBytesTrimmed;   //  Given back unused, at close or under space pressure.
+    U8                        PreallocateNumPressureTrims;
+
+    CACHE                     Cache;
+    SPINLOCK                  CacheLock;
+    BLOCK_IO_ACTIVITY         DeviceActivity;  //  Of PhysicalDeviceObject.
+
+    LAUNCHES                  Launches;  //  Under the metadata lock.
+
+    CHAIN                     PendingReadsChain;
+    CHAIN                     PendingLocksChain;
+    CHAIN                     PendingFlushesChain;
+    U8                        PendingFlushesSinceMicrosecond;  //  When the oldest pending flush arrived.
+    U8                        FlushNumCompleted;
+    U8                        FlushNumGroups;      //  One write barrier each.
+    U8                        FlushTotalMicroseconds;
+    U8                        FlushMaxMicroseconds;
+
+    volatile B1               BackgroundThreadStop;
+    volatile B1               BackgroundThreadStopped;
+    volatile B1               BackgroundThreadBusy;
 };
 
 //--------------------------------------------------------------------
@@ -335,6 +803,36 @@ struct _FCB
     LOCK_                     LockRanges;
     VCB_                      Vcb;
     ID                        Id;
+
+    U8                        AppendWindowNumBytes;   //  Room to allocate ahead of appends; see readWriteAllocationFor.
+    U8                        AppendNumBytes;         //  Decaying sums, for the append rate.
+    U8                        AppendMicroseconds;
+    U8                        LastAppendMicrosecond;
+    B1                        IsPreallocated;         //  Allocated past its end by appends, until trimmed.
+};
+
+//--------------------------------------------------------------------
+//
+//  Compiled Wildcard Pattern
+//
+//  A pattern is split at its stars into segments, which may hold '?'.
+//  Matching places each segment once, leftmost first, so it never backtracks.
+//
+
+#define PATTERN_MAX_SEGMENTS 256
+
+struct _PATTERN
+{
+    S1     Text[512];                                 //  The pattern without stars, upper cased.
+    U2     Failure[512];                              //  Per segment prefix function, for segments without a '?'.
+    U2     SegmentStart[PATTERN_MAX_SEGMENTS];
+    U2     SegmentNumBytes[PATTERN_MAX_SEGMENTS];
+    B1     SegmentHasAQuestion[PATTERN_MAX_SEGMENTS];
+    U2     NumSegments;
+    B1     StartsWithAStar;
+    B1     EndsWithAStar;
+    S1     Prefix[512];                               //  The literal characters before the first wildcard.
+    U2     PrefixNumBytes;
 };
 
 //--------------------------------------------------------------------
@@ -344,11 +842,14 @@ struct _FCB
 
 struct _CCB
 {
-    ULONG  CurrentByteOffset;  //  TODO used?
-    B1     FirstQuery;
-    B1     IsAPattern;
-    char   NameOrPattern[512];  //  TODO
-    char   LastProcessedName[512];  //  TODO
+    ULONG    CurrentByteOffset;  //  TODO used?
+    B1       FirstQuery;
+    B1       IsAPattern;
+    char     NameOrPattern[512];  //  TODO
+    char     LastProcessedName[512];  //  TODO
+    ID       CursorId;  //  The last child processed; resume after it while CursorGeneration is current.
+    U8       CursorGeneration;
+    PATTERN_ Pattern;  //  Compiled on the first query when IsAPattern.
 };
 
 //--------------------------------------------------------------------
@@ -360,9 +861,12 @@ struct _ICB
 {
     PIRP            Irp;
     PDEVICE_OBJECT  DeviceObject;
+    VCB_            Vcb;  //  Zero for IRPs to our own device.
 
     LINK            PendingReadsLink;
     LINK            PendingLocksLink;
+    LINK            PendingFlushesLink;
+    U8              PendingSinceMicrosecond;
 
     B1              DoCompleteRequest;
 };
@@ -372,56 +876,21 @@ struct _ICB
 //  Globals
 //
 
-extern ENTRY_* Entries;  //  Index to convert an Id to an Entry_
 extern unsigned int PrivateSeed;
 extern LARGE_INTEGER PerformanceCounterFrequencyInTicksPerSecond;
 
 extern U4             Volume_SpaceNodeMaxNumBytes;
 extern U4             Volume_BlockSize;
-extern U8             Volume_OverviewStart;
-extern U8             Volume_OverviewNumBytes;
-extern U8             Volume_EntriesStart;
-extern U8             Volume_EntriesNumBytes;
-extern U8             Volume_DataStart;
-extern U8             Volume_DataNumBytes;
-extern U8             Volume_TotalNumBytes;
-extern U8             Volume_ConservativeMetadataUpdateCount;
-extern U8             Volume_LastMetadataOkCount;
-extern SPINLOCK       Volume_MetadataLock;
-extern U4             Volume_TotalNumberOfEntries;
-extern ID             Volume_WhereTableMaxId;
-extern U4             Volume_WhereTableTotalAllocation;
-extern ID             Volume_WhereTableLastRecycledID;       //  i.e. No recycled IDs.
-extern ID             Volume_WhereTableFirstUnusedBottomID;  //  Index of zero reserved for errors like not found.
 extern PDRIVER_OBJECT Volume_DriverObject;
 extern PDEVICE_OBJECT Volume_TailwindDeviceObject;
-extern PDEVICE_OBJECT Volume_PhysicalDeviceObject;
-extern U4             Volume_NumSpaceBytesOnVolume;
-extern U4             Volume_NumSpaceRangesOnVolume;
-extern MULTISET_NODE_ Volume_SpaceByNumBytes;
-extern SET_NODE_      Volume_SpaceByAddress;
-extern U4             Volume_SpaceNumNodes;
-extern U8             Volume_SpaceNumDifferencesFromVolume;
-extern U8             Volume_SpaceNumBytes;
-extern CHAIN          Volume_PendingReadsChain;
-extern CHAIN          Volume_PendingLocksChain;
+extern SPINLOCK       Volume_TailwindDeviceLock;  //  Held around IRPs to our own device, like mounts.
 
 extern LARGE_INTEGER  DriverEntryTime;
 extern UNICODE_STRING DeviceName;
 extern UNICODE_STRING SymbolicName;
 
-extern CACHE Cache;
-
-extern U1_ EntriesBytes;
-extern U4  EntriesTotalAllocation;
-extern U4  EntriesNumBytesAvailable;
-extern U4  EntriesFirstFreeByte;
-
 extern int ChatVariable;
 
-extern volatile B1  BackgroundThread_Busy;
-extern U8 LastIrpMicrosecondStart;
-
 
 //////////////////////////////////////////////////////////////////////
 //
@@ -429,14 +898,25 @@ extern U8 LastIrpMicrosecondStart;
 //
 //--------------------------------------------------------------------
 
+inline ENTRY_* EntryForId_( VCB_ Vcb, ID Id ) { return &Vcb->WhereChunks[ Id >> WHERE_CHUNK_SHIFT ]->Entries[ Id & WHERE_CHUNK_MASK ]; }
+inline ENTRY_  EntryForId ( VCB_ Vcb, ID Id ) { return *EntryForId_( Vcb, Id ); }
+inline ENTRY_HOT_ EntryHotForId( VCB_ Vcb, ID Id ) { return &Vcb->WhereChunks[ Id >> WHERE_CHUNK_SHIFT ]->Hot[ Id & WHERE_CHUNK_MASK ]; }
+
+//--------------------------------------------------------------------
+
 inline B1 EntryIsADirectory ( ENTRY_ Entry ) { return Entry && BitIsSet(   Entry->FileAttributes, FILE_ATTRIBUTE_DIRECTORY ); }
 inline B1 EntryIsAFile      ( ENTRY_ Entry ) { return Entry && BitIsClear( Entry->FileAttributes, FILE_ATTRIBUTE_DIRECTORY ); }
-inline B1 IdIsADirectory    ( ID Id        ) { return Id    && BitIsSet(   Entries[Id]->FileAttributes, FILE_ATTRIBUTE_DIRECTORY ); }
-inline B1 IdIsAFile         ( ID Id        ) { return Id    && BitIsClear( Entries[Id]->FileAttributes, FILE_ATTRIBUTE_DIRECTORY ); }
+inline B1 EntryIsAnExtentNode( ENTRY_ Entry ) { return Entry->ParentId == EXTENT_NODE_PARENT_ID; }
+inline B1 IdIsADirectory    ( VCB_ Vcb, ID Id ) { return Id && BitIsSet(   EntryHotForId( Vcb, Id )->FileAttributes, FILE_ATTRIBUTE_DIRECTORY ); }
+inline B1 IdIsAFile         ( VCB_ Vcb, ID Id ) { return Id && BitIsClear( EntryHotForId( Vcb, Id )->FileAttributes, FILE_ATTRIBUTE_DIRECTORY ); }
 inline V_ Zero( V_ Address, size_t NumBytes ) { return memset( Address, 0, NumBytes ); }
 
 //--------------------------------------------------------------------
 
+inline B1 DataIsInline( FILE_DATA_ FileData ) { return ! FileData->NumRanges && ! FileData->ExtentTreeId; }
+
+//--------------------------------------------------------------------
+
 inline ID_ ChildrenTree_( ENTRY_ Entry )
 
 {
@@ -467,11 +947,11 @@ ASSERT( EntryIsAFile( Entry ) );
 
 //--------------------------------------------------------------------
 
-inline B1 HasChildren( ID Id )
+inline B1 HasChildren( VCB_ Vcb, ID Id )
 
 {
-    if ( IdIsAFile( Id ) ) return FALSE;
-    if ( ChildrenTree( Entries[Id] ) ) return TRUE;
+    if ( IdIsAFile( Vcb, Id ) ) return FALSE;
+    if ( ChildrenTree( EntryForId( Vcb, Id ) ) ) return TRUE;
     return FALSE;
 }
 
@@ -481,8 +961,46 @@ inline B1 HasChildren( ID Id )
 inline void InitializeSpinlock( SPINLOCK_ Lock )
 
 {
-    Lock->Locked      = 0;  //  Initialize the lock to "not locked".
-    Lock->NumSpinning = 0;  //  Initialize the number of waiting threads to none.
+    Zero( Lock, sizeof( SPINLOCK ) );  //  Initialize the lock to "not locked", with no waiters and no history.
+}
+
+//--------------------------------------------------------------------
+
+#define SPINLOCK_MAX_BACKOFF    1024  //  Most pauses between looks at the lock: some 10 to 40 microseconds, by the CPU's pause,
+                                      //  so a waiter still sees the lock come free well before a 1 ms park would end.
+#define SPINLOCK_SPIN_BUDGET     100  //  Looks at the lock before we start parking: 10 to reach the most backoff, then about
+                                      //  100'000 pauses, which spends roughly what one park costs before we give up the CPU.
+
+inline U8 SpinlockTick()
+
+{
+#if SPINLOCK_STATS == YES
+    return KeQueryPerformanceCounter( 0 ).QuadPart;
+#else
+    return 0;
+#endif
+}
+
+//--------------------------------------------------------------------
+
+inline void SpinlockAcquired( SPINLOCK_ Lock, U8 WaitStartTick )
+
+{
+#if SPINLOCK_STATS == YES
+    U8 Now = SpinlockTick();
+    Lock->NumAcquisitions++;
+    if ( WaitStartTick )
+    {
+        U8 WaitTicks = Now - WaitStartTick;
+        Lock->NumContendedAcquisitions++;
+        Lock->TotalWaitTicks += WaitTicks;
+        if ( WaitTicks > Lock->MaxWaitTicks ) Lock->MaxWaitTicks = WaitTicks;
+    }
+    Lock->AcquiredTick = Now;
+#else
+    UNREFERENCED_PARAMETER( Lock );
+    UNREFERENCED_PARAMETER( WaitStartTick );
+#endif
 }
 
 //--------------------------------------------------------------------
@@ -490,9 +1008,13 @@ inline void InitializeSpinlock( SPINLOCK_ Lock )
 inline B1 AcquireSpinlockOrFail( SPINLOCK_ Lock )
 
 {
-    //                                                  destination      exchange     Comperand
-    LONG PreviouslyLocked = InterlockedCompareExchange( &Lock->Locked,    1,           0 );
-    B1 Acquired = ! PreviouslyLocked;
+    //  The lock is free only when the next ticket is the one being served,
+    //  so take that ticket only if nobody else has taken it first.
+    LONG Serving = Lock->NowServing;
+    //                                          destination          exchange      Comperand
+    LONG Previous = InterlockedCompareExchange( &Lock->NextTicket,    Serving + 1,  Serving );
+    B1 Acquired = Previous == Serving;
+    if ( Acquired ) SpinlockAcquired( Lock, 0 );
     return Acquired;
 }
 
@@ -503,29 +1025,43 @@ inline B1 AcquireSpinlockOrFail( SPINLOCK_ Lock )
 inline void AcquireSpinlock( SPINLOCK_ Lock )
 
 {
+    //  A ticket lock: threads get the lock in the order they asked for it.
+    LONG MyTicket = InterlockedIncrement( &Lock->NextTicket ) - 1;
+    if ( Lock->NowServing == MyTicket )
+    {
+        SpinlockAcquired( Lock, 0 );
+        return;
+    }
+
     InterlockedIncrement( &Lock->NumSpinning );
-    ////Lock->NumSpinning++;
 
-    U8 NumTimesHadToWait = 0;
-    for ( ;; )
+    U8 WaitStartTick = SpinlockTick() | 1;  //  Never zero, which means "did not wait".
+    U4 Backoff       = 1;
+
+    for ( U4 NumLooks = 1 ;; NumLooks++ )
     {
-        //                                                  destination      exchange     Comperand
-        LONG PreviouslyLocked = InterlockedCompareExchange( &Lock->Locked,    1,           0 );
-        if ( ! PreviouslyLocked ) break;
-        NumTimesHadToWait++;
-        //  TODO Do some small useful thing here maybe.
-        if ( ( NumTimesHadToWait & 0xFFFFF ) == 0 )  //  TODO constant
+        LONG NumAhead = MyTicket - Lock->NowServing;
+        if ( NumAhead <= 0 ) break;
+
+        if ( NumLooks < SPINLOCK_SPIN_BUDGET )
+        {
+            //  Back off in proportion to our place in line, so waiters do not all hammer the
+            //  lock's cache line, and back off more each time we look and it is still not ours.
+            U4 NumPauses = min( Backoff * ( U4 ) NumAhead, SPINLOCK_MAX_BACKOFF );
+            for ( U4 i = 0; i < NumPauses; i++ ) YieldProcessor();
+            if ( Backoff < SPINLOCK_MAX_BACKOFF ) Backoff <<= 1;
+        }
+        else
         {
-LogFormatted( "****!!!! Waited %lld times; sleeping 1 ms here  (%d spinning) \n", NumTimesHadToWait, Lock->NumSpinning );  //  TODO
-            SleepForMilliseconds( 1 );
+            //  The holder is taking a while.  Park: sleep if others are ahead of us,
+            //  or just give up the rest of our time slice if we are next.
+            SleepForMilliseconds( NumAhead > 1 ? 1 : 0 );
         }
     }
 
-if ( NumTimesHadToWait )
-LogFormatted( "Had to wait %lld times.\n", NumTimesHadToWait );
-
     InterlockedDecrement( &Lock->NumSpinning );
-    ////Lock->NumSpinning--;
+
+    SpinlockAcquired( Lock, WaitStartTick );
 }
 
 //--------------------------------------------------------------------
@@ -533,7 +1069,15 @@ LogFormatted( "Had to wait %lld times.\n", NumTimesHadToWait );
 inline void ReleaseSpinlock( SPINLOCK_ Lock )
 
 {
-    InterlockedExchange( &Lock->Locked, 0 );  //  Switch the lock to "not locked".
+#if SPINLOCK_STATS == YES
+    U8 HoldTicks = SpinlockTick() - Lock->AcquiredTick;
+    Lock->TotalHoldTicks += HoldTicks;
+    if ( HoldTicks > Lock->MaxHoldTicks ) Lock->MaxHoldTicks = HoldTicks;
+#endif
+
+ASSERT( Lock->NowServing != Lock->NextTicket );  //  Releasing a lock nobody holds.
+
+    InterlockedIncrement( &Lock->NowServing );  //  Hand the lock to the next ticket.
 }
 
 //--------------------------------------------------------------------
@@ -706,38 +1250,57 @@ LogString( "!!!!! Calling MmGetSystemAddressForMdlSafe !!!!!\n" );
 //  Function Prototypes
 //
 
-NTSTATUS DataReallocateFile ( ID, U8 MinimumNewAllocationSize );
-NTSTATUS DataResizeFile     ( ID, U8 NewFileSize, FILL_TYPE );
+NTSTATUS DataReallocateFile ( VCB_, ID, U8 MinimumNewAllocationSize );
+NTSTATUS DataResizeFile     ( VCB_, ID, U8 NewFileSize, FILL_TYPE );
+
+DATA_RANGE_ DataFirstRange ( VCB_, ENTRY_, RANGE_CURSOR_ );
+DATA_RANGE_ DataRangeAt    ( VCB_, ENTRY_, U8 FileOffset, RANGE_CURSOR_ );
+DATA_RANGE_ DataNextRange  ( RANGE_CURSOR_ );
+B1          DataLastRange  ( VCB_, ENTRY_, DATA_RANGE_ Last );
+void        DataSetRangeState ( RANGE_CURSOR_, RANGE_STATE );
+void        DataMarkRangeWritten ( VCB_, ID, U8 FileOffset, U8 VolumeAddress );
+
+NTSTATUS DataZeroFile  ( VCB_, ID, U8 FromOffset, U8 ToOffset );
+NTSTATUS DataFillHoles ( VCB_, ID, U8 Offset, U4 Length );
+NTSTATUS DataTrimFile  ( VCB_, ID, U8 ToNumBytes, U8_ NumBytesTrimmed );
 
 //--------------------------------------------------------------------
 
-ID   MakeEntry   ( ID ParentId, U4 DirectoryOrNumRanges, char* Name );
-void UnmakeEntry ( ID );
-ID   EntryNext   ( ID );
-ID   EntryPrev   ( ID );
-ID   EntryFirst  ( ID );
-ID   EntryLast   ( ID );
-ID   EntryFind   ( ID *rootHandle, S1_ Name );
-ID   EntryNear   ( ID *rootHandle, S1_ Name, NEIGHBOR want );
-void AttachEntry ( ENTRY_ Parent, ENTRY_ Entry );
-void DetachEntry ( ENTRY_ Entry );
+ID   GetID       ( VCB_ );
+void RecycleID   ( VCB_, ID );
+ID   MakeEntry   ( VCB_, ID ParentId, U4 DirectoryOrNumRanges, char* Name );
+void UnmakeEntry ( VCB_, ID );
+ID   EntryNext   ( VCB_, ID );
+ID   EntryPrev   ( VCB_, ID );
+ID   EntryFirst  ( VCB_, ID );
+ID   EntryLast   ( VCB_, ID );
+ID   EntryFind   ( VCB_, ID *rootHandle, S1_ Name );
+ID   EntryNear   ( VCB_, ID *rootHandle, S1_ Name, NEIGHBOR want );
+void AttachEntry ( VCB_, ENTRY_ Parent, ENTRY_ Entry );
+void DetachEntry ( VCB_, ENTRY_ Entry );
+void EntryHotRefresh ( VCB_, ID );
+ID   FindChild   ( VCB_, ID DirectoryId, S1_ Name );
+void ChildIndexFree ( VCB_, ID DirectoryId );
 
 //--------------------------------------------------------------------
 
 FCB_ LookupFcbById ( VCB_, ID );
 
-NTSTATUS FindByPathAndName ( ID StartId, S1_ PathAndName, S1_ *NameOut, ID *ParentIdOut, ID *EntryIdOut );
+NTSTATUS FindByPathAndName ( VCB_, ID StartId, S1_ PathAndName, S1_ *NameOut, ID *ParentIdOut, ID *EntryIdOut );
 
 //--------------------------------------------------------------------
 
 int Utf8StringToWideString                ( S1_ Utf8String, WCHAR * WideString );
+int Utf8CharactersToWideString            ( int NumBytesIn, S1_ Utf8Characters, WCHAR * WideString );
 int WideStringToUtf8String                ( WCHAR * WideString, S1_ Utf8String );
 int WideCharactersToUtf8String            ( int NumBytesIn, WCHAR* WideCharacters, S1_ Utf8String );
 int WidePathAndNameCharactersToUtf8String ( int NumBytesIn, WCHAR* WideCharacters, S1_ Utf8String );
-B1  WildcardCompare                       ( char* pattern, int patternLen, char* string, int stringLen );
-int WideFullPathAndName                   ( ENTRY_ , WCHAR *WidePathAndNameOut );
+int WideFullPathAndName                   ( VCB_, ENTRY_ , WCHAR *WidePathAndNameOut );
 B1  RemoveTrailingNameFromPath            ( S1_ PathAndName );
 
+PATTERN_ PatternCompile ( S1_ NameOrPattern );
+B1       PatternMatch   ( PATTERN_, S1_ Name );
+
 //--------------------------------------------------------------------
 
 U8 DataGetFileNumBytes       ( ENTRY_ );
@@ -745,60 +1308,112 @@ U8 DataGetAllocationNumBytes ( ENTRY_ );
 
 //--------------------------------------------------------------------
 
-NTSTATUS CacheStartup                         ();
-NTSTATUS CacheShutdown                        ();
-U4       CacheFreeSomeCache                   ();
-NTSTATUS CacheReport                          ( S1_ Buffer, int MaxNumBytes );
-U4       CacheBackgroundWriteDirtiestToVolume ();
+NTSTATUS CacheStartup                         ( VCB_ );
+NTSTATUS CacheShutdown                        ( VCB_ );
+U4       CacheFreeSomeCache                   ( VCB_ );
+NTSTATUS CacheReport                          ( VCB_, S1_ Buffer, int MaxNumBytes );
+U4       CacheBackgroundWriteDirtiestToVolume ( VCB_ );
+NTSTATUS WriteBackReport                      ( VCB_, S1_ Buffer, int MaxNumBytes );
 
 NTSTATUS BackgroundThreadStartup  ( VCB_ );
-NTSTATUS BackgroundThreadShutdown ();
-
-NTSTATUS SpaceStartup            ();
-NTSTATUS SpaceShutdown           ();
-NTSTATUS SpaceRequestNumBytes    ( U4 NumBytesRequested, U8 * VolumeAddressResult, U4 * VolumeNumBytesResult );
-NTSTATUS SpaceReturnAddressRange ( U8 ReturnAddress, U4 ReturnNumBytes );
-
-void SleepForMilliseconds ( int NumMilliseconds );
+NTSTATUS BackgroundThreadShutdown ( VCB_ );
+NTSTATUS FlushReport              ( VCB_, S1_ Buffer, int MaxNumBytes );
+void     FailPendingFlushes       ( VCB_, PFILE_OBJECT FileObjectOrZero, NTSTATUS );
+
+void     PreallocationTrim    ( VCB_, FCB_ );
+void     PreallocationTrimAll ( VCB_ );
+NTSTATUS PreallocationReport  ( VCB_, S1_ Buffer, int MaxNumBytes );
+
+void     LaunchNoteCreate    ( VCB_, PIRP, ENTRY_ );
+void     LaunchNoteRead      ( VCB_, PIRP, ENTRY_, U8 FileOffset, U4 NumBytes );
+NTSTATUS LaunchTracesFreeze1 ( VCB_, U1_ *BufferResult, U4_ NumBytesResult );
+NTSTATUS LaunchTracesFreeze2 ( VCB_, U1_ Buffer, U4 NumBytes );
+NTSTATUS LaunchTracesThaw    ( VCB_ );
+void     LaunchTracesShutdown ( VCB_ );
+NTSTATUS LaunchReport        ( VCB_, S1_ Buffer, int MaxNumBytes );
+
+NTSTATUS SpaceStartup            ( VCB_ );
+NTSTATUS SpaceShutdown           ( VCB_ );
+NTSTATUS SpaceRequestNumBytes    ( VCB_, U4 NumBytesRequested, U8 * VolumeAddressResult, U4 * VolumeNumBytesResult );
+NTSTATUS SpaceReturnAddressRange ( VCB_, U8 ReturnAddress, U4 ReturnNumBytes );
+
+void     SleepForMilliseconds ( int NumMilliseconds );
+NTSTATUS SpinlockReport       ( S1_ Buffer, int MaxNumBytes, const char* Name, SPINLOCK_ );
 
 void     DumpRam ( const void* AddressAsVoid, int NumBytes );
 
-NTSTATUS WriteBlockDevice ( PDEVICE_OBJECT, U8 Offset, U4 Length, V_ Buffer, VERIFY );
-NTSTATUS ReadBlockDevice  ( PDEVICE_OBJECT, U8 Offset, U4 Length, V_ Buffer, VERIFY );
+NTSTATUS WriteBlockDevice ( PDEVICE_OBJECT, U8 Offset, U4 Length, V_ Buffer, VERIFY, IO_CLASS );
+NTSTATUS ReadBlockDevice  ( PDEVICE_OBJECT, U8 Offset, U4 Length, V_ Buffer, VERIFY, IO_CLASS );
+NTSTATUS FlushBlockDevice ( PDEVICE_OBJECT );
 
-void FindFirstUncachedRange ( ENTRY_, U8_ A_, U4_ N_ );
-
-//  TODO Bad?
-NTSTATUS CacheRangeMakeWithLock ( U8 VolumeAddress, U1_ B, U4 NumBytes, CLEAN_OR_DIRTY, U4 WithinRangeOffset, U4 WithinRangeNumBytes );
+void     BlockIoTrackDevice   ( BLOCK_IO_ACTIVITY_ );
+void     BlockIoUntrackDevice ( BLOCK_IO_ACTIVITY_ );
+NTSTATUS BlockIoReport        ( S1_ Buffer, int MaxNumBytes, BLOCK_IO_ACTIVITY_ );
 
-NTSTATUS CacheBlindlyThrowAwayAll ();
-NTSTATUS AccessCacheForFile ( ENTRY_, DIRECTION, U1_ CallerBuffer, U8 CallerFileOffset, U4 CallerNumBytes );
+NTSTATUS WriteBlockDeviceVector ( PDEVICE_OBJECT, BLOCK_IO_SEGMENT_ Segments, U4 NumSegments, VERIFY, IO_CLASS );
+NTSTATUS ReadBlockDeviceVector  ( PDEVICE_OBJECT, BLOCK_IO_SEGMENT_ Segments, U4 NumSegments, VERIFY, IO_CLASS );
 
-NTSTATUS DataReadFromFile ( ENTRY_, U8 Offset, U4 Length, U1_ BufferOut );
-NTSTATUS DataWriteToFile  ( ENTRY_, U8 Offset, U4 Length, U1_ BufferIn  );
+U4 FindUncachedRanges ( VCB_, ENTRY_, BLOCK_IO_SEGMENT_ Segments, U4 MaxNumSegments );
 
-NTSTATUS ResizeEntry ( ID Id, S1_ NewNameOrZero, S4 DeltaToNumRanges );
-
-NTSTATUS EntriesStartupEmpty ( U4 RequestedNumBytes );
-NTSTATUS EntriesShutdown     ();
-NTSTATUS EntriesFreeze       ( V_ Buffer, U4 NumBytes );
-NTSTATUS EntriesThaw         ();
-ENTRY_   EntriesAllocate     ( U4 NumBytesToAllocate );
-void     EntriesFree         ( ENTRY_ );
-void     EntriesCompact      ();
-
-NTSTATUS WhereTableStartupEmpty ( U4 RequestedNumBytes );
-NTSTATUS WhereTableShutdown     ();
-
-NTSTATUS OverviewFreeze1 ();
-NTSTATUS OverviewFreeze2 ();
-NTSTATUS OverviewThaw    ();
+//  TODO Bad?
+NTSTATUS CacheRangeMakeWithLock ( VCB_, ID, U8 VolumeAddress, U1_ B, U4 NumBytes, CLEAN_OR_DIRTY, U4 WithinRangeOffset, U4 WithinRangeNumBytes );
+NTSTATUS CacheRangeAdoptWithLock ( VCB_, ID, U8 VolumeAddress, U1_ MemoryAddress, U4 NumBytes, CLEAN_OR_DIRTY, U4 DirectWriteSequence );
+
+U1_  CacheMemoryAllocateWithLock ( VCB_, U4 NumBytes, U4_ DirectWriteSequence );
+void CacheMemoryFreeWithLock     ( VCB_, U1_ MemoryAddress, U4 NumBytes );
+
+NTSTATUS CacheBlindlyThrowAwayAll ( VCB_ );
+NTSTATUS CacheFlushFile ( VCB_, ID );
+NTSTATUS CacheFlushAll  ( VCB_ );
+NTSTATUS CacheManifestFreeze1 ( VCB_, U1_ *BufferResult, U4_ NumBytesResult );
+NTSTATUS CacheManifestFreeze2 ( VCB_, U1_ Buffer, U4 NumBytes );
+NTSTATUS CacheManifestThaw    ( VCB_ );
+B1       CachePrefetchFromManifest ( VCB_, B1 UrgentOnly );
+void     CachePrefetchFirst ( VCB_, MANIFEST_RECORD_ Records, U4 NumRecords );
+void     CachePurgeFile ( VCB_, ID );
+void     CachePurgeRange ( VCB_, ID, U8 VolumeAddress );
+B1       CacheTrimRange  ( VCB_, U8 VolumeAddress, U4 NumBytes );
+U4       CacheEvictFile ( VCB_, ID );
+NTSTATUS AccessCacheForFile ( VCB_, ENTRY_, DIRECTION, U1_ CallerBuffer, U8 CallerFileOffset, U4 CallerNumBytes );
+NTSTATUS AccessVolumeForFile( VCB_, ENTRY_, DIRECTION, U1_ CallerBuffer, U8 CallerFileOffset, U4 CallerNumBytes );
+
+NTSTATUS DataReadFromFile ( VCB_, ENTRY_, U8 Offset, U4 Length, U1_ BufferOut );
+NTSTATUS DataWriteToFile  ( VCB_, ENTRY_, U8 Offset, U4 Length, U1_ BufferIn  );
+
+NTSTATUS ResizeEntry ( VCB_, ID Id, S1_ NewNameOrZero, S4 DeltaToNumRanges, S4 DeltaToNumRangeBytes );
+NTSTATUS ResizeEntryInlineData ( VCB_, ID Id, U4 NewNumBytes );
+NTSTATUS EntriesSelfTest       ( VCB_, S1_ Buffer, int MaxNumBytes );
+
+NTSTATUS EntriesStartupEmpty ( VCB_, U4 RequestedNumBytes );
+NTSTATUS EntriesShutdown     ( VCB_ );
+NTSTATUS EntriesFreeze       ( VCB_, U1_ Buffer, U4 FromByte, U4 NumBytes );
+NTSTATUS EntriesThaw         ( VCB_ );
+ENTRY_   EntriesAllocate     ( VCB_, U4 NumBytesToAllocate );
+void     EntriesFree         ( VCB_, ENTRY_ );
+void     EntriesFreeBytes    ( VCB_, U1_ Address, U4 NumBytes );
+B1       EntriesShedBytes    ( VCB_, U1_ Address, U4 NumBytes );
+NTSTATUS EntriesCheck        ( VCB_ );
+B1       EntriesClaimBytes   ( VCB_, U1_ Address, U4 NumBytes );
+NTSTATUS EntriesReport       ( VCB_, S1_ Buffer, int MaxNumBytes );
+void     EntriesCompact      ( VCB_ );
+B1       EntriesCompactSlice ( VCB_ );
+
+NTSTATUS WhereTableStartupEmpty ( VCB_ );
+NTSTATUS WhereTableShutdown     ( VCB_ );
+ID       WhereTableTakeId       ( VCB_ );
+void     WhereTableGiveBackId   ( VCB_, ID );
+NTSTATUS WhereTableReport       ( VCB_, S1_ Buffer, int MaxNumBytes );
+
+NTSTATUS OverviewFreeze1 ( VCB_, U1_ Buffer );
+NTSTATUS OverviewFreeze2 ( VCB_, U1_ Buffer );
+NTSTATUS OverviewThaw    ( VCB_ );
+NTSTATUS OverviewCheckFormat ( VCB_ );
 
 U4 EntrySize ( ENTRY_ );
 
-NTSTATUS SpaceBuildFromEntries ();
+NTSTATUS SpaceBuildFromEntries ( VCB_ );
 
-void ZeroVolumeGlobals ();
+void ZeroDriverGlobals ();
 
 NTSTATUS Dispatch ( PDEVICE_OBJECT , PIRP );
 NTSTATUS IrpMj                       ( ICB_ );
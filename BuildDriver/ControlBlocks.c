@@ -26,6 +26,7 @@ ICB_  MakeIcb( PDEVICE_OBJECT DeviceObject, PIRP Irp )
 
     Icb->Irp               = Irp;
     Icb->DeviceObject      = DeviceObject;
+    Icb->Vcb               = ( DeviceObject == Volume_TailwindDeviceObject ) ? 0 : DeviceObject->DeviceExtension;
     Icb->DoCompleteRequest = TRUE;  //  Default to the normal case.
 
     return Icb;
@@ -87,6 +88,8 @@ VCB_ MakeVcb(  ICB_ Icb, PDEVICE_OBJECT VolumeDeviceObject, PDEVICE_OBJECT Physi
     Vcb->VolumeDeviceObject   = VolumeDeviceObject;
     Vcb->PhysicalDeviceObject = PhysicalDeviceObject;
 
+    InitializeSpinlock( &Vcb->MetadataLock );
+
     return Vcb;
 }
 
@@ -99,6 +102,8 @@ void  UnmakeVcb( VCB_ Vcb )
 
     FreeMemory( Vcb->FirstBlock );
 
+    UninitializeSpinlock( &Vcb->MetadataLock );
+
     IoDeleteDevice( Vcb->VolumeDeviceObject );
 }
 
@@ -120,6 +125,7 @@ CCB_ MakeCcb()
 void UnmakeCcb( CCB_ Ccb )
 
 {
+    if ( Ccb->Pattern ) FreeMemory( Ccb->Pattern );
     FreeMemory( Ccb );
 }
 
@@ -108,10 +108,10 @@ LogString( "funny little OpenTargetDirectory\n" );
         ID ParentId;
         ID EntryId;
         char* Name;
-        Status = FindByPathAndName( AncestorId, PathAndName, &Name, &ParentId, &EntryId );
+        Status = FindByPathAndName( Vcb, AncestorId, PathAndName, &Name, &ParentId, &EntryId );
         if ( Status && Status != STATUS_OBJECT_NAME_NOT_FOUND ) break;
 ASSERT( ParentId );
-        ENTRY_ Entry       = Entries[EntryId];
+        ENTRY_ Entry       = EntryForId( Vcb, EntryId );
 ASSERT( ( ! Entry ) == ( Status == STATUS_OBJECT_NAME_NOT_FOUND ) );
 
 
@@ -156,14 +156,14 @@ AlwaysBreakToDebugger();  //  eb eip 0x90
 
 //LogString( "Creating the Entry.\n" );
             U4 DirectoryOrNumRanges = MakingANewDirectory ? A_DIRECTORY : 0;
-            EntryId = MakeEntry( ParentId, DirectoryOrNumRanges, Name );
+            EntryId = MakeEntry( Vcb, ParentId, DirectoryOrNumRanges, Name );
 
             if ( ! EntryId )
             {
                 Status = STATUS_INSUFFICIENT_RESOURCES;
                 break;
             }
-            Entry = Entries[EntryId];
+            Entry = EntryForId( Vcb, EntryId );
 
 LogMarker();
 
@@ -193,8 +193,8 @@ LogFormatted( "Requesting an initial allocation of %d bytes.\n", ( int ) Initial
 
                     //  Don't set Entry->FileSize here, right??? TODO
                     ID Id = Entry->Id;
-                    Status = DataReallocateFile( Id, InitialAllocationSize );
-                    Entry = Entries[Id];
+                    Status = DataReallocateFile( Vcb, Id, InitialAllocationSize );
+                    Entry = EntryForId( Vcb, Id );
                     if ( Status ) break;
 
                 }
@@ -237,9 +237,9 @@ LogFormatted( "We have an Entry.  Entry->FileAttributes = $%X.\n", Entry->FileAt
         if ( it == FILE_SUPERSEDE || it == FILE_OVERWRITE || it == FILE_OVERWRITE_IF )
         {
             ID Id = Entry->Id;
-            NTSTATUS xxxxxx = DataResizeFile( Id, 0, ZERO_FILL );  //  TODO difference between SUPERSEDE & OVERWRITE??
+            NTSTATUS xxxxxx = DataResizeFile( Vcb, Id, 0, ZERO_FILL );  //  TODO difference between SUPERSEDE & OVERWRITE??
 ASSERT( ! xxxxxx );
-            Entry = Entries[Id];
+            Entry = EntryForId( Vcb, Id );
         }
 
         if ( DeleteOnClose )
@@ -275,6 +275,10 @@ If I build it set to &( Fcb->SectionObjectPointers ) , I currently hang.
 
         FileObject->Vpb = Vcb->Vpb;
 
+#if LAUNCH_TRACES == YES
+        LaunchNoteCreate( Vcb, Irp, Entry );
+#endif
+
         Status = STATUS_SUCCESS;
 
 LogFormatted( "FcbReferences: %d  NumReferences: %d  NumOpenHandles: %d\n",
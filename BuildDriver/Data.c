@@ -19,9 +19,9 @@
 //////////////////////////////////////////////////////////////////////
 /*
 
-Based on "EXTRA/Info/Analysis of the periodic update write policy...", we
-should maybe have code that does a writethrough if the drive is not busy,
-instead of waiting for a lull with the background thread.
+Based on "EXTRA/Info/Analysis of the periodic update write policy...", dirty
+data is written back at once while the drive is not busy, instead of waiting
+for a lull with the background thread; see the write-back policy in Cache.c.
 
 */
 //////////////////////////////////////////////////////////////////////
@@ -30,64 +30,717 @@ instead of waiting for a lull with the background thread.
     //....NextProxyAddress = ( U8 ) 0x8000000000001000LL;  //  Starting at high bit on plus 4096.
 
 //////////////////////////////////////////////////////////////////////
+//
+//  Packed Data Ranges
+//
+//  Ranges are packed in block units, as a varint number of blocks and state then, unless
+//  it is a hole, a zigzagged varint gap from where the range before ends; see FILE_DATA.
+//
+
+//--------------------------------------------------------------------
 
-NTSTATUS addADataRange( ID Id, U4 NumBytesRequested, U4_ NumBytesResult )
+inline U1_ varintPut( U1_ P, U8 Value )
 
 {
-    ENTRY_     OldEntry     = Entries[Id];
-    FILE_DATA_ OldFileData  = Data( OldEntry );
-    U4         OldNumRanges = OldFileData->NumRanges;
+    while ( Value >= 0x80 )
+    {
+        *P++ = ( U1 ) ( Value | 0x80 );
+        Value >>= 7;
+    }
+    *P++ = ( U1 ) Value;
+    return P;
+}
 
-    NTSTATUS Status = ResizeEntry( Id, 0, +1 );
-    if( Status ) return Status;
+//--------------------------------------------------------------------
+
+inline U1_ varintGet( U1_ P, U8_ Value )
+
+{
+    //  Most block counts and gaps fit in one byte.
+    if ( *P < 0x80 )
+    {
+        *Value = *P;
+        return P + 1;
+    }
 
-    ENTRY_     NewEntry     = Entries[Id];
-    FILE_DATA_ NewFileData  = Data( NewEntry );
+    U8 V = 0;
+    for ( int Shift = 0; ; Shift += 7 )
+    {
+        U1 Byte = *P++;
+        V |= ( U8 ) ( Byte & 0x7F ) << Shift;
+        if ( Byte < 0x80 ) break;
+    }
+    *Value = V;
+    return P;
+}
+
+//--------------------------------------------------------------------
+
+static U1_ rangePack( U1_ P, DATA_RANGE_ Range, U8_ LastEnd )
+
+{
+    U8 Start     = Range->VolumeAddress / Volume_BlockSize;
+    U8 NumBlocks = Range->NumBytes      / Volume_BlockSize;
+    S8 Gap       = ( S8 ) ( Start - *LastEnd );
 
+    P = varintPut( P, NumBlocks << 2 | ( U8 ) Range->State );
+    if ( Range->State == RANGE_HOLE ) return P;
+
+    P = varintPut( P, ( ( U8 ) Gap << 1 ) ^ ( U8 ) ( Gap >> 63 ) );
+    *LastEnd = Start + NumBlocks;
+    return P;
+}
+
+//--------------------------------------------------------------------
+
+static U1_ rangeUnpack( U1_ P, DATA_RANGE_ Range, U8_ LastEnd )
+
+{
+    U8 NumBlocksAndState;
+    U8 Zigzag;
+    P = varintGet( P, &NumBlocksAndState );
 
+    U8 NumBlocks = NumBlocksAndState >> 2;
+    Range->State = ( RANGE_STATE ) ( NumBlocksAndState & 3 );
+    if ( Range->State == RANGE_HOLE )
+    {
+        Range->VolumeAddress = 0;
+        Range->NumBytes      = ( U4 ) ( NumBlocks * Volume_BlockSize );
+        return P;
+    }
+
+    P = varintGet( P, &Zigzag );
+
+    U8 Start = *LastEnd + ( ( Zigzag >> 1 ) ^ ( 0 - ( Zigzag & 1 ) ) );
+    Range->VolumeAddress = Start     * Volume_BlockSize;
+    Range->NumBytes      = ( U4 ) ( NumBlocks * Volume_BlockSize );
+    *LastEnd = Start + NumBlocks;
+    return P;
+}
+
+//--------------------------------------------------------------------
+//
+//  Where the last range ends, in blocks; the next one is packed from here.
+
+static U8 rangesEnd( U1_ P, U1_ End )
+
+{
+    U8 LastEnd = 0;
+    while ( P < End )
+    {
+        DATA_RANGE Range;
+        P = rangeUnpack( P, &Range, &LastEnd );
+    }
+    return LastEnd;
+}
+
+//--------------------------------------------------------------------
+//
+//  Unpack through to the last range; return where it is packed, and where the one before it ends.
+
+static U1_ rangesUnpackLast( U1_ P, U1_ End, DATA_RANGE_ Last, U8_ EndBefore )
+
+{
+    U8  LastEnd = 0;
+    U1_ LastAt  = P;
+    while ( P < End )
+    {
+        *EndBefore = LastEnd;
+        LastAt     = P;
+        P = rangeUnpack( P, Last, &LastEnd );
+    }
+    return LastAt;
+}
+
+//////////////////////////////////////////////////////////////////////
+//
+//  Extent Trees
+//
+
+//--------------------------------------------------------------------
+
+inline EXTENT_NODE_ extentNode( VCB_ Vcb, ID Id )
+
+{
+    ENTRY_ Entry = EntryForId( Vcb, Id );
+ASSERT( EntryIsAnExtentNode( Entry ) );
+
+    return ( EXTENT_NODE_ ) ( ( U1_ ) Entry + offsetof( ENTRY, Name ) + 1 );
+}
+
+//--------------------------------------------------------------------
+
+static ID extentNodeMake( VCB_ Vcb, U2 Height )
+
+{
+    ENTRY_ Entry = EntriesAllocate( Vcb, ( U4 ) ( offsetof( ENTRY, Name ) + 1 + sizeof( EXTENT_NODE ) ) );
+    if ( ! Entry ) return 0;
+
+    ID Id = GetID( Vcb );
+    if ( ! Id )
+    {
+        EntriesFree( Vcb, Entry );
+        return 0;
+    }
+
+    //  EntriesAllocate zeroed it, so the name is empty and the node has no items.
+    Entry->Id       = Id;
+    Entry->ParentId = EXTENT_NODE_PARENT_ID;
+    *EntryForId_( Vcb, Id ) = Entry;
+    extentNode( Vcb, Id )->Height = Height;
+
+    return Id;
+}
+
+//--------------------------------------------------------------------
+
+static void extentNodeUnmake( VCB_ Vcb, ID Id )
+
+{
+    EntriesFree( Vcb, EntryForId( Vcb, Id ) );
+    RecycleID( Vcb, Id );
+}
+
+//--------------------------------------------------------------------
+
+static U8 extentNodeNumBytes( EXTENT_NODE_ Node )
+
+{
+    U8 NumBytes = 0;
+    if ( Node->Height )
+    {
+        for ( U4 i = 0; i < Node->NumItems; i++ ) NumBytes += Node->Child[i].NumBytes;
+        return NumBytes;
+    }
+
+    U8 LastEnd = 0;
+    for ( U1_ P = Node->RangeBytes; P < Node->RangeBytes + Node->NumRangeBytes; )
+    {
+        DATA_RANGE Range;
+        P = rangeUnpack( P, &Range, &LastEnd );
+        NumBytes += Range.NumBytes;
+    }
+    return NumBytes;
+}
+
+//--------------------------------------------------------------------
+//
+//  A leaf is full when a range might not fit, so checking never needs to pack one.
+
+inline B1 extentLeafIsFull( EXTENT_NODE_ Leaf )
+
+{
+    return Leaf->NumRangeBytes + RANGE_MAX_PACKED_NUM_BYTES > EXTENT_LEAF_NUM_BYTES;
+}
+
+//--------------------------------------------------------------------
+
+static void extentLeafAdd( EXTENT_NODE_ Leaf, DATA_RANGE_ Range )
+
+{
+    U1_ P = rangePack( Leaf->RangeBytes + Leaf->NumRangeBytes, Range, &Leaf->LastEnd );
+    Leaf->NumRangeBytes = ( U2 ) ( P - Leaf->RangeBytes );
+    Leaf->NumItems++;
+}
+
+//--------------------------------------------------------------------
+//
+//  Fill Path with the nodes down the right edge of the tree; Path[0] is the last leaf.
+
+static int extentTreeRightEdge( VCB_ Vcb, ID RootId, ID Path[EXTENT_TREE_MAX_HEIGHT] )
+
+{
+    int Height = extentNode( Vcb, RootId )->Height;
+    ID  NodeId = RootId;
+    for ( int h = Height; ; h-- )
+    {
+        Path[h] = NodeId;
+        if ( h == 0 ) break;
+        EXTENT_NODE_ Node = extentNode( Vcb, NodeId );
+        NodeId = Node->Child[ Node->NumItems - 1 ].ChildId;
+    }
+    return Height;
+}
+
+//--------------------------------------------------------------------
+//
+//  Move a file's inline ranges into a new one leaf tree.
+
+static NTSTATUS extentTreeMake( VCB_ Vcb, ID Id )
+
+{
+    ID LeafId = extentNodeMake( Vcb, 0 );
+    if ( ! LeafId ) return STATUS_INSUFFICIENT_RESOURCES;
+
+    FILE_DATA_   FileData  = Data( EntryForId( Vcb, Id ) );
+    EXTENT_NODE_ Leaf      = extentNode( Vcb, LeafId );
+    U4           NumRanges = FileData->NumRanges;
+    U4           NumBytes  = FileData->NumRangeBytes;
+ASSERT( NumBytes <= EXTENT_LEAF_NUM_BYTES );
+
+    //  Both are packed from zero, so the bytes move as they are.
+    memcpy( Leaf->RangeBytes, FileData->RangeBytes, NumBytes );
+    Leaf->LastEnd       = rangesEnd( Leaf->RangeBytes, Leaf->RangeBytes + NumBytes );
+    Leaf->NumRangeBytes = ( U2 ) NumBytes;
+    Leaf->NumItems      = ( U2 ) NumRanges;
+    FileData->ExtentTreeId = LeafId;
+
+    //  Shedding ranges never moves the entry.
+    return ResizeEntry( Vcb, Id, 0, - ( S4 ) NumRanges, - ( S4 ) NumBytes );
+}
+
+//--------------------------------------------------------------------
+//
+//  Add a range after the last one; only touches the right edge of the tree.
+
+static NTSTATUS extentTreeAppend( VCB_ Vcb, ID Id, DATA_RANGE Range )
+
+{
+    ID Path[EXTENT_TREE_MAX_HEIGHT];
+    int Height = extentTreeRightEdge( Vcb, Data( EntryForId( Vcb, Id ) )->ExtentTreeId, Path );
+
+    //  The lowest level with room takes it; every full level below it gets a new node.
+    int Level = 0;
+    if ( extentLeafIsFull( extentNode( Vcb, Path[0] ) ) )
+    {
+        do Level++; while ( Level <= Height && extentNode( Vcb, Path[Level] )->NumItems == EXTENT_NODE_NUM_ITEMS );
+    }
+    if ( Level == EXTENT_TREE_MAX_HEIGHT ) return STATUS_INSUFFICIENT_RESOURCES;
+
+    //  Make all the new nodes first, so we can back out cleanly.
+    int NumNewNodes = Level + ( Level > Height ? 1 : 0 );  //  Maybe a new root too.
+    ID NewIds[EXTENT_TREE_MAX_HEIGHT + 1];
+    for ( int n = 0; n < NumNewNodes; n++ )
+    {
+        NewIds[n] = extentNodeMake( Vcb, ( U2 ) n );
+        if ( ! NewIds[n] )
+        {
+            while ( n-- ) extentNodeUnmake( Vcb, NewIds[n] );
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+    }
+
+    if ( Level == 0 )
+    {
+        //  The last leaf has room.
+        extentLeafAdd( extentNode( Vcb, Path[0] ), &Range );
+    }
+    else
+    {
+        //  Start a new right edge below Level, holding just this range.
+        extentLeafAdd( extentNode( Vcb, NewIds[0] ), &Range );
+        extentNode( Vcb, Path[0] )->NextLeafId = NewIds[0];
+
+        for ( int h = 1; h < Level; h++ )
+        {
+            EXTENT_NODE_ Node = extentNode( Vcb, NewIds[h] );
+            Node->Child[0].NumBytes = Range.NumBytes;
+            Node->Child[0].ChildId  = NewIds[h - 1];
+            Node->NumItems = 1;
+        }
+
+        if ( Level <= Height )
+        {
+            EXTENT_NODE_ Node = extentNode( Vcb, Path[Level] );
+            Node->Child[ Node->NumItems ].NumBytes = Range.NumBytes;
+            Node->Child[ Node->NumItems ].ChildId  = NewIds[Level - 1];
+            Node->NumItems++;
+        }
+        else
+        {
+            //  The whole right edge was full, so the tree grows a new root.
+            FILE_DATA_   FileData = Data( EntryForId( Vcb, Id ) );
+            EXTENT_NODE_ Root     = extentNode( Vcb, NewIds[Level] );
+            Root->Child[0].NumBytes = extentNodeNumBytes( extentNode( Vcb, FileData->ExtentTreeId ) );
+            Root->Child[0].ChildId  = FileData->ExtentTreeId;
+            Root->Child[1].NumBytes = Range.NumBytes;
+            Root->Child[1].ChildId  = NewIds[Level - 1];
+            Root->NumItems = 2;
+            FileData->ExtentTreeId = NewIds[Level];
+            return 0;
+        }
+    }
+
+    //  Count the range's bytes in the old interior nodes above.
+    for ( int h = max( Level, 1 ) + ( Level ? 1 : 0 ); h <= Height; h++ )
+    {
+        EXTENT_NODE_ Node = extentNode( Vcb, Path[h] );
+        Node->Child[ Node->NumItems - 1 ].NumBytes += Range.NumBytes;
+    }
+
+    return 0;
+}
+
+//--------------------------------------------------------------------
+//
+//  Remove the last range, freeing any nodes left empty. If the tree empties, it is gone.
+
+static void extentTreeRemoveLast( VCB_ Vcb, ID Id, DATA_RANGE_ Removed )
+
+{
+    ID Path[EXTENT_TREE_MAX_HEIGHT];
+    FILE_DATA_ FileData = Data( EntryForId( Vcb, Id ) );
+    int Height = extentTreeRightEdge( Vcb, FileData->ExtentTreeId, Path );
+
+    EXTENT_NODE_ Leaf   = extentNode( Vcb, Path[0] );
+    U1_          LastAt = rangesUnpackLast( Leaf->RangeBytes, Leaf->RangeBytes + Leaf->NumRangeBytes, Removed, &Leaf->LastEnd );
+    Zero( LastAt, Leaf->NumRangeBytes - ( U4 ) ( LastAt - Leaf->RangeBytes ) );
+    Leaf->NumRangeBytes = ( U2 ) ( LastAt - Leaf->RangeBytes );
+    Leaf->NumItems--;
+    for ( int h = 1; h <= Height; h++ )
+    {
+        EXTENT_NODE_ Node = extentNode( Vcb, Path[h] );
+        Node->Child[ Node->NumItems - 1 ].NumBytes -= Removed->NumBytes;
+    }
+
+    //  Free the nodes that are now empty, from the bottom up.
+    int h = 0;
+    while ( h <= Height && extentNode( Vcb, Path[h] )->NumItems == 0 )
+    {
+        extentNodeUnmake( Vcb, Path[h] );
+        h++;
+        if ( h <= Height ) extentNode( Vcb, Path[h] )->NumItems--;
+    }
+    if ( h > Height )
+    {
+        FileData->ExtentTreeId = 0;
+        return;
+    }
+
+    //  A root with just one child is not needed.
+    ID RootId = FileData->ExtentTreeId;
+    while ( extentNode( Vcb, RootId )->Height && extentNode( Vcb, RootId )->NumItems == 1 )
+    {
+        ID ChildId = extentNode( Vcb, RootId )->Child[0].ChildId;
+        extentNodeUnmake( Vcb, RootId );
+        RootId = ChildId;
+    }
+    FileData->ExtentTreeId = RootId;
+
+    //  If we freed the last leaf, the one before it is last now.
+    if ( h )
+    {
+        extentTreeRightEdge( Vcb, RootId, Path );
+        extentNode( Vcb, Path[0] )->NextLeafId = 0;
+    }
+}
+
+//--------------------------------------------------------------------
+
+static void rangeCursorLoad( RANGE_CURSOR_ Cursor, U1_ Bytes, U4 NumBytes, ID NextLeafId )
+
+{
+    Cursor->Next       = Bytes;
+    Cursor->End        = Bytes + NumBytes;
+    Cursor->LastEnd    = 0;
+    Cursor->NextLeafId = NextLeafId;
+}
+
+//--------------------------------------------------------------------
+//
+//  Unpack the next range into the cursor, moving on to the next leaf when needed.
+
+static DATA_RANGE_ rangeCursorStep( RANGE_CURSOR_ Cursor )
+
+{
+    if ( Cursor->Next == Cursor->End )
+    {
+        if ( ! Cursor->NextLeafId ) return 0;
+
+        EXTENT_NODE_ Leaf = extentNode( Cursor->Vcb, Cursor->NextLeafId );
+        rangeCursorLoad( Cursor, Leaf->RangeBytes, Leaf->NumRangeBytes, Leaf->NextLeafId );
+    }
+
+    Cursor->At   = Cursor->Next;
+    Cursor->Next = rangeUnpack( Cursor->Next, &Cursor->Range, &Cursor->LastEnd );
+    return &Cursor->Range;
+}
+
+//////////////////////////////////////////////////////////////////////
+//
+//  The range holding FileOffset, or zero if it is past the end. Follow with DataNextRange.
+//  The range returned is unpacked into the cursor, so it is only good until the next call.
+
+DATA_RANGE_ DataRangeAt( VCB_ Vcb, ENTRY_ Entry, U8 FileOffset, RANGE_CURSOR_ Cursor )
+
+{
+    FILE_DATA_  FileData = Data( Entry );
+    U8          At = 0;
+
+    Cursor->Vcb = Vcb;
+
+    if ( ! FileData->ExtentTreeId )
+    {
+        rangeCursorLoad( Cursor, FileData->RangeBytes, FileData->NumRangeBytes, 0 );
+    }
+    else
+    {
+        EXTENT_NODE_ Node = extentNode( Vcb, FileData->ExtentTreeId );
+        while ( Node->Height )
+        {
+            U4 i = 0;
+            while ( i + 1 < Node->NumItems && At + Node->Child[i].NumBytes <= FileOffset ) At += Node->Child[i++].NumBytes;
+            Node = extentNode( Vcb, Node->Child[i].ChildId );
+        }
+        rangeCursorLoad( Cursor, Node->RangeBytes, Node->NumRangeBytes, Node->NextLeafId );
+    }
+
+    for ( DATA_RANGE_ Range = rangeCursorStep( Cursor ); Range; Range = rangeCursorStep( Cursor ) )
+    {
+        if ( At + Range->NumBytes > FileOffset )
+        {
+            Cursor->FileOffset = At;
+            return Range;
+        }
+        At += Range->NumBytes;
+    }
+
+    return 0;
+}
+
+//////////////////////////////////////////////////////////////////////
+
+DATA_RANGE_ DataFirstRange( VCB_ Vcb, ENTRY_ Entry, RANGE_CURSOR_ Cursor )
+
+{
+    return DataRangeAt( Vcb, Entry, 0, Cursor );
+}
+
+//////////////////////////////////////////////////////////////////////
+
+DATA_RANGE_ DataNextRange( RANGE_CURSOR_ Cursor )
+
+{
+    Cursor->FileOffset += Cursor->Range.NumBytes;
+    return rangeCursorStep( Cursor );
+}
+
+//////////////////////////////////////////////////////////////////////
+
+B1 DataLastRange( VCB_ Vcb, ENTRY_ Entry, DATA_RANGE_ Last )
+
+{
+    FILE_DATA_ FileData = Data( Entry );
+    U1_        Bytes    = FileData->RangeBytes;
+    U4         NumBytes = FileData->NumRangeBytes;
+
+    if ( FileData->ExtentTreeId )
+    {
+        ID Path[EXTENT_TREE_MAX_HEIGHT];
+        extentTreeRightEdge( Vcb, FileData->ExtentTreeId, Path );
+        EXTENT_NODE_ Leaf = extentNode( Vcb, Path[0] );
+        Bytes    = Leaf->RangeBytes;
+        NumBytes = Leaf->NumRangeBytes;
+    }
+    if ( ! NumBytes ) return FALSE;
+
+    U8 EndBefore;
+    rangesUnpackLast( Bytes, Bytes + NumBytes, Last, &EndBefore );
+    return TRUE;
+}
+
+//////////////////////////////////////////////////////////////////////
+//
+//  Change the current range of the cursor between written and unwritten. The state is in the
+//  low bits of its first packed byte, so it changes in place. Call with the metadata lock held.
+
+void DataSetRangeState( RANGE_CURSOR_ Cursor, RANGE_STATE State )
+
+{
+ASSERT( Cursor->Range.State != RANGE_HOLE && State != RANGE_HOLE );
+
+    *Cursor->At = ( U1 ) ( ( *Cursor->At & ~3 ) | State );
+    Cursor->Range.State = State;
+}
+
+//////////////////////////////////////////////////////////////////////
+//
+//  Write-back has put a dirty cache range of an unwritten range on the volume, so the range
+//  is written now. Unless, meanwhile, it stopped being the file's. Call with the metadata lock held.
+
+void DataMarkRangeWritten( VCB_ Vcb, ID Id, U8 FileOffset, U8 VolumeAddress )
+
+{
+    ENTRY_ Entry = EntryForId( Vcb, Id );
+    if ( ! Entry || EntryIsADirectory( Entry ) || EntryIsAnExtentNode( Entry ) || DataIsInline( Data( Entry ) ) ) return;
+
+    RANGE_CURSOR Cursor;
+    DATA_RANGE_  Range = DataRangeAt( Vcb, Entry, FileOffset, &Cursor );
+    if ( ! Range || Cursor.FileOffset != FileOffset || Range->VolumeAddress != VolumeAddress ) return;
+
+    if ( Range->State == RANGE_UNWRITTEN ) DataSetRangeState( &Cursor, RANGE_WRITTEN );
+}
+
+//--------------------------------------------------------------------
+//
+//  Add a range after the last one, in the entry or in the extent tree.
+
+static NTSTATUS dataAppendRange( VCB_ Vcb, ID Id, DATA_RANGE Range )
+
+{
+    FILE_DATA_ FileData = Data( EntryForId( Vcb, Id ) );
+    B1         Inline   = ! FileData->ExtentTreeId && FileData->NumRanges < EXTENTS_MAX_INLINE;
+    NTSTATUS   Status;
+
+    if ( ! Inline && ! FileData->ExtentTreeId )
+    {
+        Status = extentTreeMake( Vcb, Id );
+        if( Status ) return Status;
+    }
+
+    if ( ! Inline ) return extentTreeAppend( Vcb, Id, Range );
+
+    //  We need the range before we know how many bytes it packs into.
+    U8 LastEnd  = rangesEnd( FileData->RangeBytes, FileData->RangeBytes + FileData->NumRangeBytes );
+    U1 Packed[RANGE_MAX_PACKED_NUM_BYTES];
+    U4 NumPacked = ( U4 ) ( rangePack( Packed, &Range, &LastEnd ) - Packed );
+
+    Status = ResizeEntry( Vcb, Id, 0, +1, ( S4 ) NumPacked );
+    if ( Status ) return Status;
+
+    FileData = Data( EntryForId( Vcb, Id ) );
+    memcpy( FileData->RangeBytes + FileData->NumRangeBytes - NumPacked, Packed, NumPacked );
+
+    return 0;
+}
+
+//--------------------------------------------------------------------
+//
+//  Remove the last range, from the entry or from the extent tree.
+
+static NTSTATUS dataRemoveLastRange( VCB_ Vcb, ID Id, DATA_RANGE_ Removed )
+
+{
+    FILE_DATA_ FileData = Data( EntryForId( Vcb, Id ) );
+
+    if ( FileData->ExtentTreeId )
+    {
+        extentTreeRemoveLast( Vcb, Id, Removed );
+        return 0;
+    }
+
+ASSERT( FileData->NumRanges );
+    U1_ End = FileData->RangeBytes + FileData->NumRangeBytes;
+    U8  EndBefore;
+    U1_ LastAt = rangesUnpackLast( FileData->RangeBytes, End, Removed, &EndBefore );
+
+    return ResizeEntry( Vcb, Id, 0, -1, - ( S4 ) ( End - LastAt ) );
+}
+
+//--------------------------------------------------------------------
+//
+//  Put the NumWith ranges With, as many bytes in all, in place of the range holding FileOffset.
+//  Ranges only come and go at the end, so the ones after it come off and go back on. It is all
+//  or nothing: on failure the ranges are put back as they were. *NumWithIn says how many of
+//  With are in the file on return; only if putting back fails too is that not all or none.
+
+static NTSTATUS dataReplaceRange( VCB_ Vcb, ID Id, U8 FileOffset, DATA_RANGE_ With, U4 NumWith, U4_ NumWithIn )
+
+{
+    RANGE_CURSOR Cursor;
+    U4           NumTaken = 0;
+
+    *NumWithIn = 0;
+    for ( DATA_RANGE_ Range = DataRangeAt( Vcb, EntryForId( Vcb, Id ), FileOffset, &Cursor ); Range; Range = DataNextRange( &Cursor ) ) NumTaken++;
+    if ( ! NumTaken ) return STATUS_INVALID_PARAMETER;
+
+    DATA_RANGE_ Taken = AllocateMemory( NumTaken * sizeof( DATA_RANGE ) );
+    if ( ! Taken ) return STATUS_INSUFFICIENT_RESOURCES;
+
+    NTSTATUS Status      = 0;
+    U4       NumRemoved  = 0;
+    U4       NumAppended = 0;
+    for ( ; NumRemoved < NumTaken && ! Status; NumRemoved++ ) Status = dataRemoveLastRange( Vcb, Id, Taken + NumTaken - 1 - NumRemoved );
+    if ( Status ) NumRemoved--;
+
+    for ( U4 i = 0; i < NumWith  && ! Status; i++ ) if ( ! ( Status = dataAppendRange( Vcb, Id, With[i]  ) ) ) NumAppended++;
+    for ( U4 i = 1; i < NumTaken && ! Status; i++ ) if ( ! ( Status = dataAppendRange( Vcb, Id, Taken[i] ) ) ) NumAppended++;
+
+    if ( Status )
+    {
+        //  Off with what went on, and back on with what came off.
+        NTSTATUS   UndoStatus = 0;
+        DATA_RANGE Removed;
+        while ( NumAppended && ! UndoStatus ) if ( ! ( UndoStatus = dataRemoveLastRange( Vcb, Id, &Removed ) ) ) NumAppended--;
+        for ( U4 i = NumTaken - NumRemoved; i < NumTaken && ! UndoStatus; i++ ) UndoStatus = dataAppendRange( Vcb, Id, Taken[i] );
+ASSERT( ! UndoStatus );
+        *NumWithIn = min( NumAppended, NumWith );
+    }
+    else
+    {
+        *NumWithIn = NumWith;
+    }
+
+    FreeMemory( Taken );
+    return Status;
+}
+
+//////////////////////////////////////////////////////////////////////
+
+NTSTATUS addADataRange( VCB_ Vcb, ID Id, U4 NumBytesRequested, U4_ NumBytesResult )
+
+{
     U4 NumBytesRoundedUp = ROUND_UP( NumBytesRequested, Volume_BlockSize );
     U4 NumBytesConstrained = min( NumBytesRoundedUp, Volume_SpaceNodeMaxNumBytes );
 
-    NewFileData->AllocationNumBytes += NumBytesConstrained;
-
 
-    U8 VolumeAddress;
+    DATA_RANGE Range;
     U4 NumBytesGot;
-    Status = SpaceRequestNumBytes( NumBytesConstrained, &VolumeAddress, &NumBytesGot );
-ASSERT( ! Status );
-    NewFileData->DataRange[OldNumRanges].VolumeAddress = VolumeAddress;
+    NTSTATUS Status = SpaceRequestNumBytes( Vcb, NumBytesConstrained, &Range.VolumeAddress, &NumBytesGot );
+    if ( Status ) return STATUS_DISK_FULL;
+    Range.NumBytes = NumBytesGot;  //  The free space may come in smaller pieces than we asked for.
+    Range.State    = RANGE_UNWRITTEN;  //  Until written, it reads as zeros; whatever is on the volume there is not ours.
 
+    Status = dataAppendRange( Vcb, Id, Range );
+    if ( Status )
+    {
+        SpaceReturnAddressRange( Vcb, Range.VolumeAddress, NumBytesGot );
+        return Status;
+    }
 
-    NewFileData->DataRange[OldNumRanges].NumBytes = NumBytesConstrained;
+    Data( EntryForId( Vcb, Id ) )->AllocationNumBytes += NumBytesGot;
 
-    *NumBytesResult = NumBytesConstrained;
+    *NumBytesResult = NumBytesGot;
 
     return 0;
 }
 
-//////////////////////////////////////////////////////////////////////
+//--------------------------------------------------------------------
+//
+//  A sparse file grows by holes, which take no volume space until they are written.
 
-NTSTATUS removeADataRange( ID Id )
+static NTSTATUS dataAddHoles( VCB_ Vcb, ID Id, U8 NumBytes )
 
 {
-    ENTRY_     OldEntry     = Entries[Id];
-    FILE_DATA_ OldFileData  = Data( OldEntry );
-    U4         OldNumRanges = OldFileData->NumRanges;
-ASSERT( OldNumRanges );
-    U4         NewNumRanges = OldNumRanges - 1;
+    while ( NumBytes )
+    {
+        DATA_RANGE Hole;
+        Hole.VolumeAddress = 0;
+        Hole.NumBytes      = ( U4 ) min( NumBytes, HOLE_MAX_NUM_BYTES );
+        Hole.State         = RANGE_HOLE;
+
+        NTSTATUS Status = dataAppendRange( Vcb, Id, Hole );
+        if ( Status ) return Status;
+
+        Data( EntryForId( Vcb, Id ) )->AllocationNumBytes += Hole.NumBytes;
+        NumBytes -= Hole.NumBytes;
+    }
 
+    return 0;
+}
 
-    DATA_RANGE RangeToRemove = OldFileData->DataRange[NewNumRanges];
+//////////////////////////////////////////////////////////////////////
 
+NTSTATUS removeADataRange( VCB_ Vcb, ID Id )
 
-    NTSTATUS Status = ResizeEntry( Id, 0, -1 );
+{
+    DATA_RANGE Removed;
+    NTSTATUS   Status = dataRemoveLastRange( Vcb, Id, &Removed );
     if( Status ) return Status;
 
+    Data( EntryForId( Vcb, Id ) )->AllocationNumBytes -= Removed.NumBytes;
 
-    ENTRY_     NewEntry = Entries[Id];
-    FILE_DATA_ NewFileData = Data( NewEntry );
-    NewFileData->AllocationNumBytes -= RangeToRemove.NumBytes;
-
+    if ( Removed.State != RANGE_HOLE ) CachePurgeRange( Vcb, Id, Removed.VolumeAddress );
 
     return 0;
 }
@@ -114,12 +767,20 @@ U8 DataGetAllocationNumBytes( ENTRY_ Entry )
 
 //////////////////////////////////////////////////////////////////////
 
-NTSTATUS DataReadFromFile( ENTRY_ Entry, U8 Offset, U4 Length, U1_ BufferOut )
+NTSTATUS DataReadFromFile( VCB_ Vcb, ENTRY_ Entry, U8 Offset, U4 Length, U1_ BufferOut )
 
 {
     if ( Length == 0 ) return 0;
 
-    NTSTATUS Status = AccessCacheForFile( Entry, OUT_OF_CACHE, BufferOut, Offset, Length );
+    FILE_DATA_ FileData = Data( Entry );
+    if ( DataIsInline( FileData ) )
+    {
+        if ( Offset + Length > FileData->AllocationNumBytes ) return STATUS_INVALID_USER_BUFFER;
+        memcpy( BufferOut, FileData->RangeBytes + Offset, Length );
+        return 0;
+    }
+
+    NTSTATUS Status = AccessCacheForFile( Vcb, Entry, OUT_OF_CACHE, BufferOut, Offset, Length );
 ASSERT( Status == 0 || Status == STATUS_PENDING );
 
     return Status;
@@ -127,25 +788,82 @@ ASSERT( Status == 0 || Status == STATUS_PENDING );
 
 //////////////////////////////////////////////////////////////////////
 
-NTSTATUS DataWriteToFile( ENTRY_ Entry, U8 Offset, U4 Length, U1_ BufferIn )
+NTSTATUS DataWriteToFile( VCB_ Vcb, ENTRY_ Entry, U8 Offset, U4 Length, U1_ BufferIn )
 
 {
     if ( Length == 0 ) return 0;
 
-    NTSTATUS Status = AccessCacheForFile( Entry, INTO_CACHE, BufferIn, Offset, Length );
+    FILE_DATA_ FileData = Data( Entry );
+    if ( DataIsInline( FileData ) )
+    {
+        if ( Offset + Length > FileData->AllocationNumBytes ) return STATUS_INVALID_USER_BUFFER;
+        if ( BufferIn ) memcpy( FileData->RangeBytes + Offset, BufferIn, Length );
+        else            Zero(   FileData->RangeBytes + Offset,           Length );
+        return 0;
+    }
+
+    //  Holes we write into need volume space first, which may move the entry.
+    ID Id = Entry->Id;
+    NTSTATUS Status = BufferIn ? DataFillHoles( Vcb, Id, Offset, Length ) : 0;
+    if ( Status ) return Status;
+    Entry = EntryForId( Vcb, Id );
+
+    Status = AccessCacheForFile( Vcb, Entry, INTO_CACHE, BufferIn, Offset, Length );
 ASSERT( Status == 0 );
 
     return Status;
 }
 
+//--------------------------------------------------------------------
+//
+//  A file with inline data is growing too big for it; give it data ranges instead.
+
+static NTSTATUS dataMoveInlineDataOut( VCB_ Vcb, ID Id, U8 RequestedMinimumAllocationSize )
+
+{
+    FILE_DATA_ FileData  = Data( EntryForId( Vcb, Id ) );
+    U4         NumBytes  = ( U4 ) FileData->FileNumBytes;
+    U1_        Saved     = 0;
+
+    if ( NumBytes )
+    {
+        Saved = AllocateMemory( NumBytes );
+        if ( ! Saved ) return STATUS_INSUFFICIENT_RESOURCES;
+        memcpy( Saved, FileData->RangeBytes, NumBytes );
+    }
+
+    //  With no inline data, the file takes ranges like any empty file.
+    NTSTATUS Status = ResizeEntryInlineData( Vcb, Id, 0 );
+    if ( ! Status ) Status = DataReallocateFile( Vcb, Id, RequestedMinimumAllocationSize );
+    if ( ! Status ) Status = DataWriteToFile( Vcb, EntryForId( Vcb, Id ), 0, NumBytes, Saved );
+
+    FreeMemory( Saved );
+    return Status;
+}
+
 //////////////////////////////////////////////////////////////////////
 
-NTSTATUS DataReallocateFile( ID Id, U8 RequestedMinimumAllocationSize )
+NTSTATUS DataReallocateFile( VCB_ Vcb, ID Id, U8 RequestedMinimumAllocationSize )
 {
-    ENTRY_ Entry = Entries[Id];
+    ENTRY_ Entry = EntryForId( Vcb, Id );
     U8 FileNumBytes = DataGetFileNumBytes( Entry );
 ASSERT( FileNumBytes <= RequestedMinimumAllocationSize );
 
+    //  Small files keep their data in their entry, until they grow too big.
+    FILE_DATA_ FileData = Data( Entry );
+    if ( DataIsInline( FileData ) )
+    {
+        if ( RequestedMinimumAllocationSize <= INLINE_DATA_MAX_NUM_BYTES )
+        {
+            return ResizeEntryInlineData( Vcb, Id, ( U4 ) ROUND_UP( RequestedMinimumAllocationSize, INLINE_DATA_ROUNDING ) );
+        }
+        if ( FileData->AllocationNumBytes )
+        {
+            return dataMoveInlineDataOut( Vcb, Id, RequestedMinimumAllocationSize );
+        }
+        //  An empty file just gets ranges.
+    }
+
     RequestedMinimumAllocationSize = ROUND_UP( RequestedMinimumAllocationSize, Volume_BlockSize );
 
     U8 OldAllocationSize = DataGetAllocationNumBytes( Entry );
@@ -158,12 +876,14 @@ ASSERT( FileNumBytes <= RequestedMinimumAllocationSize );
     //  Handle larger.
     if ( Delta > 0 )
     {
+        if ( BitIsSet( Entry->FileAttributes, FILE_ATTRIBUTE_SPARSE_FILE ) ) return dataAddHoles( Vcb, Id, ( U8 ) Delta );
+
         //  Add as many data ranges as we need to.
         U4 NumBytesWant = ( U4 ) Delta;
         U4 NumBytesGot;
         for (;;)
         {
-            NTSTATUS Status = addADataRange( Id, NumBytesWant, &NumBytesGot );
+            NTSTATUS Status = addADataRange( Vcb, Id, NumBytesWant, &NumBytesGot );
             if ( Status ) return Status;
             if ( NumBytesGot >= NumBytesWant ) break;
             NumBytesWant -= NumBytesGot;
@@ -176,14 +896,14 @@ ASSERT( FileNumBytes <= RequestedMinimumAllocationSize );
     //  While we can remove ranges, do it.
     for ( ;; )
     {
-        if ( Data( Entry )->NumRanges == 0 ) break;
-        DATA_RANGE LastRange = Data( Entry )->DataRange[Data( Entry )->NumRanges - 1];
+        DATA_RANGE LastRange;
+        if ( ! DataLastRange( Vcb, Entry, &LastRange ) ) break;
         U8 AllocationSizeBefore = Data( Entry )->AllocationNumBytes;
         U8 AllocationSizeAfter  = AllocationSizeBefore - LastRange.NumBytes;
         if ( AllocationSizeAfter < RequestedMinimumAllocationSize ) break;
 
-        NTSTATUS Status = removeADataRange( Id );
-        Entry = Entries[Id];
+        NTSTATUS Status = removeADataRange( Vcb, Id );
+        Entry = EntryForId( Vcb, Id );
         if ( Status ) return Status;
     }
 
@@ -194,32 +914,205 @@ ASSERT( FileNumBytes <= RequestedMinimumAllocationSize );
 
 //////////////////////////////////////////////////////////////////////
 
-NTSTATUS DataResizeFile( ID Id, U8 NewFileSize, FILL_TYPE FillType )
+NTSTATUS DataResizeFile( VCB_ Vcb, ID Id, U8 NewFileSize, FILL_TYPE FillType )
 
 {
     NTSTATUS Status = STATUS__PRIVATE__NEVER_SET;
 
 
     //  Reallocate the file, if necessary.
-    if ( NewFileSize > DataGetAllocationNumBytes( Entries[Id] ) )
+    if ( NewFileSize > DataGetAllocationNumBytes( EntryForId( Vcb, Id ) ) )
     {
-        Status = DataReallocateFile( Id, NewFileSize );  //  the minimum.
+        Status = DataReallocateFile( Vcb, Id, NewFileSize );  //  the minimum.
         if ( Status ) return Status;
     }
 
 
     if ( FillType == ZERO_FILL )
     {
-        S8 Expansion = NewFileSize - DataGetFileNumBytes( Entries[Id] );
-        if ( Expansion > 0 )
+        U8 OldFileSize = DataGetFileNumBytes( EntryForId( Vcb, Id ) );
+        if ( NewFileSize > OldFileSize )
         {
             //  Fill to the new offset with zeroes.
-            Status = DataWriteToFile( Entries[Id], DataGetFileNumBytes( Entries[Id] ), ( int ) Expansion, 0 );
-            //  TODO what about status here?	
+            Status = DataZeroFile( Vcb, Id, OldFileSize, NewFileSize );
+            if ( Status ) return Status;
+        }
+    }
+
+    Data( EntryForId( Vcb, Id ) )->FileNumBytes = NewFileSize;
+
+    return 0;
+}
+
+//////////////////////////////////////////////////////////////////////
+//
+//  Make the file read as zeros from FromOffset to ToOffset, as when it is extended. Whole ranges
+//  in between just become unwritten, and forget their cache; only the parts of ranges at either
+//  end are zeroed in the cache, and so written. Holes, and unwritten ranges with no cache, are
+//  zeros already.
+
+NTSTATUS DataZeroFile( VCB_ Vcb, ID Id, U8 FromOffset, U8 ToOffset )
+
+{
+    ENTRY_ Entry = EntryForId( Vcb, Id );
+    if ( DataIsInline( Data( Entry ) ) ) return DataWriteToFile( Vcb, Entry, FromOffset, ( U4 ) ( ToOffset - FromOffset ), 0 );
+
+    RANGE_CURSOR Cursor;
+
+    for ( DATA_RANGE_ Range = DataRangeAt( Vcb, Entry, FromOffset, &Cursor ); Range && Cursor.FileOffset < ToOffset; Range = DataNextRange( &Cursor ) )
+    {
+        if ( Range->State == RANGE_HOLE ) continue;
+
+        U8 RangeFrom = Cursor.FileOffset;
+        U8 RangeTo   = RangeFrom + Range->NumBytes;
+        if ( RangeFrom >= FromOffset && RangeTo <= ToOffset )
+        {
+            CachePurgeRange( Vcb, Id, Range->VolumeAddress );
+            if ( Range->State == RANGE_WRITTEN ) DataSetRangeState( &Cursor, RANGE_UNWRITTEN );
+            continue;
+        }
+
+        //  Zeroing in the cache changes no ranges, so the cursor stays good.
+        U8 From = max( RangeFrom, FromOffset );
+        U8 To   = min( RangeTo,   ToOffset   );
+        NTSTATUS Status = AccessCacheForFile( Vcb, Entry, INTO_CACHE, 0, From, ( U4 ) ( To - From ) );
+        if ( Status ) return Status;
+    }
+
+    return 0;
+}
+
+//////////////////////////////////////////////////////////////////////
+//
+//  Give the holes a write will land in volume space, HOLE_FILL_NUM_BYTES at a time, aligned
+//  in the file so that nearby writes land in the same range. It comes unwritten, so the parts
+//  the write does not cover read as zeros.
+
+NTSTATUS DataFillHoles( VCB_ Vcb, ID Id, U8 Offset, U4 Length )
+
+{
+    if ( DataIsInline( Data( EntryForId( Vcb, Id ) ) ) ) return 0;
+
+    U8 At   = Offset;
+    U8 AtTo = Offset + Length;
+    while ( At < AtTo )
+    {
+        RANGE_CURSOR Cursor;
+        DATA_RANGE_  Range = DataRangeAt( Vcb, EntryForId( Vcb, Id ), At, &Cursor );
+        if ( ! Range ) break;
+
+        U8 RangeFrom = Cursor.FileOffset;
+        U8 RangeTo   = RangeFrom + Range->NumBytes;
+        if ( Range->State != RANGE_HOLE )
+        {
+            At = RangeTo;
+            continue;
+        }
+
+        U8 From = max( RangeFrom, ROUND_DOWN( At, HOLE_FILL_NUM_BYTES ) );
+        U8 To   = min( RangeTo,   ROUND_UP( min( AtTo, RangeTo ), HOLE_FILL_NUM_BYTES ) );
+
+        //  The space may come in pieces; each takes a turn around the loop.
+        DATA_RANGE Filled;
+        U4         NumBytesGot;
+        NTSTATUS Status = SpaceRequestNumBytes( Vcb, ( U4 ) ( To - From ), &Filled.VolumeAddress, &NumBytesGot );
+        if ( Status ) return STATUS_DISK_FULL;
+ASSERT( NumBytesGot <= To - From );
+        Filled.NumBytes = NumBytesGot;
+        Filled.State    = RANGE_UNWRITTEN;
+
+        DATA_RANGE With[3];
+        U4         NumWith = 0;
+        if ( From > RangeFrom )
+        {
+            With[NumWith].VolumeAddress = 0;
+            With[NumWith].NumBytes      = ( U4 ) ( From - RangeFrom );
+            With[NumWith].State         = RANGE_HOLE;
+            NumWith++;
         }
+        U4 FilledAt = NumWith;
+        With[NumWith++] = Filled;
+        if ( RangeTo > From + NumBytesGot )
+        {
+            With[NumWith].VolumeAddress = 0;
+            With[NumWith].NumBytes      = ( U4 ) ( RangeTo - From - NumBytesGot );
+            With[NumWith].State         = RANGE_HOLE;
+            NumWith++;
+        }
+
+        U4 NumWithIn;
+        Status = dataReplaceRange( Vcb, Id, RangeFrom, With, NumWith, &NumWithIn );
+        if ( Status )
+        {
+            //  Unless it stuck in the file after all, the space was never used.
+            if ( FilledAt >= NumWithIn ) SpaceReturnAddressRange( Vcb, Filled.VolumeAddress, NumBytesGot );
+            return Status;
+        }
+
+        At = max( At, From + NumBytesGot );
     }
 
-    Data( Entries[Id] )->FileNumBytes = NewFileSize;
+    return 0;
+}
+
+//////////////////////////////////////////////////////////////////////
+//
+//  Give back the file's volume space past ToNumBytes, rounded up to a block, as when what was
+//  allocated ahead of its appends goes unused. The last range kept is cut short. Ranges that
+//  are being written back from the cache stay, for now.
+
+NTSTATUS DataTrimFile( VCB_ Vcb, ID Id, U8 ToNumBytes, U8_ NumBytesTrimmed )
+
+{
+    *NumBytesTrimmed = 0;
+    ToNumBytes = ROUND_UP( ToNumBytes, Volume_BlockSize );
+
+    if ( DataIsInline( Data( EntryForId( Vcb, Id ) ) ) ) return 0;
+
+    for (;;)
+    {
+        ENTRY_     Entry    = EntryForId( Vcb, Id );
+        FILE_DATA_ FileData = Data( Entry );
+        if ( FileData->AllocationNumBytes <= ToNumBytes ) break;
+
+        DATA_RANGE Last;
+        if ( ! DataLastRange( Vcb, Entry, &Last ) ) break;
+
+        U8 LastFrom = FileData->AllocationNumBytes - Last.NumBytes;
+        U4 NumKept  = ( LastFrom >= ToNumBytes ) ? 0 : ( U4 ) ( ToNumBytes - LastFrom );
+
+        //  Cut the range, then its cache. If either fails, the range goes back whole and no space
+        //  is given back; only if even that fails is the cut space lost, until the next mount.
+        DATA_RANGE Kept = Last;
+        Kept.NumBytes = NumKept;
+
+        NTSTATUS Status = dataRemoveLastRange( Vcb, Id, &Last );
+        if ( Status ) return Status;
+
+        if ( NumKept ) Status = dataAppendRange( Vcb, Id, Kept );
+        if ( Status )
+        {
+            NTSTATUS UndoStatus = dataAppendRange( Vcb, Id, Last );
+ASSERT( ! UndoStatus );
+            return Status;
+        }
+
+        if ( Last.State != RANGE_HOLE && ! CacheTrimRange( Vcb, Last.VolumeAddress, NumKept ) )
+        {
+            DATA_RANGE Removed;
+            NTSTATUS   UndoStatus = NumKept ? dataRemoveLastRange( Vcb, Id, &Removed ) : 0;
+            if ( ! UndoStatus ) UndoStatus = dataAppendRange( Vcb, Id, Last );
+ASSERT( ! UndoStatus );
+            break;
+        }
+
+        U4 NumCut = Last.NumBytes - NumKept;
+        Data( EntryForId( Vcb, Id ) )->AllocationNumBytes -= NumCut;
+        if ( Last.State != RANGE_HOLE ) SpaceReturnAddressRange( Vcb, Last.VolumeAddress + NumKept, NumCut );
+        *NumBytesTrimmed += NumCut;
+
+        if ( NumKept ) break;
+    }
 
     return 0;
 }
@@ -30,26 +30,49 @@ inline B1 DoesStringContainWildcards( S1_ S )
 int fillOneQueryDirectoryInfo( FILE_INFORMATION_CLASS FileInformationClass, U1_ InfoAddress, int InfoMaxLength, ENTRY_ Entry )
 
 {
-    S1_ Utf8Name = Entry->Name;
+    int StructNumBytes;
 
-    WCHAR WideName[512];  //  TODO
+    switch ( FileInformationClass )
+    {
+      case FileDirectoryInformation:       StructNumBytes = offsetof( FILE_DIRECTORY_INFORMATION,    FileName ); break;
+      case FileFullDirectoryInformation:   StructNumBytes = offsetof( FILE_FULL_DIR_INFORMATION,     FileName ); break;
+      case FileIdFullDirectoryInformation: StructNumBytes = offsetof( FILE_ID_FULL_DIR_INFORMATION,  FileName ); break;
+      case FileBothDirectoryInformation:   StructNumBytes = offsetof( FILE_BOTH_DIR_INFORMATION,     FileName ); break;
+      case FileIdBothDirectoryInformation: StructNumBytes = offsetof( FILE_ID_BOTH_DIR_INFORMATION,  FileName ); break;
+      case FileNamesInformation:           StructNumBytes = offsetof( FILE_NAMES_INFORMATION,        FileName ); break;
 
-    int NumWideChars = Utf8StringToWideString( Utf8Name, WideName );
-    int WideNameNumBytes = NumWideChars * 2;
+      default:
+        {
+LogMarker();
+AlwaysBreakToDebugger();
+            return 0;
+        }
+    }
 
-//WideName[NumWideChars] = 0;  //  Need to terminate for debug output only.
-//LogFormatted( " Utf8:\"%s\"  Wide:\"%S\"  wide num bytes is %d\n", Utf8Name, WideName, WideNameNumBytes );
+    //  Each UTF-8 byte becomes at most one wide character, so when even that worst case
+    //  (and the trailing zero) fits, convert the name straight into the caller's buffer.
+    WCHAR* FileName = ( WCHAR* ) ( InfoAddress + StructNumBytes );
+    int    NumWideChars;
+    if ( StructNumBytes + ( Entry->NameNumBytes + 1 ) * 2 <= InfoMaxLength )
+    {
+        NumWideChars = Utf8CharactersToWideString( Entry->NameNumBytes, Entry->Name, FileName );
+    }
+    else
+    {
+        WCHAR WideName[256];
+        NumWideChars = Utf8CharactersToWideString( Entry->NameNumBytes, Entry->Name, WideName );
+        if ( StructNumBytes + NumWideChars * 2 > InfoMaxLength ) return 0;
+        memcpy( FileName, WideName, NumWideChars * 2LL );
+    }
 
-    int InfoNumBytes = 0;
+    int WideNameNumBytes = NumWideChars * 2;
+    int InfoNumBytes     = StructNumBytes + WideNameNumBytes;
 
     switch ( FileInformationClass )
     {
       case FileDirectoryInformation:
         {
             PFILE_DIRECTORY_INFORMATION Info = ( PFILE_DIRECTORY_INFORMATION ) InfoAddress;
-            int StructNumBytes =         offsetof( FILE_DIRECTORY_INFORMATION, FileName );
-            InfoNumBytes = StructNumBytes + WideNameNumBytes;
-            if ( InfoNumBytes > InfoMaxLength ) return 0;
 
             Info->NextEntryOffset = ROUND_UP( InfoNumBytes, 8 );
             Info->FileIndex = 0;
@@ -61,7 +84,6 @@ int fillOneQueryDirectoryInfo( FILE_INFORMATION_CLASS FileInformationClass, U1_
             Info->AllocationSize.QuadPart = DataGetAllocationNumBytes( Entry );
             Info->FileAttributes          = OrNormal( Entry->FileAttributes );
             Info->FileNameLength          = WideNameNumBytes;
-            memcpy( Info->FileName, WideName, WideNameNumBytes );
 
 /*
 LogFormatted( " FileIndex %d \n", ( int )Info->FileIndex );
@@ -82,9 +104,6 @@ LogFormatted( "( Current Time )  $%p \n", CurrentTime.QuadPart );
       case FileFullDirectoryInformation:
         {
             PFILE_FULL_DIR_INFORMATION Info = ( PFILE_FULL_DIR_INFORMATION ) InfoAddress;
-            int StructNumBytes =        offsetof( FILE_FULL_DIR_INFORMATION, FileName );
-            InfoNumBytes = StructNumBytes + WideNameNumBytes;
-            if ( InfoNumBytes > InfoMaxLength ) return 0;
 
             Info->NextEntryOffset = ROUND_UP( InfoNumBytes, 8 );
             Info->FileIndex = 0;
@@ -97,7 +116,6 @@ LogFormatted( "( Current Time )  $%p \n", CurrentTime.QuadPart );
             Info->FileAttributes          = OrNormal( Entry->FileAttributes );
             Info->FileNameLength          = WideNameNumBytes;
             Info->EaSize                  = 0;
-            memcpy( Info->FileName, WideName, WideNameNumBytes );
 
 /*
 LogFormatted( " FileIndex %d \n", ( int )Info->FileIndex );
@@ -119,9 +137,6 @@ LogFormatted( "( Current Time )  $%p \n", CurrentTime.QuadPart );
       case FileIdFullDirectoryInformation:
         {
             PFILE_ID_FULL_DIR_INFORMATION Info = ( PFILE_ID_FULL_DIR_INFORMATION ) InfoAddress;
-            int StructNumBytes =           offsetof( FILE_ID_FULL_DIR_INFORMATION, FileName );
-            InfoNumBytes = StructNumBytes + WideNameNumBytes;
-            if ( InfoNumBytes > InfoMaxLength ) return 0;
 
             Info->NextEntryOffset = ROUND_UP( InfoNumBytes, 8 );
             Info->FileIndex = 0;
@@ -135,16 +150,12 @@ LogFormatted( "( Current Time )  $%p \n", CurrentTime.QuadPart );
             Info->FileNameLength          = WideNameNumBytes;
             Info->EaSize                  = 0;
             Info->FileId.QuadPart         = 0;  //  TODO set this to our internal id?
-            memcpy( Info->FileName, WideName, WideNameNumBytes );
         }
         break;
 
       case FileBothDirectoryInformation:
         {
             PFILE_BOTH_DIR_INFORMATION Info = ( PFILE_BOTH_DIR_INFORMATION ) InfoAddress;
-            int StructNumBytes =        offsetof( FILE_BOTH_DIR_INFORMATION, FileName );
-            InfoNumBytes = StructNumBytes + WideNameNumBytes;
-            if ( InfoNumBytes > InfoMaxLength ) return 0;
 
             Info->NextEntryOffset = ROUND_UP( InfoNumBytes, 8 );
             Info->FileIndex = 0;
@@ -159,16 +170,12 @@ LogFormatted( "( Current Time )  $%p \n", CurrentTime.QuadPart );
             Info->EaSize                  = 0;
             Info->ShortNameLength         = 0;
             Zero( Info->ShortName, sizeof( Info->ShortName ) );
-            memcpy( Info->FileName, WideName, WideNameNumBytes );
         }
         break;
 
       case FileIdBothDirectoryInformation:
         {
             PFILE_ID_BOTH_DIR_INFORMATION Info = ( PFILE_ID_BOTH_DIR_INFORMATION ) InfoAddress;
-            int StructNumBytes =           offsetof( FILE_ID_BOTH_DIR_INFORMATION, FileName );
-            InfoNumBytes = StructNumBytes + WideNameNumBytes;
-            if ( InfoNumBytes > InfoMaxLength ) return 0;
 
             Info->NextEntryOffset = ROUND_UP( InfoNumBytes, 8 );
             Info->FileIndex = 0;
@@ -184,29 +191,21 @@ LogFormatted( "( Current Time )  $%p \n", CurrentTime.QuadPart );
             Info->ShortNameLength         = 0;
             Zero( Info->ShortName, sizeof( Info->ShortName ) );
             Info->FileId.QuadPart         = 0;  //  TODO set this to our internal id?
-            memcpy( Info->FileName, WideName, WideNameNumBytes );
         }
         break;
 
       case FileNamesInformation:
         {
             PFILE_NAMES_INFORMATION Info = ( PFILE_NAMES_INFORMATION ) InfoAddress;
-            int StructNumBytes =     offsetof( FILE_NAMES_INFORMATION, FileName );
-            InfoNumBytes = StructNumBytes + WideNameNumBytes;
-            if ( InfoNumBytes > InfoMaxLength ) return 0;
 
             Info->NextEntryOffset = ROUND_UP( InfoNumBytes, 8 );
             Info->FileIndex = 0;
             Info->FileNameLength = WideNameNumBytes;
-            memcpy( Info->FileName, WideName, WideNameNumBytes );
         }
         break;
 
       default:
-        {
-LogMarker();
-AlwaysBreakToDebugger();
-        }
+        break;
     }
 
     return ROUND_UP( InfoNumBytes, 8 );
@@ -227,6 +226,7 @@ NTSTATUS QueryDirectory( ICB_ Icb )
     FCB_                   Fcb                     = FileObject->FsContext;
     CCB_                   Ccb                     = FileObject->FsContext2;
     ID                     DirectoryId             = Fcb->Id;
+    VCB_                   Vcb                     = Fcb->Vcb;
 
     B1 RestartScan       = BitIsSet( IrpSp->Flags, SL_RESTART_SCAN );
     B1 ReturnSingleEntry = BitIsSet( IrpSp->Flags, SL_RETURN_SINGLE_ENTRY );
@@ -234,9 +234,9 @@ NTSTATUS QueryDirectory( ICB_ Icb )
     U1_ UserBuffer = IrpBuffer( Irp );
     if ( ! UserBuffer ) return STATUS_INVALID_USER_BUFFER;
 
-    if ( IdIsAFile( DirectoryId ) ) return STATUS_INVALID_PARAMETER;
+    if ( IdIsAFile( Vcb, DirectoryId ) ) return STATUS_INVALID_PARAMETER;
 
-    ENTRY_ DirectoryEntry = Entries[DirectoryId];
+    ENTRY_ DirectoryEntry = EntryForId( Vcb, DirectoryId );
 
     //  If this is our first time...
     if ( Ccb->FirstQuery )
@@ -255,8 +255,18 @@ NTSTATUS QueryDirectory( ICB_ Icb )
                 Ccb->IsAPattern = DoesStringContainWildcards( Ccb->NameOrPattern );
             }
         }
+
+        //  Compile the pattern once; every later query of this handle reuses it.
+        if ( Ccb->IsAPattern )
+        {
+            Ccb->Pattern = PatternCompile( Ccb->NameOrPattern );
+            if ( ! Ccb->Pattern ) return STATUS_INSUFFICIENT_RESOURCES;
+        }
     }
 
+    //  Children are sorted by name, so only those starting with the pattern's literal prefix can match.
+    S1_ Prefix = ( Ccb->IsAPattern && Ccb->Pattern->PrefixNumBytes ) ? Ccb->Pattern->Prefix : 0;
+
 
 //LogFormatted( "Ccb->LastProcessedName  is \"%s\"\n", Ccb->LastProcessedName );
 //LogFormatted( "Ccb->NameOrPattern      is \"%s\"\n", Ccb->NameOrPattern );
@@ -266,27 +276,29 @@ NTSTATUS QueryDirectory( ICB_ Icb )
 
     //  Get the child to start with.
     ID ChildNode;
-    if ( RestartScan )
+    if ( RestartScan || Ccb->FirstQuery )
     {
-        ChildNode = EntryFirst( ChildrenTree( DirectoryEntry ) );
+        if ( Ccb->IsAPattern )
+        {
+            if ( Prefix ) ChildNode = EntryNear(  Vcb, ChildrenTree_( DirectoryEntry ), Prefix, GE );
+            else          ChildNode = EntryFirst( Vcb, ChildrenTree( DirectoryEntry ) );
+        }
+        else
+        {
+            if ( Ccb->NameOrPattern[0] ) ChildNode = FindChild(  Vcb, DirectoryEntry->Id, Ccb->NameOrPattern );
+            else                         ChildNode = EntryFirst( Vcb, ChildrenTree( DirectoryEntry ) );
+        }
     }
     else
     {
-        if ( Ccb->FirstQuery )
+        //  Resume after the last child processed by ID; only if a directory changed since, seek by name.
+        if ( Ccb->CursorId && Ccb->CursorGeneration == Vcb->ChildrenGeneration )
         {
-            if ( Ccb->IsAPattern )
-            {
-                ChildNode = EntryFirst( ChildrenTree( DirectoryEntry ) );
-            }
-            else
-            {
-                if ( Ccb->NameOrPattern[0] ) ChildNode = EntryFind(  ChildrenTree_( DirectoryEntry ), Ccb->NameOrPattern );
-                else                         ChildNode = EntryFirst( ChildrenTree( DirectoryEntry ) );
-            }
+            ChildNode = EntryNext( Vcb, Ccb->CursorId );
         }
         else
         {
-            ChildNode = EntryNear( ChildrenTree_( DirectoryEntry ), Ccb->LastProcessedName, GT );
+            ChildNode = EntryNear( Vcb, ChildrenTree_( DirectoryEntry ), Ccb->LastProcessedName, GT );
         }
     }
 
@@ -299,7 +311,7 @@ NTSTATUS QueryDirectory( ICB_ Icb )
     *UsedLength_ = 0;
     while ( ChildNode )
     {
-        ENTRY_ ChildEntry = Entries[ ChildNode ];
+        ENTRY_ ChildEntry = EntryForId( Vcb, ChildNode );
 
         //  Should this entry be included?
         B1 Match;
@@ -313,7 +325,10 @@ LogFormatted( "Match = %d for \"%s\" because Ccb->NameOrPattern[0] == 0\n", ( in
             S1_ Name = ChildEntry->Name;
             if ( Ccb->IsAPattern )
             {
-                Match = WildcardCompare( Ccb->NameOrPattern, ( int ) strlen( Ccb->NameOrPattern ), Name, ( int )strlen( Name ) );
+                //  Past the prefix, no later child can match.
+                if ( Prefix && _strnicmp( Name, Prefix, Ccb->Pattern->PrefixNumBytes ) > 0 ) break;
+
+                Match = PatternMatch( Ccb->Pattern, Name );
 LogFormatted( "Match = %d for \"%s\" because Ccb->IsAPattern of \"%s\"\n", ( int )Match, ChildEntry->Name, Ccb->NameOrPattern );
             }
             else
@@ -334,7 +349,6 @@ LogFormatted( "Match = %d for \"%s\" because NOT Ccb->IsAPattern of \"%s\"\n", (
                 break;
             }
 
-            strcpy( Ccb->LastProcessedName, ChildEntry->Name );
             LastInfoAddress = InfoAddress;
             InfoAddress    += InfoNumBytes;
             *UsedLength_   += InfoNumBytes;
@@ -348,13 +362,15 @@ LogFormatted( "Match = %d for \"%s\" because NOT Ccb->IsAPattern of \"%s\"\n", (
             LastProcessedChild = ChildEntry;
         }
 
-        ChildNode = EntryNext( ChildNode );
+        ChildNode = EntryNext( Vcb, ChildNode );
 
     }
 
     if ( LastProcessedChild )
     {
         strcpy( Ccb->LastProcessedName, LastProcessedChild->Name );
+        Ccb->CursorId         = LastProcessedChild->Id;
+        Ccb->CursorGeneration = Vcb->ChildrenGeneration;
     }
 
 
@@ -390,6 +406,7 @@ NTSTATUS NotifyChangeDirectory ( ICB_ Icb )
     IRPSP_       IrpSp      = IoGetCurrentIrpStackLocation( Irp );
     PFILE_OBJECT FileObject = IrpSp->FileObject;
     FCB_         Fcb        = FileObject->FsContext;
+    VCB_         Vcb        = Fcb->Vcb;
 
     switch ( IrpSp->MinorFunction )
     {
@@ -406,7 +423,7 @@ NTSTATUS NotifyChangeDirectory ( ICB_ Icb )
         break;
     }
 
-    if ( IdIsAFile( Fcb->Id ) ) return STATUS_INVALID_PARAMETER;
+    if ( IdIsAFile( Vcb, Fcb->Id ) ) return STATUS_INVALID_PARAMETER;
 
     PDEVICE_OBJECT DeviceObject = Icb->DeviceObject;
     if ( DeviceObject == Volume_TailwindDeviceObject ) return STATUS_INVALID_DEVICE_REQUEST;
@@ -30,7 +30,7 @@ AlwaysLogString( "Unloading driver.\n" );
     IoUnregisterFileSystem( Volume_TailwindDeviceObject );
     IoDeleteDevice(         Volume_TailwindDeviceObject );
 
-    UninitializeSpinlock( &Volume_MetadataLock );
+    UninitializeSpinlock( &Volume_TailwindDeviceLock );
 }
 
 //////////////////////////////////////////////////////////////////////
@@ -38,6 +38,7 @@ AlwaysLogString( "Unloading driver.\n" );
 NTSTATUS IrpMj( ICB_ Icb )
 
 {
+    VCB_   Vcb   = Icb->Vcb;
     PIRP   Irp   = Icb->Irp;
     IRPSP_ IrpSp = IoGetCurrentIrpStackLocation( Irp );
     NTSTATUS Status;
@@ -70,14 +71,15 @@ AlwaysBreakToDebugger();
 
 
     //  Temporary very crude way to initiate writing metadata.
-    if ( NT_SUCCESS( Status ) )
+    //  Pending reads count when redispatched; pending flushes change nothing.
+    if ( NT_SUCCESS( Status ) && Status != STATUS_PENDING && Vcb )
     {
         //switch ( IrpSp->MajorFunction )
         //{
         //  case IRP_MJ_CREATE:            //  maybe
         //  case IRP_MJ_WRITE:             //  maybe
         //  case IRP_MJ_SET_INFORMATION:   //  maybe
-            Volume_ConservativeMetadataUpdateCount++;  //  Crude note that we may need to update some metadata.
+            Vcb->ConservativeMetadataUpdateCount++;  //  Crude note that we may need to update some metadata.
         //    break;
         //}
     }
@@ -102,11 +104,15 @@ PrintRaw( "\n" );
 PrintRaw( "~%04d + %s\n", THETHREAD, GetMajorFunctionName( MajorFunction ) );
 
 
-    AcquireSpinlock( &Volume_MetadataLock );
+    //  Our own device has no VCB; every mounted volume has its own lock.
+    VCB_      Vcb  = ( DeviceObject == Volume_TailwindDeviceObject ) ? 0 : DeviceObject->DeviceExtension;
+    SPINLOCK_ Lock = Vcb ? &Vcb->MetadataLock : &Volume_TailwindDeviceLock;
+
+    AcquireSpinlock( Lock );
 
 
     U8 ThisIrpMicrosecondStart = CurrentMicrosecond();
-    if ( ! LastIrpMicrosecondStart ) LastIrpMicrosecondStart = ThisIrpMicrosecondStart;
+    U8 LastIrpMicrosecondStart = Vcb && Vcb->LastIrpMicrosecondStart ? Vcb->LastIrpMicrosecondStart : ThisIrpMicrosecondStart;
 
 U4 delta = ( U4 ) ( ThisIrpMicrosecondStart - LastIrpMicrosecondStart );
 if ( delta > 100 )
@@ -119,7 +125,7 @@ else
 //PrintRaw( "~%04d + %s\n", THETHREAD, GetMajorFunctionName( MajorFunction ) );
 }
 
-    LastIrpMicrosecondStart = ThisIrpMicrosecondStart;
+    if ( Vcb ) Vcb->LastIrpMicrosecondStart = ThisIrpMicrosecondStart;
 
 
 //    B1 AtIrqlPassiveLevel = ( KeGetCurrentIrql() == PASSIVE_LEVEL );
@@ -152,16 +158,23 @@ AlwaysLogString( "******** SHOULDNT STATUS BE SET? ********\n" );
     //  "Never call IoCompleteRequest while holding a spin lock.
     //  Attempting to complete an IRP while holding a spin lock can cause deadlocks."
     // https://learn.microsoft.com/en-us/windows-hardware/drivers/ddi/wdm/nf-wdm-iocompleterequest
-    ReleaseSpinlock( &Volume_MetadataLock );
+    ReleaseSpinlock( Lock );
 
 
     if ( Icb && Icb->DoCompleteRequest )
     {
 
+        if ( Status == STATUS_PENDING && MajorFunction == IRP_MJ_FLUSH_BUFFERS )
+        {
+            //  IrpMjFlushBuffers already marked it pending and queued it, under the lock,
+            //  so the background thread may even have completed it by now.
+        }
+        else
         if ( Status == STATUS_PENDING )
         {
 
 ASSERT ( MajorFunction == IRP_MJ_READ );
+ASSERT ( Vcb );
 
             if ( ! Irp->MdlAddress )
             {
@@ -179,7 +192,7 @@ ASSERT( 0 );
 
             IoMarkIrpPending( Icb->Irp );
             Icb->Irp->IoStatus.Information = 0;  //  TODO ??
-            AttachLinkLast( &Volume_PendingReadsChain, &Icb->PendingReadsLink );
+            AttachLinkLast( &Vcb->PendingReadsChain, &Icb->PendingReadsLink );
 
         }
         else
@@ -227,9 +240,7 @@ LogString( "Release version built " __DATE__ " " __TIME__ "\n" );
 #endif
 
 
-    InitializeSpinlock( &Volume_MetadataLock );  //  TODO per volume
-
-    ZeroVolumeGlobals();  //  TODO per volume
+    ZeroDriverGlobals();
 
     KeQuerySystemTime( &DriverEntryTime );
     RtlInitUnicodeString( &DeviceName   , DEVICE_NAME   );
@@ -24,17 +24,50 @@ static_assert(1, "need these to be undefined here");
 
 #pragma warning(disable : 4706)  //  (ex) if (a = b)
 
-#define P(Id) ( Entries[Id]->SiblingTreeParentId )
-#define L(Id) ( Entries[Id]->SiblingTreeLeftId   )
-#define R(Id) ( Entries[Id]->SiblingTreeRightId  )
+//  Links are read from the hot index, and written to both it and the entry.
 
-#define SetP(Id,p) ( Entries[Id]->SiblingTreeParentId = p )
-#define SetL(Id,l) ( Entries[Id]->SiblingTreeLeftId   = l )
-#define SetR(Id,r) ( Entries[Id]->SiblingTreeRightId  = r )
+#define P(Id) ( EntryHotForId( Vcb, Id )->SiblingTreeParentId )
+#define L(Id) ( EntryHotForId( Vcb, Id )->SiblingTreeLeftId   )
+#define R(Id) ( EntryHotForId( Vcb, Id )->SiblingTreeRightId  )
+
+#define SetP(Id,p) ( EntryForId( Vcb, Id )->SiblingTreeParentId = EntryHotForId( Vcb, Id )->SiblingTreeParentId = p )
+#define SetL(Id,l) ( EntryForId( Vcb, Id )->SiblingTreeLeftId   = EntryHotForId( Vcb, Id )->SiblingTreeLeftId   = l )
+#define SetR(Id,r) ( EntryForId( Vcb, Id )->SiblingTreeRightId  = EntryHotForId( Vcb, Id )->SiblingTreeRightId  = r )
+
+//--------------------------------------------------------------------
+//
+//  Keys order like _stricmp orders names, as far as their first eight bytes go.
+
+inline U8 entryNameKey( S1_ Name )
+
+{
+    U8 Key = 0;
+    for ( int i = 0; i < 8; i++ )
+    {
+        U1 c = ( U1 ) *Name;
+        if ( c ) Name++;
+        if ( c >= 'A' && c <= 'Z' ) c += 'a' - 'A';
+        Key = ( Key << 8 ) | c;
+    }
+    return Key;
+}
+
+//--------------------------------------------------------------------
+
+inline int entryCompare( VCB_ Vcb, S1_ Name, U8 Key, U8 xKey, ID x )
+
+{
+    if ( Key != xKey ) return Key < xKey ? -1 : 1;
+
+    //  The same key ending in a zero means the same short name.
+    if ( ! ( Key & 0xFF ) ) return 0;
+
+    return _stricmp( Name + 8, EntryForId( Vcb, x )->Name + 8 );
+}
 
 //--------------------------------------------------------------------
 
-inline void entryRotateL(ID_ rootHandle, ID x)
+inline void entryRotateL(VCB_ Vcb, ID_ rootHandle, ID x)
 
 {
     ID y = R(x), p = P(x);
@@ -50,7 +83,7 @@ inline void entryRotateL(ID_ rootHandle, ID x)
 
 //--------------------------------------------------------------------
 
-inline void entryRotateR(ID *rootHandle, ID y)
+inline void entryRotateR(VCB_ Vcb, ID *rootHandle, ID y)
 
 {
     ID x = L(y), p = P(y);
@@ -66,7 +99,7 @@ inline void entryRotateR(ID *rootHandle, ID y)
 
 //--------------------------------------------------------------------
 
-static void entrySplay(ID *rootHandle, ID x)
+static void entrySplay(VCB_ Vcb, ID *rootHandle, ID x)
 
 {
     ID p;
@@ -74,22 +107,22 @@ static void entrySplay(ID *rootHandle, ID x)
     {
         if (!P(p))
         {
-            if (L(p) == x) entryRotateR(rootHandle, p);
-            else           entryRotateL(rootHandle, p);
+            if (L(p) == x) entryRotateR(Vcb, rootHandle, p);
+            else           entryRotateL(Vcb, rootHandle, p);
         }
         else
         {
             if (p == R(P(p)))
             {
-                if (R(p) == x) entryRotateL(rootHandle, P(p));
-                else           entryRotateR(rootHandle, p);
-                entryRotateL(rootHandle, P(x));
+                if (R(p) == x) entryRotateL(Vcb, rootHandle, P(p));
+                else           entryRotateR(Vcb, rootHandle, p);
+                entryRotateL(Vcb, rootHandle, P(x));
             }
             else
             {
-                if (L(p) == x) entryRotateR(rootHandle, P(p));
-                else           entryRotateL(rootHandle, p);
-                entryRotateR(rootHandle, P(x));
+                if (L(p) == x) entryRotateR(Vcb, rootHandle, P(p));
+                else           entryRotateL(Vcb, rootHandle, p);
+                entryRotateR(Vcb, rootHandle, P(x));
             }
         }
     }
@@ -97,15 +130,17 @@ static void entrySplay(ID *rootHandle, ID x)
 
 //--------------------------------------------------------------------
 
-inline int entrySeek(ID *rootHandle, ID *resultHandle, S1_ Name )
+inline int entrySeek(VCB_ Vcb, ID *rootHandle, ID *resultHandle, S1_ Name, int *depthHandle )
 
 {
     int difference;
+    int depth = 0;
+    U8 key = entryNameKey( Name );
     ID x = *rootHandle;
     for (;;)
     {
-
-        difference = _stricmp( Name, Entries[x]->Name );
+        depth++;
+        difference = entryCompare( Vcb, Name, key, EntryHotForId( Vcb, x )->NameKey, x );
 
         if (difference < 0)
         {
@@ -124,12 +159,13 @@ inline int entrySeek(ID *rootHandle, ID *resultHandle, S1_ Name )
     }
 
     *resultHandle = x;
+    *depthHandle = depth;
     return difference;
 }
 
 //--------------------------------------------------------------------
 
-ID EntryNext( ID x )
+ID EntryNext( VCB_ Vcb, ID x )
 
 {
     ID l,p;
@@ -141,7 +177,7 @@ ID EntryNext( ID x )
 
 //--------------------------------------------------------------------
 
-ID EntryPrev( ID x )
+ID EntryPrev( VCB_ Vcb, ID x )
 
 {
     ID r,p;
@@ -153,7 +189,7 @@ ID EntryPrev( ID x )
 
 //--------------------------------------------------------------------
 
-ID EntryFirst( ID x )
+ID EntryFirst( VCB_ Vcb, ID x )
 
 {
     ID l;
@@ -163,7 +199,7 @@ ID EntryFirst( ID x )
 
 //--------------------------------------------------------------------
 
-ID EntryLast( ID x )
+ID EntryLast( VCB_ Vcb, ID x )
 
 {
     ID r;
@@ -173,28 +209,30 @@ ID EntryLast( ID x )
 
 //--------------------------------------------------------------------
 
-ID EntryFind(ID *rootHandle, S1_ Name )
+ID EntryFind(VCB_ Vcb, ID *rootHandle, S1_ Name )
 
 {
     if (! *rootHandle) return 0;
     ID x;
-    int direction = entrySeek(rootHandle, &x, Name );
-    entrySplay(rootHandle, x);
+    int depth;
+    int direction = entrySeek(Vcb, rootHandle, &x, Name, &depth );
+    entrySplay(Vcb, rootHandle, x);
     return direction?0:x;
 }
 
 //--------------------------------------------------------------------
 
-ID EntryNear(ID *rootHandle, S1_ Name, NEIGHBOR want)
+ID EntryNear(VCB_ Vcb, ID *rootHandle, S1_ Name, NEIGHBOR want)
 
 {
     //  Return a node relative to (<, <=, ==, >=, or >) a key.
     if (! *rootHandle) return 0;
     ID x;
-    int dir = entrySeek(rootHandle, &x, Name );  //  NearVolumeAddress);
-    if ((dir == 0 && want == GT) || (dir > 0 && want >= GE)) x = EntryNext( x) ;
+    int depth;
+    int dir = entrySeek(Vcb, rootHandle, &x, Name, &depth );  //  NearVolumeAddress);
+    if ((dir == 0 && want == GT) || (dir > 0 && want >= GE)) x = EntryNext( Vcb, x) ;
     else
-    if ((dir == 0 && want == LT) || (dir < 0 && want <= LE)) x = EntryPrev( x );
+    if ((dir == 0 && want == LT) || (dir < 0 && want <= LE)) x = EntryPrev( Vcb, x );
     else
     if (dir != 0 && want == EQ) x = 0;
 
@@ -209,11 +247,12 @@ ID EntryNear(ID *rootHandle, S1_ Name, NEIGHBOR want)
 
 //--------------------------------------------------------------------
 
-int EntryAttach(ID *rootHandle, ID x)
+int EntryAttach(VCB_ Vcb, ID *rootHandle, ID x)
 
 {
 
     SetL(x,0); SetR(x,0);
+    EntryHotForId( Vcb, x )->NameKey = entryNameKey( EntryForId( Vcb, x )->Name );
     if (! *rootHandle)
     {
         *rootHandle = x;
@@ -222,20 +261,21 @@ int EntryAttach(ID *rootHandle, ID x)
     else
     {
         ID f;
+        int depth;
 
-        int diff = entrySeek(rootHandle, &f, Entries[x]->Name );
+        int diff = entrySeek(Vcb, rootHandle, &f, EntryForId( Vcb, x )->Name, &depth );
 
         if (!diff) return 0;
         if (diff < 0) SetL(f, x); else SetR(f,x);
         SetP(x, f);
-        entrySplay(rootHandle, x);
+        entrySplay(Vcb, rootHandle, x);
     }
     return 1;
 }
 
 //--------------------------------------------------------------------
 
-void EntryDetach(ID *rootHandle, ID x)
+void EntryDetach(VCB_ Vcb, ID *rootHandle, ID x)
 
 {
     ID p = P(x);
@@ -278,86 +318,365 @@ void EntryDetach(ID *rootHandle, ID x)
 #pragma warning(default : 4706)  //  (ex) if (a = b)
 
 //////////////////////////////////////////////////////////////////////
+//
+//  Child Indexes
+//
+//  A directory whose sibling tree grows deep gets a B+tree over its children
+//  too, kept in memory beside it. Lookups through it never write, so they do
+//  not splay, and nodes keep their name keys inline so a search reads only
+//  nodes until two keys tie. Nodes split to the right when appended to, so a
+//  directory filled in name order gets full nodes, and they are freed only
+//  when they empty.
+//
+
+//--------------------------------------------------------------------
+
+static CHILD_INDEX_NODE_ childIndexNodeMake( U2 Height )
+
+{
+    //  A leaf has no use for the Child array.
+    size_t NumBytes = Height ? sizeof( CHILD_INDEX_NODE ) : offsetof( CHILD_INDEX_NODE, Child );
+    CHILD_INDEX_NODE_ Node = AllocateAndZeroMemory( NumBytes );
+    if ( Node ) Node->Height = Height;
+    return Node;
+}
+
+//--------------------------------------------------------------------
+//
+//  Free a node and everything under it.
+
+static void childIndexNodeUnmake( CHILD_INDEX_NODE_ Node )
+
+{
+    if ( Node->Height ) for ( U4 i = 0; i < Node->NumItems; i++ ) childIndexNodeUnmake( Node->Child[i] );
+    FreeMemory( Node );
+}
+
+//--------------------------------------------------------------------
+
+static void childIndexNodePut( CHILD_INDEX_NODE_ Node, U4 Slot, U8 Key, ID Id, CHILD_INDEX_NODE_ Child )
+
+{
+    U4 NumAfter = Node->NumItems - Slot;
+    memmove( &Node->Key[Slot + 1], &Node->Key[Slot], NumAfter * sizeof( U8 ) );
+    memmove( &Node->Id [Slot + 1], &Node->Id [Slot], NumAfter * sizeof( ID ) );
+    Node->Key[Slot] = Key;
+    Node->Id [Slot] = Id;
+    if ( Node->Height )
+    {
+        memmove( &Node->Child[Slot + 1], &Node->Child[Slot], NumAfter * sizeof( CHILD_INDEX_NODE_ ) );
+        Node->Child[Slot] = Child;
+    }
+    Node->NumItems++;
+}
+
+//--------------------------------------------------------------------
+
+static void childIndexNodeTake( CHILD_INDEX_NODE_ Node, U4 Slot )
+
+{
+    U4 NumAfter = Node->NumItems - Slot - 1;
+    memmove( &Node->Key[Slot], &Node->Key[Slot + 1], NumAfter * sizeof( U8 ) );
+    memmove( &Node->Id [Slot], &Node->Id [Slot + 1], NumAfter * sizeof( ID ) );
+    if ( Node->Height ) memmove( &Node->Child[Slot], &Node->Child[Slot + 1], NumAfter * sizeof( CHILD_INDEX_NODE_ ) );
+    Node->NumItems--;
+}
+
+//--------------------------------------------------------------------
+//
+//  Walk down to the leaf for Name, noting the node and slot taken at each height.
+//  Slots[0] is the first child in the leaf not below Name; return if it is Name.
 
-ID GetID()
+static B1 childIndexSeek( VCB_ Vcb, CHILD_INDEX_NODE_ Root, S1_ Name, U8 Key,
+                          CHILD_INDEX_NODE_ Path[CHILD_INDEX_MAX_HEIGHT], U4 Slots[CHILD_INDEX_MAX_HEIGHT] )
 
 {
-    ID Id;
-    if ( Volume_WhereTableLastRecycledID )
+    CHILD_INDEX_NODE_ Node = Root;
+    while ( Node->Height )
+    {
+        //  Take the last child whose smallest name is not above Name.
+        U4 i = 1;
+        while ( i < Node->NumItems && entryCompare( Vcb, Name, Key, Node->Key[i], Node->Id[i] ) >= 0 ) i++;
+        Path [Node->Height] = Node;
+        Slots[Node->Height] = i - 1;
+        Node = Node->Child[i - 1];
+    }
+
+    int Difference = 1;
+    U4  i = 0;
+    while ( i < Node->NumItems && ( Difference = entryCompare( Vcb, Name, Key, Node->Key[i], Node->Id[i] ) ) > 0 ) i++;
+    Path [0] = Node;
+    Slots[0] = i;
+    return i < Node->NumItems && Difference == 0;
+}
+
+//--------------------------------------------------------------------
+
+static NTSTATUS childIndexInsert( VCB_ Vcb, CHILD_INDEX_NODE_* RootHandle, ID Id )
+
+{
+    S1_ Name = EntryForId( Vcb, Id )->Name;
+    U8  Key  = EntryHotForId( Vcb, Id )->NameKey;
+
+    CHILD_INDEX_NODE_ Path[CHILD_INDEX_MAX_HEIGHT];
+    U4                Slots[CHILD_INDEX_MAX_HEIGHT];
+    B1 Found = childIndexSeek( Vcb, *RootHandle, Name, Key, Path, Slots );
+ASSERT( ! Found );
+    int Height = ( *RootHandle )->Height;
+
+    //  The lowest level with room takes an item; every full level below it splits.
+    int Level = 0;
+    while ( Level <= Height && Path[Level]->NumItems == CHILD_INDEX_NODE_NUM_ITEMS ) Level++;
+    if ( Level == CHILD_INDEX_MAX_HEIGHT ) return STATUS_INSUFFICIENT_RESOURCES;
+
+    //  Make all the new nodes first, so we can back out cleanly.
+    int NumNewNodes = Level + ( Level > Height ? 1 : 0 );  //  Maybe a new root too.
+    CHILD_INDEX_NODE_ NewNodes[CHILD_INDEX_MAX_HEIGHT + 1];
+    for ( int n = 0; n < NumNewNodes; n++ )
+    {
+        NewNodes[n] = childIndexNodeMake( ( U2 ) n );
+        if ( ! NewNodes[n] )
+        {
+            while ( n-- ) FreeMemory( NewNodes[n] );
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+    }
+
+    //  Split each full level, passing the new node's smallest child up to the next.
+    CHILD_INDEX_NODE_ Child = 0;
+    for ( int h = 0; h < Level; h++ )
     {
-        Id = Volume_WhereTableLastRecycledID;
-        Volume_WhereTableLastRecycledID = ( ID ) ( U8 ) Entries[Volume_WhereTableLastRecycledID];
+        CHILD_INDEX_NODE_ Node  = Path[h];
+        CHILD_INDEX_NODE_ Right = NewNodes[h];
+        U4                Slot  = h ? Slots[h] + 1 : Slots[0];
+
+        //  Appending starts an empty node, rather than leaving two half full ones.
+        U4 Keep = Slot == CHILD_INDEX_NODE_NUM_ITEMS ? Slot : CHILD_INDEX_NODE_NUM_ITEMS / 2;
+        U4 Move = CHILD_INDEX_NODE_NUM_ITEMS - Keep;
+        memcpy( Right->Key, &Node->Key[Keep], Move * sizeof( U8 ) );
+        memcpy( Right->Id,  &Node->Id [Keep], Move * sizeof( ID ) );
+        if ( h ) memcpy( Right->Child, &Node->Child[Keep], Move * sizeof( CHILD_INDEX_NODE_ ) );
+        Right->NumItems = ( U2 ) Move;
+        Node->NumItems  = ( U2 ) Keep;
+
+        if ( Slot < Keep ) childIndexNodePut( Node,  Slot,        Key, Id, Child );
+        else               childIndexNodePut( Right, Slot - Keep, Key, Id, Child );
+
+        if ( h == 0 )
+        {
+            Right->Prev = Node;
+            Right->Next = Node->Next;
+            if ( Node->Next ) Node->Next->Prev = Right;
+            Node->Next = Right;
+        }
+
+        Key   = Right->Key[0];
+        Id    = Right->Id [0];
+        Child = Right;
+    }
+
+    if ( Level <= Height )
+    {
+        childIndexNodePut( Path[Level], Level ? Slots[Level] + 1 : Slots[0], Key, Id, Child );
     }
     else
     {
-        if ( Volume_WhereTableFirstUnusedBottomID >= Volume_WhereTableMaxId )
+        //  The whole path was full, so the tree grows a new root.
+        CHILD_INDEX_NODE_ Root = NewNodes[Level];
+        childIndexNodePut( Root, 0, ( *RootHandle )->Key[0], ( *RootHandle )->Id[0], *RootHandle );
+        childIndexNodePut( Root, 1, Key, Id, Child );
+        *RootHandle = Root;
+    }
+
+    return 0;
+}
+
+//--------------------------------------------------------------------
+
+static void childIndexRemove( VCB_ Vcb, CHILD_INDEX_NODE_* RootHandle, ID Id )
+
+{
+    CHILD_INDEX_NODE_ Path[CHILD_INDEX_MAX_HEIGHT];
+    U4                Slots[CHILD_INDEX_MAX_HEIGHT];
+    B1 Found = childIndexSeek( Vcb, *RootHandle, EntryForId( Vcb, Id )->Name, EntryHotForId( Vcb, Id )->NameKey, Path, Slots );
+ASSERT( Found && Path[0]->Id[ Slots[0] ] == Id );
+    int Height = ( *RootHandle )->Height;
+
+    CHILD_INDEX_NODE_ Leaf     = Path[0];
+    CHILD_INDEX_NODE_ NextLeaf = Leaf->Next;
+    childIndexNodeTake( Leaf, Slots[0] );
+
+    //  Free the nodes that are now empty, from the bottom up.
+    int h = 0;
+    while ( h <= Height && Path[h]->NumItems == 0 )
+    {
+        if ( h == 0 )
+        {
+            if ( Leaf->Prev ) Leaf->Prev->Next = Leaf->Next;
+            if ( Leaf->Next ) Leaf->Next->Prev = Leaf->Prev;
+        }
+        FreeMemory( Path[h] );
+        h++;
+        if ( h <= Height ) childIndexNodeTake( Path[h], Slots[h] );
+    }
+    if ( h > Height )
+    {
+        *RootHandle = 0;
+        return;
+    }
+
+    //  If the node we stopped at lost its first child, it has a new smallest one,
+    //  which the nearest ancestor that reaches it through a later slot routes by.
+    if ( Slots[h] == 0 )
+    {
+        CHILD_INDEX_NODE_ First = h ? NextLeaf : Leaf;
+        for ( int a = h + 1; a <= Height; a++ )
+        {
+            if ( ! Slots[a] ) continue;
+            Path[a]->Key[ Slots[a] ] = First->Key[0];
+            Path[a]->Id [ Slots[a] ] = First->Id [0];
+            break;
+        }
+    }
+
+    //  A root with just one child is not needed.
+    while ( ( *RootHandle )->Height && ( *RootHandle )->NumItems == 1 )
+    {
+        CHILD_INDEX_NODE_ Root = *RootHandle;
+        *RootHandle = Root->Child[0];
+        FreeMemory( Root );
+    }
+}
+
+//--------------------------------------------------------------------
+//
+//  Index a directory's children, in order. Without the memory for it, do without.
+
+static void childIndexBuild( VCB_ Vcb, ID DirectoryId )
+
+{
+    ENTRY_HOT_ Hot = EntryHotForId( Vcb, DirectoryId );
+ASSERT( ! Hot->ChildIndex );
+
+    Hot->ChildIndex = childIndexNodeMake( 0 );
+    if ( ! Hot->ChildIndex ) return;
+
+    for ( ID x = EntryFirst( Vcb, ChildrenTree( EntryForId( Vcb, DirectoryId ) ) ); x; x = EntryNext( Vcb, x ) )
+    {
+        if ( childIndexInsert( Vcb, &Hot->ChildIndex, x ) )
         {
-ASSERT( 0 );
-            return 0;  //  No more IDs.
+            ChildIndexFree( Vcb, DirectoryId );
+            return;
         }
-        Id = Volume_WhereTableFirstUnusedBottomID;
-        Volume_WhereTableFirstUnusedBottomID++;
     }
 
-    Volume_TotalNumberOfEntries++;
+    Vcb->ChildIndexNumBuilt++;
+}
+
+//////////////////////////////////////////////////////////////////////
+
+void ChildIndexFree( VCB_ Vcb, ID DirectoryId )
+
+{
+    ENTRY_HOT_ Hot = EntryHotForId( Vcb, DirectoryId );
+    if ( Hot->ChildIndex ) childIndexNodeUnmake( Hot->ChildIndex );
+    Hot->ChildIndex = 0;
+}
+
+//////////////////////////////////////////////////////////////////////
+//
+//  Look up a child by name. Use the directory's index if it has one, or else
+//  splay its sibling tree, and give it an index if that search went deep.
+
+ID FindChild( VCB_ Vcb, ID DirectoryId, S1_ Name )
+
+{
+    CHILD_INDEX_NODE_ Index = EntryHotForId( Vcb, DirectoryId )->ChildIndex;
+    if ( Index )
+    {
+        CHILD_INDEX_NODE_ Path[CHILD_INDEX_MAX_HEIGHT];
+        U4                Slots[CHILD_INDEX_MAX_HEIGHT];
+        Vcb->ChildIndexNumLookups++;
+        return childIndexSeek( Vcb, Index, Name, entryNameKey( Name ), Path, Slots ) ? Path[0]->Id[ Slots[0] ] : 0;
+    }
+
+    ID* rootHandle = ChildrenTree_( EntryForId( Vcb, DirectoryId ) );
+    if ( ! *rootHandle ) return 0;
+
+    ID  x;
+    int Depth;
+    int Difference = entrySeek( Vcb, rootHandle, &x, Name, &Depth );
+    entrySplay( Vcb, rootHandle, x );
+
+#if CHILD_INDEXES == YES
+    if ( Depth >= CHILD_INDEX_MIN_SEEK_DEPTH ) childIndexBuild( Vcb, DirectoryId );
+#endif
+
+    return Difference ? 0 : x;
+}
+
+//////////////////////////////////////////////////////////////////////
+
+ID GetID( VCB_ Vcb )
+
+{
+    ID Id = WhereTableTakeId( Vcb );
+    if ( ! Id ) return 0;  //  No more IDs, or no memory for more.
+
+    Vcb->TotalNumberOfEntries++;
 
     return Id;
 }
 
 //////////////////////////////////////////////////////////////////////
 
-void RecycleID( ID Id )
+void RecycleID( VCB_ Vcb, ID Id )
 
 {
-    Entries[Id] = ( ENTRY_ ) ( U8 ) Volume_WhereTableLastRecycledID;
-    Volume_WhereTableLastRecycledID = Id;
+    WhereTableGiveBackId( Vcb, Id );
 
-    Volume_TotalNumberOfEntries--;
+    Vcb->TotalNumberOfEntries--;
 
-LogFormatted( "Just recycled %d. Volume_TotalNumberOfEntries now %d\n", Id, Volume_TotalNumberOfEntries );
+LogFormatted( "Just recycled %d. Vcb->TotalNumberOfEntries now %d\n", Id, Vcb->TotalNumberOfEntries );
 }
 
 //////////////////////////////////////////////////////////////////////
 
-ID MakeEntry( ID ParentId, U4 DirectoryOrNumRanges, char* Name )
+ID MakeEntry( VCB_ Vcb, ID ParentId, U4 DirectoryOrNumRanges, char* Name )
 
 {
     size_t NewNameLen = strlen( Name );
     size_t size = offsetof( ENTRY, Name ) + NewNameLen + 1;
     U4 N = DirectoryOrNumRanges;
     if ( N == A_DIRECTORY ) size += sizeof( ID );
-    else                    size += offsetof( FILE_DATA, DataRange ) + N * sizeof( DATA_RANGE );
+    else                    size += offsetof( FILE_DATA, RangeBytes );  //  Files start empty.
+ASSERT( N == 0 || N == A_DIRECTORY );
 
-    ENTRY_ Entry = EntriesAllocate( ( U4 ) size );
+    ENTRY_ Entry = EntriesAllocate( Vcb, ( U4 ) size );
 
     if ( ! Entry ) return 0;
 
 ASSERT( NewNameLen < 255 );
     Entry->NameNumBytes = ( U1 ) NewNameLen;
     strcpy( Entry->Name, Name );
-    NTSTATUS Status = 0;
-    if ( Status )
-    {
-        FreeMemory( Entry );
-        return 0;
-    }
 
     if ( N == A_DIRECTORY ) Entry->FileAttributes = FILE_ATTRIBUTE_DIRECTORY;
     else                    Entry->FileAttributes = FILE_ATTRIBUTE_NORMAL;  //  TODO temp should use OrNormal, right?
 
 
-    //  Pick out an Entry ID.
-    ID Id = GetID();
+    //  Pick out an Entry ID. If they have run out, the caller fails the create.
+    ID Id = GetID( Vcb );
     if ( ! Id )
     {
-ASSERT( 0 );
+        EntriesFree( Vcb, Entry );
         return 0;
     }
 
     Entry->Id = Id;
-    Entries[Id] = Entry;
+    *EntryForId_( Vcb, Id ) = Entry;
+    EntryHotRefresh( Vcb, Id );
 
-    if ( ParentId ) AttachEntry( Entries[ParentId], Entry );
+    if ( ParentId ) AttachEntry( Vcb, EntryForId( Vcb, ParentId ), Entry );
 
     return Id;
 }
@@ -368,6 +687,11 @@ U4 EntrySize( ENTRY_ Entry )
 
 {
     size_t Size  = offsetof( ENTRY, Name ) + Entry->NameNumBytes + 1;
+    if ( EntryIsAnExtentNode( Entry ) )
+    {
+        Size += sizeof( EXTENT_NODE );
+    }
+    else
     if ( EntryIsADirectory( Entry ) )
     {
         Size += sizeof( ID );
@@ -375,31 +699,36 @@ U4 EntrySize( ENTRY_ Entry )
     else
     {
         FILE_DATA_ FileData  = Data( Entry );
-        Size += offsetof( FILE_DATA, DataRange ) + FileData->NumRanges * sizeof( DATA_RANGE );
+        Size += offsetof( FILE_DATA, RangeBytes );
+        Size += DataIsInline( FileData ) ? ( size_t ) FileData->AllocationNumBytes : FileData->NumRangeBytes;
     }
     return ( U4 ) Size;
 }
 
 //////////////////////////////////////////////////////////////////////
 
-NTSTATUS ResizeEntry( ID Id, S1_ NewNameOrZero, S4 DeltaToNumRanges )
+//  Resize the name, and for a file, its tail: the bytes after its FILE_DATA header,
+//  which are its data ranges or its inline data. The caller fixes the header.
+
+static NTSTATUS resizeEntry( VCB_ Vcb, ID Id, S1_ NewNameOrZero, S4 DeltaToTailNumBytes )
 
 {
-    B1 D = IdIsADirectory( Id );
+    B1 D = IdIsADirectory( Vcb, Id );
 
-    ENTRY_     OldEntry     = Entries[Id];
+    ENTRY_     OldEntry     = EntryForId( Vcb, Id );
     U1         OldNameLen   = OldEntry->NameNumBytes;
     FILE_DATA_ OldFileData  = D ? 0 : Data( OldEntry );
-    U4         OldNumRanges = D ? 0 : OldFileData->NumRanges;
     U4         OldSize      = EntrySize( OldEntry );
+    U1_        OldTail      = D ? 0 : OldFileData->RangeBytes;
+    U4         OldTailNumBytes = D ? 0 : OldSize - ( U4 ) ( OldTail - ( U1_ ) OldEntry );
 
     U1         NewNameLen   = ( U1 ) ( NewNameOrZero ? strlen( NewNameOrZero ) : OldNameLen );
-    U4         NewNumRanges = OldNumRanges + DeltaToNumRanges;
+    U4         NewTailNumBytes = OldTailNumBytes + DeltaToTailNumBytes;
 
-    int NumRangeBytesAdding = D ? 0 : DeltaToNumRanges * sizeof( DATA_RANGE );
+    int NumTailBytesAdding  = D ? 0 : DeltaToTailNumBytes;
     int NumNameBytesAdding  = NewNameLen - OldNameLen;
-    int NumBytesAdding      = NumNameBytesAdding + NumRangeBytesAdding;
-    if ( NumBytesAdding > ( int ) EntriesNumBytesAvailable )
+    int NumBytesAdding      = NumNameBytesAdding + NumTailBytesAdding;
+    if ( NumBytesAdding > ( int ) Vcb->EntriesNumBytesAvailable )
         return STATUS_INSUFFICIENT_RESOURCES;
 
     U4 NewSize = ( U4 ) ( OldSize + NumBytesAdding );
@@ -409,45 +738,36 @@ NTSTATUS ResizeEntry( ID Id, S1_ NewNameOrZero, S4 DeltaToNumRanges )
 
 
     //  Yes, if we don't need to resize at all.
-    if ( NewNameLen == OldNameLen && ! DeltaToNumRanges )
+    if ( NewNameLen == OldNameLen && ! NumTailBytesAdding )
     {
         if ( NewNameOrZero ) strcpy( OldEntry->Name, NewNameOrZero );
         return 0;
     }
 
 
-    //  Yes, if we are just shedding some ranges.
-    if ( NewNameOrZero == 0 && DeltaToNumRanges < 0 )
+    //  Yes, if we are just shedding some of the tail, and it is enough to leave a hole.
+    //  Packed ranges come and go a few bytes at a time, so it often is not.
+    if ( NewNameOrZero == 0 && NumTailBytesAdding < 0 )
     {
-        U4_ AddressOfShedding = ( U4_ ) ( ( ( U1_ ) OldFileData )
-                              + offsetof( FILE_DATA, DataRange )
-                              + NewNumRanges * sizeof( DATA_RANGE ) );
-        OldFileData->NumRanges = NewNumRanges;
-        AddressOfShedding[0] = 0;                                   //  Marker for unused
-        AddressOfShedding[1] = ( U4 ) ( 0 - NumRangeBytesAdding );  //  Number of unused
-        return 0;
+        if ( EntriesShedBytes( Vcb, OldTail + NewTailNumBytes, ( U4 ) ( 0 - NumTailBytesAdding ) ) ) return 0;
     }
 
 
-    //  Yes, if we are the last entry and we are just adding some ranges.
-    if ( NewNameOrZero == 0 && DeltaToNumRanges > 0 )
+    //  Yes, if we are just adding to the tail and the bytes after us are free,
+    //  either because we are the last entry or because a hole follows us.
+    if ( NewNameOrZero == 0 && NumTailBytesAdding > 0 )
     {
-        U1_ AddressOfEndOfEntry    = ( U1_ ) OldEntry + OldSize;
-        U1_ AddressOfFirstFreeByte = EntriesBytes + EntriesFirstFreeByte;
-        B1 WeAreLast = AddressOfEndOfEntry == AddressOfFirstFreeByte;
-        if ( WeAreLast )
+        U1_ AddressOfEndOfEntry = ( U1_ ) OldEntry + OldSize;
+        if ( EntriesClaimBytes( Vcb, AddressOfEndOfEntry, ( U4 ) NumTailBytesAdding ) )
         {
-            OldFileData->NumRanges = NewNumRanges;
-            EntriesFirstFreeByte     += ( U4 ) NumRangeBytesAdding;
-            EntriesNumBytesAvailable -= ( U4 ) NumRangeBytesAdding;
-            Zero( &OldFileData->DataRange[OldNumRanges], NumRangeBytesAdding );
+            Zero( OldTail + OldTailNumBytes, NumTailBytesAdding );
             return 0;
         }
     }
 
 
-    ENTRY_ NewEntry = EntriesAllocate( ( U4 ) NewSize );
-ASSERT( NewEntry );
+    ENTRY_ NewEntry = EntriesAllocate( Vcb, ( U4 ) NewSize );
+    if ( ! NewEntry ) return STATUS_INSUFFICIENT_RESOURCES;
 
     if ( NewNameOrZero )
     {
@@ -467,45 +787,144 @@ ASSERT( NewEntry );
     else
     {
         FILE_DATA_ NewFileData  = Data( NewEntry );
-        U4 MinNumRanges = min( OldNumRanges, NewNumRanges );
-        U4 NumExtraToCopy = offsetof( FILE_DATA, DataRange ) + MinNumRanges * sizeof( DATA_RANGE );
+        U4 NumExtraToCopy = offsetof( FILE_DATA, RangeBytes ) + min( OldTailNumBytes, NewTailNumBytes );
         memcpy( NewFileData, OldFileData, NumExtraToCopy );
-        NewFileData->NumRanges = NewNumRanges;
     }
 
 
-    Entries[Id] = NewEntry;
+    *EntryForId_( Vcb, Id ) = NewEntry;
+
+    EntriesFreeBytes( Vcb, ( U1_ ) OldEntry, OldSize );
+
+    return 0;
+}
+
+//////////////////////////////////////////////////////////////////////
+
+NTSTATUS ResizeEntry( VCB_ Vcb, ID Id, S1_ NewNameOrZero, S4 DeltaToNumRanges, S4 DeltaToNumRangeBytes )
+
+{
+    NTSTATUS Status = resizeEntry( Vcb, Id, NewNameOrZero, DeltaToNumRangeBytes );
+    if ( Status ) return Status;
+
+    if ( DeltaToNumRanges || DeltaToNumRangeBytes )
+    {
+        FILE_DATA_ FileData = Data( EntryForId( Vcb, Id ) );
+        FileData->NumRanges     = ( U2 ) ( FileData->NumRanges     + DeltaToNumRanges     );
+        FileData->NumRangeBytes = ( U2 ) ( FileData->NumRangeBytes + DeltaToNumRangeBytes );
+    }
+
+    return 0;
+}
+
+//////////////////////////////////////////////////////////////////////
+
+NTSTATUS ResizeEntryInlineData( VCB_ Vcb, ID Id, U4 NewNumBytes )
+
+{
+    FILE_DATA_ FileData = Data( EntryForId( Vcb, Id ) );
+ASSERT( DataIsInline( FileData ) );
 
-    EntriesFree( OldEntry );
+    NTSTATUS Status = resizeEntry( Vcb, Id, 0, ( S4 ) NewNumBytes - ( S4 ) FileData->AllocationNumBytes );
+    if ( Status ) return Status;
+
+    Data( EntryForId( Vcb, Id ) )->AllocationNumBytes = NewNumBytes;
 
     return 0;
 }
 
 //////////////////////////////////////////////////////////////////////
+//
+//  Grow two files a block at a time in turn, so their ranges interleave and each packs into
+//  a few bytes, then shrink them a range at a time with other entries right after them, which
+//  is when a shrink is too small to leave a hole. Check the store after every step, and after
+//  compacting it. The files are in no directory, and are gone again after.
+
+#define ENTRIES_SELF_TEST_NUM_RANGES 12  //  Few enough to stay in the entry.
 
-void UnmakeEntry( ID Id )
+NTSTATUS EntriesSelfTest( VCB_ Vcb, S1_ Buffer, int MaxNumBytes )
 
 {
-    if ( Entries[Id]->ParentId ) DetachEntry( Entries[Id] );
+    ID       Ids[3];
+    U4       NumShrinks = 0;
+    NTSTATUS Status     = 0;
+
+    Ids[0] = MakeEntry( Vcb, 0, 0, "entries self test a" );
+    Ids[1] = MakeEntry( Vcb, 0, 0, "entries self test b" );
+    Ids[2] = 0;
+    if ( ! Ids[0] || ! Ids[1] ) Status = STATUS_INSUFFICIENT_RESOURCES;
+
+    for ( U4 i = 1; i <= ENTRIES_SELF_TEST_NUM_RANGES && ! Status; i++ )
+    {
+        for ( int f = 0; f < 2 && ! Status; f++ ) Status = DataReallocateFile( Vcb, Ids[f], ( U8 ) i * Volume_BlockSize );
+    }
 
-ASSERT( ! HasChildren( Id ) );
+    //  One more entry, so that neither file is last in the store.
+    if ( ! Status )
+    {
+        Ids[2] = MakeEntry( Vcb, 0, 0, "entries self test c" );
+        if ( ! Ids[2] ) Status = STATUS_INSUFFICIENT_RESOURCES;
+    }
 
-    if ( IdIsAFile( Id ) )
+    for ( U4 i = ENTRIES_SELF_TEST_NUM_RANGES; i-- && ! Status; )
     {
-        NTSTATUS Status = DataResizeFile( Id, 0, DONT_FILL );
+        for ( int f = 0; f < 2 && ! Status; f++ )
+        {
+            U8 NumBytesTrimmed;
+            Status = DataTrimFile( Vcb, Ids[f], ( U8 ) i * Volume_BlockSize, &NumBytesTrimmed );
+            if ( ! Status ) Status = EntriesCheck( Vcb );
+            NumShrinks++;
+        }
+    }
+
+    if ( ! Status )
+    {
+        EntriesCompact( Vcb );
+        Status = EntriesCheck( Vcb );
+    }
+
+    for ( int f = 0; f < 3; f++ )
+    {
+        if ( ! Ids[f] ) continue;
+        U8 NumBytesTrimmed;
+        DataTrimFile( Vcb, Ids[f], 0, &NumBytesTrimmed );
+        UnmakeEntry( Vcb, Ids[f] );
+    }
+
+    return RtlStringCchPrintfA( Buffer, MaxNumBytes, "EntriesSelfTest %s after %u shrinks   status $%X",
+            Status ? "FAILED" : "passed", NumShrinks, Status );
+}
+
+//////////////////////////////////////////////////////////////////////
+
+void UnmakeEntry( VCB_ Vcb, ID Id )
+
+{
+    if ( EntryForId( Vcb, Id )->ParentId ) DetachEntry( Vcb, EntryForId( Vcb, Id ) );
+
+ASSERT( ! HasChildren( Vcb, Id ) );
+
+    if ( IdIsAFile( Vcb, Id ) )
+    {
+        //  Its dirty cache is not worth writing now.
+        CachePurgeFile( Vcb, Id );
+
+        NTSTATUS Status = DataResizeFile( Vcb, Id, 0, DONT_FILL );
 ASSERT( ! Status );
-        Status = DataReallocateFile( Id, 0 );
+        Status = DataReallocateFile( Vcb, Id, 0 );
 ASSERT( ! Status );
     }
 
-    EntriesFree( Entries[Id] );
+    ChildIndexFree( Vcb, Id );
 
-    RecycleID( Id );
+    EntriesFree( Vcb, EntryForId( Vcb, Id ) );
+
+    RecycleID( Vcb, Id );
 }
 
 //////////////////////////////////////////////////////////////////////
 
-NTSTATUS FindByPathAndName( ID StartId, S1_ PathAndName, S1_ *NameOut, ID *ParentIdOut, ID *EntryIdOut )
+NTSTATUS FindByPathAndName( VCB_ Vcb, ID StartId, S1_ PathAndName, S1_ *NameOut, ID *ParentIdOut, ID *EntryIdOut )
 
 {
     //  Let's work on a private copy so we can clobber bytes for our evil ways.
@@ -571,7 +990,7 @@ BreakToDebugger();
 
 
         //  Find it.
-        ID Id =  EntryFind( ChildrenTree_( Entries[AncestorId] ), fm );
+        ID Id =  FindChild( Vcb, AncestorId, fm );
         if ( ! Id )
         {
             if ( ParentIdOut ) *ParentIdOut = 0;
@@ -581,7 +1000,7 @@ BreakToDebugger();
 
         AncestorId = Id;
 
-        if ( IdIsAFile( AncestorId ) )
+        if ( IdIsAFile( Vcb, AncestorId ) )
         {
             if ( ParentIdOut ) *ParentIdOut = 0;
             *EntryIdOut = 0;
@@ -598,7 +1017,7 @@ BreakToDebugger();
         *ParentIdOut = AncestorId;
 
     //  Find the directory entry, if it exists.
-    ID FoundId = EntryFind( ChildrenTree_( Entries[AncestorId] ), fm );
+    ID FoundId = FindChild( Vcb, AncestorId, fm );
     if ( ! FoundId )
     {
         *EntryIdOut = 0;
@@ -610,22 +1029,54 @@ BreakToDebugger();
 
 //////////////////////////////////////////////////////////////////////
 
-void AttachEntry( ENTRY_ Parent, ENTRY_ Entry )
+void AttachEntry( VCB_ Vcb, ENTRY_ Parent, ENTRY_ Entry )
 
 {
-    EntryAttach( ChildrenTree_( Parent ), Entry->Id );
+    if ( EntryAttach( Vcb, ChildrenTree_( Parent ), Entry->Id ) )
+    {
+        ENTRY_HOT_ ParentHot = EntryHotForId( Vcb, Parent->Id );
+        if ( ParentHot->ChildIndex && childIndexInsert( Vcb, &ParentHot->ChildIndex, Entry->Id ) )
+        {
+            ChildIndexFree( Vcb, Parent->Id );  //  Out of memory, so do without.
+        }
+    }
 
     Entry->ParentId = Parent->Id;
+
+    Vcb->ChildrenGeneration++;
 }
 
 //////////////////////////////////////////////////////////////////////
 
-void DetachEntry( ENTRY_ Entry )
+void DetachEntry( VCB_ Vcb, ENTRY_ Entry )
 
 {
-    ENTRY_ Parent = Entries[ Entry->ParentId ];
+    ENTRY_ Parent = EntryForId( Vcb, Entry->ParentId );
+
+    ENTRY_HOT_ ParentHot = EntryHotForId( Vcb, Parent->Id );
+    if ( ParentHot->ChildIndex ) childIndexRemove( Vcb, &ParentHot->ChildIndex, Entry->Id );
+
+    EntryDetach( Vcb, ChildrenTree_( Parent ), Entry->Id );
+
+    Vcb->ChildrenGeneration++;
+}
+
+//////////////////////////////////////////////////////////////////////
+//
+//  Copy an entry's links, attributes, and name key into its hot index slot.
+//  Whoever changes an entry's FileAttributes calls this too.
+
+void EntryHotRefresh( VCB_ Vcb, ID Id )
 
-    EntryDetach( ChildrenTree_( Parent ), Entry->Id );
+{
+    ENTRY_     Entry = EntryForId( Vcb, Id );
+    ENTRY_HOT_ Hot   = EntryHotForId( Vcb, Id );
+
+    Hot->SiblingTreeParentId = Entry->SiblingTreeParentId;
+    Hot->SiblingTreeLeftId   = Entry->SiblingTreeLeftId;
+    Hot->SiblingTreeRightId  = Entry->SiblingTreeRightId;
+    Hot->FileAttributes      = Entry->FileAttributes;
+    Hot->NameKey             = entryNameKey( Entry->Name );
 }
 
 //////////////////////////////////////////////////////////////////////
@@ -36,12 +36,13 @@ NTSTATUS IrpMjQueryInformation( ICB_ Icb )
     int                    BufferNumBytes = ( int ) BufferLength;
     FILE_INFORMATION_CLASS Class          = IrpSp->Parameters.QueryFile.FileInformationClass;
     ID                     Id             = Fcb->Id;
+    VCB_                   Vcb            = Fcb->Vcb;
     NTSTATUS               Status         = STATUS__PRIVATE__NEVER_SET;
 
     ULONG_PTR* NumBytesReturning_;
     NumBytesReturning_ = &Irp->IoStatus.Information;
 
-    ENTRY_ Entry = Entries[Id];
+    ENTRY_ Entry = EntryForId( Vcb, Id );
 
     switch ( Class )
     {
@@ -193,7 +194,7 @@ LogString( "Query FileNormalizedNameInformation\n" );
             //  TODO speedup
 //BreakToDebugger();
             WCHAR NewWayWidePathAndName[1024];
-            int NumWideChars = WideFullPathAndName( Entry, NewWayWidePathAndName );
+            int NumWideChars = WideFullPathAndName( Vcb, Entry, NewWayWidePathAndName );
             NewWayWidePathAndName[NumWideChars] = 0;  //  TODO temp for printing purposes?
 //LogFormatted( "NewWayWidePathAndName = \"%S\"  NumWideChars = %d\n", NewWayWidePathAndName, NumWideChars );
             //  ...the string will begin with a single backslash, regardless of its location.
@@ -291,7 +292,7 @@ LogMarker();
             //  TODO speedup
 //BreakToDebugger();
             WCHAR NewWayWidePathAndName[1024];
-            int NumWideChars = WideFullPathAndName( Entry, NewWayWidePathAndName );
+            int NumWideChars = WideFullPathAndName( Vcb, Entry, NewWayWidePathAndName );
             NewWayWidePathAndName[NumWideChars] = 0;  //  TODO temp for printing purposes?
 LogFormatted( "NewWayWidePathAndName = \"%S\"  NumWideChars = %d\n", NewWayWidePathAndName, NumWideChars );
             //  ...the string will begin with a single backslash, regardless of its location.
@@ -416,12 +417,12 @@ NTSTATUS IrpMjSetInformation ( ICB_ Icb )
     CCB_          Ccb          = FileObject->FsContext2;
     ULONG         BufferLength = IrpSp->Parameters.SetFile.Length;
     ID            Id           = Fcb->Id;
-    ENTRY_        Entry        = Entries[Id];
 
     PDEVICE_OBJECT DeviceObject = Icb->DeviceObject;
     if ( DeviceObject == Volume_TailwindDeviceObject ) return STATUS_INVALID_DEVICE_REQUEST;
 
-    VCB_ Vcb = DeviceObject->DeviceExtension;
+    VCB_   Vcb   = DeviceObject->DeviceExtension;
+    ENTRY_ Entry = EntryForId( Vcb, Id );
 
 LogFormatted( "IrpMjSetInformation on %s\n", Entry->Name );
 
@@ -483,14 +484,14 @@ LogFormatted( "DestinationPathAndName is \"%s\"\n", DestinationPathAndName );
             ID  DestinationParentId;
             ID  DestinationId;
             S1_ DestinationName = ( S1_ )-1;//TODO -1 is temp test
-            Status = FindByPathAndName( Vcb->RootId, DestinationPathAndName, &DestinationName, &DestinationParentId, &DestinationId );
+            Status = FindByPathAndName( Vcb, Vcb->RootId, DestinationPathAndName, &DestinationName, &DestinationParentId, &DestinationId );
             if ( ! DestinationParentId )
             {///////  Don't have a home! Are we supposed to create the destination dir( s )?
 BreakToDebugger();
                 return STATUS_INVALID_PARAMETER;  //  TODO need real value here===================================
             }
-            ENTRY_ DestinationParentEntry = Entries[DestinationParentId];
-            ENTRY_ DestinationEntry       = Entries[DestinationId];
+            ENTRY_ DestinationParentEntry = EntryForId( Vcb, DestinationParentId );
+            ENTRY_ DestinationEntry       = EntryForId( Vcb, DestinationId );
 
 
             //  Handle the case where the destination already exists.
@@ -512,21 +513,21 @@ BreakToDebugger();
 
 
 LogString( "DELETE - unmake entry.\n" );
-                UnmakeEntry( DestinationId );
+                UnmakeEntry( Vcb, DestinationId );
 //BreakToDebugger();
 //LogString( "What about fcb and ccb?\n" );
 
             }
 
 
-            DetachEntry( Entry );
+            DetachEntry( Vcb, Entry );
 
             ID MyId = Entry->Id;
-            Status = ResizeEntry( MyId, DestinationName, 0 );
+            Status = ResizeEntry( Vcb, MyId, DestinationName, 0, 0 );
             if( Status ) return Status;  //  and reattach?  TODO
-            Entry = Entries[MyId];
+            Entry = EntryForId( Vcb, MyId );
 
-            AttachEntry( DestinationParentEntry, Entry );
+            AttachEntry( Vcb, DestinationParentEntry, Entry );
 
 
             return Status;
@@ -571,9 +572,13 @@ LogFormatted( "Set FileBasicInformation                        BufferLength is %
                     FileAttributes |= FILE_ATTRIBUTE_DIRECTORY;
                 }
 
+                //  Only FSCTL_SET_SPARSE changes this one.
+                FileAttributes |= Entry->FileAttributes & FILE_ATTRIBUTE_SPARSE_FILE;
+
 LogFormatted( "Set FileBasicInformation FileAttributes from $%X to $%X\n", Entry->FileAttributes, FileAttributes );
 
                 Entry->FileAttributes = FileAttributes;
+                EntryHotRefresh( Vcb, Entry->Id );
             }
 
             return STATUS_SUCCESS;
@@ -642,7 +647,7 @@ LogString( "AdvanceOnly and we aren't advancing so we ignore.\n" );
 
             if ( RequestedEndOfFile > DataGetFileNumBytes( Entry ) )
             {
-                Status = DataResizeFile( Id, RequestedEndOfFile, ZERO_FILL );
+                Status = DataResizeFile( Vcb, Id, RequestedEndOfFile, ZERO_FILL );
                 if ( Status == STATUS_INSUFFICIENT_RESOURCES ) Status = STATUS_DISK_FULL;
             }
             else
@@ -665,7 +670,7 @@ LogString( "AdvanceOnly and we aren't advancing so we ignore.\n" );
 
             if ( Status == STATUS_SUCCESS )
             {
-                NTSTATUS sss = DataResizeFile( Id, RequestedEndOfFile, DONT_FILL );
+                NTSTATUS sss = DataResizeFile( Vcb, Id, RequestedEndOfFile, DONT_FILL );
 ASSERT( ! sss );
             }
             return Status;
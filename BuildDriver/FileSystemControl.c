@@ -45,6 +45,40 @@ AlwaysLogString( "FsctlIsPathnameValid always returning STATUS_SUCCESS just like
 
 //////////////////////////////////////////////////////////////////////
 
+NTSTATUS FsctlSetSparse( ICB_ Icb )
+
+{
+    //  Mark a file sparse, or not. Growing a sparse file adds holes, which take no volume space
+    //  until written; see DataFillHoles. Clearing the mark leaves any holes there are, as zeros.
+    PIRP         Irp        = Icb->Irp;
+    IRPSP_       IrpSp      = IoGetCurrentIrpStackLocation( Irp );
+    PFILE_OBJECT FileObject = IrpSp->FileObject;
+    VCB_         Vcb        = Icb->Vcb;
+
+    if ( ! Vcb || ! FileObject || ! FileObject->FsContext2 ) return STATUS_INVALID_PARAMETER;  //  Not a file.
+
+    FCB_   Fcb   = FileObject->FsContext;
+    ENTRY_ Entry = EntryForId( Vcb, Fcb->Id );
+    if ( ! EntryIsAFile( Entry ) ) return STATUS_INVALID_PARAMETER;
+
+    B1 SetSparse = TRUE;
+    if ( IrpSp->Parameters.FileSystemControl.InputBufferLength >= sizeof( FILE_SET_SPARSE_BUFFER ) )
+    {
+        PFILE_SET_SPARSE_BUFFER Buffer = Irp->AssociatedIrp.SystemBuffer;
+        SetSparse = Buffer->SetSparse ? TRUE : FALSE;
+    }
+
+LogFormatted( "FsctlSetSparse %s on %s\n", SetSparse ? "set" : "clear", Entry->Name );
+
+    if ( SetSparse ) Entry->FileAttributes |=  FILE_ATTRIBUTE_SPARSE_FILE;
+    else             Entry->FileAttributes &= ~FILE_ATTRIBUTE_SPARSE_FILE;
+    EntryHotRefresh( Vcb, Entry->Id );
+
+    return STATUS_SUCCESS;
+}
+
+//////////////////////////////////////////////////////////////////////
+
 NTSTATUS TailwindChatSet( S1_ InputBuffer, S1_ OutputBuffer, U4 OutputBufferLength )
 
 {
@@ -78,7 +112,7 @@ NTSTATUS TailwindChatTest( S1_ InputBuffer, S1_ OutputBuffer, U4 OutputBufferLen
 
     //LONG Locked;
     //LONG NumSpinning;
-    //sprintf( OutputBuffer, "ChatVariable set to %d\n", Volume_MetadataLock );
+    //sprintf( OutputBuffer, "ChatVariable set to %d\n", Vcb->MetadataLock );
 
 
     return 0;
@@ -86,7 +120,7 @@ NTSTATUS TailwindChatTest( S1_ InputBuffer, S1_ OutputBuffer, U4 OutputBufferLen
 
 //////////////////////////////////////////////////////////////////////
 
-NTSTATUS TailwindChat( S1_ InputBuffer, S1_ OutputBuffer, U4 OutputBufferLength )
+NTSTATUS TailwindChat( VCB_ Vcb, S1_ InputBuffer, S1_ OutputBuffer, U4 OutputBufferLength )
 
 {
 
@@ -108,6 +142,20 @@ NTSTATUS TailwindChat( S1_ InputBuffer, S1_ OutputBuffer, U4 OutputBufferLength
     }
 
 
+    else
+    if ( strcmp( InputBuffer, "test entries" ) == 0 )
+    {
+
+        if ( ! Vcb ) return STATUS_INVALID_DEVICE_REQUEST;
+
+        S1 report[256];
+        Status = EntriesSelfTest( Vcb, report, 256 );
+        if ( Status ) return Status;
+        if ( OutputBufferLength < strlen( report ) + 1 ) return STATUS_BUFFER_TOO_SMALL;
+        strcpy( OutputBuffer, report );
+    }
+
+
     else
     if ( ( strcmp( InputBuffer, "test" ) == 0 ) || ( memcmp( InputBuffer, "test ", 5 ) == 0 ) )
     {
@@ -128,8 +176,10 @@ DbgBreakPoint();
     if ( strcmp( InputBuffer, "report" ) == 0 )
     {
 
+        if ( ! Vcb ) return STATUS_INVALID_DEVICE_REQUEST;  //  The cache belongs to a volume.
+
         S1 report[1024];
-        Status = CacheReport( report, 1024 );
+        Status = CacheReport( Vcb, report, 1024 );
         ULONG reportLength = ( ULONG ) strlen( report );
         if ( Status ) return Status;
         if ( OutputBufferLength < reportLength ) return STATUS_BUFFER_TOO_SMALL;
@@ -137,6 +187,117 @@ DbgBreakPoint();
     }
 
 
+    else
+    if ( strcmp( InputBuffer, "entries" ) == 0 )
+    {
+
+        if ( ! Vcb ) return STATUS_INVALID_DEVICE_REQUEST;
+
+        S1 report[1024];
+        Status = EntriesReport( Vcb, report, 512 );
+        if ( Status ) return Status;
+        size_t Used = strlen( report );
+        Status = WhereTableReport( Vcb, report + Used, ( int ) ( 1024 - Used ) );
+        if ( Status ) return Status;
+        ULONG reportLength = ( ULONG ) strlen( report );
+        if ( OutputBufferLength < reportLength ) return STATUS_BUFFER_TOO_SMALL;
+        strcpy( OutputBuffer, report );
+    }
+
+
+    else
+    if ( strcmp( InputBuffer, "flushes" ) == 0 )
+    {
+
+        if ( ! Vcb ) return STATUS_INVALID_DEVICE_REQUEST;
+
+        S1 report[512];
+        Status = FlushReport( Vcb, report, 512 );
+        if ( Status ) return Status;
+        if ( OutputBufferLength < strlen( report ) + 1 ) return STATUS_BUFFER_TOO_SMALL;
+        strcpy( OutputBuffer, report );
+    }
+
+
+    else
+    if ( strcmp( InputBuffer, "writeback" ) == 0 )
+    {
+
+        if ( ! Vcb ) return STATUS_INVALID_DEVICE_REQUEST;
+
+        S1 report[1024];
+        Status = WriteBackReport( Vcb, report, 1024 );
+        if ( Status ) return Status;
+        if ( OutputBufferLength < strlen( report ) + 1 ) return STATUS_BUFFER_TOO_SMALL;
+        strcpy( OutputBuffer, report );
+    }
+
+
+    else
+    if ( strcmp( InputBuffer, "io" ) == 0 )
+    {
+
+        if ( ! Vcb ) return STATUS_INVALID_DEVICE_REQUEST;
+
+        S1 report[1024];
+        Status = BlockIoReport( report, 1024, &Vcb->DeviceActivity );
+        if ( Status ) return Status;
+        if ( OutputBufferLength < strlen( report ) + 1 ) return STATUS_BUFFER_TOO_SMALL;
+        strcpy( OutputBuffer, report );
+    }
+
+
+    else
+    if ( strcmp( InputBuffer, "preallocation" ) == 0 )
+    {
+
+        if ( ! Vcb ) return STATUS_INVALID_DEVICE_REQUEST;
+
+        S1 report[1024];
+        Status = PreallocationReport( Vcb, report, 1024 );
+        if ( Status ) return Status;
+        if ( OutputBufferLength < strlen( report ) + 1 ) return STATUS_BUFFER_TOO_SMALL;
+        strcpy( OutputBuffer, report );
+    }
+
+
+    else
+    if ( strcmp( InputBuffer, "launches" ) == 0 )
+    {
+
+        if ( ! Vcb ) return STATUS_INVALID_DEVICE_REQUEST;
+
+        S1 report[1024];
+        Status = LaunchReport( Vcb, report, 1024 );
+        if ( Status ) return Status;
+        if ( OutputBufferLength < strlen( report ) + 1 ) return STATUS_BUFFER_TOO_SMALL;
+        strcpy( OutputBuffer, report );
+    }
+
+
+    else
+    if ( strcmp( InputBuffer, "locks" ) == 0 )
+    {
+        //  Note the lock of the device we were sent to is held by this very request while we report it.
+        S1 report[1024];
+        if ( ! Vcb )
+        {
+            Status = SpinlockReport( report, 1024, "TailwindDeviceLock", &Volume_TailwindDeviceLock );
+            if ( Status ) return Status;
+        }
+        else
+        {
+            Status = SpinlockReport( report, 512, "MetadataLock", &Vcb->MetadataLock );
+            if ( Status ) return Status;
+            size_t Used = strlen( report );
+            Status = SpinlockReport( report + Used, ( int ) ( 1024 - Used ), "CacheLock", &Vcb->CacheLock );
+            if ( Status ) return Status;
+        }
+        if ( OutputBufferLength < strlen( report ) + 1 ) return STATUS_BUFFER_TOO_SMALL;
+        strcpy( OutputBuffer, report );
+    }
+
+
     else
     {
         if ( OutputBufferLength < 6 ) return STATUS_BUFFER_TOO_SMALL;
@@ -162,6 +323,7 @@ NTSTATUS FsctlTailwindChat( ICB_ Icb )
     ULONG  InputBufferLength  = IrpSp->Parameters.FileSystemControl.InputBufferLength;
     ULONG  OutputBufferLength = IrpSp->Parameters.FileSystemControl.OutputBufferLength;
     S1_    Buffer             = Irp->AssociatedIrp.SystemBuffer;
+    VCB_   Vcb                = Icb->Vcb;  //  Zero when sent to our own device.
 
     //ULONG MaxBufferLength    = max( InputBufferLength, OutputBufferLength );
 
@@ -188,7 +350,7 @@ NTSTATUS FsctlTailwindChat( ICB_ Icb )
 
 
 
-    NTSTATUS Status = TailwindChat( InputBuffer, OutputBuffer, OutputBufferLength );
+    NTSTATUS Status = TailwindChat( Vcb, InputBuffer, OutputBuffer, OutputBufferLength );
     if ( ! Status )
         Irp->IoStatus.Information = strlen( OutputBuffer ) + 1;
 
@@ -236,6 +398,7 @@ AlwaysLogFormatted( "FsControlCode is $%X %s\n", FsControlCode, AsText );
       case FSCTL_IS_VOLUME_MOUNTED:   return FsctlVerifyVolume(      Icb );
       case FSCTL_IS_PATHNAME_VALID:   return FsctlIsPathnameValid(   Icb );
       case FSCTL_TAILWIND_CHAT:       return FsctlTailwindChat(      Icb );
+      case FSCTL_SET_SPARSE:          return FsctlSetSparse(         Icb );
 
       case FSCTL_QUERY_RETRIEVAL_POINTERS:  //  drop through  reactos fastfat_new fsctl.c returns this, not STATUS_INVALID_PARAMETER;
       case FSCTL_READ_FILE_USN_DATA:        //  drop through
@@ -268,7 +431,7 @@ void PurgeVolumesFiles ( VCB_ Vcb, B1 FlushBeforePurge )
     {
         FCB_ Fcb = OWNER( FCB, OpenFcbsLink, L );
 
-        ENTRY_ Entry = Entries[Fcb->Id];
+        ENTRY_ Entry = EntryForId( Vcb, Fcb->Id );
 
 AlwaysLogFormatted( "Should be purging %s here.   %d\n", Entry->Name, FlushBeforePurge );
 
@@ -0,0 +1,445 @@
+//
+//  Tailwind: A File System Driver
+//  Copyright (C) 2024 John Oberschelp
+//
+//  This program is free software: you can redistribute it and/or modify it under the
+//  terms of the GNU General Public License as published by the Free Software
+//  Foundation, either version 3 of the License, or (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful, but WITHOUT ANY
+//  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+//  FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License along with this
+//  program. If not, see https://www.gnu.org/licenses/.
+//
+
+#include "Common.h"
+
+//////////////////////////////////////////////////////////////////////
+//
+//  Launch Traces
+//
+//  A program reads much the same extents each time it starts. For a process that started
+//  less than LAUNCH_LEARN_SECONDS ago, we note the extents it reads from the volume until
+//  then, and keep that trace by the program's file name. The next time the program's file
+//  is opened, or a process of it shows up, its trace goes to the front of the prefetch
+//  queue for the background thread to read ahead of it. The traces are written with the
+//  metadata and read back at mount. All of this is under the metadata lock.
+//
+
+#define LAUNCH_LEARN_TIME  ( LAUNCH_LEARN_SECONDS * 10'000'000ULL )  //  In the 100ns units of system time.
+
+//--------------------------------------------------------------------
+
+static U4 launchKey( S1_ Name )
+
+{
+    //  FNV-1a, upper casing ASCII, so "vlc.exe" and "VLC.EXE" are one program.
+    U4 Key = 2166136261U;
+
+    for ( S1_ s = Name; *s; s++ )
+    {
+        U1 c = ( U1 ) *s;
+        if ( c >= 'a' && c <= 'z' ) c = ( U1 ) ( c - 'a' + 'A' );
+        Key = ( Key ^ c ) * 16777619U;
+    }
+
+    return Key;
+}
+
+//--------------------------------------------------------------------
+
+static B1 launchNameIsAProgram( S1_ Name )
+
+{
+    size_t NumBytes = strlen( Name );
+
+    return NumBytes > 4 && _stricmp( Name + NumBytes - 4, ".exe" ) == 0;
+}
+
+//--------------------------------------------------------------------
+
+static U8 launchNow()
+
+{
+    LARGE_INTEGER SystemTime;
+    KeQuerySystemTime( &SystemTime );
+
+    return ( U8 ) SystemTime.QuadPart;
+}
+
+//--------------------------------------------------------------------
+
+static LAUNCH_TRACE_ launchTraceFind( VCB_ Vcb, U4 Key )
+
+{
+    for ( int i = 0; i < LAUNCH_MAX_TRACES; i++ )
+    {
+        LAUNCH_TRACE_ Trace = Vcb->Launches.Traces + i;
+        if ( Trace->Records && Trace->Key == Key ) return Trace;
+    }
+
+    return 0;
+}
+
+//--------------------------------------------------------------------
+
+static void launchTraceAdd( LAUNCH_TRACE_ Trace, U8 VolumeAddress, U4 NumBytes, ID Id )
+
+{
+    for ( U4 i = 0; i < Trace->NumRecords; i++ )
+    {
+        if ( Trace->Records[i].VolumeAddress == VolumeAddress ) return;
+    }
+
+    if ( Trace->NumRecords == LAUNCH_TRACE_MAX_NUM_RECORDS ) return;
+
+    MANIFEST_RECORD_ Record = Trace->Records + Trace->NumRecords++;
+    Record->VolumeAddress = VolumeAddress;
+    Record->NumBytes      = NumBytes;
+    Record->Id            = Id;
+}
+
+//--------------------------------------------------------------------
+
+static void launchPrefetch( VCB_ Vcb, LAUNCH_TRACE_ Trace, U8 Now )
+
+{
+    //  Once per launch; its file is opened, then its process starts and opens more.
+    if ( Now - Trace->LastLaunchTime < LAUNCH_LEARN_TIME ) return;
+    Trace->LastLaunchTime = Now;
+
+    CachePrefetchFirst( Vcb, Trace->Records, Trace->NumRecords );
+    Vcb->Launches.NumPrefetched++;
+}
+
+//--------------------------------------------------------------------
+
+static void launchLearned( VCB_ Vcb, int Slot )
+
+{
+    //  Keep a finished trace. Pages the system still had mapped were not read this time,
+    //  so what the program read before follows what it read now, as room allows.
+    LAUNCHES_     L       = &Vcb->Launches;
+    LAUNCH_TRACE_ Learned = L->Learning + Slot;
+
+    if ( Learned->NumRecords )
+    {
+        LAUNCH_TRACE_ Trace = launchTraceFind( Vcb, Learned->Key );
+
+        if ( Trace )
+        {
+            for ( U4 i = 0; i < Trace->NumRecords; i++ )
+            {
+                MANIFEST_RECORD_ R = Trace->Records + i;
+                launchTraceAdd( Learned, R->VolumeAddress, R->NumBytes, R->Id );
+            }
+        }
+        else
+        {
+            //  Take an unused slot, or forget the least recently launched.
+            Trace = L->Traces;
+            for ( int i = 0; i < LAUNCH_MAX_TRACES && Trace->Records; i++ )
+            {
+                if ( ! L->Traces[i].Records || L->Traces[i].LastLaunchTime < Trace->LastLaunchTime ) Trace = L->Traces + i;
+            }
+        }
+
+        FreeMemory( Trace->Records );
+        *Trace = *Learned;
+        L->NumLearned++;
+    }
+    else FreeMemory( Learned->Records );
+
+    Zero( Learned, sizeof( LAUNCH_TRACE ) );
+    ObDereferenceObject( L->LearningProcess[Slot] );
+    L->LearningProcess[Slot] = 0;
+    L->NumLearning--;
+}
+
+//--------------------------------------------------------------------
+
+static void launchRetire( VCB_ Vcb, U8 Now )
+
+{
+    //  Finish the traces whose time is up.
+    if ( ! Vcb->Launches.NumLearning ) return;
+
+    for ( int Slot = 0; Slot < LAUNCH_MAX_LEARNERS; Slot++ )
+    {
+        if ( ! Vcb->Launches.LearningProcess[Slot] ) continue;
+        if ( Now - Vcb->Launches.Learning[Slot].LastLaunchTime >= LAUNCH_LEARN_TIME ) launchLearned( Vcb, Slot );
+    }
+}
+
+//////////////////////////////////////////////////////////////////////
+
+void LaunchNoteCreate( VCB_ Vcb, PIRP Irp, ENTRY_ Entry )
+
+{
+    //  Called after each successful create of a file or directory.
+    LAUNCHES_ L   = &Vcb->Launches;
+    U8        Now = launchNow();
+
+    launchRetire( Vcb, Now );
+
+    //  A program's file is opened to start it, before its process reads anything.
+    if ( EntryIsAFile( Entry ) && launchNameIsAProgram( Entry->Name ) )
+    {
+        LAUNCH_TRACE_ Trace = launchTraceFind( Vcb, launchKey( Entry->Name ) );
+        if ( Trace ) launchPrefetch( Vcb, Trace, Now );
+    }
+
+    //  Is this a process that is starting, and that we have not seen yet?
+    PEPROCESS Process = IoGetRequestorProcess( Irp );
+    if ( ! Process ) Process = PsGetCurrentProcess();
+
+    for ( int i = 0; i < LAUNCH_MAX_LEARNERS; i++ ) if ( L->LearningProcess[i] == Process ) return;
+
+    U8 CreateTime = ( U8 ) PsGetProcessCreateTimeQuadPart( Process );
+    if ( Now - CreateTime >= LAUNCH_LEARN_TIME ) return;
+
+    HANDLE ProcessId = PsGetProcessId( Process );
+    for ( int i = 0; i < LAUNCH_MAX_RECENT; i++ ) if ( L->RecentId[i] == ProcessId && L->RecentCreateTime[i] == CreateTime ) return;
+    U4 Recent = L->RecentCursor++ % LAUNCH_MAX_RECENT;
+    L->RecentId[Recent]         = ProcessId;
+    L->RecentCreateTime[Recent] = CreateTime;
+
+    //  Which program is it? Its image may be on any volume; we key by its file name.
+    PUNICODE_STRING ImageName;
+    NTSTATUS Status = SeLocateProcessImageName( Process, &ImageName );
+    if ( ! NT_SUCCESS( Status ) ) return;
+
+    WCHAR* Wide     = ImageName->Buffer;
+    U4     NumChars = ImageName->Length / sizeof( WCHAR );
+    U4     First    = NumChars;
+    while ( First && Wide[First - 1] != L'\\' ) First--;
+
+    S1 Name[4 * 256];
+    WideCharactersToUtf8String( ( int ) ( min( NumChars - First, 255 ) * sizeof( WCHAR ) ), Wide + First, Name );
+    ExFreePool( ImageName );
+
+    U4 Key = launchKey( Name );
+
+    //  Prefetch what it read last time, and learn what it reads this time.
+    LAUNCH_TRACE_ Trace = launchTraceFind( Vcb, Key );
+    if ( Trace ) launchPrefetch( Vcb, Trace, Now );
+
+    for ( int Slot = 0; Slot < LAUNCH_MAX_LEARNERS; Slot++ )
+    {
+        if ( L->LearningProcess[Slot] ) continue;
+
+        MANIFEST_RECORD_ Records = AllocateMemory( LAUNCH_TRACE_MAX_NUM_RECORDS * sizeof( MANIFEST_RECORD ) );
+        if ( ! Records ) return;
+
+        LAUNCH_TRACE_ Learning = L->Learning + Slot;
+        Learning->Key            = Key;
+        Learning->NumRecords     = 0;
+        Learning->LastLaunchTime = CreateTime;
+        Learning->Records        = Records;
+        strncpy( Learning->Name, Name, LAUNCH_NAME_NUM_BYTES - 1 );
+        Learning->Name[LAUNCH_NAME_NUM_BYTES - 1] = 0;
+
+        //  Hold the process, so its address is not reused by another while we learn.
+        ObReferenceObject( Process );
+        L->LearningProcess[Slot] = Process;
+        L->NumLearning++;
+        return;
+    }
+}
+
+//////////////////////////////////////////////////////////////////////
+
+void LaunchNoteRead( VCB_ Vcb, PIRP Irp, ENTRY_ Entry, U8 FileOffset, U4 NumBytes )
+
+{
+    //  Called after each successful read of a file, to add its extents to a trace being learned.
+    LAUNCHES_ L = &Vcb->Launches;
+    if ( ! L->NumLearning ) return;
+
+    PEPROCESS Process = IoGetRequestorProcess( Irp );
+    if ( ! Process ) Process = PsGetCurrentProcess();
+
+    int Slot = 0;
+    while ( Slot < LAUNCH_MAX_LEARNERS && L->LearningProcess[Slot] != Process ) Slot++;
+    if ( Slot == LAUNCH_MAX_LEARNERS ) return;
+
+    U8 Now = launchNow();
+    if ( Now - L->Learning[Slot].LastLaunchTime >= LAUNCH_LEARN_TIME )
+    {
+        launchRetire( Vcb, Now );
+        return;
+    }
+
+    if ( DataIsInline( Data( Entry ) ) ) return;
+
+    RANGE_CURSOR Cursor;
+
+    for ( DATA_RANGE_ DataRange = DataRangeAt( Vcb, Entry, FileOffset, &Cursor );
+          DataRange && Cursor.FileOffset < FileOffset + NumBytes;
+          DataRange = DataNextRange( &Cursor ) )
+    {
+        if ( DataRange->State == RANGE_WRITTEN ) launchTraceAdd( L->Learning + Slot, DataRange->VolumeAddress, DataRange->NumBytes, Entry->Id );
+    }
+}
+
+//////////////////////////////////////////////////////////////////////
+
+NTSTATUS LaunchTracesFreeze1( VCB_ Vcb, U1_ *BufferResult, U4_ NumBytesResult )
+
+{
+    //  Copy the traces, to write after the metadata lock is released.
+    launchRetire( Vcb, launchNow() );
+
+    U1_ Buffer = AllocateAndZeroMemory( LAUNCH_MAX_NUM_BYTES );
+    if ( ! Buffer ) return STATUS_INSUFFICIENT_RESOURCES;
+
+    U1_ b = Buffer + 8;
+    U4  NumTraces = 0;
+
+    for ( int i = 0; i < LAUNCH_MAX_TRACES; i++ )
+    {
+        LAUNCH_TRACE_ Trace = Vcb->Launches.Traces + i;
+        if ( ! Trace->Records ) continue;
+
+        PUT4( b, Trace->Key )
+        PUT4( b, Trace->NumRecords )
+        PUT8( b, Trace->LastLaunchTime )
+        memcpy( b, Trace->Name, LAUNCH_NAME_NUM_BYTES );
+        b += LAUNCH_NAME_NUM_BYTES;
+
+        for ( U4 j = 0; j < Trace->NumRecords; j++ )
+        {
+            PUT8( b, Trace->Records[j].VolumeAddress )
+            PUT4( b, Trace->Records[j].NumBytes )
+            PUT4( b, Trace->Records[j].Id )
+        }
+        NumTraces++;
+    }
+
+    *BufferResult   = Buffer;
+    *NumBytesResult = ROUND_UP( ( U4 ) ( b - Buffer ), 4096 );
+
+    b = Buffer;
+    PUT4( b, LAUNCH_MAGIC )
+    PUT4( b, NumTraces )
+
+    return 0;
+}
+
+//////////////////////////////////////////////////////////////////////
+
+NTSTATUS LaunchTracesFreeze2( VCB_ Vcb, U1_ Buffer, U4 NumBytes )
+
+{
+    //  Write the copied traces, then free the copy.
+    NTSTATUS Status = WriteBlockDevice( Vcb->PhysicalDeviceObject, Vcb->OverviewStart + LAUNCH_OFFSET, NumBytes, Buffer, MAY_VERIFY, IO_CHECKPOINT );
+    FreeMemory( Buffer );
+
+    return Status;
+}
+
+//////////////////////////////////////////////////////////////////////
+
+NTSTATUS LaunchTracesThaw( VCB_ Vcb )
+
+{
+    //  Read the traces, if the volume has them.
+    U1_ Buffer = AllocateMemory( LAUNCH_MAX_NUM_BYTES );
+    if ( ! Buffer ) return STATUS_INSUFFICIENT_RESOURCES;
+
+    NTSTATUS Status = ReadBlockDevice( Vcb->PhysicalDeviceObject, Vcb->OverviewStart + LAUNCH_OFFSET, LAUNCH_MAX_NUM_BYTES, Buffer, MAY_VERIFY, IO_DEMAND );
+
+    U1_ b = Buffer;
+    U4  Magic;
+    U4  NumTraces;
+    GET4( b, Magic )
+    GET4( b, NumTraces )
+
+    if ( Status || Magic != LAUNCH_MAGIC || NumTraces > LAUNCH_MAX_TRACES )
+    {
+        FreeMemory( Buffer );
+        return Status;
+    }
+
+    for ( U4 i = 0; i < NumTraces; i++ )
+    {
+        LAUNCH_TRACE_ Trace = Vcb->Launches.Traces + i;
+
+        GET4( b, Trace->Key )
+        GET4( b, Trace->NumRecords )
+        GET8( b, Trace->LastLaunchTime )
+        memcpy( Trace->Name, b, LAUNCH_NAME_NUM_BYTES );
+        b += LAUNCH_NAME_NUM_BYTES;
+        Trace->Name[LAUNCH_NAME_NUM_BYTES - 1] = 0;
+
+        if ( Trace->NumRecords > LAUNCH_TRACE_MAX_NUM_RECORDS ) Trace->Records = 0;
+        else Trace->Records = AllocateMemory( LAUNCH_TRACE_MAX_NUM_RECORDS * sizeof( MANIFEST_RECORD ) );
+        if ( ! Trace->Records )
+        {
+            Zero( Trace, sizeof( LAUNCH_TRACE ) );
+            break;
+        }
+
+        for ( U4 j = 0; j < Trace->NumRecords; j++ )
+        {
+            GET8( b, Trace->Records[j].VolumeAddress )
+            GET4( b, Trace->Records[j].NumBytes )
+            GET4( b, Trace->Records[j].Id )
+        }
+    }
+
+    FreeMemory( Buffer );
+
+AlwaysLogFormatted( "LaunchTracesThaw read %u launch traces\n", NumTraces );
+
+    return 0;
+}
+
+//////////////////////////////////////////////////////////////////////
+
+void LaunchTracesShutdown( VCB_ Vcb )
+
+{
+    LAUNCHES_ L = &Vcb->Launches;
+
+    for ( int Slot = 0; Slot < LAUNCH_MAX_LEARNERS; Slot++ )
+    {
+        if ( ! L->LearningProcess[Slot] ) continue;
+        FreeMemory( L->Learning[Slot].Records );
+        ObDereferenceObject( L->LearningProcess[Slot] );
+    }
+
+    for ( int i = 0; i < LAUNCH_MAX_TRACES; i++ ) FreeMemory( L->Traces[i].Records );
+
+    Zero( L, sizeof( LAUNCHES ) );
+}
+
+//////////////////////////////////////////////////////////////////////
+
+NTSTATUS LaunchReport( VCB_ Vcb, S1_ Buffer, int MaxNumBytes )
+
+{
+    LAUNCHES_ L = &Vcb->Launches;
+
+    NTSTATUS Status = RtlStringCchPrintfA( Buffer, MaxNumBytes,
+            "LaunchReport %u launches learned   %u launches prefetched   %u being learned now  ",
+            L->NumLearned,
+            L->NumPrefetched,
+            L->NumLearning );
+
+    for ( int i = 0; i < LAUNCH_MAX_TRACES && ! Status; i++ )
+    {
+        LAUNCH_TRACE_ Trace = L->Traces + i;
+        if ( ! Trace->Records ) continue;
+
+        S1 scratch[64];
+        Status = RtlStringCchPrintfA( scratch, sizeof( scratch ), " %s:%u", Trace->Name, Trace->NumRecords );
+        if ( ! Status ) Status = RtlStringCchCatA( Buffer, MaxNumBytes, scratch );
+    }
+
+    return Status;
+}
+
+//////////////////////////////////////////////////////////////////////
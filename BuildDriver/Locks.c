@@ -108,7 +108,8 @@ NTSTATUS IrpMjLockControl( ICB_ Icb )
 
 
     FCB_ Fcb = IrpSp->FileObject->FsContext;
-    if ( Fcb->IsAVolume || IdIsADirectory( Fcb->Id ) ) return STATUS_INVALID_PARAMETER;
+    VCB_ Vcb = Fcb->Vcb;
+    if ( Fcb->IsAVolume || IdIsADirectory( Vcb, Fcb->Id ) ) return STATUS_INVALID_PARAMETER;
 
     ID Id  = Fcb->Id;
 
@@ -129,7 +130,7 @@ S1_ M
 : m == IRP_MN_UNLOCK_SINGLE     ? "IRP_MN_UNLOCK_SINGLE"
 : "IRP_MN_?";
 LogFormatted( "Key %d  exclusive?%d  immediate?%d  from $%X  for $%X  on %s  do %s\n",
-Key, Exclusive, Immediate, ( int )ByteOffset, ( int )Length, Entries[Id]->Name, M );
+Key, Exclusive, Immediate, ( int )ByteOffset, ( int )Length, EntryForId( Vcb, Id )->Name, M );
 
 
 //  https://docs.microsoft.com/en-us/windows-hardware/drivers/ddi/ntifs/nf-ntifs-_fsrtl_advanced_fcb_header-fsrtlprocessfilelock
@@ -150,7 +151,7 @@ AlwaysLogString( "PENDING IRP_MN_LOCK\n" );
 
 AlwaysBreakToDebugger();
 ASSERT( ( ! Icb->PendingLocksLink.Next ) && ( ! Icb->PendingLocksLink.Prev ) );
-                AttachLinkLast( &Volume_PendingLocksChain, &Icb->PendingLocksLink );
+                AttachLinkLast( &Vcb->PendingLocksChain, &Icb->PendingLocksLink );
                 Status = STATUS_PENDING;
             }
             break;
@@ -168,7 +169,7 @@ AlwaysLogString( "PENDING IRP_MN_UNLOCK_SINGLE\n" );
 
 AlwaysBreakToDebugger();
 ASSERT( ( ! Icb->PendingLocksLink.Next ) && ( ! Icb->PendingLocksLink.Prev ) );
-                AttachLinkLast( &Volume_PendingLocksChain, &Icb->PendingLocksLink );
+                AttachLinkLast( &Vcb->PendingLocksChain, &Icb->PendingLocksLink );
                 Status = STATUS_PENDING;
             }
             break;
@@ -17,133 +17,482 @@
 #include "Common.h"
 
 //////////////////////////////////////////////////////////////////////
+//
+//  Holes in EntriesBytes
+//
+//  A freed span is marked with a zero ID and its size. Spans big enough
+//  also hold the offsets of their neighbors on the free list of their size
+//  class, so the space is reused right away. Smaller ones wait for EntriesCompact.
+
+typedef struct _ENTRIES_HOLE { U4 Zero, Size, Next, Prev; } ENTRIES_HOLE, *ENTRIES_HOLE_;
+
+//--------------------------------------------------------------------
+
+inline ENTRIES_HOLE_ entriesHole( VCB_ Vcb, U4 Offset )
+
+{
+    return ( ENTRIES_HOLE_ ) ( Vcb->EntriesBytes + Offset );
+}
+
+//--------------------------------------------------------------------
+
+inline int entriesSizeClass( U4 Size )
+
+{
+    U4 Class = Size / 16;
+    return ( int ) min( Class, ENTRIES_NUM_FREE_LISTS - 1 );
+}
+
+//--------------------------------------------------------------------
+
+static void entriesFreeListsReset( VCB_ Vcb )
+
+{
+    for ( int c = 0; c < ENTRIES_NUM_FREE_LISTS; c++ ) Vcb->EntriesFreeLists[c] = ENTRIES_NO_HOLE;
+    Vcb->EntriesNumBytesInHoles = 0;
+}
+
+//--------------------------------------------------------------------
+
+static void entriesMakeHole( VCB_ Vcb, U4 Offset, U4 Size )
+
+{
+ASSERT( Size >= 8 );
+    ENTRIES_HOLE_ Hole = entriesHole( Vcb, Offset );
+    Hole->Zero = 0;
+    Hole->Size = Size;
+    Vcb->EntriesNumBytesInHoles += Size;
+
+    if ( Size < sizeof( ENTRIES_HOLE ) ) return;  //  Too small to link.
+
+    int c = entriesSizeClass( Size );
+    Hole->Prev = ENTRIES_NO_HOLE;
+    Hole->Next = Vcb->EntriesFreeLists[c];
+    if ( Hole->Next != ENTRIES_NO_HOLE ) entriesHole( Vcb, Hole->Next )->Prev = Offset;
+    Vcb->EntriesFreeLists[c] = Offset;
+}
+
+//--------------------------------------------------------------------
+
+static void entriesUnmakeHole( VCB_ Vcb, U4 Offset )
+
+{
+    ENTRIES_HOLE_ Hole = entriesHole( Vcb, Offset );
+    Vcb->EntriesNumBytesInHoles -= Hole->Size;
+
+    if ( Hole->Size < sizeof( ENTRIES_HOLE ) ) return;
 
-NTSTATUS EntriesStartupEmpty( U4 RequestedNumBytes )
+    if ( Hole->Prev != ENTRIES_NO_HOLE ) entriesHole( Vcb, Hole->Prev )->Next = Hole->Next;
+    else                                 Vcb->EntriesFreeLists[ entriesSizeClass( Hole->Size ) ] = Hole->Next;
+    if ( Hole->Next != ENTRIES_NO_HOLE ) entriesHole( Vcb, Hole->Next )->Prev = Hole->Prev;
+}
+
+//--------------------------------------------------------------------
+//
+//  Use the start of the hole for NumBytes, keeping the rest as a hole.
+//  Any rest must be big enough for a hole marker, so not every hole fits.
+
+static B1 entriesTakeFromHole( VCB_ Vcb, U4 Offset, U4 NumBytes )
+
+{
+    U4 Size = entriesHole( Vcb, Offset )->Size;
+    if ( Size != NumBytes && Size < NumBytes + 8 ) return FALSE;
+
+    entriesUnmakeHole( Vcb, Offset );
+    if ( Size > NumBytes ) entriesMakeHole( Vcb, Offset + NumBytes, Size - NumBytes );
+
+    return TRUE;
+}
+
+//--------------------------------------------------------------------
+
+static U4 entriesFindHole( VCB_ Vcb, U4 NumBytes )
+
+{
+    //  Holes in the request's own class may be too small, so look at only a few there.
+    //  In the classes above, the first hole nearly always fits.
+    int FirstClass = entriesSizeClass( NumBytes );
+    for ( int c = FirstClass; c < ENTRIES_NUM_FREE_LISTS; c++ )
+    {
+        int NumTries = 0;
+        for ( U4 Offset = Vcb->EntriesFreeLists[c]; Offset != ENTRIES_NO_HOLE; Offset = entriesHole( Vcb, Offset )->Next )
+        {
+            if ( entriesTakeFromHole( Vcb, Offset, NumBytes ) ) return Offset;
+            if ( c == FirstClass && ++NumTries == 8 ) break;
+        }
+    }
+
+    return ENTRIES_NO_HOLE;
+}
+
+//////////////////////////////////////////////////////////////////////
+
+NTSTATUS EntriesStartupEmpty( VCB_ Vcb, U4 RequestedNumBytes )
 
 {
 LogString( "Entering EntriesStartupEmpty.\n" );
 
-    EntriesTotalAllocation = ROUND_UP( RequestedNumBytes, 4096 );  //  TODO
+    Vcb->EntriesTotalAllocation = ROUND_UP( RequestedNumBytes, 4096 );  //  TODO
 
-    if ( EntriesBytes ) return STATUS_INVALID_PARAMETER;  //  TODO need real value
-    V_ RawBytes = AllocateMemory( EntriesTotalAllocation );
+    if ( Vcb->EntriesBytes ) return STATUS_INVALID_PARAMETER;  //  TODO need real value
+    V_ RawBytes = AllocateMemory( Vcb->EntriesTotalAllocation );
     if ( ! RawBytes ) return STATUS_INSUFFICIENT_RESOURCES;
 
-    memset( RawBytes, -1, EntriesTotalAllocation );  //  TODO temp test
+    memset( RawBytes, -1, Vcb->EntriesTotalAllocation );  //  TODO temp test
 
-    EntriesBytes = RawBytes;
-    EntriesFirstFreeByte     = 0;
-    EntriesNumBytesAvailable = EntriesTotalAllocation;
+    Vcb->EntriesBytes = RawBytes;
+    Vcb->EntriesFirstFreeByte     = 0;
+    Vcb->EntriesNumBytesAvailable = Vcb->EntriesTotalAllocation;
+    Vcb->EntriesHighWaterMark     = 0;
+    entriesFreeListsReset( Vcb );
 
 LogString( "Leaving  EntriesStartupEmpty.\n" );
 
     return 0;
 }
 
+//--------------------------------------------------------------------
+
+static NTSTATUS whereTableAddChunk( VCB_ Vcb )
+
+{
+    if ( Vcb->WhereNumChunks == WHERE_MAX_NUM_CHUNKS ) return STATUS_INSUFFICIENT_RESOURCES;  //  Out of IDs.
+
+    //  Only the small array of chunk pointers is ever copied; the chunks stay put.
+    if ( Vcb->WhereNumChunks == Vcb->WhereMaxNumChunks )
+    {
+        U4 NewMaxNumChunks = max( 16, Vcb->WhereMaxNumChunks * 2 );
+        WHERE_CHUNK_* NewChunks = AllocateMemory( NewMaxNumChunks * sizeof( WHERE_CHUNK_ ) );
+        if ( ! NewChunks ) return STATUS_INSUFFICIENT_RESOURCES;
+        if ( Vcb->WhereChunks ) memcpy( NewChunks, Vcb->WhereChunks, Vcb->WhereNumChunks * sizeof( WHERE_CHUNK_ ) );
+        FreeMemory( Vcb->WhereChunks );
+        Vcb->WhereChunks = NewChunks;
+        Vcb->WhereTableTotalAllocation += ( U4 ) ( ( NewMaxNumChunks - Vcb->WhereMaxNumChunks ) * sizeof( WHERE_CHUNK_ ) );
+        Vcb->WhereMaxNumChunks = NewMaxNumChunks;
+    }
+
+    WHERE_CHUNK_ Chunk = AllocateMemory( sizeof( WHERE_CHUNK ) );
+    if ( ! Chunk ) return STATUS_INSUFFICIENT_RESOURCES;
+    Chunk->NumFreeIds = WHERE_CHUNK_NUM_IDS;
+    memset( Chunk->FreeBits, -1, sizeof( Chunk->FreeBits ) );
+    Zero( Chunk->Entries, sizeof( Chunk->Entries ) );
+    Zero( Chunk->Hot,     sizeof( Chunk->Hot     ) );
+
+    Vcb->WhereChunks[ Vcb->WhereNumChunks++ ] = Chunk;
+    Vcb->WhereTableMaxId            = ( ID ) min( 0x7FFFFFFF, Vcb->WhereNumChunks * ( U8 ) WHERE_CHUNK_NUM_IDS );
+    Vcb->WhereTableTotalAllocation += sizeof( WHERE_CHUNK );
+
+    return 0;
+}
+
+//--------------------------------------------------------------------
+
+static void whereTableMarkUsed( VCB_ Vcb, ID Id )
+
+{
+    WHERE_CHUNK_ Chunk = Vcb->WhereChunks[ Id >> WHERE_CHUNK_SHIFT ];
+    U4           Bit   = Id & WHERE_CHUNK_MASK;
+ASSERT( BitIsSet( Chunk->FreeBits[ Bit / 32 ], 1u << ( Bit % 32 ) ) );
+    Chunk->FreeBits[ Bit / 32 ] &= ~ ( 1u << ( Bit % 32 ) );
+    Chunk->NumFreeIds--;
+
+    Vcb->WhereTableFirstUnusedBottomID = max( Vcb->WhereTableFirstUnusedBottomID, Id + 1 );
+}
+
+//--------------------------------------------------------------------
+
+static NTSTATUS whereTableStartup( VCB_ Vcb )
+
+{
+ASSERT( ! Vcb->WhereChunks );
+    Vcb->WhereNumChunks             = 0;
+    Vcb->WhereMaxNumChunks          = 0;
+    Vcb->WhereFirstChunkWithAFreeId = 0;
+    Vcb->WhereTableTotalAllocation  = 0;
+    Vcb->WhereTableFirstUnusedBottomID = 0;
+
+    NTSTATUS Status = whereTableAddChunk( Vcb );
+    if ( Status ) return Status;
+
+    whereTableMarkUsed( Vcb, 0 );  //  Index of zero reserved for errors like not found.
+
+    return 0;
+}
+
 //////////////////////////////////////////////////////////////////////
 
-NTSTATUS WhereTableStartupEmpty( U4 RequestedNumBytes )
+NTSTATUS WhereTableStartupEmpty( VCB_ Vcb )
 
 {
 LogString( "Entering WhereTableStartupEmpty.\n" );
 
-ASSERT( ! Entries );
-    Volume_WhereTableTotalAllocation = ROUND_UP( RequestedNumBytes, 4096 );  //  TODO
-    Entries = AllocateMemory( Volume_WhereTableTotalAllocation );  //  Volume_WhereTableTotalAllocation );
-    if ( ! Entries )
+    NTSTATUS Status = whereTableStartup( Vcb );
+    if ( Status )
     {
-        FreeMemory( EntriesBytes );
-        EntriesBytes = 0;
-        return STATUS_INSUFFICIENT_RESOURCES;
+        WhereTableShutdown( Vcb );
+        FreeMemory( Vcb->EntriesBytes );
+        Vcb->EntriesBytes = 0;
+        return Status;
     }
-    Entries[0] = 0;  //  TODO Index of zero reserved for errors like not found.
-    Volume_WhereTableMaxId = Volume_WhereTableTotalAllocation / sizeof( ENTRY_ );
-    Volume_WhereTableLastRecycledID = 0;  //  i.e. No recycled IDs.
-    Volume_WhereTableFirstUnusedBottomID = 1;  //  Index of zero reserved for errors like not found.
 
-    Volume_TotalNumberOfEntries = 0;
+    Vcb->TotalNumberOfEntries = 0;
 
 LogString( "Leaving  WhereTableStartupEmpty.\n" );
 
     return 0;
 }
 
+//////////////////////////////////////////////////////////////////////
+//
+//  Returns the lowest unused Id, keeping the table dense, or zero if there are none left.
+
+ID WhereTableTakeId( VCB_ Vcb )
+
+{
+    U4 c = Vcb->WhereFirstChunkWithAFreeId;
+    while ( c < Vcb->WhereNumChunks && ! Vcb->WhereChunks[c]->NumFreeIds ) c++;
+    if ( c == Vcb->WhereNumChunks )
+    {
+        if ( whereTableAddChunk( Vcb ) ) return 0;
+    }
+    Vcb->WhereFirstChunkWithAFreeId = c;
+
+    WHERE_CHUNK_ Chunk = Vcb->WhereChunks[c];
+    for ( U4 w = 0; w < WHERE_CHUNK_NUM_IDS / 32; w++ )
+    {
+        unsigned long b;
+        if ( ! _BitScanForward( &b, Chunk->FreeBits[w] ) ) continue;
+
+        ID Id = ( ID ) ( ( c << WHERE_CHUNK_SHIFT ) + w * 32 + b );
+        whereTableMarkUsed( Vcb, Id );
+        return Id;
+    }
+
+ASSERT( 0 );  //  NumFreeIds was wrong.
+    return 0;
+}
+
+//////////////////////////////////////////////////////////////////////
+
+void WhereTableGiveBackId( VCB_ Vcb, ID Id )
+
+{
+    U4           c     = Id >> WHERE_CHUNK_SHIFT;
+    WHERE_CHUNK_ Chunk = Vcb->WhereChunks[c];
+    U4           Bit   = Id & WHERE_CHUNK_MASK;
+
+ASSERT( BitIsClear( Chunk->FreeBits[ Bit / 32 ], 1u << ( Bit % 32 ) ) );
+    Chunk->FreeBits[ Bit / 32 ] |= 1u << ( Bit % 32 );
+    Chunk->NumFreeIds++;
+    Chunk->Entries[Bit] = 0;
+    Zero( &Chunk->Hot[Bit], sizeof( ENTRY_HOT ) );
+
+    Vcb->WhereFirstChunkWithAFreeId = min( Vcb->WhereFirstChunkWithAFreeId, c );
+}
+
+//////////////////////////////////////////////////////////////////////
+
+NTSTATUS WhereTableReport( VCB_ Vcb, S1_ Buffer, int MaxNumBytes )
+
+{
+    U8 NumBytes = Vcb->WhereTableTotalAllocation;
+    U8 NumIds   = max( 1, Vcb->TotalNumberOfEntries );
+
+    return RtlStringCchPrintfA( Buffer, MaxNumBytes,
+            "WhereTableReport %u chunks of %d IDs   %u IDs in use, highest %d   "
+            "%llu bytes, %llu bytes per million entries",
+            Vcb->WhereNumChunks,
+            WHERE_CHUNK_NUM_IDS,
+            Vcb->TotalNumberOfEntries,
+            Vcb->WhereTableFirstUnusedBottomID - 1,
+            NumBytes,
+            NumBytes * 1'000'000 / NumIds );
+}
+
 //////////////////////////////////////////////////////////////////////
 
-NTSTATUS EntriesShutdown()
+NTSTATUS EntriesShutdown( VCB_ Vcb )
 
 {
-    if ( ! EntriesBytes ) return STATUS_INVALID_PARAMETER;  //  TODO need real value
+    if ( ! Vcb->EntriesBytes ) return STATUS_INVALID_PARAMETER;  //  TODO need real value
 
-    FreeMemory( EntriesBytes );
-    EntriesBytes = 0;
+    FreeMemory( Vcb->EntriesBytes );
+    Vcb->EntriesBytes = 0;
 
     return 0;
 }
 
 //////////////////////////////////////////////////////////////////////
 
-NTSTATUS WhereTableShutdown()
+NTSTATUS WhereTableShutdown( VCB_ Vcb )
 
 {
-    FreeMemory( Entries );
-    Entries = 0;
+    for ( U4 c = 0; c < Vcb->WhereNumChunks; c++ )
+    {
+        WHERE_CHUNK_ Chunk = Vcb->WhereChunks[c];
+        for ( U4 i = 0; i < WHERE_CHUNK_NUM_IDS; i++ ) if ( Chunk->Hot[i].ChildIndex ) ChildIndexFree( Vcb, ( ID ) ( ( c << WHERE_CHUNK_SHIFT ) + i ) );
+        FreeMemory( Chunk );
+    }
+    FreeMemory( Vcb->WhereChunks );
+    Vcb->WhereChunks       = 0;
+    Vcb->WhereNumChunks    = 0;
+    Vcb->WhereMaxNumChunks = 0;
 
     return 0;
 }
 
 //////////////////////////////////////////////////////////////////////
 
-ENTRY_ EntriesAllocate( U4 NumBytesToAllocate )
+ENTRY_ EntriesAllocate( VCB_ Vcb, U4 NumBytesToAllocate )
 
 {
-    if ( NumBytesToAllocate > EntriesNumBytesAvailable ) return 0;
+    Vcb->EntriesNumAllocations++;
 
-    ENTRY_ Entry = ( ENTRY_ ) &EntriesBytes[EntriesFirstFreeByte];
-    Zero( Entry, NumBytesToAllocate );
+    U4 Offset = entriesFindHole( Vcb, NumBytesToAllocate );
+    if ( Offset != ENTRIES_NO_HOLE )
+    {
+        Vcb->EntriesNumAllocationsFromHoles++;
+    }
+    else
+    {
+        if ( NumBytesToAllocate > Vcb->EntriesNumBytesAvailable ) return 0;
 
-    EntriesFirstFreeByte     += NumBytesToAllocate;
-    EntriesNumBytesAvailable -= NumBytesToAllocate;
+        Offset = Vcb->EntriesFirstFreeByte;
+        Vcb->EntriesFirstFreeByte     += NumBytesToAllocate;
+        Vcb->EntriesNumBytesAvailable -= NumBytesToAllocate;
+        Vcb->EntriesHighWaterMark      = max( Vcb->EntriesHighWaterMark, Vcb->EntriesFirstFreeByte );
+    }
+
+    ENTRY_ Entry = ( ENTRY_ ) &Vcb->EntriesBytes[Offset];
+    Zero( Entry, NumBytesToAllocate );
 
     return Entry;
 }
 
 //////////////////////////////////////////////////////////////////////
 
-void EntriesFree( ENTRY_ Entry )
+void EntriesFreeBytes( VCB_ Vcb, U1_ Address, U4 NumBytes )
 
 {
-    U4 Size = EntrySize( Entry );
+    U4 Offset = ( U4 ) ( Address - Vcb->EntriesBytes );
+    U4 End    = Offset + NumBytes;
 
-    //  Special case the last entry.
-    U1_ u1 = ( U1_ ) Entry;
-    if ( u1 + Size ==  &EntriesBytes[ EntriesFirstFreeByte ] )
+    //  Merge with any holes that follow.
+    while ( End < Vcb->EntriesFirstFreeByte && entriesHole( Vcb, End )->Zero == 0 )
     {
-        EntriesFirstFreeByte     -= Size;
-        EntriesNumBytesAvailable += Size;
+        U4 Size = entriesHole( Vcb, End )->Size;
+        entriesUnmakeHole( Vcb, End );
+        End += Size;
+    }
+
+    //  At the end of the store, just give the bytes back.
+    if ( End == Vcb->EntriesFirstFreeByte )
+    {
+        Vcb->EntriesNumBytesAvailable += End - Offset;
+        Vcb->EntriesFirstFreeByte      = Offset;
         return;
     }
 
-    //  Stomp on the ID and save the size.
-    U4_ u4 = ( U4_ ) u1;
-    u4[0] = 0;
-    u4[1] = Size;
+    entriesMakeHole( Vcb, Offset, End - Offset );
+}
+
+//////////////////////////////////////////////////////////////////////
+//
+//  Free the last NumBytes of an entry, so it shrinks in place, unless that would leave
+//  a hole too small for its marker; then FALSE, and the caller moves the entry instead.
+
+B1 EntriesShedBytes( VCB_ Vcb, U1_ Address, U4 NumBytes )
+
+{
+    U4 End = ( U4 ) ( Address - Vcb->EntriesBytes ) + NumBytes;
+
+    if (    NumBytes < 8
+         && End != Vcb->EntriesFirstFreeByte
+         && entriesHole( Vcb, End )->Zero != 0 ) return FALSE;  //  Another entry follows.
+
+    EntriesFreeBytes( Vcb, Address, NumBytes );
+    return TRUE;
+}
+
+//////////////////////////////////////////////////////////////////////
+
+void EntriesFree( VCB_ Vcb, ENTRY_ Entry )
+
+{
+    EntriesFreeBytes( Vcb, ( U1_ ) Entry, EntrySize( Entry ) );
+}
+
+//////////////////////////////////////////////////////////////////////
+//
+//  Claim NumBytes starting at Address, which must be the end of an entry,
+//  if they are free; lets an entry grow in place.
+
+B1 EntriesClaimBytes( VCB_ Vcb, U1_ Address, U4 NumBytes )
+
+{
+    U4 Offset = ( U4 ) ( Address - Vcb->EntriesBytes );
+
+    if ( Offset == Vcb->EntriesFirstFreeByte )
+    {
+        if ( NumBytes > Vcb->EntriesNumBytesAvailable ) return FALSE;
+        Vcb->EntriesFirstFreeByte     += NumBytes;
+        Vcb->EntriesNumBytesAvailable -= NumBytes;
+        Vcb->EntriesHighWaterMark      = max( Vcb->EntriesHighWaterMark, Vcb->EntriesFirstFreeByte );
+        return TRUE;
+    }
+
+    if ( entriesHole( Vcb, Offset )->Zero != 0 ) return FALSE;  //  Another entry.
+
+    return entriesTakeFromHole( Vcb, Offset, NumBytes );
+}
+
+//////////////////////////////////////////////////////////////////////
+
+NTSTATUS EntriesReport( VCB_ Vcb, S1_ Buffer, int MaxNumBytes )
+
+{
+    //  Files, directories and extent tree nodes.
+    U4 NumEntries        = Vcb->TotalNumberOfEntries;
+    U4 NumBytesInEntries = Vcb->EntriesFirstFreeByte - Vcb->EntriesNumBytesInHoles;
+
+    return RtlStringCchPrintfA( Buffer, MaxNumBytes,
+            "EntriesReport %u bytes in use of %u ( high water %u )   %u bytes in holes   "
+            "%u entries averaging %u bytes   %llu child indexes built, %llu lookups through them   "
+            "%llu allocations, %llu from holes   %llu compactions%s   "
+            "%llu slices moved %llu bytes and reclaimed %llu, pausing %llu us at most and %llu us in all",
+            Vcb->EntriesFirstFreeByte,
+            Vcb->EntriesTotalAllocation,
+            Vcb->EntriesHighWaterMark,
+            Vcb->EntriesNumBytesInHoles,
+            NumEntries,
+            NumEntries ? NumBytesInEntries / NumEntries : 0,
+            Vcb->ChildIndexNumBuilt,
+            Vcb->ChildIndexNumLookups,
+            Vcb->EntriesNumAllocations,
+            Vcb->EntriesNumAllocationsFromHoles,
+            Vcb->EntriesNumCompactions,
+            Vcb->EntriesCompacting ? " ( compacting )" : "",
+            Vcb->EntriesCompactNumSlices,
+            Vcb->EntriesCompactNumBytesMoved,
+            Vcb->EntriesCompactNumBytesReclaimed,
+            Vcb->EntriesCompactMaxPauseMicroseconds,
+            Vcb->EntriesCompactTotalPauseMicroseconds );
 }
 
 //////////////////////////////////////////////////////////////////////
 
 //  May goober up any ENTRY_	
 
-void EntriesCompact()
+void EntriesCompact( VCB_ Vcb )
 
 {
-    U1_ Fm = EntriesBytes;
+    U1_ Fm = Vcb->EntriesBytes;
     U1_ To = Fm;
     U4 doubleCheckTheNumberOfEntries = 0;
     for (;;)
     {
 
-if ( Fm == EntriesBytes + EntriesFirstFreeByte ) break;
+if ( Fm == Vcb->EntriesBytes + Vcb->EntriesFirstFreeByte ) break;
 
         if ( ( ( U4_ ) Fm ) [0] )
         {
@@ -154,9 +503,9 @@ if ( Fm == EntriesBytes + EntriesFirstFreeByte ) break;
 
             U4 Size = EntrySize( Entry );
 
-ASSERT( ( U1_ ) Entries[Id] == Fm );
+ASSERT( ( U1_ ) EntryForId( Vcb, Id ) == Fm );
             if ( Fm != To ) memmove( To, Fm, Size );
-            Entries[Id] = ( ENTRY_ ) To;
+            *EntryForId_( Vcb, Id ) = ( ENTRY_ ) To;
             Fm += Size;
             To += Size;
         }
@@ -168,28 +517,172 @@ ASSERT( ( U1_ ) Entries[Id] == Fm );
         }
     }
 
-    EntriesFirstFreeByte     = ( U4 ) ( To - &EntriesBytes[0] );
-    EntriesNumBytesAvailable = EntriesTotalAllocation - EntriesFirstFreeByte;
+    Vcb->EntriesFirstFreeByte     = ( U4 ) ( To - &Vcb->EntriesBytes[0] );
+    Vcb->EntriesNumBytesAvailable = Vcb->EntriesTotalAllocation - Vcb->EntriesFirstFreeByte;
+    Vcb->EntriesNumCompactions++;
+    entriesFreeListsReset( Vcb );  //  No holes are left.
+
+AlwaysLogFormatted( "%d doubleCheckTheNumberOfEntries   %d Volume_TotalNumberOfEntries\n", doubleCheckTheNumberOfEntries, Vcb->TotalNumberOfEntries );
+ASSERT( doubleCheckTheNumberOfEntries == Vcb->TotalNumberOfEntries );
+}
+
+//////////////////////////////////////////////////////////////////////
+//
+//  Walk the store the way EntriesThaw does, and check that it parses: every entry is where
+//  its Id says, every hole is big enough for its marker, and the walk ends at the free bytes.
+
+NTSTATUS EntriesCheck( VCB_ Vcb )
+
+{
+    U4 At         = 0;
+    U4 NumEntries = 0;
+    U4 NumInHoles = 0;
+
+    while ( At < Vcb->EntriesFirstFreeByte )
+    {
+        ENTRIES_HOLE_ Hole = entriesHole( Vcb, At );
+        if ( Hole->Zero )
+        {
+            ENTRY_ Entry = ( ENTRY_ ) Hole;
+            if ( Entry->Id >= Vcb->WhereTableFirstUnusedBottomID || EntryForId( Vcb, Entry->Id ) != Entry ) break;
+            NumEntries++;
+            At += EntrySize( Entry );
+        }
+        else
+        {
+            if ( Hole->Size < 8 ) break;
+            NumInHoles += Hole->Size;
+            At += Hole->Size;
+        }
+    }
+
+    if (    At         != Vcb->EntriesFirstFreeByte
+         || NumEntries != Vcb->TotalNumberOfEntries
+         || NumInHoles != Vcb->EntriesNumBytesInHoles )
+    {
+AlwaysLogFormatted( "EntriesCheck failed at %u of %u: %u entries of %u, %u bytes in holes of %u\n",
+At, Vcb->EntriesFirstFreeByte, NumEntries, Vcb->TotalNumberOfEntries, NumInHoles, Vcb->EntriesNumBytesInHoles );
+        return STATUS_DISK_CORRUPT_ERROR;
+    }
+
+    return 0;
+}
+
+//////////////////////////////////////////////////////////////////////
+//
+//  Compact a little, called with the metadata lock held.
+//
+//  Rather than sliding every entry down at once, a slice finds the next hole
+//  after the cursor and slides the entries after it down into it, so the hole
+//  moves up, swallowing the holes it meets, until it reaches the end of the store
+//  and is given back. The store is whole between slices, so other irps run as usual.
+//  Returns TRUE if it did some work.
+
+B1 EntriesCompactSlice( VCB_ Vcb )
+
+{
+    U4 InUse = Vcb->EntriesFirstFreeByte;
+    U4 Holes = Vcb->EntriesNumBytesInHoles;
+
+    if ( ! Vcb->EntriesCompacting )
+    {
+        if ( Holes < ENTRIES_COMPACT_MIN_NUM_BYTES )                      return FALSE;
+        if ( ( U8 ) Holes * 100 < ( U8 ) InUse * ENTRIES_COMPACT_START_PERCENT ) return FALSE;
+        Vcb->EntriesCompacting    = TRUE;
+        Vcb->EntriesCompactCursor = 0;
+    }
+    else
+    if ( ( U8 ) Holes * 100 <= ( U8 ) InUse * ENTRIES_COMPACT_STOP_PERCENT )
+    {
+        Vcb->EntriesCompacting = FALSE;
+        return FALSE;
+    }
+
+    U8 Start  = CurrentMicrosecond();
+    U4 Budget = ENTRIES_COMPACT_SLICE_NUM_BYTES;
+
+    //  Find the next hole.
+    U4 Offset = Vcb->EntriesCompactCursor;
+    for (;;)
+    {
+        if ( Offset >= Vcb->EntriesFirstFreeByte )
+        {
+            //  We made it to the end; start over next time if still needed.
+            Vcb->EntriesCompactCursor = 0;
+            Vcb->EntriesCompacting    = FALSE;
+            Vcb->EntriesNumCompactions++;
+            return FALSE;
+        }
+        ENTRIES_HOLE_ Hole = entriesHole( Vcb, Offset );
+        if ( Hole->Zero == 0 ) break;
+
+        U4 Size = EntrySize( ( ENTRY_ ) Hole );
+        Offset += Size;
+        if ( Budget <= Size )
+        {
+            Vcb->EntriesCompactCursor = Offset;
+            return TRUE;
+        }
+        Budget -= Size;
+    }
+
+    //  Slide entries down into it, swallowing any holes we meet.
+    U4 To = Offset;
+    U4 Fm = Offset;
+    while ( Fm < Vcb->EntriesFirstFreeByte )
+    {
+        ENTRIES_HOLE_ Hole = entriesHole( Vcb, Fm );
+        if ( Hole->Zero == 0 )
+        {
+            U4 Size = Hole->Size;
+            entriesUnmakeHole( Vcb, Fm );
+            Fm += Size;
+            continue;
+        }
+
+        ENTRY_ Entry = ( ENTRY_ ) Hole;
+        U4     Size  = EntrySize( Entry );
+        if ( Size > Budget && To != Offset ) break;
+
+ASSERT( ( U1_ ) EntryForId( Vcb, Entry->Id ) == Vcb->EntriesBytes + Fm );
+        memmove( Vcb->EntriesBytes + To, Entry, Size );
+        *EntryForId_( Vcb, ( ( ENTRY_ ) ( Vcb->EntriesBytes + To ) )->Id ) = ( ENTRY_ ) ( Vcb->EntriesBytes + To );
+        Vcb->EntriesCompactNumBytesMoved += Size;
+        To += Size;
+        Fm += Size;
+        Budget -= min( Budget, Size );
+    }
+
+    //  What is left behind is one hole, or is given back if it reaches the end.
+    U4 OldFirstFreeByte = Vcb->EntriesFirstFreeByte;
+    EntriesFreeBytes( Vcb, Vcb->EntriesBytes + To, Fm - To );
+    Vcb->EntriesCompactNumBytesReclaimed += OldFirstFreeByte - Vcb->EntriesFirstFreeByte;
+    Vcb->EntriesCompactCursor = To;
 
-AlwaysLogFormatted( "%d doubleCheckTheNumberOfEntries   %d Volume_TotalNumberOfEntries\n", doubleCheckTheNumberOfEntries, Volume_TotalNumberOfEntries );
-ASSERT( doubleCheckTheNumberOfEntries == Volume_TotalNumberOfEntries );
+    U8 Pause = CurrentMicrosecond() - Start;
+    Vcb->EntriesCompactNumSlices++;
+    Vcb->EntriesCompactTotalPauseMicroseconds += Pause;
+    Vcb->EntriesCompactMaxPauseMicroseconds    = max( Vcb->EntriesCompactMaxPauseMicroseconds, Pause );
+
+    return TRUE;
 }
 
 //////////////////////////////////////////////////////////////////////
 
-NTSTATUS EntriesFreeze( V_ Buffer, U4 NumBytes )
+NTSTATUS EntriesFreeze( VCB_ Vcb, U1_ Buffer, U4 FromByte, U4 NumBytes )
 
 {
-    PDEVICE_OBJECT DeviceObject = Volume_PhysicalDeviceObject;
+    //  Write NumBytes of the copied entries in Buffer, from FromByte on; a big copy goes a slice at a time.
+    PDEVICE_OBJECT DeviceObject = Vcb->PhysicalDeviceObject;
     U8 Offset;
     NTSTATUS Status;
 
-    Offset = Volume_EntriesStart;
+    Offset = Vcb->EntriesStart + FromByte;
 
-AlwaysLogFormatted( "Writing EntriesBytes. %d bytes.\n", NumBytes );
+AlwaysLogFormatted( "Writing EntriesBytes. %d bytes from %d.\n", NumBytes, FromByte );
 UINT64 msFm = CurrentMillisecond();
 
-    Status = WriteBlockDevice( DeviceObject, Offset, NumBytes, Buffer, MAY_VERIFY );
+    Status = WriteBlockDevice( DeviceObject, Offset, NumBytes, Buffer + FromByte, MAY_VERIFY, IO_CHECKPOINT );
     if ( Status ) return Status;
 
 UINT64 msTo = CurrentMillisecond();
@@ -200,47 +693,44 @@ AlwaysLogFormatted( "Wrote   EntriesBytes. %d bytes in %d ms.\n", NumBytes, ( in
 
 //////////////////////////////////////////////////////////////////////
 
-NTSTATUS EntriesThaw()
+NTSTATUS EntriesThaw( VCB_ Vcb )
 
 {
-//  TODO great time to remove entries from the Volume_WhereTableLastRecycledID chain?
-//  need to preserve supporting variables.
-
-    PDEVICE_OBJECT DeviceObject = Volume_PhysicalDeviceObject;
+    PDEVICE_OBJECT DeviceObject = Vcb->PhysicalDeviceObject;
     U8 Offset;
     U4 Length;
     V_ Buffer;
     NTSTATUS Status;
 
-ASSERT( ! Entries );
-ASSERT( ! EntriesBytes );
+ASSERT( ! Vcb->WhereChunks );
+ASSERT( ! Vcb->EntriesBytes );
 
-AlwaysLogFormatted( "Reading EntriesBytes. %d bytes.\n", EntriesTotalAllocation );
+AlwaysLogFormatted( "Reading EntriesBytes. %d bytes.\n", Vcb->EntriesTotalAllocation );
 UINT64 msFm = CurrentMillisecond();
 
     //  Allocate the EntriesBytes.
-    if ( EntriesBytes ) return STATUS_INVALID_PARAMETER;  //  TODO need real value
+    if ( Vcb->EntriesBytes ) return STATUS_INVALID_PARAMETER;  //  TODO need real value
 
 AlwaysLogString( "allocating\n" );
 
-    V_ RawBytes = AllocateMemory( EntriesTotalAllocation );
+    V_ RawBytes = AllocateMemory( Vcb->EntriesTotalAllocation );
     if ( ! RawBytes ) return STATUS_INSUFFICIENT_RESOURCES;
 
 AlwaysLogString( "-1\n" );
 
-    memset( RawBytes, -1, EntriesTotalAllocation );  //  TODO temp test
-    EntriesBytes = RawBytes;
+    memset( RawBytes, -1, Vcb->EntriesTotalAllocation );  //  TODO temp test
+    Vcb->EntriesBytes = RawBytes;
 
 AlwaysLogString( "reading\n" );
 
     //  Read the EntriesBytes.
-    Offset = Volume_EntriesStart;
-    Length = ROUND_UP( EntriesFirstFreeByte, 4096 );//xxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxx
-    Buffer = EntriesBytes;
+    Offset = Vcb->EntriesStart;
+    Length = ROUND_UP( Vcb->EntriesFirstFreeByte, 4096 );//xxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxx
+    Buffer = Vcb->EntriesBytes;
 
 AlwaysLogFormatted( "reading %d bytes\n", Length );
 
-    Status = ReadBlockDevice( DeviceObject, Offset, Length, Buffer, MAY_VERIFY );
+    Status = ReadBlockDevice( DeviceObject, Offset, Length, Buffer, MAY_VERIFY, IO_DEMAND );
     if ( Status ) return Status;
 
 
@@ -248,29 +738,28 @@ UINT64 msTo = CurrentMillisecond();
 AlwaysLogFormatted( "Read EntriesBytes. %d bytes in %d ms.\n", Length, ( int ) ( msTo - msFm ) );
 
 
-    //  Rebuild the Entries array.
+    //  Rebuild the where table, adding chunks as we meet higher IDs.
+    //  Whatever IDs we do not meet are left free, so there is no recycled list to rebuild.
 
-AlwaysLogFormatted( "Rebuilding the Entries array. Allocating %d bytes.\n", Volume_WhereTableTotalAllocation );
+AlwaysLogString( "Rebuilding the where table.\n" );
 
-ASSERT( ! Entries );
-    Entries = AllocateMemory( Volume_WhereTableTotalAllocation );
-    if ( ! Entries )
+    Status = whereTableStartup( Vcb );
+    if ( Status )
     {
-        FreeMemory( EntriesBytes );
-        EntriesBytes = 0;
-        return STATUS_INSUFFICIENT_RESOURCES;
+        WhereTableShutdown( Vcb );
+        FreeMemory( Vcb->EntriesBytes );
+        Vcb->EntriesBytes = 0;
+        return Status;
     }
-    Entries[0] = 0;  //  TODO Index of zero reserved for errors like not found.
-
-
-AlwaysLogString( "Allocated\n" );
 
-AlwaysLogString( "TEMPORARY set all memory addresses to zero.\n" );
+    //  Rebuild the free lists as we go; the links saved in holes are stale.
+    entriesFreeListsReset( Vcb );
+    Vcb->EntriesHighWaterMark = Vcb->EntriesFirstFreeByte;
 
-    U1_ Fm = EntriesBytes;
+    U1_ Fm = Vcb->EntriesBytes;
     for (;;)
     {
-        if ( Fm == EntriesBytes + EntriesFirstFreeByte ) break;
+        if ( Fm == Vcb->EntriesBytes + Vcb->EntriesFirstFreeByte ) break;
 
         if ( ( ( U4_ ) Fm ) [0] )
         {
@@ -278,7 +767,14 @@ AlwaysLogString( "TEMPORARY set all memory addresses to zero.\n" );
             ENTRY_ Entry = ( ENTRY_ ) Fm;
 
             ID Id = Entry->Id;
-            Entries[Id] = Entry;
+            while ( ( U4 ) ( Id >> WHERE_CHUNK_SHIFT ) >= Vcb->WhereNumChunks )
+            {
+                Status = whereTableAddChunk( Vcb );
+                if ( Status ) return Status;
+            }
+            *EntryForId_( Vcb, Id ) = Entry;
+            whereTableMarkUsed( Vcb, Id );
+            EntryHotRefresh( Vcb, Id );
 
             U4 Size = EntrySize( Entry );
             Fm += Size;
@@ -287,17 +783,10 @@ AlwaysLogString( "TEMPORARY set all memory addresses to zero.\n" );
         {
             //  A freed Entry.
             U4 Size = ( ( U4_ ) Fm ) [1];
+            entriesMakeHole( Vcb, ( U4 ) ( Fm - Vcb->EntriesBytes ), Size );
             Fm += Size;
         }
     }
-    //  Rebuild a recycled ids list. Any ones that are zero are unused.
-    Volume_WhereTableLastRecycledID = 0;
-    for ( ID Id = 1; Id < ( int ) Volume_TotalNumberOfEntries; Id++ )
-    {
-        if ( Entries[Id] ) continue;
-        Entries[Id] = ( ENTRY_ ) ( U8 ) Volume_WhereTableLastRecycledID;
-        Volume_WhereTableLastRecycledID = Id;
-    }
 
 AlwaysLogString( "b\n" );
 
@@ -306,34 +795,34 @@ AlwaysLogString( "b\n" );
 
 //////////////////////////////////////////////////////////////////////
 
-NTSTATUS OverviewFreeze1( U1_ Buffer )
+NTSTATUS OverviewFreeze1( VCB_ Vcb, U1_ Buffer )
 
 {
     memset( Buffer, -1, 4096 );  //  TODO temp
     U1_ b = Buffer;
 
     PUT8( b, 0 )                         //  Will be number of bytes.
-    PUT4( b, Volume_TotalNumberOfEntries )
-    PUT4( b, Volume_WhereTableMaxId )
-    PUT4( b, Volume_WhereTableTotalAllocation )
-    PUT4( b, Volume_WhereTableLastRecycledID )
-    PUT4( b, Volume_WhereTableFirstUnusedBottomID )
+    PUT4( b, Vcb->TotalNumberOfEntries )
+    PUT4( b, Vcb->WhereTableMaxId )
+    PUT4( b, Vcb->WhereTableTotalAllocation )
+    PUT4( b, OVERVIEW_FORMAT )           //  At OVERVIEW_FORMAT_OFFSET; older volumes had 0 or a recycled ID here.
+    PUT4( b, Vcb->WhereTableFirstUnusedBottomID )
 
 
     PUT4( b, Volume_SpaceNodeMaxNumBytes )
     PUT4( b, Volume_BlockSize )
-    PUT8( b, Volume_OverviewStart )
-    PUT8( b, Volume_OverviewNumBytes )
-    PUT8( b, Volume_EntriesStart )
-    PUT8( b, Volume_EntriesNumBytes )
-    PUT8( b, Volume_DataStart )
-    PUT8( b, Volume_DataNumBytes )
-    PUT8( b, Volume_TotalNumBytes )
+    PUT8( b, Vcb->OverviewStart )
+    PUT8( b, Vcb->OverviewNumBytes )
+    PUT8( b, Vcb->EntriesStart )
+    PUT8( b, Vcb->EntriesNumBytes )
+    PUT8( b, Vcb->DataStart )
+    PUT8( b, Vcb->DataNumBytes )
+    PUT8( b, Vcb->TotalNumBytes )
 
 
-    PUT4( b, EntriesTotalAllocation )
-    PUT4( b, EntriesNumBytesAvailable )
-    PUT4( b, EntriesFirstFreeByte )
+    PUT4( b, Vcb->EntriesTotalAllocation )
+    PUT4( b, Vcb->EntriesNumBytesAvailable )
+    PUT4( b, Vcb->EntriesFirstFreeByte )
 
 
     ( ( U8_ ) Buffer )[0] = b - Buffer;  //  Number of bytes.
@@ -345,17 +834,17 @@ AlwaysLogString( "OverviewFreeze1 done.\n" );
 
 //////////////////////////////////////////////////////////////////////
 
-NTSTATUS OverviewFreeze2( U1_ Buffer )
+NTSTATUS OverviewFreeze2( VCB_ Vcb, U1_ Buffer )
 
 {
-    PDEVICE_OBJECT DeviceObject = Volume_PhysicalDeviceObject;
-    U8 Offset = Volume_OverviewStart;
+    PDEVICE_OBJECT DeviceObject = Vcb->PhysicalDeviceObject;
+    U8 Offset = Vcb->OverviewStart;
     U4 Length = 4096;
 
 AlwaysLogFormatted( "Writing.\n" );
 UINT64 msFm = CurrentMillisecond();
 
-    NTSTATUS Status = WriteBlockDevice( DeviceObject, Offset, Length, Buffer, MAY_VERIFY );
+    NTSTATUS Status = WriteBlockDevice( DeviceObject, Offset, Length, Buffer, MAY_VERIFY, IO_CHECKPOINT );
     if ( Status ) return Status;
 
 UINT64 msTo = CurrentMillisecond();
@@ -366,49 +855,74 @@ AlwaysLogFormatted( "Wrote %d bytes in %d ms.\n", Length, ( int ) ( msTo - msFm
 
 //////////////////////////////////////////////////////////////////////
 
-NTSTATUS OverviewThaw()
+NTSTATUS OverviewThaw( VCB_ Vcb )
 
 {
     U1 Buffer[4096];
 
-    PDEVICE_OBJECT DeviceObject = Volume_PhysicalDeviceObject;
-    U8 Offset = Volume_OverviewStart;
+    PDEVICE_OBJECT DeviceObject = Vcb->PhysicalDeviceObject;
+    U8 Offset = Vcb->OverviewStart;
     U4 Length = 4096;//xxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxx
-    NTSTATUS Status = ReadBlockDevice( DeviceObject, Offset, Length, Buffer, MAY_VERIFY );
+    NTSTATUS Status = ReadBlockDevice( DeviceObject, Offset, Length, Buffer, MAY_VERIFY, IO_DEMAND );
     if ( Status ) return Status;
 
     U1_ b = Buffer;
 
     U8 Length8;
+    U4 Format;
 
     GET8( b, Length8 )
-    GET4( b, Volume_TotalNumberOfEntries )
-    GET4( b, Volume_WhereTableMaxId )
-    GET4( b, Volume_WhereTableTotalAllocation )
-    GET4( b, Volume_WhereTableLastRecycledID )
-    GET4( b, Volume_WhereTableFirstUnusedBottomID )
+    GET4( b, Vcb->TotalNumberOfEntries )
+    GET4( b, Vcb->WhereTableMaxId )
+    GET4( b, Vcb->WhereTableTotalAllocation )
+    GET4( b, Format )
+    if ( Format != OVERVIEW_FORMAT ) return STATUS_UNRECOGNIZED_VOLUME;
+    GET4( b, Vcb->WhereTableFirstUnusedBottomID )
 
 
     GET4( b, Volume_SpaceNodeMaxNumBytes )
     GET4( b, Volume_BlockSize )
-    GET8( b, Volume_OverviewStart )
-    GET8( b, Volume_OverviewNumBytes )
-    GET8( b, Volume_EntriesStart )
-    GET8( b, Volume_EntriesNumBytes )
-    GET8( b, Volume_DataStart )
-    GET8( b, Volume_DataNumBytes )
-    GET8( b, Volume_TotalNumBytes )
+    GET8( b, Vcb->OverviewStart )
+    GET8( b, Vcb->OverviewNumBytes )
+    GET8( b, Vcb->EntriesStart )
+    GET8( b, Vcb->EntriesNumBytes )
+    GET8( b, Vcb->DataStart )
+    GET8( b, Vcb->DataNumBytes )
+    GET8( b, Vcb->TotalNumBytes )
 
 
-    GET4( b, EntriesTotalAllocation )
-    GET4( b, EntriesNumBytesAvailable )
-    GET4( b, EntriesFirstFreeByte )
+    GET4( b, Vcb->EntriesTotalAllocation )
+    GET4( b, Vcb->EntriesNumBytesAvailable )
+    GET4( b, Vcb->EntriesFirstFreeByte )
 
 AlwaysLogString( "OverviewThaw\n" );
 
     return 0;
 }
 
+//////////////////////////////////////////////////////////////////////
+//
+//  Before mounting, make sure the volume's metadata is in the format we read. Older volumes
+//  packed ranges differently, and are not converted; reformat them.
+
+NTSTATUS OverviewCheckFormat( VCB_ Vcb )
+
+{
+    U1 Buffer[4096];
+
+    NTSTATUS Status = ReadBlockDevice( Vcb->PhysicalDeviceObject, Vcb->OverviewStart, 4096, Buffer, MAY_VERIFY, IO_DEMAND );
+    if ( Status ) return Status;
+
+    U4 Format = * ( U4_ ) ( Buffer + OVERVIEW_FORMAT_OFFSET );
+    if ( Format != OVERVIEW_FORMAT )
+    {
+AlwaysLogFormatted( "Overview format is $%X, not $%X\n", Format, OVERVIEW_FORMAT );
+        return STATUS_UNRECOGNIZED_VOLUME;
+    }
+
+    return 0;
+}
+
 //////////////////////////////////////////////////////////////////////
 //////////////////////////////////////////////////////////////////////
 
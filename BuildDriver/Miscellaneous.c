@@ -20,74 +20,31 @@
 
 LARGE_INTEGER  PerformanceCounterFrequencyInTicksPerSecond = {0,0};
 
-U8 LastIrpMicrosecondStart = 0;
-
 LARGE_INTEGER  DriverEntryTime;
 UNICODE_STRING DeviceName;
 UNICODE_STRING SymbolicName;
 
 PDRIVER_OBJECT Volume_DriverObject;
 PDEVICE_OBJECT Volume_TailwindDeviceObject;
-PDEVICE_OBJECT Volume_PhysicalDeviceObject;
-U4             Volume_NumSpaceBytesOnVolume;
-U4             Volume_NumSpaceRangesOnVolume;
-MULTISET_NODE_ Volume_SpaceByNumBytes;
-SET_NODE_      Volume_SpaceByAddress;
-U4             Volume_SpaceNumNodes;
-U8             Volume_SpaceNumDifferencesFromVolume;
-U8             Volume_SpaceNumBytes;
-CHAIN          Volume_PendingReadsChain;
-CHAIN          Volume_PendingLocksChain;
+SPINLOCK       Volume_TailwindDeviceLock;
 U4             Volume_SpaceNodeMaxNumBytes = 16 * 1024 * 1024;  //  16MB TODO what is the best number?
 ///            Volume_SpaceNodeMaxNumBytes =  1 * 1024 * 1024;  //  16MB TODO what is the best number?
 U4             Volume_BlockSize = 4096;
-U8             Volume_OverviewStart;
-U8             Volume_OverviewNumBytes;
-U8             Volume_EntriesStart;
-U8             Volume_EntriesNumBytes;
-U8             Volume_DataStart;
-U8             Volume_DataNumBytes;
-U8             Volume_TotalNumBytes;
-U8             Volume_ConservativeMetadataUpdateCount;
-U8             Volume_LastMetadataOkCount;
-SPINLOCK       Volume_MetadataLock;
-U4             Volume_TotalNumberOfEntries;
-ID             Volume_WhereTableMaxId;
-U4             Volume_WhereTableTotalAllocation;
-ID             Volume_WhereTableLastRecycledID;       //  i.e. No recycled IDs.
-ID             Volume_WhereTableFirstUnusedBottomID;  //  Index of zero reserved for errors like not found.
 
 int ChatVariable = 0;
 
-U1_     EntriesBytes = 0;
-U4      EntriesTotalAllocation;
-U4      EntriesFirstFreeByte;
-U4      EntriesNumBytesAvailable;
-ENTRY_* Entries = 0;  //  Table to convert an entry ID to and entry's address.
-
 //////////////////////////////////////////////////////////////////////
 
-void ZeroVolumeGlobals()
+void ZeroDriverGlobals()
 
 {
+    //  Only driver-wide state lives here; everything about a mounted volume is in its VCB.
+
     Volume_DriverObject = 0;
     Volume_TailwindDeviceObject = 0;
-    Volume_PhysicalDeviceObject = 0;
     DriverEntryTime.QuadPart = 0;
-    Volume_NumSpaceBytesOnVolume = 0;
-    Volume_NumSpaceRangesOnVolume = 0;
-    Volume_SpaceByNumBytes = 0;
-    Volume_SpaceByAddress = 0;
-    Volume_SpaceNumNodes = 0;
-    Volume_SpaceNumDifferencesFromVolume = 0;
-    Volume_SpaceNumBytes = 0;
-    Volume_ConservativeMetadataUpdateCount = 0;
-    Volume_LastMetadataOkCount = 0;
-
-    Zero( &Volume_PendingReadsChain, sizeof( CHAIN ) );
-    Zero( &Volume_PendingLocksChain, sizeof( CHAIN ) );
-
-    CacheStartup();
+
+    InitializeSpinlock( &Volume_TailwindDeviceLock );
 }
 
 //////////////////////////////////////////////////////////////////////
@@ -107,93 +64,163 @@ void SleepForMilliseconds( int Milliseconds )
 
 //////////////////////////////////////////////////////////////////////
 
-int Utf8StringToWideString( S1_ Utf8, WCHAR * Wchar )
+NTSTATUS SpinlockReport( S1_ Buffer, int MaxNumBytes, const char* Name, SPINLOCK_ Lock )
+
+{
+    //  Read without the lock, so the numbers may be a moment out of step with each other.
+    U8 TicksPerSecond = PerformanceCounterFrequencyInTicksPerSecond.QuadPart;
+    if ( ! TicksPerSecond ) TicksPerSecond = 1;
+
+    U8 NumAcquisitions  = Lock->NumAcquisitions;
+    U8 NumContended     = Lock->NumContendedAcquisitions;
+    U8 TotalWaitMicros  = Lock->TotalWaitTicks * 1'000'000 / TicksPerSecond;
+    U8 MaxWaitMicros    = Lock->MaxWaitTicks   * 1'000'000 / TicksPerSecond;
+    U8 TotalHoldMicros  = Lock->TotalHoldTicks * 1'000'000 / TicksPerSecond;
+    U8 MaxHoldMicros    = Lock->MaxHoldTicks   * 1'000'000 / TicksPerSecond;
+
+    return RtlStringCchPrintfA( Buffer, MaxNumBytes,
+            "%s: %llu acquisitions, %llu contended, %d waiting, "
+            "wait %llu us total %llu us max, hold %llu us total %llu us max\n",
+            Name,
+            NumAcquisitions,
+            NumContended,
+            Lock->NumSpinning,
+            TotalWaitMicros,
+            MaxWaitMicros,
+            TotalHoldMicros,
+            MaxHoldMicros );
+}
+
+//////////////////////////////////////////////////////////////////////
+//
+//  Name transcoding
+//  Names are nearly always ASCII, so each direction converts runs of ASCII
+//  in bulk, and only goes one code point at a time for the rest.
+
+//--------------------------------------------------------------------
+//
+//  Widen the leading ASCII bytes; return how many there were.
+
+static int asciiToWide( const U1* Utf8, int NumBytes, WCHAR* Wide )
 
 {
-    WCHAR * StartWchar = Wchar;
-    unsigned int CodePoint = 0;
+    int i = 0;
 
-    for ( ;; )
+#if TRANSCODE_WITH_SSE2 == YES
+    const __m128i Zero = _mm_setzero_si128();
+    for ( ; i + 16 <= NumBytes; i += 16 )
+    {
+        __m128i Bytes = _mm_loadu_si128( ( const __m128i* ) ( Utf8 + i ) );
+        if ( _mm_movemask_epi8( Bytes ) ) break;  //  Some byte has its high bit set.
+        _mm_storeu_si128( ( __m128i* ) ( Wide + i     ), _mm_unpacklo_epi8( Bytes, Zero ) );
+        _mm_storeu_si128( ( __m128i* ) ( Wide + i + 8 ), _mm_unpackhi_epi8( Bytes, Zero ) );
+    }
+#else
+    for ( ; i + 8 <= NumBytes; i += 8 )
     {
-        U1 c = ( U1 ) ( *Utf8++ );
-        if ( !c ) break;
+        U8 Word;
+        memcpy( &Word, Utf8 + i, 8 );
+        if ( Word & 0x8080808080808080 ) break;
+        for ( int j = 0; j < 8; j++ ) Wide[i + j] = ( WCHAR ) ( ( Word >> ( 8 * j ) ) & 0xFF );
+    }
+#endif
 
-        if      ( c <= 0x7F ) CodePoint = c;
-        else if ( c <= 0xBF ) CodePoint = ( CodePoint << 6 ) | ( c & 0x3F );
-        else if ( c <= 0xDF ) CodePoint = c & 0x1F;
-        else if ( c <= 0xEF ) CodePoint = c & 0x0F;
-        else                  CodePoint = c & 0x07;
+    for ( ; i < NumBytes && Utf8[i] <= 0x7F; i++ ) Wide[i] = Utf8[i];
 
-        if ( ( ( *Utf8 & 0xC0 ) != 0x80 ) && ( CodePoint <= 0x10FFFF ) )
-        {
-            if ( CodePoint > 0xFFFF )
-            {
-                CodePoint -= 0x10000;
-                *Wchar++ = ( WCHAR ) ( 0xD800 + ( CodePoint >> 10 ) );
-                *Wchar++ = ( WCHAR ) ( 0xDC00 + ( CodePoint & 0x03FF ) );
-            }
-            else
-            if ( CodePoint < 0xD800 || CodePoint >= 0xE000 )
-            {
-                *Wchar++ = ( WCHAR ) CodePoint;
-            }
-        }
+    return i;
+}
+
+//--------------------------------------------------------------------
+//
+//  Narrow the leading ASCII wide characters; return how many there were.
+
+static int wideToAscii( const WCHAR* Wide, int NumWide, U1* Utf8 )
+
+{
+    int i = 0;
+
+#if TRANSCODE_WITH_SSE2 == YES
+    const __m128i NotAscii = _mm_set1_epi16( ( short ) 0xFF80 );
+    const __m128i Zero     = _mm_setzero_si128();
+    for ( ; i + 16 <= NumWide; i += 16 )
+    {
+        __m128i Lo = _mm_loadu_si128( ( const __m128i* ) ( Wide + i     ) );
+        __m128i Hi = _mm_loadu_si128( ( const __m128i* ) ( Wide + i + 8 ) );
+        __m128i High = _mm_and_si128( _mm_or_si128( Lo, Hi ), NotAscii );
+        if ( _mm_movemask_epi8( _mm_cmpeq_epi16( High, Zero ) ) != 0xFFFF ) break;
+        _mm_storeu_si128( ( __m128i* ) ( Utf8 + i ), _mm_packus_epi16( Lo, Hi ) );
     }
+#else
+    for ( ; i + 4 <= NumWide; i += 4 )
+    {
+        U8 Word;
+        memcpy( &Word, Wide + i, 8 );
+        if ( Word & 0xFF80FF80FF80FF80 ) break;
+        for ( int j = 0; j < 4; j++ ) Utf8[i + j] = ( U1 ) ( Word >> ( 16 * j ) );
+    }
+#endif
 
-    *Wchar = 0;
+    for ( ; i < NumWide && Wide[i] <= 0x7F; i++ ) Utf8[i] = ( U1 ) Wide[i];
 
-    return ( int ) ( Wchar - StartWchar );
+    return i;
 }
+
 //////////////////////////////////////////////////////////////////////
 
-int WideStringToUtf8String( WCHAR * Wchar, S1_ Utf8 )
+int Utf8CharactersToWideString( int NumBytesIn, S1_ Utf8Characters, WCHAR * WideString )
 
 {
-    S1_ StartUtf8 = Utf8;
-    unsigned int CodePoint = 0;
+    const U1* Utf8       = ( const U1* ) Utf8Characters;
+    const U1* Stop       = Utf8 + NumBytesIn;
+    WCHAR*    StartWchar = WideString;
+    WCHAR*    Wchar      = WideString;
 
-    for ( ; *Wchar;  Wchar++ )
+    while ( Utf8 < Stop )
     {
-        if ( *Wchar >= 0xD800 && *Wchar <= 0xDBFF )
-            CodePoint = ( ( *Wchar - 0xD800 ) << 10 ) + 0x10000;
+        int NumAscii = asciiToWide( Utf8, ( int ) ( Stop - Utf8 ), Wchar );
+        Utf8  += NumAscii;
+        Wchar += NumAscii;
+        if ( Utf8 == Stop ) break;
+
+        //  Decode one multi-byte sequence. Malformed ones are dropped.
+        U1 c = *Utf8++;
+        unsigned int CodePoint;
+        int NumContinuations;
+        if      ( c <= 0xBF ) continue;  //  A stray continuation byte.
+        else if ( c <= 0xDF ) { CodePoint = c & 0x1F; NumContinuations = 1; }
+        else if ( c <= 0xEF ) { CodePoint = c & 0x0F; NumContinuations = 2; }
+        else                  { CodePoint = c & 0x07; NumContinuations = 3; }
+
+        for ( ; NumContinuations && Utf8 < Stop && ( *Utf8 & 0xC0 ) == 0x80; NumContinuations-- )
+        {
+            CodePoint = ( CodePoint << 6 ) | ( *Utf8++ & 0x3F );
+        }
+        if ( NumContinuations || CodePoint > 0x10FFFF ) continue;
+
+        if ( CodePoint > 0xFFFF )
+        {
+            CodePoint -= 0x10000;
+            *Wchar++ = ( WCHAR ) ( 0xD800 + ( CodePoint >> 10 ) );
+            *Wchar++ = ( WCHAR ) ( 0xDC00 + ( CodePoint & 0x03FF ) );
+        }
         else
+        if ( CodePoint < 0xD800 || CodePoint >= 0xE000 )
         {
-            if ( *Wchar >= 0xDC00 && *Wchar <= 0xDFFF )
-                CodePoint |= *Wchar - 0xDC00;
-            else
-                CodePoint = *Wchar;
-
-            if ( CodePoint <= 0x7F )
-            {
-                *Utf8++ = ( S1 ) CodePoint;
-            }
-            else
-            if ( CodePoint <= 0x7FF )
-            {
-                *Utf8++ = ( 0xC0 | ( ( CodePoint >> 6 ) & 0x1F ) );
-                *Utf8++ = ( 0x80 | (   CodePoint        & 0x3F ) );
-            }
-            else
-            if ( CodePoint <= 0xFFFF )
-            {
-                *Utf8++ = ( 0xE0 | ( ( CodePoint >> 12 ) & 0x0F ) );
-                *Utf8++ = ( 0x80 | ( ( CodePoint >>  6 ) & 0x3F ) );
-                *Utf8++ = ( 0x80 | (   CodePoint         & 0x3F ) );
-            }
-            else
-            {
-                *Utf8++ = ( 0xF0 | ( ( CodePoint >> 18 ) & 0x07 ) );
-                *Utf8++ = ( 0x80 | ( ( CodePoint >> 12 ) & 0x3F ) );
-                *Utf8++ = ( 0x80 | ( ( CodePoint >>  6 ) & 0x3F ) );
-                *Utf8++ = ( 0x80 | (   CodePoint         & 0x3F ) );
-            }
-            CodePoint = 0;
+            *Wchar++ = ( WCHAR ) CodePoint;
         }
     }
 
-    *Utf8 = 0;
+    *Wchar = 0;
 
-    return ( int ) ( Utf8 - StartUtf8 );
+    return ( int ) ( Wchar - StartWchar );
+}
+
+//////////////////////////////////////////////////////////////////////
+
+int Utf8StringToWideString( S1_ Utf8, WCHAR * Wchar )
+
+{
+    return Utf8CharactersToWideString( ( int ) strlen( Utf8 ), Utf8, Wchar );
 }
 
 //////////////////////////////////////////////////////////////////////
@@ -201,52 +228,57 @@ int WideStringToUtf8String( WCHAR * Wchar, S1_ Utf8 )
 int WideCharactersToUtf8String( int NumBytesIn, WCHAR * WideCharacters, S1_ Utf8String )
 
 {
-    S1_ StartUtf8 = Utf8String;
-    unsigned int CodePoint = 0;
-    const WCHAR * StopWchar = WideCharacters + ( NumBytesIn/2 );
+    U1_          Utf8      = ( U1_ ) Utf8String;
+    U1_          StartUtf8 = Utf8;
+    const WCHAR* StopWchar = WideCharacters + ( NumBytesIn/2 );
 
-    for ( ; WideCharacters < StopWchar;  WideCharacters++ )
+    while ( WideCharacters < StopWchar )
     {
-        if ( *WideCharacters >= 0xD800 && *WideCharacters <= 0xDBFF )
-            CodePoint = ( ( *WideCharacters - 0xD800 ) << 10 ) + 0x10000;
+        int NumAscii = wideToAscii( WideCharacters, ( int ) ( StopWchar - WideCharacters ), Utf8 );
+        WideCharacters += NumAscii;
+        Utf8           += NumAscii;
+        if ( WideCharacters == StopWchar ) break;
+
+        //  Encode one code point, joining a surrogate pair.
+        unsigned int CodePoint = *WideCharacters++;
+        if (    CodePoint >= 0xD800 && CodePoint <= 0xDBFF && WideCharacters < StopWchar
+             && *WideCharacters >= 0xDC00 && *WideCharacters <= 0xDFFF )
+        {
+            CodePoint = ( ( CodePoint - 0xD800 ) << 10 ) + ( *WideCharacters++ - 0xDC00 ) + 0x10000;
+        }
+
+        if ( CodePoint <= 0x7FF )
+        {
+            *Utf8++ = ( U1 ) ( 0xC0 | ( ( CodePoint >> 6 ) & 0x1F ) );
+            *Utf8++ = ( U1 ) ( 0x80 | (   CodePoint        & 0x3F ) );
+        }
         else
+        if ( CodePoint <= 0xFFFF )
         {
-            if ( *WideCharacters >= 0xDC00 && *WideCharacters <= 0xDFFF )
-                CodePoint |= *WideCharacters - 0xDC00;
-            else
-                CodePoint = *WideCharacters;
-
-            if ( CodePoint <= 0x7F )
-            {
-                *Utf8String++ = ( S1 ) CodePoint;
-            }
-            else
-            if ( CodePoint <= 0x7FF )
-            {
-                *Utf8String++ = ( 0xC0 | ( ( CodePoint >> 6 ) & 0x1F ) );
-                *Utf8String++ = ( 0x80 | (   CodePoint        & 0x3F ) );
-            }
-            else
-            if ( CodePoint <= 0xFFFF )
-            {
-                *Utf8String++ = ( 0xE0 | ( ( CodePoint >> 12 ) & 0x0F ) );
-                *Utf8String++ = ( 0x80 | ( ( CodePoint >>  6 ) & 0x3F ) );
-                *Utf8String++ = ( 0x80 | (   CodePoint         & 0x3F ) );
-            }
-            else
-            {
-                *Utf8String++ = ( 0xF0 | ( ( CodePoint >> 18 ) & 0x07 ) );
-                *Utf8String++ = ( 0x80 | ( ( CodePoint >> 12 ) & 0x3F ) );
-                *Utf8String++ = ( 0x80 | ( ( CodePoint >>  6 ) & 0x3F ) );
-                *Utf8String++ = ( 0x80 | (   CodePoint         & 0x3F ) );
-            }
-            CodePoint = 0;
+            *Utf8++ = ( U1 ) ( 0xE0 | ( ( CodePoint >> 12 ) & 0x0F ) );
+            *Utf8++ = ( U1 ) ( 0x80 | ( ( CodePoint >>  6 ) & 0x3F ) );
+            *Utf8++ = ( U1 ) ( 0x80 | (   CodePoint         & 0x3F ) );
+        }
+        else
+        {
+            *Utf8++ = ( U1 ) ( 0xF0 | ( ( CodePoint >> 18 ) & 0x07 ) );
+            *Utf8++ = ( U1 ) ( 0x80 | ( ( CodePoint >> 12 ) & 0x3F ) );
+            *Utf8++ = ( U1 ) ( 0x80 | ( ( CodePoint >>  6 ) & 0x3F ) );
+            *Utf8++ = ( U1 ) ( 0x80 | (   CodePoint         & 0x3F ) );
         }
     }
 
-    *Utf8String = 0;
+    *Utf8 = 0;
 
-    return ( int ) ( Utf8String - StartUtf8 );
+    return ( int ) ( Utf8 - StartUtf8 );
+}
+
+//////////////////////////////////////////////////////////////////////
+
+int WideStringToUtf8String( WCHAR * Wchar, S1_ Utf8 )
+
+{
+    return WideCharactersToUtf8String( ( int ) wcslen( Wchar ) * 2, Wchar, Utf8 );
 }
 
 //////////////////////////////////////////////////////////////////////
@@ -254,90 +286,188 @@ int WideCharactersToUtf8String( int NumBytesIn, WCHAR * WideCharacters, S1_ Utf8
 int WidePathAndNameCharactersToUtf8String( int NumBytesIn, WCHAR* WideCharacters, S1_ Utf8String )
 
 {
-    //  Convert any forward slashes to backslashes.
-    WCHAR   BackSlashed[512];
-    for ( int i = 0; i < NumBytesIn/2; i++ )  //  TODO wont work on 4 byte chars
+    int NumBytes = WideCharactersToUtf8String( NumBytesIn, WideCharacters, Utf8String );
+
+    //  Convert any forward slashes to backslashes. A '/' byte is never inside a multi-byte sequence.
+    for ( int i = 0; i < NumBytes; i++ )
     {
-        WCHAR c = WideCharacters[i];
-        BackSlashed[i] = ( c == L'/' ) ? L'\\' : c;
+        if ( Utf8String[i] == '/' ) Utf8String[i] = '\\';
     }
 
-    int NumBytes = WideCharactersToUtf8String( NumBytesIn, BackSlashed, Utf8String );
-
     return NumBytes;
 }
 
 //////////////////////////////////////////////////////////////////////
 //
-//  Compare a char string to a pattern
+//  Compiled wildcard patterns
 //  Patterns may contain:
 //    '?': match any single character
 //    '*': match zero or more characters
+//  Letters compare like _stricmp, upper casing ASCII only.
+
+//--------------------------------------------------------------------
 
-B1 WildcardCompare( char* pattern, int patternLen, char* string, int stringLen )
+inline S1 patternUpper( S1 c )
 
 {
+    return ( c >= 'a' && c <= 'z' ) ? ( S1 ) ( c - 32 ) : c;
+}
 
-  top:
+//--------------------------------------------------------------------
 
-    if ( stringLen == patternLen && _strnicmp( pattern, string, stringLen ) == 0 ) return TRUE;
+PATTERN_ PatternCompile( S1_ NameOrPattern )
 
-    if ( stringLen == 0 || string == 0 )
-    {
-        if ( pattern == 0 ) return TRUE;
-        for ( int i = 0; i < patternLen; i++ ) if ( pattern[i] != '*' ) return FALSE;
-        return TRUE;
-    }
+{
+    PATTERN_ Pattern = AllocateAndZeroMemory( sizeof( PATTERN ) );
+    if ( ! Pattern ) return 0;
 
-    if ( patternLen == 0 )
+    Pattern->StartsWithAStar = ( NameOrPattern[0] == '*' );
+
+    //  Split at the stars, dropping them. Runs of stars act as one.
+    int NumBytes   = 0;
+    B1  InASegment = FALSE;
+    B1  PastPrefix = FALSE;
+    for ( S1_ p = NameOrPattern; *p && NumBytes < ( int ) sizeof( Pattern->Text ) - 1; p++ )
     {
-        return FALSE;
+        if ( *p == '*' )
+        {
+            InASegment = FALSE;
+            PastPrefix = TRUE;
+            continue;
+        }
+
+        if ( ! InASegment )
+        {
+            if ( Pattern->NumSegments == PATTERN_MAX_SEGMENTS ) { FreeMemory( Pattern ); return 0; }
+            Pattern->SegmentStart[ Pattern->NumSegments++ ] = ( U2 ) NumBytes;
+            InASegment = TRUE;
+        }
+
+        int s = Pattern->NumSegments - 1;
+        if ( *p == '?' )
+        {
+            Pattern->SegmentHasAQuestion[s] = TRUE;
+            PastPrefix = TRUE;
+        }
+        else
+        if ( ! PastPrefix )
+        {
+            Pattern->Prefix[ Pattern->PrefixNumBytes++ ] = *p;
+        }
+
+        Pattern->Text[ NumBytes++ ] = patternUpper( *p );
+        Pattern->SegmentNumBytes[s]++;
     }
 
-    if ( pattern[0] == '?' )
+    Pattern->EndsWithAStar = ! InASegment;
+
+    //  Knuth-Morris-Pratt prefix function, so finding a segment never re-reads the name.
+    for ( int s = 0; s < Pattern->NumSegments; s++ )
     {
-        pattern++; patternLen--; string++; stringLen--; goto top;
+        if ( Pattern->SegmentHasAQuestion[s] ) continue;
+
+        S1_ Segment = Pattern->Text    + Pattern->SegmentStart[s];
+        U2_ Failure = Pattern->Failure + Pattern->SegmentStart[s];
+        int k = 0;
+        Failure[0] = 0;
+        for ( int i = 1; i < Pattern->SegmentNumBytes[s]; i++ )
+        {
+            while ( k && Segment[i] != Segment[k] ) k = Failure[k - 1];
+            if ( Segment[i] == Segment[k] ) k++;
+            Failure[i] = ( U2 ) k;
+        }
     }
 
-    if ( pattern[patternLen - 1] == '?' )
+    return Pattern;
+}
+
+//--------------------------------------------------------------------
+
+static B1 patternSegmentIsAt( PATTERN_ Pattern, int s, S1_ NameAt )
+
+{
+    S1_ Segment = Pattern->Text + Pattern->SegmentStart[s];
+
+    for ( int i = 0; i < Pattern->SegmentNumBytes[s]; i++ )
     {
-        patternLen--; stringLen--; goto top;
+        if ( Segment[i] != '?' && Segment[i] != patternUpper( NameAt[i] ) ) return FALSE;
     }
 
-    if ( pattern[0] == '*' )
+    return TRUE;
+}
+
+//--------------------------------------------------------------------
+//
+//  Return the leftmost place at or after From where segment s matches, or -1.
+
+static int patternFindSegment( PATTERN_ Pattern, int s, S1_ Name, int NameNumBytes, int From )
+
+{
+    S1_ Segment = Pattern->Text    + Pattern->SegmentStart[s];
+    U2_ Failure = Pattern->Failure + Pattern->SegmentStart[s];
+    int N       = Pattern->SegmentNumBytes[s];
+
+    //  With a '?' there is no prefix function; try each place, which is bounded by name times segment.
+    if ( Pattern->SegmentHasAQuestion[s] )
     {
-        if ( WildcardCompare( pattern+1, patternLen-1, string, stringLen ) )
+        for ( int At = From; At + N <= NameNumBytes; At++ )
         {
-            return TRUE;
+            if ( patternSegmentIsAt( Pattern, s, Name + At ) ) return At;
         }
-        string++; stringLen--; goto top;
+        return -1;
     }
 
-    if ( pattern[patternLen - 1] == '*' )
+    int k = 0;
+    for ( int i = From; i < NameNumBytes; i++ )
     {
-        if ( WildcardCompare( pattern,  patternLen - 1, string, stringLen ) )
-        {
-            return TRUE;
-        }
-        stringLen--; goto top;
+        S1 c = patternUpper( Name[i] );
+        while ( k && c != Segment[k] ) k = Failure[k - 1];
+        if ( c == Segment[k] ) k++;
+        if ( k == N ) return i - N + 1;
     }
 
-    B1 charsMatch;
-    char p = pattern[0];
-    char s = string[0];
-    if ( p == s ) charsMatch = TRUE;
-    else
-    {  //  Upper case p and s.  TODO yes i know this aint gunna fly for utf8
-        if ( p >= 'a' && p <= 'z' ) p -= 32;
-        if ( s >= 'a' && s <= 'z' ) s -= 32;
-        charsMatch = ( p == s );
-    }
-    if ( charsMatch )
+    return -1;
+}
+
+//--------------------------------------------------------------------
+//
+//  Placing each segment at its leftmost match is always safe, since a
+//  star before the next segment can absorb anything the first choice skipped.
+
+B1 PatternMatch( PATTERN_ Pattern, S1_ Name )
+
+{
+    int NameNumBytes = ( int ) strlen( Name );
+    int NumSegments  = Pattern->NumSegments;
+    int At           = 0;
+
+    for ( int s = 0; s < NumSegments; s++ )
     {
-        pattern++; patternLen--; string++; stringLen--; goto top;
+        int N     = Pattern->SegmentNumBytes[s];
+        B1  First = ( s == 0               ) && ! Pattern->StartsWithAStar;
+        B1  Last  = ( s == NumSegments - 1 ) && ! Pattern->EndsWithAStar;
+
+        if ( Last )
+        {
+            //  The last segment must end the name without overlapping what is already placed.
+            int End = NameNumBytes - N;
+            if ( End < At || ( First && End != 0 ) ) return FALSE;
+            return patternSegmentIsAt( Pattern, s, Name + End );
+        }
+
+        if ( First )
+        {
+            if ( N > NameNumBytes || ! patternSegmentIsAt( Pattern, s, Name ) ) return FALSE;
+            At = N;
+            continue;
+        }
+
+        int Found = patternFindSegment( Pattern, s, Name, NameNumBytes, At );
+        if ( Found < 0 ) return FALSE;
+        At = Found + N;
     }
 
-    return FALSE;
+    return TRUE;  //  Every segment placed, and a star ends the pattern (or there were only stars).
 }
 
 //////////////////////////////////////////////////////////////////////
@@ -358,7 +488,7 @@ B1 RemoveTrailingNameFromPath( S1_ PathAndName )
 }
 //////////////////////////////////////////////////////////////////////
 
-int WideFullPathAndName( ENTRY_ Entry, WCHAR *WidePathAndNameOut )
+int WideFullPathAndName( VCB_ Vcb, ENTRY_ Entry, WCHAR *WidePathAndNameOut )
 
 {
     //  Special case root.
@@ -383,10 +513,10 @@ int WideFullPathAndName( ENTRY_ Entry, WCHAR *WidePathAndNameOut )
         b--;
         *b = '\\';
         //  Repeat for each parent.
-        Entry = Entries[ Entry->ParentId ];
+        Entry = EntryForId( Vcb, Entry->ParentId );
     } while ( Entry->ParentId );
 
-    int NumWideChars = Utf8StringToWideString( b, WidePathAndNameOut );
+    int NumWideChars = Utf8CharactersToWideString( ( int ) ( Buffer + 1024 - 1 - b ), b, WidePathAndNameOut );
     WidePathAndNameOut[NumWideChars] = 0;  //  Add a trailing zero.
 
 //LogFormatted( "WideFullPathAndName is \"%S\"\n", WidePathAndNameOut );
@@ -0,0 +1,381 @@
+//
+//  Tailwind: A File System Driver
+//  Copyright (C) 2024 John Oberschelp
+//
+//  This program is free software: you can redistribute it and/or modify it under the
+//  terms of the GNU General Public License as published by the Free Software
+//  Foundation, either version 3 of the License, or (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful, but WITHOUT ANY
+//  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+//  FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License along with this
+//  program. If not, see https://www.gnu.org/licenses/.
+//
+
+//////////////////////////////////////////////////////////////////////
+//
+//  Ordered Indexes
+//
+//  One intrusive ordered index, generated per use by macro, in place of
+//  the hand copied splay trees that used to live in each subsystem.
+//
+//  A node is any struct with P, L and R pointers to its own type, plus
+//  a U1 H that only the AVL variant uses. A multiset node also has E,
+//  the chain of nodes whose keys equal its own; only the head of such a
+//  chain is in the tree. Keys are U8, read from a node by a KeyOf( x )
+//  macro that the user supplies.
+//
+//  ORDERED_SET_SPLAY     ( Pub, pri, NODE_, KeyOf )
+//  ORDERED_SET_AVL       ( Pub, pri, NODE_, KeyOf )
+//  ORDERED_MULTISET_SPLAY( Pub, pri, NODE_, KeyOf )
+//  ORDERED_MULTISET_AVL  ( Pub, pri, NODE_, KeyOf )
+//
+//  each define the same functions, so a subsystem picks its variant with
+//  a Configuration switch and nothing else changes:
+//
+//  NODE_ PubFind  ( NODE_ *rootHandle, U8 Key );
+//  NODE_ PubNear  ( NODE_ *rootHandle, U8 Key, NEIGHBOR want );
+//  int   PubAttach( NODE_ *rootHandle, NODE_ x, U8 Key );  //  Sets return 0 for a duplicate key.
+//  void  PubDetach( NODE_ *rootHandle, NODE_ x );
+//  NODE_ PubNext  ( NODE_ x );
+//  NODE_ PubPrev  ( NODE_ x );
+//  NODE_ PubFirst ( NODE_ root );
+//  NODE_ PubLast  ( NODE_ root );
+//
+//  Splay trees move whatever was touched to the root, which wins when
+//  lookups cluster, as they do for the cache and for space coalescing.
+//  AVL trees never write on a lookup and bound every seek at 1.44 lg N.
+//
+//  The pri helpers assign within conditionals, so users disable 4706.
+
+//--------------------------------------------------------------------
+//  Shared by all variants.
+
+#define ORDERED_INDEX_CORE( Pub, pri, NODE_, KeyOf )                                               \
+                                                                                                   \
+inline void pri##RotateL( NODE_ *rootHandle, NODE_ x )                                             \
+{                                                                                                  \
+    NODE_ y = x->R, p = x->P;                                                                      \
+    if ( x->R = y->L ) y->L->P = x;                                                                \
+    if ( ! ( y->P = p ) ) *rootHandle = y;                                                         \
+    else if ( x == p->L ) p->L = y;                                                                \
+    else                  p->R = y;                                                                \
+    ( y->L = x )->P = y;                                                                           \
+}                                                                                                  \
+                                                                                                   \
+inline void pri##RotateR( NODE_ *rootHandle, NODE_ y )                                             \
+{                                                                                                  \
+    NODE_ x = y->L, p = y->P;                                                                      \
+    if ( y->L = x->R ) x->R->P = y;                                                                \
+    if ( ! ( x->P = p ) ) *rootHandle = x;                                                         \
+    else if ( y == p->L ) p->L = x;                                                                \
+    else                  p->R = x;                                                                \
+    ( x->R = y )->P = x;                                                                           \
+}                                                                                                  \
+                                                                                                   \
+inline int pri##Seek( NODE_ from, NODE_ *resultHandle, U8 Key )                                    \
+{                                                                                                  \
+    NODE_ x = from;                                                                                \
+    for ( ;; )                                                                                     \
+    {                                                                                              \
+        U8 xKey = KeyOf( x );                                                                      \
+        if ( Key < xKey )                                                                          \
+        {                                                                                          \
+            if ( ! x->L ) { *resultHandle = x; return -1; }                                        \
+            x = x->L;                                                                              \
+        }                                                                                          \
+        else                                                                                       \
+        if ( Key > xKey )                                                                          \
+        {                                                                                          \
+            if ( ! x->R ) { *resultHandle = x; return  1; }                                        \
+            x = x->R;                                                                              \
+        }                                                                                          \
+        else              { *resultHandle = x; return  0; }                                        \
+    }                                                                                              \
+}                                                                                                  \
+                                                                                                   \
+static NODE_ pri##Replace( NODE_ *rootHandle, NODE_ x, NODE_ y )                                   \
+{                                                                                                  \
+    NODE_ p = x->P;                                                                                \
+    if ( ! p )           *rootHandle = y;                                                          \
+    else if ( p->L == x ) p->L = y;                                                                \
+    else                  p->R = y;                                                                \
+    if ( y ) y->P = p;                                                                             \
+    return p;                                                                                      \
+}                                                                                                  \
+                                                                                                   \
+static NODE_ pri##Unlink( NODE_ *rootHandle, NODE_ x )                                             \
+{                                                                                                  \
+    if ( ! x->L ) return pri##Replace( rootHandle, x, x->R );                                      \
+    if ( ! x->R ) return pri##Replace( rootHandle, x, x->L );                                      \
+    NODE_ e = x->L, from = e;                                                                      \
+    if ( e->R )                                                                                    \
+    {                                                                                              \
+        do { e = e->R; } while ( e->R );                                                           \
+        from = e->P;                                                                               \
+        if ( from->R = e->L ) e->L->P = from;                                                      \
+        ( e->L = x->L )->P = e;                                                                    \
+    }                                                                                              \
+    ( e->R = x->R )->P = e;                                                                        \
+    e->H = x->H;                                                                                   \
+    pri##Replace( rootHandle, x, e );                                                              \
+    return from;                                                                                   \
+}                                                                                                  \
+                                                                                                   \
+NODE_ Pub##Next( NODE_ x )                                                                         \
+{                                                                                                  \
+    if ( x->R ) { x = x->R; while ( x->L ) x = x->L; return x; }                                   \
+    NODE_ p = x->P;                                                                                \
+    while ( p && x == p->R ) { x = p; p = p->P; }                                                  \
+    return p;                                                                                      \
+}                                                                                                  \
+                                                                                                   \
+NODE_ Pub##Prev( NODE_ x )                                                                         \
+{                                                                                                  \
+    if ( x->L ) { x = x->L; while ( x->R ) x = x->R; return x; }                                   \
+    NODE_ p = x->P;                                                                                \
+    while ( p && x == p->L ) { x = p; p = p->P; }                                                  \
+    return p;                                                                                      \
+}                                                                                                  \
+                                                                                                   \
+NODE_ Pub##First( NODE_ x )                                                                        \
+{                                                                                                  \
+    if ( x ) while ( x->L ) x = x->L;                                                              \
+    return x;                                                                                      \
+}                                                                                                  \
+                                                                                                   \
+NODE_ Pub##Last( NODE_ x )                                                                         \
+{                                                                                                  \
+    if ( x ) while ( x->R ) x = x->R;                                                              \
+    return x;                                                                                      \
+}
+
+//--------------------------------------------------------------------
+//  How each variant settles a tree after a lookup, an attach or a detach.
+
+#define ORDERED_INDEX_SPLAY_HOOKS( pri, NODE_ )                                                    \
+                                                                                                   \
+static void pri##Splay( NODE_ *rootHandle, NODE_ x )                                               \
+{                                                                                                  \
+    NODE_ p;                                                                                       \
+    while ( p = x->P )                                                                             \
+    {                                                                                              \
+        if ( ! p->P )                                                                              \
+        {                                                                                          \
+            if ( p->L == x ) pri##RotateR( rootHandle, p );                                        \
+            else             pri##RotateL( rootHandle, p );                                        \
+        }                                                                                          \
+        else                                                                                       \
+        if ( p == p->P->R )                                                                        \
+        {                                                                                          \
+            if ( p->R == x ) pri##RotateL( rootHandle, p->P );                                     \
+            else             pri##RotateR( rootHandle, p );                                        \
+            pri##RotateL( rootHandle, x->P );                                                      \
+        }                                                                                          \
+        else                                                                                       \
+        {                                                                                          \
+            if ( p->L == x ) pri##RotateR( rootHandle, p->P );                                     \
+            else             pri##RotateL( rootHandle, p );                                        \
+            pri##RotateR( rootHandle, x->P );                                                      \
+        }                                                                                          \
+    }                                                                                              \
+}                                                                                                  \
+                                                                                                   \
+inline void pri##Touched ( NODE_ *rootHandle, NODE_ x ) { pri##Splay( rootHandle, x ); }           \
+inline void pri##Attached( NODE_ *rootHandle, NODE_ x ) { pri##Splay( rootHandle, x ); }           \
+inline void pri##Detached( NODE_ *rootHandle, NODE_ x )                                            \
+{                                                                                                  \
+    UNREFERENCED_PARAMETER( rootHandle );                                                          \
+    UNREFERENCED_PARAMETER( x );                                                                   \
+}
+
+
+#define ORDERED_INDEX_AVL_HOOKS( pri, NODE_ )                                                      \
+                                                                                                   \
+inline U1 pri##Height( NODE_ x ) { return ( U1 ) ( x ? x->H : 0 ); }                               \
+                                                                                                   \
+inline U1 pri##Fix( NODE_ x )                                                                      \
+{                                                                                                  \
+    U1 l = pri##Height( x->L ), r = pri##Height( x->R );                                           \
+    return x->H = ( U1 ) ( 1 + ( l > r ? l : r ) );                                                \
+}                                                                                                  \
+                                                                                                   \
+static void pri##Rebalance( NODE_ *rootHandle, NODE_ x )                                           \
+{                                                                                                  \
+    while ( x )                                                                                    \
+    {                                                                                              \
+        U1 l = pri##Height( x->L ), r = pri##Height( x->R ), h = x->H;                             \
+        if ( l > r + 1 )                                                                           \
+        {                                                                                          \
+            if ( pri##Height( x->L->L ) < pri##Height( x->L->R ) )                                 \
+            {                                                                                      \
+                pri##RotateL( rootHandle, x->L );                                                  \
+                pri##Fix( x->L->L );                                                               \
+            }                                                                                      \
+            pri##RotateR( rootHandle, x );                                                         \
+            pri##Fix( x );                                                                         \
+            pri##Fix( x = x->P );                                                                  \
+        }                                                                                          \
+        else                                                                                       \
+        if ( r > l + 1 )                                                                           \
+        {                                                                                          \
+            if ( pri##Height( x->R->R ) < pri##Height( x->R->L ) )                                 \
+            {                                                                                      \
+                pri##RotateR( rootHandle, x->R );                                                  \
+                pri##Fix( x->R->R );                                                               \
+            }                                                                                      \
+            pri##RotateL( rootHandle, x );                                                         \
+            pri##Fix( x );                                                                         \
+            pri##Fix( x = x->P );                                                                  \
+        }                                                                                          \
+        else                                                                                       \
+        if ( pri##Fix( x ) == h ) return;                                                          \
+        x = x->P;                                                                                  \
+    }                                                                                              \
+}                                                                                                  \
+                                                                                                   \
+inline void pri##Touched ( NODE_ *rootHandle, NODE_ x )                                            \
+{                                                                                                  \
+    UNREFERENCED_PARAMETER( rootHandle );                                                          \
+    UNREFERENCED_PARAMETER( x );                                                                   \
+}                                                                                                  \
+                                                                                                   \
+inline void pri##Attached( NODE_ *rootHandle, NODE_ x ) { pri##Rebalance( rootHandle, x->P ); }    \
+inline void pri##Detached( NODE_ *rootHandle, NODE_ x ) { pri##Rebalance( rootHandle, x ); }
+
+//--------------------------------------------------------------------
+//  Lookups, the same for sets and multisets.
+
+#define ORDERED_INDEX_LOOKUPS( Pub, pri, NODE_ )                                                   \
+                                                                                                   \
+NODE_ Pub##Find( NODE_ *rootHandle, U8 Key )                                                       \
+{                                                                                                  \
+    if ( ! *rootHandle ) return 0;                                                                 \
+    NODE_ x;                                                                                       \
+    int dir = pri##Seek( *rootHandle, &x, Key );                                                   \
+    pri##Touched( rootHandle, x );                                                                 \
+    return dir ? 0 : x;                                                                            \
+}                                                                                                  \
+                                                                                                   \
+NODE_ Pub##Near( NODE_ *rootHandle, U8 Key, NEIGHBOR want )                                        \
+{                                                                                                  \
+    if ( ! *rootHandle ) return 0;                                                                 \
+    NODE_ x;                                                                                       \
+    int dir = pri##Seek( *rootHandle, &x, Key );                                                   \
+    if ( ( dir == 0 && want == GT ) || ( dir > 0 && want >= GE ) ) x = Pub##Next( x );             \
+    else                                                                                           \
+    if ( ( dir == 0 && want == LT ) || ( dir < 0 && want <= LE ) ) x = Pub##Prev( x );             \
+    else                                                                                           \
+    if ( dir != 0 && want == EQ ) x = 0;                                                           \
+    if ( x ) pri##Touched( rootHandle, x );                                                        \
+    return x;                                                                                      \
+}
+
+//--------------------------------------------------------------------
+//  Attach and detach for sets, whose keys are unique.
+
+#define ORDERED_INDEX_SET( Pub, pri, NODE_ )                                                       \
+                                                                                                   \
+int Pub##Attach( NODE_ *rootHandle, NODE_ x, U8 Key )                                              \
+{                                                                                                  \
+    x->L = x->R = 0;                                                                               \
+    x->H = 1;                                                                                      \
+    if ( ! *rootHandle )                                                                           \
+    {                                                                                              \
+        *rootHandle = x;                                                                           \
+        x->P = 0;                                                                                  \
+        return 1;                                                                                  \
+    }                                                                                              \
+    NODE_ f;                                                                                       \
+    int dir = pri##Seek( *rootHandle, &f, Key );                                                   \
+    if ( ! dir ) return 0;                                                                         \
+    if ( dir < 0 ) f->L = x; else f->R = x;                                                        \
+    x->P = f;                                                                                      \
+    pri##Attached( rootHandle, x );                                                                \
+    return 1;                                                                                      \
+}                                                                                                  \
+                                                                                                   \
+void Pub##Detach( NODE_ *rootHandle, NODE_ x )                                                     \
+{                                                                                                  \
+    pri##Detached( rootHandle, pri##Unlink( rootHandle, x ) );                                     \
+}
+
+//--------------------------------------------------------------------
+//  Attach and detach for multisets. A node whose key is already present
+//  takes the tree position of the one it equals, and chains it on E.
+
+#define ORDERED_INDEX_MULTISET( Pub, pri, NODE_ )                                                  \
+                                                                                                   \
+static void pri##Swap( NODE_ *rootHandle, NODE_ x, NODE_ y )                                       \
+{                                                                                                  \
+    if ( y->L = x->L ) y->L->P = y;                                                                \
+    if ( y->R = x->R ) y->R->P = y;                                                                \
+    y->H = x->H;                                                                                   \
+    pri##Replace( rootHandle, x, y );                                                              \
+}                                                                                                  \
+                                                                                                   \
+int Pub##Attach( NODE_ *rootHandle, NODE_ x, U8 Key )                                              \
+{                                                                                                  \
+    x->L = x->R = x->E = 0;                                                                        \
+    x->H = 1;                                                                                      \
+    if ( ! *rootHandle )                                                                           \
+    {                                                                                              \
+        *rootHandle = x;                                                                           \
+        x->P = 0;                                                                                  \
+        return 1;                                                                                  \
+    }                                                                                              \
+    NODE_ f;                                                                                       \
+    int dir = pri##Seek( *rootHandle, &f, Key );                                                   \
+    if ( ! dir )                                                                                   \
+    {                                                                                              \
+        pri##Swap( rootHandle, f, x );                                                             \
+        ( x->E = f )->P = x;                                                                       \
+        f->L = f->R = 0;                                                                           \
+        pri##Touched( rootHandle, x );                                                             \
+        return 1;                                                                                  \
+    }                                                                                              \
+    if ( dir < 0 ) f->L = x; else f->R = x;                                                        \
+    x->P = f;                                                                                      \
+    pri##Attached( rootHandle, x );                                                                \
+    return 1;                                                                                      \
+}                                                                                                  \
+                                                                                                   \
+void Pub##Detach( NODE_ *rootHandle, NODE_ x )                                                     \
+{                                                                                                  \
+    NODE_ e = x->E, p = x->P;                                                                      \
+    if ( p && p->E == x ) { if ( p->E = e ) e->P = p; }                                            \
+    else if ( e ) pri##Swap( rootHandle, x, e );                                                   \
+    else pri##Detached( rootHandle, pri##Unlink( rootHandle, x ) );                                \
+}
+
+//--------------------------------------------------------------------
+//  The four variants.
+
+#define ORDERED_SET_SPLAY( Pub, pri, NODE_, KeyOf )                                                \
+    ORDERED_INDEX_CORE( Pub, pri, NODE_, KeyOf )                                                   \
+    ORDERED_INDEX_SPLAY_HOOKS( pri, NODE_ )                                                        \
+    ORDERED_INDEX_LOOKUPS( Pub, pri, NODE_ )                                                       \
+    ORDERED_INDEX_SET( Pub, pri, NODE_ )
+
+#define ORDERED_SET_AVL( Pub, pri, NODE_, KeyOf )                                                  \
+    ORDERED_INDEX_CORE( Pub, pri, NODE_, KeyOf )                                                   \
+    ORDERED_INDEX_AVL_HOOKS( pri, NODE_ )                                                          \
+    ORDERED_INDEX_LOOKUPS( Pub, pri, NODE_ )                                                       \
+    ORDERED_INDEX_SET( Pub, pri, NODE_ )
+
+#define ORDERED_MULTISET_SPLAY( Pub, pri, NODE_, KeyOf )                                           \
+    ORDERED_INDEX_CORE( Pub, pri, NODE_, KeyOf )                                                   \
+    ORDERED_INDEX_SPLAY_HOOKS( pri, NODE_ )                                                        \
+    ORDERED_INDEX_LOOKUPS( Pub, pri, NODE_ )                                                       \
+    ORDERED_INDEX_MULTISET( Pub, pri, NODE_ )
+
+#define ORDERED_MULTISET_AVL( Pub, pri, NODE_, KeyOf )                                             \
+    ORDERED_INDEX_CORE( Pub, pri, NODE_, KeyOf )                                                   \
+    ORDERED_INDEX_AVL_HOOKS( pri, NODE_ )                                                          \
+    ORDERED_INDEX_LOOKUPS( Pub, pri, NODE_ )                                                       \
+    ORDERED_INDEX_MULTISET( Pub, pri, NODE_ )
+
+//////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////
@@ -30,6 +30,29 @@ Mustsync NormalIo Maycache    514          9984                8940
 
 //////////////////////////////////////////////////////////////////////
 
+static B1 readWriteGoesDirect( VCB_ Vcb, ENTRY_ Entry, PIRP Irp, U1_ Buffer, U8 FileOffset, U4 NumBytes )
+
+{
+    //  Should this transfer skip the cache, and go straight between the volume and the caller's buffer?
+#if DIRECT_IO == YES
+    if ( DataIsInline( Data( Entry ) ) ) return FALSE;
+    if ( BitIsClear( Irp->Flags, IRP_NOCACHE ) && NumBytes < DIRECT_IO_MIN_NUM_BYTES ) return FALSE;
+    if ( ! VOLUME_BLOCK_ALIGNED( FileOffset ) || ! VOLUME_BLOCK_ALIGNED( NumBytes ) ) return FALSE;
+    if ( ( ULONG_PTR ) Buffer & Vcb->PhysicalDeviceObject->AlignmentRequirement ) return FALSE;
+    return TRUE;
+#else
+    UNREFERENCED_PARAMETER( Vcb );
+    UNREFERENCED_PARAMETER( Entry );
+    UNREFERENCED_PARAMETER( Irp );
+    UNREFERENCED_PARAMETER( Buffer );
+    UNREFERENCED_PARAMETER( FileOffset );
+    UNREFERENCED_PARAMETER( NumBytes );
+    return FALSE;
+#endif
+}
+
+//////////////////////////////////////////////////////////////////////
+
 NTSTATUS IrpMjRead_File( ICB_ Icb )
 
 {
@@ -41,6 +64,7 @@ NTSTATUS IrpMjRead_File( ICB_ Icb )
     FCB_         Fcb            = FileObject->FsContext;
     CCB_         Ccb            = FileObject->FsContext2;
     ID           Id             = Fcb->Id;
+    VCB_         Vcb            = Fcb->Vcb;
 
 //  https://community.osr.com/discussion/67486/irp-nocache-vs-irp-paging-io
     B1           PagingIo       = BitIsSet( Irp->Flags, IRP_PAGING_IO );
@@ -59,15 +83,15 @@ ASSERT( IrpSp->MinorFunction == IRP_MN_NORMAL );
 
     Irp->IoStatus.Information = 0;
 
-    if ( IdIsADirectory( Id ) ) return STATUS_INVALID_PARAMETER;
+    if ( IdIsADirectory( Vcb, Id ) ) return STATUS_INVALID_PARAMETER;
 
     U1_ Buffer = IrpBuffer( Irp );
     if ( ! Buffer ) return STATUS_INVALID_USER_BUFFER;
 
-    U8 FileSize = DataGetFileNumBytes( Entries[Id] );
+    U8 FileSize = DataGetFileNumBytes( EntryForId( Vcb, Id ) );
 
 LogFormatted( "%s  FileOffset %d  FileNumBytes %d ( FileSize %d )\n",
-Entries[Id]->Name, ( int ) FileOffset, ( int ) FileNumBytes, ( int ) FileSize );
+EntryForId( Vcb, Id )->Name, ( int ) FileOffset, ( int ) FileNumBytes, ( int ) FileSize );
 
     if ( FileNumBytes == 0 && FileOffset <= FileSize ) return STATUS_SUCCESS;
 
@@ -76,8 +100,21 @@ Entries[Id]->Name, ( int ) FileOffset, ( int ) FileNumBytes, ( int ) FileSize );
     if ( FileOffset + FileNumBytes > FileSize ) FileNumBytes = ( U4 )( FileSize - FileOffset );  //  TODO
 
 
-    ENTRY_ Entry = Entries[Id];
-    NTSTATUS Status = DataReadFromFile( Entry, FileOffset, FileNumBytes, Buffer );
+    ENTRY_ Entry = EntryForId( Vcb, Id );
+    NTSTATUS Status;
+
+    //  A direct read that ends the file reads the rest of its last block too, if the caller has room.
+    //  Whatever is on the volume past the end of the file is not the caller's to see, so it is zeroed.
+    U4 DirectNumBytes = ROUND_UP( FileNumBytes, Volume_BlockSize );
+    if ( DirectNumBytes <= IrpSp->Parameters.Read.Length && readWriteGoesDirect( Vcb, Entry, Irp, Buffer, FileOffset, DirectNumBytes ) )
+    {
+        Status = AccessVolumeForFile( Vcb, Entry, OUT_OF_CACHE, Buffer, FileOffset, DirectNumBytes );
+        if ( ! Status ) Zero( Buffer + FileNumBytes, DirectNumBytes - FileNumBytes );
+    }
+    else
+    {
+        Status = DataReadFromFile( Vcb, Entry, FileOffset, FileNumBytes, Buffer );
+    }
 
 
     if ( Status == STATUS_PENDING )
@@ -100,6 +137,9 @@ LogString( " alter CurrentByteOffset? NO \n" );
 
         if ( NT_SUCCESS( Status ) ) Irp->IoStatus.Information = FileNumBytes;
 
+#if LAUNCH_TRACES == YES
+        if ( NT_SUCCESS( Status ) ) LaunchNoteRead( Vcb, Irp, Entry, FileOffset, FileNumBytes );
+#endif
     }
 
 //  TODO should we be using fcb Filesize instead of Entry filesize?
@@ -114,6 +154,138 @@ LogFormatted( "IoStatus.Information %d   FileObject->CurrentByteOffset %d   Ccb-
     return Status;
 }
 
+//////////////////////////////////////////////////////////////////////
+//
+//  Speculative Preallocation
+//
+//  A file appended past its allocation gets room ahead, so that a log-style writer takes a new
+//  data range, and resizes its entry, only now and then. The room is an exponential window: it
+//  starts at PREALLOCATE_MIN_NUM_BYTES and doubles each time the file outgrows it, or is what the
+//  file appends in PREALLOCATE_HORIZON_MICROSECONDS if that is more, but is never more than the
+//  file's size or a share of the free space. What goes unused is given back when the file is
+//  closed, or sooner when free space runs low. Call these with the metadata lock held.
+//
+
+//--------------------------------------------------------------------
+
+static void readWriteNoteAppend( VCB_ Vcb, FCB_ Fcb, U4 NumBytes )
+
+{
+    //  The rate is decaying sums of the bytes appended and of the time between appends, in which
+    //  a pause counts for no more than the horizon.
+    U8 Now     = CurrentMicrosecond();
+    U8 Elapsed = Fcb->LastAppendMicrosecond ? min( Now - Fcb->LastAppendMicrosecond, PREALLOCATE_HORIZON_MICROSECONDS ) : 0;
+
+    Fcb->AppendNumBytes        = Fcb->AppendNumBytes     - Fcb->AppendNumBytes     / 8 + NumBytes;
+    Fcb->AppendMicroseconds    = Fcb->AppendMicroseconds - Fcb->AppendMicroseconds / 8 + Elapsed;
+    Fcb->LastAppendMicrosecond = Now;
+
+    Vcb->PreallocateNumAppends++;
+    Vcb->PreallocateNumAppendBytes += NumBytes;
+}
+
+//--------------------------------------------------------------------
+
+static U8 readWriteAllocationFor( VCB_ Vcb, FCB_ Fcb, ENTRY_ Entry, U8 OffsetAfterWrite )
+
+{
+    //  How much to allocate for an append that ends past the allocation, at OffsetAfterWrite.
+    if ( OffsetAfterWrite <= INLINE_DATA_MAX_NUM_BYTES ) return OffsetAfterWrite;
+    if ( BitIsSet( Entry->FileAttributes, FILE_ATTRIBUTE_SPARSE_FILE ) ) return OffsetAfterWrite;  //  It grows by holes anyway.
+    if ( Vcb->SpaceNumBytes < PREALLOCATE_PRESSURE_NUM_BYTES ) return OffsetAfterWrite;
+
+    U8 Window = Fcb->AppendWindowNumBytes ? min( Fcb->AppendWindowNumBytes * 2, PREALLOCATE_MAX_NUM_BYTES ) : PREALLOCATE_MIN_NUM_BYTES;
+    Fcb->AppendWindowNumBytes = Window;
+
+    U8 AtRate = Fcb->AppendMicroseconds ? Fcb->AppendNumBytes * PREALLOCATE_HORIZON_MICROSECONDS / Fcb->AppendMicroseconds : 0;
+    Window = max( Window, AtRate );
+    Window = min( Window, max( OffsetAfterWrite, PREALLOCATE_MIN_NUM_BYTES ) );
+    Window = min( Window, Vcb->SpaceNumBytes / PREALLOCATE_FREE_SPACE_SHARE );
+
+    return OffsetAfterWrite + Window;
+}
+
+//////////////////////////////////////////////////////////////////////
+
+void PreallocationTrim( VCB_ Vcb, FCB_ Fcb )
+
+{
+    //  Give back what the file was allocated ahead of its appends and did not use.
+    if ( ! Fcb->IsPreallocated ) return;
+
+    U8       NumBytesTrimmed;
+    U8       FileNumBytes = DataGetFileNumBytes( EntryForId( Vcb, Fcb->Id ) );
+    NTSTATUS Status       = DataTrimFile( Vcb, Fcb->Id, FileNumBytes, &NumBytesTrimmed );
+    if ( Status ) return;
+
+    //  Ranges being written back stay until next time.
+    Fcb->IsPreallocated = DataGetAllocationNumBytes( EntryForId( Vcb, Fcb->Id ) ) > ROUND_UP( FileNumBytes, Volume_BlockSize );
+    if ( ! NumBytesTrimmed ) return;
+
+    Vcb->PreallocateNumTrims++;
+    Vcb->PreallocateNumBytesTrimmed += NumBytesTrimmed;
+}
+
+//////////////////////////////////////////////////////////////////////
+
+void PreallocationTrimAll( VCB_ Vcb )
+
+{
+    //  Free space is running low, so every open file gives back its room ahead.
+    U8 NumTrimsBefore = Vcb->PreallocateNumTrims;
+
+    for ( LINK_ L = Vcb->OpenFcbsChain.First; L; L = L->Next )
+    {
+        FCB_ Fcb = OWNER( FCB, OpenFcbsLink, L );
+        PreallocationTrim( Vcb, Fcb );
+    }
+
+    if ( Vcb->PreallocateNumTrims != NumTrimsBefore ) Vcb->PreallocateNumPressureTrims++;
+}
+
+//////////////////////////////////////////////////////////////////////
+
+NTSTATUS PreallocationReport( VCB_ Vcb, S1_ Buffer, int MaxNumBytes )
+
+{
+    NTSTATUS Status = RtlStringCchPrintfA( Buffer, MaxNumBytes,
+            "PreallocationReport %llu appends of %llu KB   %llu grew the allocation, with %llu KB ahead   "
+            "%llu trims gave back %llu KB, %llu times under space pressure  ",
+            Vcb->PreallocateNumAppends,
+            Vcb->PreallocateNumAppendBytes / 1024,
+            Vcb->PreallocateNumGrowths,
+            Vcb->PreallocateNumBytes / 1024,
+            Vcb->PreallocateNumTrims,
+            Vcb->PreallocateNumBytesTrimmed / 1024,
+            Vcb->PreallocateNumPressureTrims );
+
+    //  Each open file that has appended: its size, extents, room ahead, and append rate.
+    for ( LINK_ L = Vcb->OpenFcbsChain.First; L && ! Status; L = L->Next )
+    {
+        FCB_ Fcb = OWNER( FCB, OpenFcbsLink, L );
+        if ( ! Fcb->LastAppendMicrosecond ) continue;
+
+        ENTRY_       Entry        = EntryForId( Vcb, Fcb->Id );
+        U4           NumExtents   = 0;
+        RANGE_CURSOR Cursor;
+        for ( DATA_RANGE_ Range = DataFirstRange( Vcb, Entry, &Cursor ); Range; Range = DataNextRange( &Cursor ) ) NumExtents++;
+
+        U8 FileNumBytes = DataGetFileNumBytes( Entry );
+        U8 NumBytesRate = Fcb->AppendMicroseconds ? Fcb->AppendNumBytes * 1'000'000 / Fcb->AppendMicroseconds : 0;
+
+        S1 scratch[128];
+        Status = RtlStringCchPrintfA( scratch, sizeof( scratch ), " %.32s:%llu KB in %u extents, %llu KB ahead, %llu KB/s",
+                Entry->Name,
+                FileNumBytes / 1024,
+                NumExtents,
+                ( DataGetAllocationNumBytes( Entry ) - FileNumBytes ) / 1024,
+                NumBytesRate / 1024 );
+        if ( ! Status ) Status = RtlStringCchCatA( Buffer, MaxNumBytes, scratch );
+    }
+
+    return Status;
+}
+
 //////////////////////////////////////////////////////////////////////
 
 NTSTATUS IrpMjWrite_File( ICB_ Icb )
@@ -125,6 +297,7 @@ NTSTATUS IrpMjWrite_File( ICB_ Icb )
     FCB_         Fcb           = FileObject->FsContext;
     CCB_         Ccb           = FileObject->FsContext2;
     ID           Id            = Fcb->Id;
+    VCB_         Vcb           = Fcb->Vcb;
     B1           PagingIo      = BitIsSet( Irp->Flags, IRP_PAGING_IO );
 //  B1           Nocache       = BitIsSet( Irp->Flags, IRP_NOCACHE );
     B1           SynchronousIo = BitIsSet( FileObject->Flags, FO_SYNCHRONOUS_IO );
@@ -177,13 +350,13 @@ BreakToDebugger();
     U8 FileOffset   = IrpSp->Parameters.Write.ByteOffset.QuadPart;
     U4 FileNumBytes = IrpSp->Parameters.Write.Length;
 
-    if ( IdIsADirectory( Id ) ) return STATUS_INVALID_PARAMETER;
+    if ( IdIsADirectory( Vcb, Id ) ) return STATUS_INVALID_PARAMETER;
 
     U1_ Buffer = IrpBuffer( Irp );
     if ( ! Buffer ) return STATUS_INVALID_USER_BUFFER;  //  TODO or STATUS_INVALID_PARAMETER
 
     //  Special offset means write to end of file.
-    U8 FileSizeBeforeWrite = DataGetFileNumBytes( Entries[Id] );
+    U8 FileSizeBeforeWrite = DataGetFileNumBytes( EntryForId( Vcb, Id ) );
     if ( FileOffset == 0xFFFFFFFFFFFFFFFFLL ) FileOffset = FileSizeBeforeWrite;
 
     if ( FileNumBytes == 0 && FileOffset <= FileSizeBeforeWrite ) return STATUS_SUCCESS;
@@ -192,40 +365,61 @@ BreakToDebugger();
     do
     {
 
-        //  Reallocate the file, if necessary.
+        //  Reallocate the file, if necessary. An append gets room ahead; see readWriteAllocationFor.
         U8 OffsetAfterWrite = FileOffset + FileNumBytes;
-        if ( OffsetAfterWrite > DataGetAllocationNumBytes( Entries[Id] ) )
+        B1 IsAppend         = FileOffset >= FileSizeBeforeWrite;
+        if ( IsAppend ) readWriteNoteAppend( Vcb, Fcb, FileNumBytes );
+
+        if ( OffsetAfterWrite > DataGetAllocationNumBytes( EntryForId( Vcb, Id ) ) )
         {
-            U8 NewMinimumAllocationSize = OffsetAfterWrite;
-            //  Hack to not do resize as often, at the expense of over-allocating.  TODO
-            if ( FileSizeBeforeWrite > 1024 * 1024 )
-                {
-                U8 BiggerBy25Percent = DataGetAllocationNumBytes( Entries[Id] ) * 5 / 4;
-                if ( BiggerBy25Percent > NewMinimumAllocationSize )
-                {
-LogFormatted( "Deciding to overallocate to %d instead of %d\n", ( int ) BiggerBy25Percent, ( int ) NewMinimumAllocationSize );
-                    NewMinimumAllocationSize = BiggerBy25Percent;
-                }
-            }
+            if ( Vcb->SpaceNumBytes < PREALLOCATE_PRESSURE_NUM_BYTES ) PreallocationTrimAll( Vcb );
+
+            U8 NewMinimumAllocationSize = IsAppend ? readWriteAllocationFor( Vcb, Fcb, EntryForId( Vcb, Id ), OffsetAfterWrite ) : OffsetAfterWrite;
 
-            Status = DataReallocateFile( Id, NewMinimumAllocationSize );
+            //  With the volume full, other files give back their room ahead, and this one gets none.
+            Status = DataReallocateFile( Vcb, Id, NewMinimumAllocationSize );
+            if ( Status == STATUS_DISK_FULL )
+            {
+                PreallocationTrimAll( Vcb );
+                NewMinimumAllocationSize = OffsetAfterWrite;
+                Status = ( DataGetAllocationNumBytes( EntryForId( Vcb, Id ) ) >= OffsetAfterWrite ) ? 0 : DataReallocateFile( Vcb, Id, OffsetAfterWrite );
+            }
             if ( Status ) break;
+
+            if ( IsAppend ) Vcb->PreallocateNumGrowths++;
+            if ( NewMinimumAllocationSize > OffsetAfterWrite )
+            {
+LogFormatted( "Preallocated to %llu for a write to %llu\n", NewMinimumAllocationSize, OffsetAfterWrite );
+                Vcb->PreallocateNumBytes += NewMinimumAllocationSize - OffsetAfterWrite;
+                Fcb->IsPreallocated = TRUE;
+            }
         }
 
 
-        //  Fill to offset with zeros, if necessary.
+        //  Fill to offset with zeros, if necessary; whole ranges in the gap just become unwritten.
         if ( FileOffset > FileSizeBeforeWrite )
         {
-            Status = DataWriteToFile( Entries[Id], FileSizeBeforeWrite, ( int )( FileOffset-FileSizeBeforeWrite ), 0 );
-            //  TODO what about status here?
+            Status = DataZeroFile( Vcb, Id, FileSizeBeforeWrite, FileOffset );
+            if ( Status ) break;
         }
 
-        Status = DataWriteToFile( Entries[Id], FileOffset, FileNumBytes, Buffer );
+        ENTRY_ Entry = EntryForId( Vcb, Id );
+        if ( readWriteGoesDirect( Vcb, Entry, Irp, Buffer, FileOffset, FileNumBytes ) )
+        {
+            //  Holes written into need volume space first, which may move the entry.
+            Status = DataFillHoles( Vcb, Id, FileOffset, FileNumBytes );
+            if ( Status ) break;
+            Status = AccessVolumeForFile( Vcb, EntryForId( Vcb, Id ), INTO_CACHE, Buffer, FileOffset, FileNumBytes );
+        }
+        else
+        {
+            Status = DataWriteToFile( Vcb, Entry, FileOffset, FileNumBytes, Buffer );
+        }
         if ( Status ) break;
 
-        if ( OffsetAfterWrite > DataGetFileNumBytes( Entries[Id] ) )
+        if ( OffsetAfterWrite > DataGetFileNumBytes( EntryForId( Vcb, Id ) ) )
         {
-            NTSTATUS sss = DataResizeFile( Id, OffsetAfterWrite, DONT_FILL );
+            NTSTATUS sss = DataResizeFile( Vcb, Id, OffsetAfterWrite, DONT_FILL );
 ASSERT( ! sss );
         }
 
@@ -310,7 +504,7 @@ NTSTATUS IrpMjRead_Volume( ICB_ Icb )
             break;
         }
 
-        Status = ReadBlockDevice( Vcb->PhysicalDeviceObject, Offset, Length, Buffer, MAY_VERIFY );
+        Status = ReadBlockDevice( Vcb->PhysicalDeviceObject, Offset, Length, Buffer, MAY_VERIFY, IO_DEMAND );
 
         if ( Status == STATUS_VERIFY_REQUIRED )
         {
@@ -319,7 +513,7 @@ BreakToDebugger();
 
             if ( NT_SUCCESS( Status ) )
             {
-                Status = ReadBlockDevice( Vcb->PhysicalDeviceObject, Offset, Length, Buffer, MAY_VERIFY );
+                Status = ReadBlockDevice( Vcb->PhysicalDeviceObject, Offset, Length, Buffer, MAY_VERIFY, IO_DEMAND );
             }
         }
 
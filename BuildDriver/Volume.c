@@ -70,19 +70,19 @@ void ClearVpbBit( PVPB Vpb, USHORT Flag )
 
 //////////////////////////////////////////////////////////////////////
 
-NTSTATUS volumeStartup(  )
+NTSTATUS volumeStartup( VCB_ Vcb )
 
 {
-    Volume_OverviewStart  =               2 * 1024 * 1024;  //    $20'0000
-    Volume_EntriesStart   =              80 * 1024 * 1024;  //   $500'0000
-    Volume_DataStart      =             280 * 1024 * 1024;  //  $1180'0000
+    Vcb->OverviewStart  =               2 * 1024 * 1024;  //    $20'0000
+    Vcb->EntriesStart   =              80 * 1024 * 1024;  //   $500'0000
+    Vcb->DataStart      =             280 * 1024 * 1024;  //  $1180'0000
 
-////Volume_TotalNumBytes           = 1LL * 32 * 1024 * 1024 * 1024;  //  32GB TODO temp as variable for testing
-    Volume_TotalNumBytes           = 1LL *  2 * 1024 * 1024 * 1024;  //   2GB TODO temp as variable for testing
+////Vcb->TotalNumBytes           = 1LL * 32 * 1024 * 1024 * 1024;  //  32GB TODO temp as variable for testing
+    Vcb->TotalNumBytes           = 1LL *  2 * 1024 * 1024 * 1024;  //   2GB TODO temp as variable for testing
 
-    Volume_OverviewNumBytes = Volume_EntriesStart  - Volume_OverviewStart;
-    Volume_EntriesNumBytes  = Volume_DataStart     - Volume_EntriesStart;
-    Volume_DataNumBytes     = Volume_TotalNumBytes - Volume_DataStart;
+    Vcb->OverviewNumBytes = Vcb->EntriesStart  - Vcb->OverviewStart;
+    Vcb->EntriesNumBytes  = Vcb->DataStart     - Vcb->EntriesStart;
+    Vcb->DataNumBytes     = Vcb->TotalNumBytes - Vcb->DataStart;
 
     return 0;
 }
@@ -95,7 +95,7 @@ NTSTATUS verifyItIsSameDevice( PDEVICE_OBJECT DeviceObject, VCB_ Vcb )
     U1_ Buffer = AllocateMemory( Volume_BlockSize );  //  TODO
     if ( ! Buffer ) return STATUS_INSUFFICIENT_RESOURCES;
 
-    NTSTATUS Status = ReadBlockDevice( DeviceObject, 0, Volume_BlockSize, Buffer, NO_VERIFY );
+    NTSTATUS Status = ReadBlockDevice( DeviceObject, 0, Volume_BlockSize, Buffer, NO_VERIFY, IO_DEMAND );
     if ( NT_SUCCESS( Status ) )
     {
         B1 VolumeHeaderSame = ! memcmp( Vcb->FirstBlock + 0x400, Buffer+0x400, 0x40 );
@@ -115,7 +115,7 @@ NTSTATUS verifyItIsOurTypeDevice( PDEVICE_OBJECT DeviceObject )
     U1_ Buffer = AllocateMemory( Volume_BlockSize );
     if ( ! Buffer ) return STATUS_INSUFFICIENT_RESOURCES;
 
-    NTSTATUS Status = ReadBlockDevice( DeviceObject, 0, Volume_BlockSize, Buffer, NO_VERIFY );
+    NTSTATUS Status = ReadBlockDevice( DeviceObject, 0, Volume_BlockSize, Buffer, NO_VERIFY, IO_DEMAND );
     if ( NT_SUCCESS( Status ) )
     {
         B1 TypeIsTheSame = ! memcmp( Buffer + 0x400, OurFileSystemType, sizeof( OurFileSystemType ) );
@@ -138,21 +138,26 @@ UINT64 msFm, msTo;
 msFm = CurrentMillisecond();
 
 
-    //  Set Volume_OverviewStart,Volume_EntriesStart,Volume_DataStart,Volume_EntriesNumBytes, etc.
-    Status = volumeStartup();
+    //  Set Vcb->OverviewStart,Vcb->EntriesStart,Vcb->DataStart,Vcb->EntriesNumBytes, etc.
+    Status = volumeStartup( Vcb );
     if ( Status ) return Status;
 
 
     //  Create the initial big chunks.
-    Status = SpaceStartup();
+    Status = SpaceStartup( Vcb );
     if ( Status ) return Status;
 
 
     //  Initialize the Cache to zeroes.
-    Status = CacheStartup();
+    Status = CacheStartup( Vcb );
     if ( Status ) return Status;
 
 
+    //  Count the requests we send the device, for the write-back policy.
+    Vcb->DeviceActivity.DeviceObject = Vcb->PhysicalDeviceObject;
+    BlockIoTrackDevice( &Vcb->DeviceActivity );
+
+
 msTo = CurrentMillisecond();
 AlwaysLogFormatted( "%d ms.\n", ( int ) ( msTo - msFm ) );
 msFm = CurrentMillisecond();
@@ -169,8 +174,8 @@ AlwaysLogFormatted( "%d ms.\n", ( int ) ( msTo - msFm ) );
 msFm = CurrentMillisecond();
 
 
-        //  Recover Volume_TotalNumberOfEntries, Volume_WhereTableMaxId, Volume_OverviewStart, etc.
-	    Status = OverviewThaw();
+        //  Recover Vcb->TotalNumberOfEntries, Vcb->WhereTableMaxId, Vcb->OverviewStart, etc.
+	    Status = OverviewThaw( Vcb );
 ASSERT( ! Status );
 
 
@@ -179,7 +184,7 @@ AlwaysLogFormatted( "%d ms.\n", ( int ) ( msTo - msFm ) );
 msFm = CurrentMillisecond();
 
 
-	    Status = EntriesThaw();
+	    Status = EntriesThaw( Vcb );
 ASSERT( ! Status );
 
 
@@ -188,10 +193,24 @@ AlwaysLogFormatted( "%d ms.\n", ( int ) ( msTo - msFm ) );
 msFm = CurrentMillisecond();
 
 
-        Status = SpaceBuildFromEntries();
+        Status = SpaceBuildFromEntries( Vcb );
 ASSERT( ! Status );
 
 
+#if WARM_CACHE_MANIFEST == YES
+        //  Only a hint; without it we just start cold.
+        Status = CacheManifestThaw( Vcb );
+        if ( Status ) AlwaysLogFormatted( "CacheManifestThaw reported a status of $%X\n", Status );
+#endif
+
+
+#if LAUNCH_TRACES == YES
+        //  Likewise only a hint.
+        Status = LaunchTracesThaw( Vcb );
+        if ( Status ) AlwaysLogFormatted( "LaunchTracesThaw reported a status of $%X\n", Status );
+#endif
+
+
 msTo = CurrentMillisecond();
 AlwaysLogFormatted( "%d ms.\n", ( int ) ( msTo - msFm ) );
 msFm = CurrentMillisecond();
@@ -211,17 +230,17 @@ AlwaysLogString( "There is   NO   overview address\n" );
 
         //  Allocate EntriesBytes and set EntriesFirstFreeByte = 0, etc.
         int NumBytesToAllocateToTheMetadataStore = ROUND_UP( 1'000'000, 4096 );
-        Status = EntriesStartupEmpty( NumBytesToAllocateToTheMetadataStore );  //  TODO
+        Status = EntriesStartupEmpty( Vcb, NumBytesToAllocateToTheMetadataStore );  //  TODO
         if ( Status ) return Status;
 
 
-        //  Allocate Entries, and set Volume_WhereTableLastRecycledID = 0, etc.
-        Status = WhereTableStartupEmpty( NumBytesToAllocateToTheMetadataStore / 4 );  //  TODO
+        //  Allocate the first chunk of the where table; it grows as needed.
+        Status = WhereTableStartupEmpty( Vcb );
         if ( Status ) return Status;
 
 
         //  Create the root directory.
-        ID Id = MakeEntry( 0, A_DIRECTORY, "" );
+        ID Id = MakeEntry( Vcb, 0, A_DIRECTORY, "" );
 
         if ( ! Id )
         {
@@ -233,7 +252,7 @@ AlwaysLogString( "There is   NO   overview address\n" );
 
     }
 
-//Volume_LastMetadataOkCount = Volume_ConservativeMetadataUpdateCount;
+//Vcb->LastMetadataOkCount = Vcb->ConservativeMetadataUpdateCount;
 
 #if BACKGROUND_THREAD == YES
     Status = BackgroundThreadStartup( Vcb );
@@ -262,9 +281,6 @@ AlwaysLogString( "top\n" );
     PDEVICE_OBJECT  PhysicalDeviceObject = IrpSp->Parameters.MountVolume.DeviceObject;
 
 
-
-Volume_PhysicalDeviceObject = PhysicalDeviceObject;
-
 AlwaysLogString( "is it our device type?\n" );
 
 
@@ -292,7 +308,7 @@ AlwaysLogString( "yes\n" );
         Vcb->FirstBlock = AllocateMemory( Volume_BlockSize );
         if ( ! Vcb->FirstBlock ) { Status = STATUS_INSUFFICIENT_RESOURCES; break; }
 
-        Status = ReadBlockDevice( Vcb->PhysicalDeviceObject, 0, Volume_BlockSize, Vcb->FirstBlock, MAY_VERIFY );
+        Status = ReadBlockDevice( Vcb->PhysicalDeviceObject, 0, Volume_BlockSize, Vcb->FirstBlock, MAY_VERIFY, IO_DEMAND );
         if ( ! NT_SUCCESS( Status ) ) break;
 
         WCHAR WideLabel[MAXIMUM_VOLUME_LABEL_LENGTH];//MAX_PATH];//TODO MAXIMUM_VOLUME_LABEL_LENGTH
@@ -306,6 +322,15 @@ AlwaysLogString( "yes\n" );
         if ( ! NT_SUCCESS( Status ) ) break;
 
         Status = DeviceIoControlRequest( IOCTL_DISK_GET_PARTITION_INFO_EX, PhysicalDeviceObject, 0, 0, &Vcb->PartitionInformationEx, sizeof( PARTITION_INFORMATION_EX ) );
+        if ( ! NT_SUCCESS( Status ) ) break;
+
+        //  A volume with metadata on it must be in our format.
+        if ( * ( U8_ ) ( Vcb->FirstBlock + 0x440 ) )
+        {
+            Status = volumeStartup( Vcb );
+            if ( Status ) break;
+            Status = OverviewCheckFormat( Vcb );
+        }
 
     } while ( 0 );
 
@@ -420,24 +445,46 @@ AlwaysLogString( "Have some writes to do still?\n" );
 
 
 #if BACKGROUND_THREAD == YES
-    Status = BackgroundThreadShutdown();
+    Status = BackgroundThreadShutdown( Vcb );
     if ( Status ) AlwaysLogFormatted( "BackgroundThreadShutdown reported a status of $%X\n", Status );
 #endif
 
 
-    Status = EntriesShutdown();
+#if WARM_CACHE_MANIFEST == YES
+    U1_ ManifestBuffer;
+    U4  ManifestNumBytes;
+    Status = CacheManifestFreeze1( Vcb, &ManifestBuffer, &ManifestNumBytes );
+    if ( ! Status ) Status = CacheManifestFreeze2( Vcb, ManifestBuffer, ManifestNumBytes );
+    if ( Status ) AlwaysLogFormatted( "Writing the warm-cache manifest reported a status of $%X\n", Status );
+#endif
+
+
+#if LAUNCH_TRACES == YES
+    U1_ LaunchTracesBuffer;
+    U4  LaunchTracesNumBytes;
+    Status = LaunchTracesFreeze1( Vcb, &LaunchTracesBuffer, &LaunchTracesNumBytes );
+    if ( ! Status ) Status = LaunchTracesFreeze2( Vcb, LaunchTracesBuffer, LaunchTracesNumBytes );
+    if ( Status ) AlwaysLogFormatted( "Writing the launch traces reported a status of $%X\n", Status );
+    LaunchTracesShutdown( Vcb );
+#endif
+
+
+    Status = EntriesShutdown( Vcb );
 if ( Status ) AlwaysLogFormatted( "EntriesShutdown reported a status of $%X\n", Status );
 
 
-    Status = WhereTableShutdown();
+    Status = WhereTableShutdown( Vcb );
 if ( Status ) AlwaysLogFormatted( "WhereTableShutdown reported a status of $%X\n", Status );
 
 
-    Status = CacheShutdown();
+    Status = CacheShutdown( Vcb );
     if ( Status ) AlwaysLogFormatted( "CacheShutdown reported a status of $%X\n", Status );
 
 
-    Status = SpaceShutdown();
+    BlockIoUntrackDevice( &Vcb->DeviceActivity );
+
+
+    Status = SpaceShutdown( Vcb );
     if ( Status ) AlwaysLogFormatted( "SpaceShutdown reported a status of $%X\n", Status );
 
 
@@ -642,6 +689,7 @@ LogString( "Query FileFsAttributeInformation\n" );
                 //  | FILE_READ_ONLY_VOLUME
                 //  | FILE_CASE_PRESERVED_NAMES
                 //  | FILE_CASE_SENSITIVE_SEARCH
+                | FILE_SUPPORTS_SPARSE_FILES
 // | FILE_CASE_PRESERVED_NAMES
 // | FILE_UNICODE_ON_DISK
                 ;